@@ -0,0 +1,154 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_BVH_H
+#define RT_BVH_H
+
+#include "scene.h"
+
+// Shader storage bindings used by raytracer.glsl, see tlas.h for what's stored in them
+#define BVH_NODE_BINDING 0
+#define BVH_PRIMITIVE_BINDING 1
+
+// Primitive references store the rect flag in the top bit and the index into
+// the sphere or rect array in the remaining bits
+#define BVH_PRIMITIVE_RECT 0x80000000u
+#define BVH_PRIMITIVE_INDEX 0x7fffffffu
+
+// Matches the std430 layout of BVHNode in raytracer.glsl. Children are always
+// stored next to each other, so interior nodes only keep the index of the left one.
+struct BVHNode {
+    float min[3];
+    unsigned int leftFirst; // Left child for interior nodes, first primitive for leaves
+    float max[3];
+    unsigned int count; // Primitive count, 0 for interior nodes
+};
+
+// Relative costs of a node visit and a primitive test for the surface area heuristic
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECT_COST 1.0f
+
+#define BVH_MAX_BINS 32
+
+// Levels of nodes counting the root, the builder makes leaves at this depth.
+// Traversal stacks on the host and BVH_STACK_SIZE in raytracer.glsl are sized for it.
+#define BVH_MAX_DEPTH 64
+
+// Spatial splits are only tried where the children of the best object split
+// overlap by more than this fraction of the root's surface area
+#define BVH_SPATIAL_SPLIT_ALPHA 1e-5f
+
+// Refitting keeps the topology, so the tree degrades as primitives move away
+// from where they were at build time. Past this multiple of the SAH cost at
+// build time a full rebuild is cheaper to trace than the refitted tree.
+#define BVH_REFIT_THRESHOLD 1.5f
+
+// Sibling pairs per treelet of BVH_LAYOUT_FREQUENCY. A pair fills a 64 byte cache
+// line, so a treelet fills a 4 KiB page.
+#define BVH_LAYOUT_TREELET_PAIRS 64
+
+// Order of the nodes in memory. Siblings always stay next to each other and
+// children after their parent, the layouts only change which pair goes where.
+enum BVHLayout {
+    BVH_LAYOUT_BUILD_ORDER, // Whatever order the builder threads allocated the nodes in
+    BVH_LAYOUT_DEPTH_FIRST, // The children of the larger child follow right after a pair
+    BVH_LAYOUT_VAN_EMDE_BOAS, // Recursively split into treelets of half the height, each stored contiguously
+    BVH_LAYOUT_FREQUENCY // Treelets along the most visited paths, hottest first, see layoutBVH
+};
+
+struct BVHSettings {
+    unsigned int threadCount; // 0 uses every online processor
+    unsigned int binCount; // Candidate split planes per axis are binCount - 1, at most BVH_MAX_BINS
+    unsigned int maxLeafSize; // Larger nodes are always split, smaller ones only when the SAH says so
+    unsigned int minLeafSize; // Nodes this small are never split, compressed leaves (bvhleaf.h) pay off from 8 or so
+    unsigned int parallelThreshold; // Subtrees with at least this many primitives go to the worker pool
+
+    // Extra references spatial splits may create, as a fraction of the primitive
+    // count. Splitting large primitives like walls across children keeps them
+    // from overlapping every other node (SBVH). 0 only splits by object.
+    float spatialSplitBudget;
+
+    enum BVHLayout layout; // Applied once the build is done
+};
+
+#define BVH_DEFAULT_SETTINGS { 0, 16, 4, 1, 4096, 0.0f, BVH_LAYOUT_BUILD_ORDER }
+
+struct BVH {
+    unsigned int nodeCount;
+    struct BVHNode* nodes;
+
+    // References, spatial splits can put the same primitive in several leaves
+    unsigned int primitiveCount;
+    unsigned int* primitives;
+
+    float buildCost; // bvhSAHCost right after the build, refits are measured against it
+    _Bool spatialSplits; // Whether spatial splits clipped any references, see refitBVH
+};
+
+// Settings may be null to use BVH_DEFAULT_SETTINGS
+struct BVH* buildBVH(const struct Scene* scene, const struct BVHSettings* settings);
+
+// Builds over the object's primitives only, references still index the scene's arrays
+struct BVH* buildObjectBVH(const struct Scene* scene, const struct Object* object, const struct BVHSettings* settings);
+
+// Builds over arbitrary boxes, six floats each (min x, y, z then max x, y, z).
+// The primitives of the result are indices of the boxes, refitBVH can't be used on it.
+struct BVH* buildBVHFromBounds(const float* bounds, unsigned int count, const struct BVHSettings* settings);
+
+float bvhSAHCost(const struct BVH* bvh);
+
+// Bounds of a primitive reference as the builder sees them, rects get a little thickness
+void bvhPrimitiveBounds(const struct Scene* scene, unsigned int primitive, float* min, float* max);
+
+// Recomputes every node's bounds after spheres or rects moved or changed size,
+// without touching the topology. Returns 0 once the SAH cost has grown past
+// BVH_REFIT_THRESHOLD and the BVH should be rebuilt instead. The nodes still
+// have to be uploaded again with uploadTLAS. BVHs with spatial splits are left
+// alone and always return 0: their leaves only hold clipped parts of the split
+// primitives, and refitting them to the whole primitives makes them overlap
+// again, several times the SAH cost with large walls.
+_Bool refitBVH(struct BVH* bvh, const struct Scene* scene);
+
+// Reorders the nodes, and the primitive references in the order their leaves end
+// up in. BVH_LAYOUT_FREQUENCY grows its treelets by visits, one count per node as
+// measured by traceBVH. Without visits it uses surface area, which is what the SAH
+// takes as the chance of a node being visited. Returns 0 and leaves the BVH as it
+// was when out of memory.
+_Bool layoutBVH(struct BVH* bvh, enum BVHLayout layout, const unsigned int* visits);
+
+// Closest hit on the host with the same traversal as raytracer.glsl, returns tmax
+// on a miss. Adds one to visits for every node fetched when not null, as a
+// profiling pass for BVH_LAYOUT_FREQUENCY. The closest primitive reference goes
+// to hit when not null, which is left alone on a miss. Only for BVHs over scene
+// primitives.
+float traceBVH(const struct BVH* bvh, const struct Scene* scene, const float* origin, const float* direction, float tmax,
+    unsigned int* visits, unsigned int* hit);
+
+// Writes nodeCount skip links for stackless traversal: the node that follows a
+// node's subtree when children are visited left first. A left child skips to its
+// sibling, a right child to wherever its parent skips. The root is never a target,
+// so 0 marks the end of the traversal.
+void computeSkipLinks(const struct BVH* bvh, unsigned int* skips);
+
+// Whether traversal stays inside the node and primitive arrays and within
+// BVH_MAX_DEPTH levels, and every reference lies in the object's spheres and
+// rects. For BVHs read from files, a damaged one could send traversal anywhere.
+// Also returns 0 when out of memory.
+_Bool validBVH(const struct BVH* bvh, const struct Object* object);
+
+void freeBVH(struct BVH* bvh);
+
+#endif //RT_BVH_H
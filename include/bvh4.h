@@ -0,0 +1,46 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_BVH4_H
+#define RT_BVH4_H
+
+#include "bvh.h"
+
+#define BVH4_WIDTH 4
+
+// Traversal in raytracer.glsl can push three children per level onto a stack of
+// BVH_STACK_SIZE entries, deeper trees stay binary
+#define BVH4_MAX_DEPTH 21
+
+// Matches the std430 layout of BVH4Node in raytracer.glsl. Child bounds are
+// stored as 8 bit coordinates on a grid starting at origin, with a power of two
+// cell size per axis. Byte c of each packed word belongs to child c.
+struct BVH4Node {
+    float origin[3];
+    unsigned int exponents; // Biased float exponents of the cell sizes, x in the lowest byte
+    unsigned int qmin[3]; // Per axis, rounded down
+    unsigned int counts; // Primitive count of leaf children, 0 for interior ones
+    unsigned int qmax[3]; // Per axis, rounded up
+    unsigned int childCount;
+    unsigned int children[BVH4_WIDTH]; // Node index for interior children, first primitive for leaves
+};
+
+// Collapses a binary BVH into 4-wide nodes, pulling up the largest interior
+// children first. Leaves and primitive references are shared with the binary
+// BVH. Returns null when the tree is too deep or a leaf too large for the format.
+struct BVH4Node* collapseBVH(const struct BVH* bvh, unsigned int* nodeCount);
+
+#endif //RT_BVH4_H
@@ -0,0 +1,42 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_BVHCACHE_H
+#define RT_BVHCACHE_H
+
+#include "bvh.h"
+
+// Built BVHs saved to disk, so an unchanged scene doesn't have to be rebuilt on
+// every launch. A file is keyed by a hash of the geometry the BVHs were built
+// over and the settings that change the result, and is ignored when either
+// differs or it was written with another BVH_CACHE_VERSION or node layout.
+
+#define BVH_CACHE_VERSION 2
+
+// Covers the spheres, rects and objects. Materials don't affect the BVHs, and
+// instances only the top level, which is always built.
+unsigned long long hashBVHInput(const struct Scene* scene, const struct BVHSettings* settings);
+
+_Bool saveBVHCache(const char* path, unsigned long long key, struct BVH* const* bvhs, unsigned int count);
+
+// Fills bvhs with count newly allocated BVHs, one per object. Returns 0 and leaves
+// them null when the file is missing, doesn't match the key or count, or is
+// damaged, which includes references outside their object's spheres and rects.
+_Bool loadBVHCache(const char* path, unsigned long long key, const struct Object* objects, struct BVH** bvhs,
+    unsigned int count);
+
+#endif //RT_BVHCACHE_H
@@ -0,0 +1,55 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_BVHLEAF_H
+#define RT_BVHLEAF_H
+
+#include "bvh.h"
+
+// Compressed leaves keep their spheres in the primitive buffer instead of
+// referencing the sphere buffer, 8 bytes per sphere instead of a 4 byte
+// reference to a 32 byte Sphere. A leaf is stored as words:
+//
+// - origin[3] as float bits, the smallest center of the leaf's spheres
+// - the biased float exponents of the power of two step per axis, x in the
+//   lowest byte, and the sphere count in the highest
+// - the leaf's rects as primitive references
+// - two words per sphere, the center as 16 bit steps from the origin (x, y and
+//   z from the lowest half of the first word on) and the radius as a half float
+// - material runs covering the spheres in order, the material in the lower 24
+//   bits and the length of the run in the upper 8
+//
+// Spheres are sorted by material inside a leaf, so a leaf usually needs a
+// single run, which occlusion queries don't read at all. Decoded centers are
+// within half a step of the original ones, and radii are rounded up to cover
+// the original sphere from there, so no part of it goes missing.
+
+#define BVH_LEAF_HEADER_SIZE 4
+
+// Most spheres and materials a leaf can encode
+#define BVH_LEAF_MAX_SPHERES 255
+#define BVH_LEAF_MAX_MATERIAL 0xffffffu
+
+// Words in the compressed leaves of a BVH over scene primitives, or 0 when a
+// leaf doesn't fit the format: too many spheres, a material past
+// BVH_LEAF_MAX_MATERIAL or a radius a half float can't hold.
+unsigned int compressedLeafWordCount(const struct Scene* scene, const struct BVH* bvh);
+
+// Writes compressedLeafWordCount words, and a copy of the BVH's nodes to nodes
+// with every leaf's first primitive replaced by where its words start
+void compressLeaves(const struct Scene* scene, const struct BVH* bvh, unsigned int* words, struct BVHNode* nodes);
+
+#endif //RT_BVHLEAF_H
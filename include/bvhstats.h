@@ -0,0 +1,58 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_BVHSTATS_H
+#define RT_BVHSTATS_H
+
+#include <stdio.h>
+
+#include "tlas.h"
+
+// Measures of how good a BVH is, independent of the hardware it's traced on.
+// A slower frame with unchanged statistics points at shading rather than at the
+// builder. See DEBUG_HEATMAP in raytracer.glsl for what rays actually visit.
+
+// Leaves with more primitives than this share the last bucket of the histogram
+#define BVH_STATS_LEAF_SIZES 16
+
+struct BVHStats {
+    unsigned int nodeCount;
+    unsigned int leafCount;
+    unsigned int referenceCount; // More than the primitive count after spatial splits
+    float sahCost; // See bvhSAHCost
+
+    // Surface area of the overlap between siblings relative to the root, summed
+    // over every interior node. Rays through an overlap visit both children, so
+    // this is the part of the SAH cost the builder could still have avoided.
+    float overlapCost;
+    float meanOverlap; // Of an interior node's children, as a fraction of its own surface area
+
+    unsigned int minDepth, maxDepth; // Of the leaves, the root is at depth 0
+    float meanDepth;
+
+    unsigned int leafSizes[BVH_STATS_LEAF_SIZES]; // Leaves with i + 1 primitives
+    unsigned int maxLeafSize;
+};
+
+// Returns 0 when the BVH is empty or out of memory
+_Bool analyzeBVH(const struct BVH* bvh, struct BVHStats* stats);
+
+void printBVHStats(FILE* file, const char* name, const struct BVHStats* stats);
+
+// Prints the statistics of the top level and every object's BVH
+void printTLASStats(FILE* file, const struct TLAS* tlas);
+
+#endif //RT_BVHSTATS_H
@@ -0,0 +1,42 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_FILEWATCH_H
+#define RT_FILEWATCH_H
+
+// Reports files changing on disk. Files are watched through their directories,
+// so editors that save by writing a new file and renaming it over the old one
+// are seen as well. Uses inotify where it's available and otherwise compares
+// modification times and sizes, which can miss a rewrite within the same second.
+
+#define FILE_WATCH_MAX_FILES 16
+
+struct FileWatch;
+
+struct FileWatch* createFileWatch();
+
+// Returns the id the file's changes are reported with, or -1 when it can't be watched
+int watchFile(struct FileWatch* watch, const char* path);
+
+// The next watched file that changed since it was last reported, or -1 when none
+// did. Never blocks, so it can be called every frame. A file written several
+// times in between is reported once.
+int nextChangedFile(struct FileWatch* watch);
+
+void freeFileWatch(struct FileWatch* watch);
+
+#endif //RT_FILEWATCH_H
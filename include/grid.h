@@ -0,0 +1,87 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_GRID_H
+#define RT_GRID_H
+
+#include "bvh.h"
+
+// Uniform grid over one object's primitives, an alternative to its BVH for
+// objects made of many similar sized primitives spread evenly, like the classic
+// random spheres scene. It builds in linear time and raytracer.glsl walks the
+// cells along the ray with a 3D-DDA, which stays coherent between neighbouring
+// rays. Cells are about cellSize primitives wide. When that would take more than
+// density cells per primitive, which happens when the primitives are spread out
+// with a lot of empty space between them, the cells are hashed into a table of
+// that size instead, and colliding cells share their references.
+//
+// Grids are uploaded by uploadTLAS into the buffer at GRID_BINDING as words:
+// min[3] and max[3] of the bounds as float bits, with the hash mask (0 for dense
+// grids) and padding after each of them, then resolution[3] and the cell count,
+// cellCount + 1 offsets of every cell's references and the references themselves,
+// which are primitive references like the BVH's.
+
+#define GRID_BINDING 7
+
+// Words before a grid's cell offsets
+#define GRID_HEADER_SIZE 12
+
+// preferGrid only picks grids for objects with at least this many primitives,
+// whose sizes vary by at most this fraction of their mean (standard deviation)
+#define GRID_MIN_PRIMITIVES 256
+#define GRID_MAX_SIZE_VARIATION 0.5f
+
+enum GridMode {
+    GRID_NEVER,
+    GRID_AUTO, // Objects preferGrid picks
+    GRID_ALWAYS
+};
+
+struct GridSettings {
+    float cellSize; // Edge of a cell in mean primitive sizes
+    float density; // Most cells per primitive before the grid is hashed
+    unsigned int maxResolution; // Per axis
+};
+
+#define GRID_DEFAULT_SETTINGS { 2.0f, 8.0f, 256 }
+
+struct Grid {
+    float min[3], max[3];
+    unsigned int resolution[3];
+    unsigned int hashMask; // Table size - 1 for hashed grids, 0 for dense ones
+
+    unsigned int cellCount;
+    unsigned int* cells; // cellCount + 1 offsets into references
+
+    unsigned int referenceCount;
+    unsigned int* references;
+};
+
+// Whether a grid is likely to beat a BVH for the object: enough primitives of
+// about the same size
+_Bool preferGrid(const struct Scene* scene, const struct Object* object);
+
+// Settings may be null to use GRID_DEFAULT_SETTINGS. Returns null for empty objects.
+struct Grid* buildGrid(const struct Scene* scene, const struct Object* object, const struct GridSettings* settings);
+
+// Size of the grid in the buffer at GRID_BINDING, and the words to upload there
+unsigned int gridWordCount(const struct Grid* grid);
+void writeGrid(const struct Grid* grid, unsigned int* words);
+
+void freeGrid(struct Grid* grid);
+
+#endif //RT_GRID_H
@@ -0,0 +1,57 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_HOTRELOAD_H
+#define RT_HOTRELOAD_H
+
+#include "window.h"
+#include "lbvh.h"
+
+// Rebuilds shaders and scenes that changed on disk on a worker thread, so frames
+// keep rendering with the old ones in the meantime. Shaders are compiled in a
+// hidden window whose context shares objects with the main one. Scenes are read
+// and their TLAS built on the host, the main thread uploads them when it takes
+// them. Whatever fails to build is dropped with its errors printed, and the old
+// version stays in place.
+//
+// A request made while the worker is still busy replaces any older one of the
+// same kind that hasn't started yet, and a finished result that wasn't taken yet
+// replaces the older one too.
+
+struct HotReload;
+
+// Has to be called on the main thread, which owns window's context
+struct HotReload* createHotReload(GLFWwindow* window);
+
+void reloadShader(struct HotReload* reload, const char* path, const char* defines);
+void reloadLBVH(struct HotReload* reload, const char* shaderPath);
+void reloadScene(struct HotReload* reload, const char* path, const struct BVHSettings* settings, const char* cachePath);
+
+// The finished raytracer program, or 0 when there's none. Programs built with
+// other defines than the current ones are outdated and deleted instead.
+GLuint takeReloadedShader(struct HotReload* reload, const char* defines);
+
+// The finished LBVH, or null when there's none
+struct LBVH* takeReloadedLBVH(struct HotReload* reload);
+
+// The finished scene and its TLAS, neither uploaded yet. Returns 0 when there's none.
+_Bool takeReloadedScene(struct HotReload* reload, struct Scene** scene, struct TLAS** tlas);
+
+// Waits for the worker to finish what it's building
+void freeHotReload(struct HotReload* reload);
+
+#endif //RT_HOTRELOAD_H
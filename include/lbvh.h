@@ -0,0 +1,82 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_LBVH_H
+#define RT_LBVH_H
+
+#include "tlas.h"
+
+// Builds a linear BVH of one object from the uploaded scene buffers entirely on
+// the GPU. The result uses the same node layout as struct BVH and is copied over
+// the object's BVH in the TLAS buffers, so raytracer.glsl traverses it as is.
+
+#define LBVH_GROUP_SIZE 256
+
+// Scratch buffer bindings, only used by the stages in lbvh.glsl
+#define LBVH_BOUNDS_BINDING 8
+#define LBVH_KEYS_IN_BINDING 9
+#define LBVH_VALUES_IN_BINDING 10
+#define LBVH_KEYS_OUT_BINDING 11
+#define LBVH_VALUES_OUT_BINDING 12
+#define LBVH_HISTOGRAM_BINDING 13
+#define LBVH_PARENT_BINDING 14
+#define LBVH_INTERNAL_SLOT_BINDING 15
+#define LBVH_LEAF_SLOT_BINDING 16
+#define LBVH_FLAG_BINDING 17
+#define LBVH_SKIP_BINDING 18
+
+enum LBVHStage {
+    LBVH_STAGE_BOUNDS,
+    LBVH_STAGE_MORTON,
+    LBVH_STAGE_HISTOGRAM,
+    LBVH_STAGE_SCAN,
+    LBVH_STAGE_SCATTER,
+    LBVH_STAGE_HIERARCHY,
+    LBVH_STAGE_REFIT,
+    LBVH_STAGE_SKIP,
+    LBVH_STAGE_COUNT
+};
+
+struct LBVH {
+    unsigned int programs[LBVH_STAGE_COUNT];
+
+    // Primitives the buffers below are sized for
+    unsigned int capacity;
+
+    unsigned int boundsBuffer;
+    unsigned int keyBuffers[2];
+    unsigned int valueBuffers[2]; // valueBuffers[0] ends up holding the sorted primitive references
+    unsigned int histogramBuffer;
+    unsigned int nodeBuffer;
+    unsigned int parentBuffer;
+    unsigned int internalSlotBuffer;
+    unsigned int leafSlotBuffer;
+    unsigned int flagBuffer;
+    unsigned int skipBuffer;
+};
+
+struct LBVH* createLBVH(const char* shaderPath);
+
+// Reads the buffers bound by uploadScene, nothing is copied back to the host. The
+// object can't have more primitives than the references of the BVH the TLAS was
+// built with, and the top level isn't updated, so its primitives shouldn't leave
+// the old bounds. Objects uploaded with compressed leaves can't be rebuilt, see
+// TLAS.compressLeaves.
+// Skip links are rebuilt along with the nodes when the TLAS is stackless.
+_Bool buildLBVH(struct LBVH* lbvh, struct TLAS* tlas, const struct Scene* scene, unsigned int object);
+void freeLBVH(struct LBVH* lbvh);
+
+#endif //RT_LBVH_H
@@ -0,0 +1,35 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_MAPFILE_H
+#define RT_MAPFILE_H
+
+#include <stddef.h>
+
+// Maps the whole file read only, or reads it where mmap isn't available. Returns
+// null for missing and empty files.
+const unsigned char* mapFile(const char* path, size_t* size);
+void unmapFile(const unsigned char* data, size_t size);
+
+// Advice for a range of a mapped file, which doesn't have to be page aligned.
+// Prefetching starts reading the range ahead of its use, releasing drops its
+// pages until they're read again. Neither does anything where the whole file is
+// read instead.
+void prefetchMapped(const unsigned char* data, size_t offset, size_t size);
+void releaseMapped(const unsigned char* data, size_t offset, size_t size);
+
+#endif //RT_MAPFILE_H
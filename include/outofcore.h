@@ -0,0 +1,121 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_OUTOFCORE_H
+#define RT_OUTOFCORE_H
+
+#include "bvh.h"
+
+// Host tracing of scenes larger than memory. buildOutOfCoreFile sorts the
+// primitives of a .rtscene file into subtrees of nearby primitives and writes
+// each one's spheres, rects and BVH to a file of its own format, along with a top
+// level BVH over the subtrees' bounds. The file is built a subtree at a time, so
+// building takes about the memory of one subtree whatever the size of the scene.
+//
+// The tracer maps the file and reads subtrees on demand. Rays are queued at the
+// subtree they enter next, and the subtree with the most rays waiting traces its
+// whole queue at once, so its pages are read once per batch rather than once per
+// ray. Subtrees are released least recently used first once they take more than
+// the resident limit. Rays visit the subtrees they enter in order of distance and
+// stop at the first one past their closest hit, so the hits are the same as a
+// single BVH's.
+//
+// Only the primitives of files without objects are kept. Where mmap isn't
+// available the whole file is read, see mapfile.h.
+
+#define OUT_OF_CORE_VERSION 1
+#define OUT_OF_CORE_ALIGNMENT 4096
+
+// Primitives per subtree when the settings don't say. Nearby primitives are
+// grouped by the cells of a grid of this many cells per axis, a single cell with
+// more primitives than that still becomes one subtree.
+#define OUT_OF_CORE_SUBTREE_SIZE (1024 * 1024)
+#define OUT_OF_CORE_GRID_SIZE 64
+
+struct OutOfCoreSubtree {
+    float min[3], max[3];
+    unsigned long long sphereOffset; // From the start of the file, like the other offsets
+    unsigned long long rectOffset;
+    unsigned long long nodeOffset;
+    unsigned long long primitiveOffset; // References index the subtree's own spheres and rects
+    unsigned int sphereCount, rectCount;
+    unsigned int nodeCount, primitiveCount;
+};
+
+struct OutOfCoreHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int subtreeCount;
+    unsigned long long subtreeOffset;
+    unsigned long long textureOffset;
+    unsigned long long materialOffset;
+    unsigned long long topNodeOffset;
+    unsigned long long topPrimitiveOffset; // Subtree indices
+    unsigned int textureCount, materialCount;
+    unsigned int topNodeCount, topPrimitiveCount;
+};
+
+struct OutOfCoreSettings {
+    unsigned int subtreeSize; // 0 for OUT_OF_CORE_SUBTREE_SIZE
+    struct BVHSettings bvh; // For every subtree, the top level is built with the same
+};
+
+struct OutOfCoreRay {
+    float origin[3];
+    float tmax;
+    float direction[3];
+};
+
+// Where a ray hit, t is the ray's tmax on a miss and the rest is left unset then
+struct OutOfCoreHit {
+    float t;
+    float normal[3]; // Pointing out of spheres and along the axis for rects, not towards the ray
+    float u, v;
+    unsigned int material;
+};
+
+struct OutOfCoreScene {
+    const unsigned char* data;
+    size_t size;
+    struct OutOfCoreHeader header;
+    const struct OutOfCoreSubtree* subtrees;
+    const struct Texture* textures;
+    const struct Material* materials;
+    struct BVH topLevel; // Points into the mapped file
+
+    unsigned int threadCount;
+    size_t residentLimit;
+    size_t residentSize;
+    unsigned long long* lastUse; // Per subtree, 0 while it's not resident
+    _Bool* checked; // Per subtree, whether its BVH was validated on first use
+    unsigned long long useCount;
+};
+
+// Returns 0 with a message when the scene can't be read or written. Settings may be null.
+_Bool buildOutOfCoreFile(const char* scenePath, const char* path, const struct OutOfCoreSettings* settings);
+
+// Keeps at most residentLimit bytes of subtrees mapped in, but always the one
+// being traced. threadCount 0 uses every online processor.
+struct OutOfCoreScene* openOutOfCoreScene(const char* path, size_t residentLimit, unsigned int threadCount);
+
+// Finds the closest hit of every ray. Returns 0 with a message when out of
+// memory or a subtree turns out to be damaged.
+_Bool traceOutOfCore(struct OutOfCoreScene* scene, const struct OutOfCoreRay* rays, unsigned int count, struct OutOfCoreHit* hits);
+
+void closeOutOfCoreScene(struct OutOfCoreScene* scene);
+
+#endif //RT_OUTOFCORE_H
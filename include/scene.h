@@ -14,9 +14,26 @@
 // You should have received a copy of the GNU General Public License
 // along with rt.  If not, see <https://www.gnu.org/licenses/>.
 
+
 #ifndef RT_SCENE_H
 #define RT_SCENE_H
 
+#include <stddef.h>
+
+// Shader storage bindings used by raytracer.glsl and lbvh.glsl
+#define SCENE_SPHERE_BINDING 2
+#define SCENE_RECT_BINDING 3
+// Past the ones lbvh.c uses for its scratch buffers
+#define SCENE_TEXTURE_BINDING 19
+#define SCENE_MATERIAL_BINDING 20
+
+// Uniform buffer binding of the scene's counts in raytracer.glsl
+#define SCENE_COUNTS_BINDING 0
+
+// Every array of a scene starts at a multiple of this in its arena. It's also
+// the largest offset alignment drivers ask for when binding ranges of a buffer.
+#define SCENE_ARENA_ALIGNMENT 256
+
 enum TextureType {
     SOLID_COLOR,
     CHECKERED,
@@ -36,11 +53,15 @@ enum Plane {
     YZ
 };
 
+// Texture, Material, Sphere and Rect have the std430 layouts of raytracer.glsl,
+// so their arrays are uploaded as they are
+
 struct Texture {
-    enum TextureType type;
     float albedo[3];
+    enum TextureType type;
     unsigned int property1;
     unsigned int property2;
+    unsigned int padding[2];
 };
 
 struct Material {
@@ -53,13 +74,55 @@ struct Sphere {
     float center[3];
     float radius;
     unsigned int material;
+    unsigned int padding[3];
 };
 
 struct Rect {
     enum Plane plane;
     float x0, x1, y0, y1, k;
     unsigned int material;
-    float rotation;
+};
+
+_Static_assert(sizeof(struct Texture) == 32, "Texture must match its std430 layout in raytracer.glsl");
+_Static_assert(sizeof(struct Material) == 12, "Material must match its std430 layout in raytracer.glsl");
+_Static_assert(sizeof(struct Sphere) == 32, "Sphere must match its std430 layout in raytracer.glsl");
+_Static_assert(sizeof(struct Rect) == 28, "Rect must match its std430 layout in raytracer.glsl");
+
+// A group of primitives placed in the world through instances. Its spheres and
+// rects are consecutive ranges of the scene's arrays, given in object space.
+struct Object {
+    unsigned int firstSphere, sphereCount;
+    unsigned int firstRect, rectCount;
+};
+
+struct Instance {
+    float transform[3][4]; // Object to world, the rows of an affine 3x4 matrix
+    unsigned int object;
+};
+
+// The arrays in the order they're laid out in the arena. The ones the GPU reads
+// come first with spheres last among them, so they're uploaded in one piece and
+// the spheres can be left out.
+enum SceneArray {
+    SCENE_TEXTURES,
+    SCENE_MATERIALS,
+    SCENE_RECTS,
+    SCENE_SPHERES,
+    SCENE_OBJECTS,
+    SCENE_INSTANCES,
+    SCENE_ARRAY_COUNT
+};
+
+// The arrays in the storage buffer, see uploadScene
+#define SCENE_GPU_ARRAY_COUNT (SCENE_SPHERES + 1)
+
+// Disjoint element ranges kept per array for partial uploads, edits past that
+// many merge the ranges closest to each other
+#define SCENE_DIRTY_RANGES 8
+
+// Elements [first, end) of an array, empty when first isn't below end
+struct SceneRange {
+    unsigned int first, end;
 };
 
 struct Scene {
@@ -74,10 +137,127 @@ struct Scene {
 
     unsigned int rectCount;
     struct Rect* rects;
+
+    // Scenes without objects are treated as a single object with an identity instance
+    unsigned int objectCount;
+    struct Object* objects;
+
+    unsigned int instanceCount;
+    struct Instance* instances;
+
+    // The single allocation the arrays above point into, each with room for
+    // capacities[SceneArray] elements
+    unsigned char* arena;
+    size_t arenaSize;
+    unsigned int capacities[SCENE_ARRAY_COUNT];
+
+    // Created by uploadScene. The storage buffer holds the GPU arrays at their
+    // offsets in the arena, the uniform buffer their counts.
+    unsigned int buffer;
+    unsigned int countBuffer;
+
+    // The layout the storage buffer was last uploaded with, edits that still fit
+    // it are flushed as partial updates
+    unsigned int bufferCapacities[SCENE_GPU_ARRAY_COUNT];
+    _Bool bufferHasSpheres;
+
+    // Edits that haven't been flushed yet, sorted by first element
+    struct SceneRange dirtyRanges[SCENE_GPU_ARRAY_COUNT][SCENE_DIRTY_RANGES];
+    unsigned int dirtyRangeCounts[SCENE_GPU_ARRAY_COUNT];
+    _Bool countsDirty;
+    _Bool imageChanged;
+
+    // Spheres and rects edited since the TLAS last caught up, see updateTLASObjects
+    struct SceneRange editedSpheres, editedRects;
+
+    // Set by canonicalizeScene and cleared by adding or editing elements, so
+    // scene files can say they don't need sorting again
+    _Bool canonical;
 };
 
 struct Scene* createScene();
+
+// The add functions build a scene before it's uploaded, edits to an uploaded
+// scene go through the edit functions below.
+//
+// Append count zeroed elements and return the first of them, or null when the
+// arena can't grow. A full array at least doubles its capacity, so adding one
+// element at a time is amortized constant. Growing moves the arrays, pointers
+// into them have to be taken again. Adding no elements returns where they'd go,
+// which is null until the scene has an arena.
+struct Texture* addTextures(struct Scene* scene, unsigned int count);
+struct Material* addMaterials(struct Scene* scene, unsigned int count);
+struct Sphere* addSpheres(struct Scene* scene, unsigned int count);
+struct Rect* addRects(struct Scene* scene, unsigned int count);
+struct Object* addObjects(struct Scene* scene, unsigned int count);
+struct Instance* addInstances(struct Scene* scene, unsigned int count);
+
+// Makes room for at least capacities[SceneArray] elements of every array at once
+_Bool reserveScene(struct Scene* scene, const unsigned int* capacities);
+
+// Shrinks the arena to the arrays' counts once the scene is complete
+_Bool compactScene(struct Scene* scene);
+
+// Byte offset of an array in the arena
+size_t sceneArrayOffset(const struct Scene* scene, enum SceneArray array);
+
 _Bool uploadScene(struct Scene* scene);
+
+// Like uploadScene, but the GPU arrays are read from arrays, one per SceneArray
+// below SCENE_GPU_ARRAY_COUNT, each holding the scene's elements as the arena
+// does. Scene files upload straight from their mapping this way.
+_Bool uploadSceneArrays(struct Scene* scene, const void* const* arrays);
+
+// Uploads the scene without its spheres once raytracer.glsl only reads them from
+// compressed leaves, see tlasReadsSpheres. uploadScene includes them again.
+_Bool releaseSphereBuffer(struct Scene* scene);
 void freeScene(struct Scene* scene);
 
+// Edits to a scene, which are uploaded by the next flushSceneEdits. Each returns
+// 0 without changing anything when an index is out of range or the arena can't
+// grow. Writing an element as it already is doesn't count as an edit.
+//
+// Inserting or removing a texture or material moves the ones after it, and the
+// references to them are updated to match, so that alone doesn't change the
+// image. Removing one that's still referenced fails.
+//
+// Spheres and rects are inserted at the end of an object's range, moving the
+// following objects' ranges along. Removing one shrinks the ranges containing
+// it. Their objects have to be brought up to date with updateTLASObjects.
+_Bool setTexture(struct Scene* scene, unsigned int index, const struct Texture* texture);
+_Bool setMaterial(struct Scene* scene, unsigned int index, const struct Material* material);
+_Bool setSphere(struct Scene* scene, unsigned int index, const struct Sphere* sphere);
+_Bool setRect(struct Scene* scene, unsigned int index, const struct Rect* rect);
+
+_Bool insertTexture(struct Scene* scene, unsigned int index, const struct Texture* texture);
+_Bool insertMaterial(struct Scene* scene, unsigned int index, const struct Material* material);
+_Bool insertSphere(struct Scene* scene, unsigned int object, const struct Sphere* sphere);
+_Bool insertRect(struct Scene* scene, unsigned int object, const struct Rect* rect);
+
+_Bool removeTexture(struct Scene* scene, unsigned int index);
+_Bool removeMaterial(struct Scene* scene, unsigned int index);
+_Bool removeSphere(struct Scene* scene, unsigned int index);
+_Bool removeRect(struct Scene* scene, unsigned int index);
+
+// Appends the primitives as a new object with an identity instance, for scenes
+// that arrive in pieces. Scenes without objects get their implicit one first.
+// The TLAS takes the object with addTLASObject.
+_Bool appendObject(struct Scene* scene, const struct Sphere* spheres, unsigned int sphereCount,
+    const struct Rect* rects, unsigned int rectCount);
+
+// Uploads the edits made since the last flush, once per frame. Ranges that still
+// fit the uploaded layout are written in place and the rest of the buffer is left
+// alone, edits that grew or moved an array upload the arena again. Returns whether
+// the edits change the image, so the frames accumulated so far are stale.
+_Bool flushSceneEdits(struct Scene* scene);
+
+// Whether spheres or rects were edited since the TLAS last caught up
+_Bool sceneGeometryEdited(const struct Scene* scene);
+
+// Objects and instances of the scene, including the implicit ones of scenes without objects
+unsigned int sceneObjectCount(const struct Scene* scene);
+struct Object sceneObject(const struct Scene* scene, unsigned int object);
+unsigned int sceneInstanceCount(const struct Scene* scene);
+const struct Instance* sceneInstance(const struct Scene* scene, unsigned int instance);
+
 #endif //RT_SCENE_H
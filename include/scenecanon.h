@@ -0,0 +1,46 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_SCENECANON_H
+#define RT_SCENECANON_H
+
+#include "scene.h"
+
+// Cleanup of scenes written by tools. saveSceneFile runs it on a copy of the
+// scene, so loadSceneFile only runs it for files that weren't written canonical,
+// and parseSceneFile when asked to. It changes indices but never the image:
+//
+// - identical textures are merged, checkered ones once the textures they pick
+//   from are, keeping the order of their first occurrence
+// - identical materials are merged and sorted by type and then texture, so
+//   materials shaded the same way are next to each other
+// - spheres and rects are sorted by a coarse grid cell, then material, then
+//   Morton order inside the cell, so neighboring primitives share materials and
+//   nearby ones are close in memory
+//
+// Primitives only move inside the pieces the objects' ranges cut their arrays
+// into, so every object keeps its primitives even when ranges overlap.
+// References past the end of an array stay past its end.
+
+// Primitives per grid cell the sort aims for, the cells get no finer than a
+// Morton code's 10 bits per axis
+#define SCENE_CANON_CELL_SIZE 64
+
+// Returns 0 with a message when out of memory. The scene is still consistent
+// then, just not fully sorted.
+_Bool canonicalizeScene(struct Scene* scene);
+
+#endif //RT_SCENECANON_H
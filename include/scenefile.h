@@ -0,0 +1,91 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_SCENEFILE_H
+#define RT_SCENEFILE_H
+
+#include "scene.h"
+
+// Binary .rtscene files. A SceneFileHeader is followed by one section per
+// SceneSection, each starting at a multiple of SCENE_FILE_ALIGNMENT so it can be
+// mapped on its own. Sections hold the scene's arrays as they are in its arena,
+// so loading copies each one from the mapped file without parsing it and the
+// textures, materials, spheres and rects are already in their std430 layouts.
+// Files are little endian.
+//
+// saveSceneFile writes scenes canonical and says so in the header. Loading
+// uploads the GPU arrays of such files straight from the mapping, and only sorts
+// files without SCENE_FILE_CANONICAL, which are then uploaded from the arena.
+// Version 1 files have no flags and are still read.
+
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGNMENT 4096
+
+// SceneFileHeader flags
+#define SCENE_FILE_CANONICAL 1u
+
+enum SceneSection {
+    SCENE_SECTION_TEXTURES,
+    SCENE_SECTION_MATERIALS,
+    SCENE_SECTION_SPHERES,
+    SCENE_SECTION_RECTS,
+    SCENE_SECTION_OBJECTS,
+    SCENE_SECTION_INSTANCES,
+    SCENE_SECTION_COUNT
+};
+
+struct SceneFileSection {
+    unsigned long long offset; // From the start of the file
+    unsigned int count;
+    unsigned int elementSize; // Has to match the layout this build reads the section as
+};
+
+struct SceneFileHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int sectionCount;
+    struct SceneFileSection sections[SCENE_SECTION_COUNT];
+    unsigned int flags; // Since version 2, zero padding before
+};
+
+// A mapped file's sections, for reading a scene in pieces instead of loading it
+// at once. See scenestream.h.
+struct SceneFileView {
+    const unsigned char* data;
+    size_t size;
+    const void* sections[SCENE_SECTION_COUNT];
+    unsigned int counts[SCENE_SECTION_COUNT];
+    _Bool canonical; // The header has SCENE_FILE_CANONICAL
+};
+
+// Scenes that aren't canonical yet are sorted on a copy first, so the scene's
+// indices stay as they are. The file is written unsorted when there's no memory
+// for the copy.
+_Bool saveSceneFile(const char* path, const struct Scene* scene);
+
+// Returns null with a message when the file is missing, from another version or
+// damaged. Files that weren't written canonical are cleaned up with
+// canonicalizeScene, so the scene's indices can differ from theirs. upload fills
+// the scene's GPU buffers once it's loaded, it needs the GL context.
+struct Scene* loadSceneFile(const char* path, _Bool upload);
+
+// Maps the file and finds its sections, failing like loadSceneFile. Objects aren't
+// checked against the primitives. The sections stay readable until closeSceneFile.
+_Bool openSceneFile(const char* path, struct SceneFileView* file);
+void closeSceneFile(struct SceneFileView* file);
+
+#endif //RT_SCENEFILE_H
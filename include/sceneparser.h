@@ -0,0 +1,50 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_SCENEPARSER_H
+#define RT_SCENEPARSER_H
+
+#include "scene.h"
+
+#include <stdio.h>
+
+// Text scene descriptions, one statement per line and # starting a comment:
+//
+//   texture solid <r> <g> <b>
+//   texture checkered <odd texture> <even texture>
+//   texture image <image> [<r> <g> <b>]
+//   material diffuse|metal|dielectric|light <texture> [<fuzz or refractive index>]
+//   sphere <x> <y> <z> <radius> <material>
+//   rect xy|xz|yz <x0> <x1> <y0> <y1> <k> <material>
+//   object
+//   instance <object> <12 numbers, the rows of the object to world transform>
+//
+// Textures, materials and objects are numbered in the order they appear and
+// have to be declared before they're used. Every sphere and rect after an
+// object line belongs to that object, scenes without objects are rendered as is.
+// The numbers refer to the description. With canonicalize the scene returned is
+// cleaned up with canonicalizeScene and can number things differently.
+
+// Lines can't be longer than this
+#define SCENE_PARSER_BUFFER_SIZE (64 * 1024)
+
+// Both print errors with the line and column to stderr and return null. name is
+// only used in messages.
+struct Scene* parseScene(FILE* file, const char* name, _Bool canonicalize);
+struct Scene* parseSceneFile(const char* path, _Bool canonicalize);
+
+#endif //RT_SCENEPARSER_H
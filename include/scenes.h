@@ -0,0 +1,28 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_SCENES_H
+#define RT_SCENES_H
+
+#include "scene.h"
+
+// Scenes to render, uploaded as a whole by uploadScene. raytracer.glsl only
+// places its camera for the Cornell box.
+struct Scene* createShowcaseScene();
+struct Scene* createThreeSpheresScene();
+struct Scene* createCornellBoxScene();
+
+#endif //RT_SCENES_H
@@ -0,0 +1,67 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef RT_SCENESTREAM_H
+#define RT_SCENESTREAM_H
+
+#include "tlas.h"
+
+// Renders a large .rtscene file while it's still loading. The textures, materials
+// and a first chunk of the primitives are loaded right away, so the first frame
+// takes about as long whatever the size of the scene. A worker thread builds the
+// BVHs of the following chunks from the mapped file, each chunk larger than the
+// one before. The main thread appends every finished chunk to the scene as an
+// object of its own, writing only its primitives into the storage buffer, and
+// rebuilds the top level over the chunks.
+//
+// Once every chunk is in, the worker builds one BVH over the whole scene, which
+// traces faster than the overlapping chunks, and it replaces them.
+//
+// Only files without objects of their own are streamed, the chunks would cut
+// through them. Streamed scenes keep the file's order, which is canonical for
+// files saveSceneFile wrote; sorting others would have to see every primitive first.
+
+// Primitives of the first chunk, and the most of any later one
+#define SCENE_STREAM_FIRST_CHUNK (64 * 1024)
+#define SCENE_STREAM_MAX_CHUNK (4 * 1024 * 1024)
+
+struct SceneStream;
+
+// Returns the stream and the scene with its first chunk, not uploaded yet. The
+// scene has room reserved for every primitive of the file, so the chunks are
+// uploaded in place. Returns null without a message for files with objects,
+// which loadSceneFile loads whole, and with one for files that can't be read.
+struct SceneStream* openSceneStream(const char* path, const struct BVHSettings* settings, struct Scene** scene);
+
+// Appends the chunks that finished since the last call, or swaps in the BVH over
+// the whole scene once it's built, and uploads the TLAS again. Returns whether the
+// scene changed, so the frames accumulated so far are stale. scene and tlas have
+// to be the ones the stream was opened for, with the TLAS built over its first chunk.
+// The final BVH is built from the file, spheres and rects edited before it's
+// swapped in are left for updateTLASObjects. After spheres or rects were inserted
+// or removed it no longer matches the scene and the chunks stay, and chunks
+// appended after that are built again from the scene on the main thread.
+_Bool updateSceneStream(struct SceneStream* stream, struct Scene* scene, struct TLAS** tlas);
+
+// Whether everything was appended and the final BVH is in place
+_Bool sceneStreamFinished(const struct SceneStream* stream);
+
+// Stops the worker after the BVH it's building and unmaps the file. The scene
+// keeps what was appended so far.
+void closeSceneStream(struct SceneStream* stream);
+
+#endif //RT_SCENESTREAM_H
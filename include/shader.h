@@ -3,4 +3,5 @@
 #include <glad/glad.h>
 
 GLuint shaderCreate(const char* path, GLenum type);
+GLuint shaderCreateWithDefines(const char* path, GLenum type, const char* defines);
 GLuint shaderCreateProgram(char shaderCount, GLuint* shaders);
\ No newline at end of file
@@ -0,0 +1,120 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RT_TLAS_H
+#define RT_TLAS_H
+
+#include "bvh4.h"
+#include "grid.h"
+
+// Two level acceleration structure. Every object gets a bottom level BVH over its
+// primitives in object space and the top level BVH is built over the world space
+// bounds of the instances. Repeated objects are only stored once, and moving an
+// instance only requires rebuilding the top level.
+//
+// Both levels share the buffers at BVH_NODE_BINDING and BVH_PRIMITIVE_BINDING.
+// The top level starts at node 0, the objects follow at nodeOffsets and
+// primitiveOffsets. Every BVH gets room for the most nodes its primitives can
+// produce, so any of them can be rebuilt in place. Objects are uploaded as
+// 4-wide BVHs when they fit the format, which take two binary nodes each and
+// are read through BVH4_NODE_BINDING. The top level is small and always binary.
+//
+// raytracer.glsl built with BVH_STACKLESS follows skip links instead of keeping
+// a traversal stack. Those only exist for binary BVHs, so with stackless set
+// every object stays binary and the links go to BVH_SKIP_BINDING, indexed like
+// the nodes.
+//
+// Objects can also be uploaded as grids, see grid.h and gridMode. Their bottom
+// level BVH is still built, for the top level's bounds and the LBVH.
+//
+// With compressLeaves set, the leaves of every BVH store their spheres in the
+// primitive buffer themselves, see bvhleaf.h. Once no object reads the sphere
+// buffer anymore it can be released with releaseSphereBuffer. Compressed objects
+// only get room for the nodes they have, the LBVH can't rebuild them in place.
+
+#define TLAS_INSTANCE_BINDING 4
+#define BVH4_NODE_BINDING 5
+#define BVH_SKIP_BINDING 6
+
+enum BVHFormat {
+    BVH_BINARY,
+    BVH_WIDE,
+    BVH_GRID // Not a BVH, nodeOffset is where the grid starts in the buffer at GRID_BINDING
+};
+
+struct TLAS {
+    unsigned int objectCount;
+    struct BVH** objects; // Bottom level BVHs, indexed like scene->objects
+    unsigned int* nodeOffsets;
+    unsigned int* primitiveOffsets;
+    enum BVHFormat* formats; // How each object's nodes are currently stored
+    _Bool stackless; // Has to match how raytracer.glsl was built, read by uploadTLAS
+    _Bool compressLeaves; // Read by uploadTLAS, objects whose leaves don't fit the format keep references
+    _Bool* compressed; // Whether each object's leaves are currently compressed
+    struct Object* objectRanges; // The spheres and rects each object's BVH was built over
+
+    // Which objects uploadTLAS turns into grids, GRID_AUTO by default
+    enum GridMode gridMode;
+    struct GridSettings gridSettings;
+    unsigned int* gridOffsets; // Into the grid buffer, for objects uploaded as grids
+
+    // Primitives are indices into scene->instances, instances of empty objects are left out
+    struct BVH* topLevel;
+
+    // Sizes of the shared buffers, and how many objects have room in them
+    unsigned int nodeCount;
+    unsigned int primitiveCount;
+    unsigned int uploadedObjectCount;
+
+    unsigned int nodeBuffer;
+    unsigned int primitiveBuffer;
+    unsigned int instanceBuffer;
+    unsigned int skipBuffer; // Only uploaded for stackless traversal
+    unsigned int gridBuffer;
+};
+
+// Settings may be null to use BVH_DEFAULT_SETTINGS
+struct TLAS* buildTLAS(const struct Scene* scene, const struct BVHSettings* settings);
+
+// Same as buildTLAS, but reads the objects' BVHs from the cache file when it was
+// written for the same geometry and settings, and writes it after building them
+// otherwise. See bvhcache.h.
+struct TLAS* buildCachedTLAS(const struct Scene* scene, const struct BVHSettings* settings, const char* cachePath);
+
+// Rebuilds only the top level, after instances moved or objects were refit
+_Bool rebuildTopLevel(struct TLAS* tlas, const struct Scene* scene, const struct BVHSettings* settings);
+_Bool uploadTLAS(struct TLAS* tlas, const struct Scene* scene);
+
+// Catches up with the spheres and rects edited through the scene's edit functions.
+// Objects whose primitives only changed are refit, ones that got or lost
+// primitives or whose ranges moved are rebuilt, then the top level. Only those
+// objects, the top level and the instances are written back, in place. The TLAS
+// is uploaded whole when an object outgrew its room or is a grid, whose size
+// depends on where its primitives are. Does nothing when no geometry was edited.
+_Bool updateTLASObjects(struct TLAS* tlas, struct Scene* scene, const struct BVHSettings* settings);
+
+// Takes bvh as the BVH of the scene's next object, after appendObject added it.
+// The top level has to be rebuilt and the TLAS uploaded again before it's traced.
+_Bool addTLASObject(struct TLAS* tlas, const struct Scene* scene, struct BVH* bvh);
+
+// Only rewrites the instances, for when an object's format changed
+_Bool uploadTLASInstances(struct TLAS* tlas, const struct Scene* scene);
+
+// Whether raytracer.glsl still reads the sphere buffer for any of the uploaded objects
+_Bool tlasReadsSpheres(const struct TLAS* tlas, const struct Scene* scene);
+void freeTLAS(struct TLAS* tlas);
+
+#endif //RT_TLAS_H
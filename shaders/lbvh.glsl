@@ -0,0 +1,481 @@
+#version 430 core
+
+// Linear BVH construction (Karras 2012) of one object from the scene's sphere and rect buffers.
+// lbvh.c compiles this file once per STAGE_* define and runs the stages in order:
+// bounds, morton, then histogram, scan and scatter for every radix pass, hierarchy
+// and finally refit. Skip only runs when the raytracer traverses without a stack.
+
+layout(local_size_x = GROUP_SIZE) in;
+
+#define XY 0
+#define XZ 1
+#define YZ 2
+
+#define BVH_PRIMITIVE_RECT 0x80000000u
+#define BVH_PRIMITIVE_INDEX 0x7fffffffu
+
+// Has to match RECT_THICKNESS in bvh.c
+#define RECT_THICKNESS 0.001
+#define INFINITY 1e30
+
+#define RADIX_BITS 4
+#define RADIX_SIZE 16
+#define MASK_WORDS (GROUP_SIZE / 32)
+
+uniform uint ucount; // Spheres and rects together
+uniform uint usphereCount;
+uniform uint ufirstSphere; // Where the object's ranges start in spheres[] and rects[]
+uniform uint ufirstRect;
+uniform uint ushift; // First key bit of the current radix pass
+uniform uint ugroupCount; // Work groups of the histogram and scatter stages
+
+struct Sphere {
+    vec3 center;
+    float radius;
+    uint materialIndex;
+};
+
+struct Rect {
+    uint plane;
+    float x0, x1, y0, y1, k;
+    uint materialIndex;
+};
+
+struct BVHNode {
+    vec3 min;
+    uint leftFirst;
+    vec3 max;
+    uint count;
+};
+
+layout(std430, binding = 0) coherent buffer BVHNodes {
+    BVHNode nodes[];
+};
+
+layout(std430, binding = 2) readonly buffer Spheres {
+    Sphere spheres[];
+};
+
+layout(std430, binding = 3) readonly buffer Rects {
+    Rect rects[];
+};
+
+// Centroid bounds as order preserving uints, so they can be reduced with atomics
+layout(std430, binding = 8) coherent buffer SceneBounds {
+    uint boundsMin[3];
+    uint boundsMax[3];
+};
+
+layout(std430, binding = 9) buffer KeysIn {
+    uint keysIn[];
+};
+
+layout(std430, binding = 10) buffer ValuesIn {
+    uint valuesIn[];
+};
+
+layout(std430, binding = 11) buffer KeysOut {
+    uint keysOut[];
+};
+
+layout(std430, binding = 12) buffer ValuesOut {
+    uint valuesOut[];
+};
+
+// Digit major, so the exclusive scan gives every work group its offset per digit
+layout(std430, binding = 13) buffer Histograms {
+    uint histograms[];
+};
+
+// Internal node i keeps its children in slots 2i + 1 and 2i + 2 of nodes[].
+// parents[] maps a slot to the internal node owning it, internalSlots[] and
+// leafSlots[] map nodes back to the slot they were placed in.
+layout(std430, binding = 14) buffer Parents {
+    uint parents[];
+};
+
+layout(std430, binding = 15) buffer InternalSlots {
+    uint internalSlots[];
+};
+
+layout(std430, binding = 16) buffer LeafSlots {
+    uint leafSlots[];
+};
+
+// Counts how many children of an internal node have their bounds ready
+layout(std430, binding = 17) coherent buffer Flags {
+    uint flags[];
+};
+
+// Skip links for stackless traversal, indexed by slot like nodes[]
+layout(std430, binding = 18) buffer Skips {
+    uint skips[];
+};
+
+uint PrimitiveReference(uint i) {
+    return i < usphereCount ? ufirstSphere + i : (ufirstRect + i - usphereCount) | BVH_PRIMITIVE_RECT;
+}
+
+// Same bounds as primitiveBounds in bvh.c
+void PrimitiveBounds(uint primitive, out vec3 bmin, out vec3 bmax) {
+    uint index = primitive & BVH_PRIMITIVE_INDEX;
+
+    if((primitive & BVH_PRIMITIVE_RECT) == 0) {
+        Sphere sphere = spheres[index];
+        bmin = sphere.center - sphere.radius;
+        bmax = sphere.center + sphere.radius;
+        return;
+    }
+
+    Rect rect = rects[index];
+    if(rect.plane == XY) {
+        bmin = vec3(rect.x0, rect.y0, rect.k - RECT_THICKNESS);
+        bmax = vec3(rect.x1, rect.y1, rect.k + RECT_THICKNESS);
+    } else if(rect.plane == XZ) {
+        bmin = vec3(rect.x0, rect.k - RECT_THICKNESS, rect.y0);
+        bmax = vec3(rect.x1, rect.k + RECT_THICKNESS, rect.y1);
+    } else {
+        bmin = vec3(rect.k - RECT_THICKNESS, rect.x0, rect.y0);
+        bmax = vec3(rect.k + RECT_THICKNESS, rect.x1, rect.y1);
+    }
+}
+
+uint FloatToOrdered(float f) {
+    uint u = floatBitsToUint(f);
+    return (u & 0x80000000u) != 0 ? ~u : u | 0x80000000u;
+}
+
+float OrderedToFloat(uint u) {
+    return uintBitsToFloat((u & 0x80000000u) != 0 ? u & 0x7fffffffu : ~u);
+}
+
+#ifdef STAGE_BOUNDS
+
+shared vec3 groupMin[GROUP_SIZE];
+shared vec3 groupMax[GROUP_SIZE];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint local = gl_LocalInvocationID.x;
+
+    groupMin[local] = vec3(INFINITY);
+    groupMax[local] = vec3(-INFINITY);
+    if(i < ucount) {
+        vec3 bmin, bmax;
+        PrimitiveBounds(PrimitiveReference(i), bmin, bmax);
+        groupMin[local] = groupMax[local] = (bmin + bmax) * 0.5;
+    }
+    barrier();
+
+    for(uint stride = GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if(local < stride) {
+            groupMin[local] = min(groupMin[local], groupMin[local + stride]);
+            groupMax[local] = max(groupMax[local], groupMax[local + stride]);
+        }
+        barrier();
+    }
+
+    if(local == 0) {
+        for(int axis = 0; axis < 3; axis++) {
+            atomicMin(boundsMin[axis], FloatToOrdered(groupMin[0][axis]));
+            atomicMax(boundsMax[axis], FloatToOrdered(groupMax[0][axis]));
+        }
+    }
+}
+
+#endif
+
+#ifdef STAGE_MORTON
+
+// Spreads the lower 10 bits of v out to every third bit
+uint ExpandBits(uint v) {
+    v = (v * 0x00010001u) & 0xff0000ffu;
+    v = (v * 0x00000101u) & 0x0f00f00fu;
+    v = (v * 0x00000011u) & 0xc30c30c3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if(i >= ucount) {
+        return;
+    }
+
+    vec3 sceneMin = vec3(OrderedToFloat(boundsMin[0]), OrderedToFloat(boundsMin[1]), OrderedToFloat(boundsMin[2]));
+    vec3 sceneMax = vec3(OrderedToFloat(boundsMax[0]), OrderedToFloat(boundsMax[1]), OrderedToFloat(boundsMax[2]));
+
+    uint primitive = PrimitiveReference(i);
+    vec3 bmin, bmax;
+    PrimitiveBounds(primitive, bmin, bmax);
+
+    vec3 extent = max(sceneMax - sceneMin, vec3(1e-20));
+    uvec3 cell = uvec3(clamp((bmin + bmax) * 0.5 - sceneMin, vec3(0), extent) / extent * 1023.0);
+
+    keysIn[i] = (ExpandBits(cell.x) << 2) | (ExpandBits(cell.y) << 1) | ExpandBits(cell.z);
+    valuesIn[i] = primitive;
+}
+
+#endif
+
+#ifdef STAGE_HISTOGRAM
+
+shared uint counts[RADIX_SIZE];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint local = gl_LocalInvocationID.x;
+
+    if(local < RADIX_SIZE) {
+        counts[local] = 0;
+    }
+    barrier();
+
+    if(i < ucount) {
+        atomicAdd(counts[(keysIn[i] >> ushift) & (RADIX_SIZE - 1)], 1u);
+    }
+    barrier();
+
+    if(local < RADIX_SIZE) {
+        histograms[local * ugroupCount + gl_WorkGroupID.x] = counts[local];
+    }
+}
+
+#endif
+
+#ifdef STAGE_SCAN
+
+// Runs as a single work group, every invocation scans a contiguous chunk
+shared uint sums[GROUP_SIZE];
+
+void main()
+{
+    uint local = gl_LocalInvocationID.x;
+    uint total = RADIX_SIZE * ugroupCount;
+    uint chunk = (total + GROUP_SIZE - 1) / GROUP_SIZE;
+    uint begin = min(local * chunk, total);
+    uint end = min(begin + chunk, total);
+
+    uint sum = 0;
+    for(uint i = begin; i < end; i++) {
+        sum += histograms[i];
+    }
+    sums[local] = sum;
+    barrier();
+
+    for(uint offset = 1; offset < GROUP_SIZE; offset <<= 1) {
+        uint value = local >= offset ? sums[local - offset] : 0;
+        barrier();
+        sums[local] += value;
+        barrier();
+    }
+
+    uint running = local > 0 ? sums[local - 1] : 0;
+    for(uint i = begin; i < end; i++) {
+        uint count = histograms[i];
+        histograms[i] = running;
+        running += count;
+    }
+}
+
+#endif
+
+#ifdef STAGE_SCATTER
+
+// Bit masks of the invocations holding each digit, their popcounts give a stable rank
+shared uint masks[RADIX_SIZE * MASK_WORDS];
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    uint local = gl_LocalInvocationID.x;
+
+    for(uint m = local; m < RADIX_SIZE * MASK_WORDS; m += GROUP_SIZE) {
+        masks[m] = 0;
+    }
+    barrier();
+
+    uint key = 0, digit = 0;
+    if(i < ucount) {
+        key = keysIn[i];
+        digit = (key >> ushift) & (RADIX_SIZE - 1);
+        atomicOr(masks[digit * MASK_WORDS + local / 32], 1u << (local % 32));
+    }
+    barrier();
+
+    if(i >= ucount) {
+        return;
+    }
+
+    uint rank = bitCount(masks[digit * MASK_WORDS + local / 32] & ((1u << (local % 32)) - 1u));
+    for(uint word = 0; word < local / 32; word++) {
+        rank += bitCount(masks[digit * MASK_WORDS + word]);
+    }
+
+    uint destination = histograms[digit * ugroupCount + gl_WorkGroupID.x] + rank;
+    keysOut[destination] = key;
+    valuesOut[destination] = valuesIn[i];
+}
+
+#endif
+
+#ifdef STAGE_HIERARCHY
+
+// Length of the common prefix of two sorted keys, duplicates are told apart by index
+int Delta(int i, int j) {
+    if(j < 0 || j >= int(ucount)) {
+        return -1;
+    }
+
+    uint a = keysIn[i], b = keysIn[j];
+    if(a == b) {
+        return 32 + 31 - findMSB(uint(i) ^ uint(j));
+    }
+    return 31 - findMSB(a ^ b);
+}
+
+void main()
+{
+    int i = int(gl_GlobalInvocationID.x);
+
+    if(ucount <= 1) {
+        if(i == 0) {
+            // A single primitive is a leaf root, no primitives get a root every ray misses
+            nodes[0].leftFirst = 0;
+            nodes[0].count = ucount;
+            nodes[0].min = vec3(INFINITY);
+            nodes[0].max = vec3(-INFINITY);
+            leafSlots[0] = 0;
+        }
+        return;
+    }
+
+    if(i >= int(ucount) - 1) {
+        return;
+    }
+
+    // Direction of the range covered by internal node i
+    int d = Delta(i, i + 1) - Delta(i, i - 1) >= 0 ? 1 : -1;
+    int deltaMin = Delta(i, i - d);
+
+    int lengthMax = 2;
+    while(Delta(i, i + lengthMax * d) > deltaMin) {
+        lengthMax *= 2;
+    }
+
+    int l = 0;
+    for(int t = lengthMax / 2; t >= 1; t /= 2) {
+        if(Delta(i, i + (l + t) * d) > deltaMin) {
+            l += t;
+        }
+    }
+    int j = i + l * d;
+
+    // Find where the keys in the range stop sharing their prefix
+    int deltaNode = Delta(i, j);
+    int s = 0;
+    int t = l;
+    do {
+        t = (t + 1) >> 1;
+        if(Delta(i, i + (s + t) * d) > deltaNode) {
+            s += t;
+        }
+    } while(t > 1);
+    int gamma = i + s * d + min(d, 0);
+
+    if(i == 0) {
+        nodes[0].leftFirst = 1;
+        nodes[0].count = 0;
+        internalSlots[0] = 0;
+    }
+
+    uint leftSlot = 2 * i + 1;
+    uint rightSlot = 2 * i + 2;
+    parents[leftSlot] = i;
+    parents[rightSlot] = i;
+
+    if(min(i, j) == gamma) {
+        nodes[leftSlot].leftFirst = gamma;
+        nodes[leftSlot].count = 1;
+        leafSlots[gamma] = leftSlot;
+    } else {
+        nodes[leftSlot].leftFirst = 2 * gamma + 1;
+        nodes[leftSlot].count = 0;
+        internalSlots[gamma] = leftSlot;
+    }
+
+    if(max(i, j) == gamma + 1) {
+        nodes[rightSlot].leftFirst = gamma + 1;
+        nodes[rightSlot].count = 1;
+        leafSlots[gamma + 1] = rightSlot;
+    } else {
+        nodes[rightSlot].leftFirst = 2 * (gamma + 1) + 1;
+        nodes[rightSlot].count = 0;
+        internalSlots[gamma + 1] = rightSlot;
+    }
+}
+
+#endif
+
+#ifdef STAGE_REFIT
+
+// Every leaf walks up the tree, the second child to arrive at a node computes its bounds
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if(i >= ucount) {
+        return;
+    }
+
+    uint slot = leafSlots[i];
+    vec3 bmin, bmax;
+    PrimitiveBounds(valuesIn[i], bmin, bmax);
+    nodes[slot].min = bmin;
+    nodes[slot].max = bmax;
+
+    while(slot != 0) {
+        uint parent = parents[slot];
+
+        memoryBarrierBuffer();
+        if(atomicAdd(flags[parent], 1u) == 0) {
+            return;
+        }
+
+        uint left = 2 * parent + 1;
+        bmin = min(nodes[left].min, nodes[left + 1].min);
+        bmax = max(nodes[left].max, nodes[left + 1].max);
+
+        slot = internalSlots[parent];
+        nodes[slot].min = bmin;
+        nodes[slot].max = bmax;
+    }
+}
+
+#endif
+
+#ifdef STAGE_SKIP
+
+// Left children are in odd slots and skip to their sibling, right children skip
+// wherever their parent does. Walking up until a left child is found gives the
+// same links as computeSkipLinks in bvh.c.
+void main()
+{
+    uint slot = gl_GlobalInvocationID.x;
+    if(slot >= max(2 * ucount, 2u) - 1) {
+        return;
+    }
+
+    uint skip = 0;
+    for(uint current = slot; current != 0; current = internalSlots[parents[current]]) {
+        if((current & 1u) != 0) {
+            skip = current + 1;
+            break;
+        }
+    }
+    skips[slot] = skip;
+}
+
+#endif
@@ -35,6 +35,9 @@ layout(binding = 3) uniform sampler2D texture3;
 #define SPHERE 0
 #define RECT 1
 
+#define MAX_DISTANCE 10000.0
+#define INFINITY 1e30
+
 const int DEPTH = 100, SAMPLES = 25;
 
 float atan2(in float y, in float x) {
@@ -60,8 +63,8 @@ HitRecord SetFaceNormal(HitRecord record, Ray ray, vec3 normal) {
 }
 
 struct Texture {
-    uint type; // Texture type
     vec3 albedo; // Color for normal textures
+    uint type; // Texture type
 
     uint property1; // Texture for odd blocks when checkered or image when image texture
     uint property2; // Texture for even blocks when checkered
@@ -89,145 +92,139 @@ struct Camera {
     vec3 origin, lower_left_corner, horizontal, vertical;
 };
 
-sampler2D images[] = sampler2D[](
-    texture1,
-    texture2,
-    texture3
-);
+struct BVHNode {
+    vec3 min;
+    uint leftFirst; // Left child for interior nodes (the right one follows it), first primitive for leaves
+    vec3 max;
+    uint count; // Primitive count, 0 for interior nodes
+};
 
-#if 0
+// Four children with their bounds quantized to 8 bits, byte c of the packed words
+// belongs to child c. Takes the space of two BVHNodes in the same buffer.
+struct BVH4Node {
+    vec3 origin; // Start of the grid the child bounds are stored on
+    uint exponents; // Biased float exponents of the grid's cell size, x in the lowest byte
+    uint qmin[3];
+    uint counts; // Primitive count of leaf children, 0 for interior ones
+    uint qmax[3];
+    uint childCount;
+    uint children[4]; // Node index for interior children, first primitive for leaves
+};
 
-Texture textures[] = Texture[](
-    Texture(CHECKERED, vec3(1), 1, 2),
-    Texture(SOLID_COLOR, vec3(1.0, 0.75, 0.75), 0, 0),
-    Texture(SOLID_COLOR, vec3(0.5, 0.5, 0.75), 0, 0),
-    Texture(IMAGE, vec3(1), 0, 0),
-    Texture(IMAGE, vec3(1), 1, 0)
-);
+#define BVH_BINARY 0
+#define BVH_WIDE 1
+#define BVH_GRID 2
 
-Material materials[] = Material[](
-    Material(DIELECTRIC, 1, 1.5),
-    Material(DIFFUSE, 3, 0.0),
-    Material(DIFFUSE_LIGHT, 1, 0.25),
-    Material(DIFFUSE, 0, 0),
-    Material(DIFFUSE_LIGHT, 2, 0),
-    Material(METAL, 1, 0.25),
-    Material(DIFFUSE, 4, 0),
-    Material(DIFFUSE, 1, 0)
-);
-
-Sphere spheres[] = Sphere[](
-    Sphere(vec3(0, 0, -3), 1, 6),
-    Sphere(vec3(3, 0, -4), 1, 1),
-    Sphere(vec3(-2, 0, -4), 1, 0),
-    Sphere(vec3(2, 0, -2), 1, 5),
-    Sphere(vec3(-1.5, 0, -6), 1, 5),
-    Sphere(vec3(3, 0, -6), 1, 0),
-    Sphere(vec3(-1, 0, -1), 1, 7),
-    Sphere(vec3(0.5, 0, -5), 1, 7),
-    Sphere(vec3(0, -1001, -3), 1000, 5)
-);
+struct Instance {
+    vec4 worldToObject[3]; // Rows of the inverse of the instance's transform
+    uint nodeOffset; // Root of the object's BVH in nodes[], its indices are relative to it
+    uint primitiveOffset; // Start of the object's primitive references
+    uint format; // BVH_WIDE objects are read from wideNodes[nodeOffset / 2], BVH_GRID ones from grids[nodeOffset]
+    uint compressed; // Leaves store their spheres as in bvhleaf.h instead of primitive references
+};
 
-Rect rects[] = Rect[](
-    Rect(XY, -7, 7, -20, 20, 3, 2),
-    Rect(XY, -7, 7, -20, 20, -11, 4)
-);
+// Spheres and rects come from the scene built in main.c, see scenes.c
+layout(std430, binding = 2) readonly buffer Spheres {
+    Sphere spheres[];
+};
 
-#endif
+layout(std430, binding = 3) readonly buffer Rects {
+    Rect rects[];
+};
 
-#if 0
+// The top level BVH over the instances starts at node 0, followed by the BVH of
+// every object. See tlas.h, objects can also be rebuilt on the GPU by lbvh.glsl.
+layout(std430, binding = 0) readonly buffer BVHNodes {
+    BVHNode nodes[];
+};
 
-Texture textures[] = Texture[](
-    Texture(IMAGE, vec3(1, 1, 1), 1, 0),
-    Texture(CHECKERED, vec3(0), 2, 3),
-    Texture(SOLID_COLOR, vec3(0.9), 0, 0),
-    Texture(SOLID_COLOR, vec3(0), 0, 0),
-    Texture(IMAGE, vec3(1, 0, 0), 0, 0),
+// Top bit set for rects, the rest indexes spheres[] or rects[]
+layout(std430, binding = 1) readonly buffer BVHPrimitives {
+    uint primitives[];
+};
 
-    Texture(SOLID_COLOR, vec3(0.73), 0, 0),
-    Texture(SOLID_COLOR, vec3(0.73, 0.5, 0.5), 0, 0),
-    Texture(SOLID_COLOR, vec3(1), 0, 0)
-);
+// The same buffer as BVHNodes, for objects stored as wide BVHs
+layout(std430, binding = 5) readonly buffer BVH4Nodes {
+    BVH4Node wideNodes[];
+};
 
-Material materials[] = Material[](
-    Material(DIFFUSE_LIGHT, 7, 0), // Emission
-    Material(DIFFUSE, 1, 0), // Ground
-    Material(DIELECTRIC, 0, 1.5), // Scene object 1
-    Material(METAL, 0, 0), // Scene object 2
-    Material(DIFFUSE, 0, 0), // Scene object 3
-    Material(DIFFUSE, 5, 0),
-    Material(DIFFUSE, 6, 0)
-);
+// In the order of the top level's leaves, which index it directly
+layout(std430, binding = 4) readonly buffer Instances {
+    Instance instances[];
+};
 
-Sphere spheres[] = Sphere[](
-    Sphere(vec3(0, -1001, 0), 1000, 1), // Ground
-    Sphere(vec3(0, 0, 0), 1, 2), // Scene object 1
-    Sphere(vec3(-2, 0, 0), 1, 4), // Scene object 2
-    Sphere(vec3(2, 0, 0), 1, 3) // Scene object 3
-);
+// Objects uploaded as uniform grids, packed one after another. See grid.h for the layout.
+layout(std430, binding = 7) readonly buffer Grids {
+    uint grids[];
+};
 
-Rect rects[] = Rect[](
-    Rect(XY, -7, 7, 0, 10, 5, 0), // Light 1
-    Rect(XY, -7, 7, -1, 10, -3, 5),
-    Rect(YZ, -7, 7, -10, 10, -5, 6)
-);
+#define GRID_HEADER_SIZE 12
 
+#ifdef BVH_STACKLESS
+// Where traversal continues after each node's subtree, indexed and relative to
+// the BVH's root like nodes[]. 0 ends the traversal, see computeSkipLinks in bvh.c.
+layout(std430, binding = 6) readonly buffer BVHSkips {
+    uint skips[];
+};
 #endif
 
-// Cornell's box
-#if 1
+#define BVH_PRIMITIVE_RECT 0x80000000u
+#define BVH_PRIMITIVE_INDEX 0x7fffffffu
 
-Texture textures[] = Texture[](
-    Texture(SOLID_COLOR, vec3(0.65, 0.05, 0.05), 0, 0), // Red
-    Texture(SOLID_COLOR, vec3(0.12, 0.45, 0.15), 0, 0), // Green
-    Texture(SOLID_COLOR, vec3(0.73), 0, 0), // White
-    Texture(IMAGE, vec3(1), 2, 0)
-);
+#define BVH_LEAF_HEADER_SIZE 4
 
-Material materials[] = Material[](
-    Material(DIFFUSE, 0, 0), // Red wall
-    Material(DIFFUSE, 1, 0), // Green wall
-    Material(DIFFUSE, 2, 0), // White wall
-    Material(DIFFUSE_LIGHT, 3, 0), // Light
-    Material(DIFFUSE, 4, 0),
-    Material(DIELECTRIC, 2, 1.5),
-    Material(METAL, 2, 0.25)
-);
+// BVH_MAX_DEPTH in bvh.h, see BVH4_MAX_DEPTH for wide ones
+#define BVH_STACK_SIZE 64
 
-Sphere spheres[] = Sphere[](
-    Sphere(vec3(215, 215, 130), 50, 5),
-    Sphere(vec3(400, 50, 100), 50, 6)
-);
+#ifdef DEBUG_HEATMAP
+// Instead of the image, draw how many bounding boxes (DEBUG_HEATMAP 1) or
+// primitives (DEBUG_HEATMAP 2) each pixel's primary ray tested. Grid cells
+// count as boxes. The scales are the counts drawn dark red, twice as many are white.
+#define HEATMAP_NODE_SCALE 128.0
+#define HEATMAP_PRIMITIVE_SCALE 64.0
 
-Rect rects[] = Rect[](
-    Rect(YZ, 0, 555, 0, 555, 555, 1),
-    Rect(YZ, 0, 555, 0, 555, 0, 3),
-    Rect(XZ, 0, 555, 0, 555, 555, 2),
-    Rect(XZ, 0, 555, 0, 555, 0, 2),
-    Rect(XY, 0, 555, 0, 555, 555, 1),
+uint heatmapNodes = 0;
+uint heatmapPrimitives = 0;
+#endif
 
-    // Box 1
-    Rect(XY, 130, 295, 0, 165, 230, 2),
-    Rect(XY, 130, 295, 0, 165, 65, 2),
+#ifdef DEBUG_OCCLUSION
+// Instead of the image, draw ambient occlusion at each pixel's primary hit: the
+// share of OCCLUSION_RAYS diffuse rays that OccludedScene finds nothing on
+// within OCCLUSION_DISTANCE. Accumulates over frames like the image.
+#define OCCLUSION_RAYS 4
+#define OCCLUSION_DISTANCE 100.0
+#endif
 
-    Rect(XZ, 130, 295, 65, 230, 165, 2),
-    Rect(XZ, 130, 295, 65, 230, 0, 2),
+sampler2D images[] = sampler2D[](
+    texture1,
+    texture2,
+    texture3
+);
 
-    Rect(YZ, 0, 165, 65, 230, 295, 2),
-    Rect(YZ, 0, 165, 65, 230, 130, 2),
+// The scene's textures and materials, uploaded by uploadScene like spheres and rects
+layout(std430, binding = 19) readonly buffer Textures {
+    Texture textures[];
+};
 
-    // Box 2
-    Rect(XY, 265, 430, 0, 555, 460, 2),
-    Rect(XY, 265, 430, 0, 555, 295, 2),
+layout(std430, binding = 20) readonly buffer Materials {
+    Material materials[];
+};
 
-    Rect(XZ, 265, 430, 295, 460, 555, 2),
-    Rect(XZ, 265, 430, 295, 460, 0, 2),
+layout(std140, binding = 0) uniform SceneCounts {
+    uint textureCount;
+    uint materialCount;
+    uint sphereCount;
+    uint rectCount;
+};
 
-    Rect(YZ, 0, 555, 295, 460, 430, 2),
-    Rect(YZ, 0, 555, 295, 460, 265, 2)
-);
+// Indices past the uploaded arrays come out magenta instead of reading out of bounds
+Texture GetTexture(uint index) {
+    return index < textureCount ? textures[index] : Texture(vec3(1, 0, 1), SOLID_COLOR, 0, 0);
+}
 
-#endif
+Material GetMaterial(uint index) {
+    return index < materialCount ? materials[index] : Material(DIFFUSE, textureCount, 0);
+}
 
 void GetSphereUV(in vec3 position, inout HitRecord record) {
     record.u = 0.5 - atan(-position.z, position.x) / (2 * PI);
@@ -240,24 +237,26 @@ vec3 GetTextureColor(in Texture texture, in float u, in float v, in vec3 positio
     } else if(texture.type == CHECKERED) {
         float sines = sin(10 * position.x) * sin(10 * position.y) * sin(10 * position.z);
         if (sines < 0) {
-            if (textures[texture.property1].type == SOLID_COLOR) {
-                return textures[texture.property1].albedo;
-            } else if(textures[texture.property1].type == IMAGE) {
+            Texture odd = GetTexture(texture.property1);
+            if (odd.type == SOLID_COLOR) {
+                return odd.albedo;
+            } else if(odd.type == IMAGE) {
                 u = 1.0 - clamp(u, 0, 1);
                 v = 1.0 - clamp(v, 0, 1);
 
-                return texture2D(images[textures[texture.property1].property1], vec2(u, v)).xyz * textures[texture.property1].albedo;
+                return texture2D(images[odd.property1], vec2(u, v)).xyz * odd.albedo;
             } else {
                 return vec3(0);
             }
         } else {
-            if (textures[texture.property2].type == SOLID_COLOR) {
-                return textures[texture.property2].albedo;
-            } else if(textures[texture.property2].type == IMAGE) {
+            Texture even = GetTexture(texture.property2);
+            if (even.type == SOLID_COLOR) {
+                return even.albedo;
+            } else if(even.type == IMAGE) {
                 u = 1.0 - clamp(u, 0, 1);
                 v = 1.0 - clamp(v, 0, 1);
 
-                return texture2D(images[textures[texture.property2].property1], vec2(u, v)).xyz * textures[texture.property2].albedo;
+                return texture2D(images[even.property1], vec2(u, v)).xyz * even.albedo;
             } else {
                 return vec3(0, 1, 0);
             }
@@ -320,7 +319,7 @@ bool NearZero(in vec3 point) {
     return (abs(point.x) < s) && (abs(point.y) < s) && (abs(point.z) < s);
 }
 
-bool HitSphere(Sphere sphere, Ray ray, float tmin, float tmax, out HitRecord record) {
+bool HitSphere(Sphere sphere, Ray ray, float tmin, float tmax, inout HitRecord record) {
     vec3 oc = ray.origin - sphere.center;
     float a = LengthSquared(ray.direction);
     float halfB = dot(oc, ray.direction);
@@ -374,7 +373,7 @@ bool HitRect(in Rect rect, in Ray ray, float tmin, float tmax, inout HitRecord r
         record.t = t;
 
         vec3 normal = vec3(0, 0, 1);
-        SetFaceNormal(record, ray, normal);
+        record = SetFaceNormal(record, ray, normal);
         record.materialIndex = rect.materialIndex;
         record.position = ray.origin + ray.direction * t;
         return true;
@@ -391,7 +390,7 @@ bool HitRect(in Rect rect, in Ray ray, float tmin, float tmax, inout HitRecord r
         record.t = t;
 
         vec3 normal = vec3(0, 1, 0);
-        SetFaceNormal(record, ray, normal);
+        record = SetFaceNormal(record, ray, normal);
         record.materialIndex = rect.materialIndex;
         record.position = ray.origin + ray.direction * t;
         return true;
@@ -408,59 +407,1075 @@ bool HitRect(in Rect rect, in Ray ray, float tmin, float tmax, inout HitRecord r
         record.t = t;
 
         vec3 normal = vec3(1, 0, 0);
-        SetFaceNormal(record, ray, normal);
+        record = SetFaceNormal(record, ray, normal);
         record.materialIndex = rect.materialIndex;
         record.position = ray.origin + ray.direction * t;
         return true;
     }
 }
 
-struct IntersectData {
-    bool hit;
-    Ray ray;
-    float t;
-};
+bool HitPrimitive(uint primitive, in Ray ray, float tmin, float tmax, inout HitRecord record) {
+#ifdef DEBUG_HEATMAP
+    heatmapPrimitives++;
+#endif
+    uint index = primitive & BVH_PRIMITIVE_INDEX;
+    if((primitive & BVH_PRIMITIVE_RECT) != 0) {
+        return HitRect(rects[index], ray, tmin, tmax, record);
+    }
+    return HitSphere(spheres[index], ray, tmin, tmax, record);
+}
 
-//bool RayBounds(in Bounds3 bounds, in Ray ray, float t) {
-//    return false;
-//}
+// Returns the distance at which the ray enters the box, or INFINITY when it misses.
+// Picking the slabs by direction instead of min/max makes inverted (empty) boxes miss.
+float HitBounds(in vec3 bmin, in vec3 bmax, in Ray ray, in vec3 invDir, float tmin, float tmax) {
+#ifdef DEBUG_HEATMAP
+    heatmapNodes++;
+#endif
+    vec3 t0 = (bmin - ray.origin) * invDir;
+    vec3 t1 = (bmax - ray.origin) * invDir;
+    bvec3 negative = lessThan(invDir, vec3(0));
+    vec3 tnear = mix(t0, t1, negative);
+    vec3 tfar = mix(t1, t0, negative);
+
+    float enter = max(max(tnear.x, tnear.y), max(tnear.z, tmin));
+    float exit = min(min(tfar.x, tfar.y), min(tfar.z, tmax));
+    return enter <= exit ? enter : INFINITY;
+}
 
-bool HitScene(Ray ray, out HitRecord record)
+// Sphere of a compressed leaf, from its two words at primitives[sphere]
+Sphere LeafSphere(uint sphere, vec3 origin, vec3 step, uint material) {
+    uint xy = primitives[sphere];
+    uint zr = primitives[sphere + 1];
+    vec3 steps = vec3(xy & 0xffffu, xy >> 16, zr & 0xffffu);
+    return Sphere(origin + steps * step, unpackHalf2x16(zr >> 16).x, material);
+}
+
+// Closest hit among the count primitives of a leaf starting at primitives[first],
+// which are references or, for instances with compressed leaves, a leaf laid out
+// as in bvhleaf.h
+bool HitLeaf(in Instance instance, uint first, uint count, Ray ray, float tmin, float tmax, inout HitRecord record)
 {
     bool hit_anything = false;
-    float closest = 10000.0;
+    float closest = tmax;
+    if(instance.compressed == 0) {
+        for(uint i = first; i < first + count; i++) {
+            if(HitPrimitive(primitives[i], ray, tmin, closest, record)) {
+                hit_anything = true;
+                closest = record.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    uint header = primitives[first + 3];
+    uint sphereCount = header >> 24;
+    uint rects = first + BVH_LEAF_HEADER_SIZE;
+    for(uint i = rects; i < rects + count - sphereCount; i++) {
+        if(HitPrimitive(primitives[i], ray, tmin, closest, record)) {
+            hit_anything = true;
+            closest = record.t;
+        }
+    }
 
-    for(int i = 0; i < spheres.length(); i++) {
-        if(HitSphere(spheres[i], ray, 0.001, closest, record)) {
+    vec3 origin = uintBitsToFloat(uvec3(primitives[first], primitives[first + 1], primitives[first + 2]));
+    vec3 step = uintBitsToFloat((uvec3(header, header >> 8, header >> 16) & 0xffu) << 23);
+    uint spheres = rects + count - sphereCount;
+    uint run = spheres + 2 * sphereCount;
+    uint runEnd = 0;
+    uint material = 0;
+
+    for(uint i = 0; i < sphereCount; i++) {
+        if(i == runEnd) {
+            uint word = primitives[run++];
+            material = word & 0xffffffu;
+            runEnd += word >> 24;
+        }
+#ifdef DEBUG_HEATMAP
+        heatmapPrimitives++;
+#endif
+        if(HitSphere(LeafSphere(spheres + 2 * i, origin, step, material), ray, tmin, closest, record)) {
             hit_anything = true;
             closest = record.t;
         }
     }
 
-    for(int i = 0; i < rects.length(); i++) {
-        if(HitRect(rects[i], ray, 0.001, closest, record)) {
+    return hit_anything;
+}
+
+#ifdef BVH_STACKLESS
+
+// Closest hit in one object's BVH, the ray has to be in the object's space.
+// Follows the skip links instead of keeping a stack, so children are always
+// visited left first rather than nearest first.
+bool HitObject(in Instance instance, Ray ray, float tmin, float tmax, inout HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = tmax;
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset;
+    uint current = 0;
+
+    do {
+        BVHNode node = nodes[root + current];
+
+        if(HitBounds(node.min, node.max, ray, invDir, tmin, closest) != INFINITY) {
+            if(node.count == 0) {
+                current = node.leftFirst;
+                continue;
+            }
+
+            if(HitLeaf(instance, instance.primitiveOffset + node.leftFirst, node.count, ray, tmin, closest, record)) {
+                hit_anything = true;
+                closest = record.t;
+            }
+        }
+
+        current = skips[root + current];
+    } while(current != 0);
+
+    return hit_anything;
+}
+
+#else
+
+// Closest hit in one object's BVH, the ray has to be in the object's space
+bool HitObject(in Instance instance, Ray ray, float tmin, float tmax, inout HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = tmax;
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset;
+    if(HitBounds(nodes[root].min, nodes[root].max, ray, invDir, tmin, closest) == INFINITY) {
+        return false;
+    }
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = root;
+
+    while(true) {
+        BVHNode node = nodes[current];
+
+        if(node.count > 0) {
+            if(HitLeaf(instance, instance.primitiveOffset + node.leftFirst, node.count, ray, tmin, closest, record)) {
+                hit_anything = true;
+                closest = record.t;
+            }
+        } else {
+            // Visit the nearest child first, the far one is often culled by then
+            uint near = root + node.leftFirst;
+            uint far = near + 1;
+            float tnear = HitBounds(nodes[near].min, nodes[near].max, ray, invDir, tmin, closest);
+            float tfar = HitBounds(nodes[far].min, nodes[far].max, ray, invDir, tmin, closest);
+
+            if(tfar < tnear) {
+                uint tmp = near; near = far; far = tmp;
+                float t = tnear; tnear = tfar; tfar = t;
+            }
+
+            if(tnear != INFINITY) {
+                if(tfar != INFINITY) {
+                    stack[stackSize++] = far;
+                }
+                current = near;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return hit_anything;
+}
+
+#endif
+
+#ifndef BVH_STACKLESS
+
+// Same as HitObject for objects stored as wide BVHs. Leaf children are tested
+// right away, interior ones are pushed farthest first so the nearest is next.
+bool HitObjectWide(in Instance instance, Ray ray, float tmin, float tmax, inout HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = tmax;
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset / 2;
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    while(true) {
+        BVH4Node node = wideNodes[root + current];
+        vec3 cell = uintBitsToFloat((uvec3(node.exponents, node.exponents >> 8, node.exponents >> 16) & 0xffu) << 23);
+
+        uint hitNodes[4];
+        float hitDistances[4];
+        int hitCount = 0;
+
+        for(uint c = 0; c < node.childCount; c++) {
+            uint shift = 8 * c;
+            vec3 qmin = vec3((uvec3(node.qmin[0], node.qmin[1], node.qmin[2]) >> shift) & 0xffu);
+            vec3 qmax = vec3((uvec3(node.qmax[0], node.qmax[1], node.qmax[2]) >> shift) & 0xffu);
+            float t = HitBounds(node.origin + qmin * cell, node.origin + qmax * cell, ray, invDir, tmin, closest);
+            if(t == INFINITY) {
+                continue;
+            }
+
+            uint count = (node.counts >> shift) & 0xffu;
+            if(count > 0) {
+                if(HitLeaf(instance, instance.primitiveOffset + node.children[c], count, ray, tmin, closest, record)) {
+                    hit_anything = true;
+                    closest = record.t;
+                }
+                continue;
+            }
+
+            // Keep the hits sorted by distance, nearest last
+            int j = hitCount++;
+            for(; j > 0 && hitDistances[j - 1] < t; j--) {
+                hitNodes[j] = hitNodes[j - 1];
+                hitDistances[j] = hitDistances[j - 1];
+            }
+            hitNodes[j] = node.children[c];
+            hitDistances[j] = t;
+        }
+
+        for(int i = 0; i < hitCount; i++) {
+            // Leaves hit after the child was tested may have moved closest in front of it
+            if(hitDistances[i] < closest) {
+                stack[stackSize++] = hitNodes[i];
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return hit_anything;
+}
+
+#endif
+
+// Index of a cell's offset in grids[], matches cellIndex in grid.c
+uint GridCell(uint cells, uint hashMask, uvec3 resolution, ivec3 cell) {
+    uvec3 c = uvec3(cell);
+    uint index = hashMask != 0 ?
+        ((c.x * 73856093u) ^ (c.y * 19349663u) ^ (c.z * 83492791u)) & hashMask :
+        c.x + resolution.x * (c.y + resolution.y * c.z);
+    return cells + index;
+}
+
+// Closest hit in an object stored as a grid, the ray has to be in the object's
+// space. Walks the cells along the ray with a 3D-DDA.
+bool HitGrid(in Instance instance, Ray ray, float tmin, float tmax, inout HitRecord record)
+{
+    uint grid = instance.nodeOffset;
+    vec3 bmin = uintBitsToFloat(uvec3(grids[grid], grids[grid + 1], grids[grid + 2]));
+    vec3 bmax = uintBitsToFloat(uvec3(grids[grid + 4], grids[grid + 5], grids[grid + 6]));
+    vec3 invDir = 1.0 / ray.direction;
+    float enter = HitBounds(bmin, bmax, ray, invDir, tmin, tmax);
+    if(enter == INFINITY) {
+        return false;
+    }
+
+    uint hashMask = grids[grid + 3];
+    uvec3 resolution = uvec3(grids[grid + 8], grids[grid + 9], grids[grid + 10]);
+    uint cells = grid + GRID_HEADER_SIZE;
+    uint references = cells + grids[grid + 11] + 1;
+
+    // Start in the cell the ray enters through. next is the distance along the ray
+    // to the next cell on each axis, delta the distance across a cell. Axes the
+    // ray is parallel to are never crossed.
+    vec3 cellSize = (bmax - bmin) / vec3(resolution);
+    vec3 position = ray.origin + ray.direction * enter;
+    ivec3 cell = clamp(ivec3(floor((position - bmin) / cellSize)), ivec3(0), ivec3(resolution) - 1);
+    ivec3 step = ivec3(sign(ray.direction));
+    vec3 boundary = bmin + (vec3(cell) + vec3(greaterThan(ray.direction, vec3(0)))) * cellSize;
+    vec3 next = mix(vec3(INFINITY), (boundary - ray.origin) * invDir, notEqual(ray.direction, vec3(0)));
+    vec3 delta = abs(cellSize * invDir);
+
+    bool hit_anything = false;
+    float closest = tmax;
+
+    while(true) {
+#ifdef DEBUG_HEATMAP
+        heatmapNodes++;
+#endif
+        uint offset = GridCell(cells, hashMask, resolution, cell);
+        for(uint i = references + grids[offset]; i < references + grids[offset + 1]; i++) {
+            if(HitPrimitive(grids[i], ray, tmin, closest, record)) {
+                hit_anything = true;
+                closest = record.t;
+            }
+        }
+
+        // Primitives are listed in every cell they overlap, so a hit found in this
+        // cell can lie in a later one and is only final once the walk got past it.
+        // closest never exceeds tmax, so this also stops at tmax.
+        if(closest <= min(min(next.x, next.y), next.z)) {
+            break;
+        }
+
+        // Cross the nearest face, selecting the axis with a mask rather than indexing
+        bvec3 axis = bvec3(
+            next.x <= next.y && next.x <= next.z,
+            next.y < next.x && next.y <= next.z,
+            next.z < next.x && next.z < next.y
+        );
+        cell += step * ivec3(axis);
+        next = mix(next, next + delta, axis);
+        if(any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, ivec3(resolution)))) {
+            break;
+        }
+    }
+
+    return hit_anything;
+}
+
+vec3 TransformPoint(in Instance instance, vec3 point) {
+    vec4 p = vec4(point, 1);
+    return vec3(dot(instance.worldToObject[0], p), dot(instance.worldToObject[1], p), dot(instance.worldToObject[2], p));
+}
+
+vec3 TransformDirection(in Instance instance, vec3 direction) {
+    vec4 d = vec4(direction, 0);
+    return vec3(dot(instance.worldToObject[0], d), dot(instance.worldToObject[1], d), dot(instance.worldToObject[2], d));
+}
+
+// Brings a hit found with the ray in the instance's object space back to world space
+void InstanceHitToWorld(in Instance instance, Ray ray, inout HitRecord record) {
+    // Normals transform by the inverse transpose, which keeps them facing the ray
+    vec3 n = record.normal;
+    record.normal = normalize(n.x * instance.worldToObject[0].xyz + n.y * instance.worldToObject[1].xyz + n.z * instance.worldToObject[2].xyz);
+    record.position = ray.origin + ray.direction * record.t;
+}
+
+bool HitInstance(in Instance instance, Ray ray, float tmin, float tmax, inout HitRecord record) {
+    // The direction isn't normalized, so distances along the ray are the same in both spaces
+    Ray local = Ray(TransformPoint(instance, ray.origin), TransformDirection(instance, ray.direction));
+    bool hit;
+    if(instance.format == BVH_GRID) {
+        hit = HitGrid(instance, local, tmin, tmax, record);
+    } else {
+#ifdef BVH_STACKLESS
+        // Every BVH is uploaded binary, wide ones would need a stack
+        hit = HitObject(instance, local, tmin, tmax, record);
+#else
+        hit = instance.format == BVH_WIDE ?
+            HitObjectWide(instance, local, tmin, tmax, record) :
+            HitObject(instance, local, tmin, tmax, record);
+#endif
+    }
+    if(!hit) {
+        return false;
+    }
+
+    InstanceHitToWorld(instance, ray, record);
+    return true;
+}
+
+#ifdef BVH_STACKLESS
+
+bool HitScene(Ray ray, out HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = MAX_DISTANCE;
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint current = 0;
+
+    do {
+        BVHNode node = nodes[current];
+
+        if(HitBounds(node.min, node.max, ray, invDir, 0.001, closest) != INFINITY) {
+            if(node.count == 0) {
+                current = node.leftFirst;
+                continue;
+            }
+
+            for(uint i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if(HitInstance(instances[i], ray, 0.001, closest, record)) {
+                    hit_anything = true;
+                    closest = record.t;
+                }
+            }
+        }
+
+        current = skips[current];
+    } while(current != 0);
+
+    return hit_anything;
+}
+
+#else
+
+bool HitScene(Ray ray, out HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = MAX_DISTANCE;
+    vec3 invDir = 1.0 / ray.direction;
+
+    if(HitBounds(nodes[0].min, nodes[0].max, ray, invDir, 0.001, closest) == INFINITY) {
+        return false;
+    }
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    while(true) {
+        BVHNode node = nodes[current];
+
+        if(node.count > 0) {
+            for(uint i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if(HitInstance(instances[i], ray, 0.001, closest, record)) {
+                    hit_anything = true;
+                    closest = record.t;
+                }
+            }
+        } else {
+            uint near = node.leftFirst;
+            uint far = node.leftFirst + 1;
+            float tnear = HitBounds(nodes[near].min, nodes[near].max, ray, invDir, 0.001, closest);
+            float tfar = HitBounds(nodes[far].min, nodes[far].max, ray, invDir, 0.001, closest);
+
+            if(tfar < tnear) {
+                uint tmp = near; near = far; far = tmp;
+                float t = tnear; tnear = tfar; tfar = t;
+            }
+
+            if(tnear != INFINITY) {
+                if(tfar != INFINITY) {
+                    stack[stackSize++] = far;
+                }
+                current = near;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return hit_anything;
+}
+
+#endif
+
+#if defined(TILE_CULLING) && defined(BVH_STACKLESS)
+// Collecting the candidates keeps a stack
+#undef TILE_CULLING
+#endif
+
+#ifdef TILE_CULLING
+
+// The primary rays of a workgroup all leave the camera through its 8x8 pixels.
+// One invocation walks the hierarchy against the frustum of those pixels and
+// collects the leaves inside it, the primary rays then only test those instead
+// of traversing the whole scene. Objects stored as grids are kept whole, and
+// tiles with more leaves than fit fall back to HitScene. The candidates are
+// sorted by how far along the rays they start, so rays stop at the first
+// candidate behind their closest hit.
+#define TILE_MAX_CANDIDATES 128
+
+shared uint tileCandidateCount;
+shared bool tileOverflow;
+shared uint tileInstances[TILE_MAX_CANDIDATES];
+shared uint tileFirst[TILE_MAX_CANDIDATES]; // Into primitives[]
+shared uint tileCounts[TILE_MAX_CANDIDATES]; // 0 for whole instances
+shared vec3 tileMin[TILE_MAX_CANDIDATES]; // Bounds in the instance's object space
+shared vec3 tileMax[TILE_MAX_CANDIDATES];
+shared float tileNear[TILE_MAX_CANDIDATES]; // No ray of the tile reaches the bounds before this distance
+
+// Side planes of the pyramid from origin through the corner directions, which
+// have to go around it in order. The normals face inwards, w is the offset.
+void TilePlanes(vec3 origin, vec3 corners[4], out vec4 planes[4]) {
+    vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+    for(int i = 0; i < 4; i++) {
+        vec3 n = cross(corners[i], corners[(i + 1) % 4]);
+        n = dot(n, center) < 0 ? -n : n;
+        planes[i] = vec4(n, -dot(n, origin));
+    }
+}
+
+// Conservative, boxes close to an edge of the frustum can pass without touching it.
+// Points behind the origin are outside all four planes, so no near plane is needed.
+bool BoxInFrustum(vec4 planes[4], vec3 bmin, vec3 bmax) {
+    for(int i = 0; i < 4; i++) {
+        // The corner furthest along the normal
+        vec3 p = mix(bmin, bmax, greaterThan(planes[i].xyz, vec3(0)));
+        if(dot(planes[i].xyz, p) + planes[i].w < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void AddTileCandidate(uint instance, uint first, uint count, vec3 bmin, vec3 bmax, float near) {
+    if(tileCandidateCount == TILE_MAX_CANDIDATES) {
+        tileOverflow = true;
+        return;
+    }
+
+    // Insertion sort, the lists are short and only built once per tile
+    uint i = tileCandidateCount++;
+    for(; i > 0 && tileNear[i - 1] > near; i--) {
+        tileInstances[i] = tileInstances[i - 1];
+        tileFirst[i] = tileFirst[i - 1];
+        tileCounts[i] = tileCounts[i - 1];
+        tileMin[i] = tileMin[i - 1];
+        tileMax[i] = tileMax[i - 1];
+        tileNear[i] = tileNear[i - 1];
+    }
+
+    tileInstances[i] = instance;
+    tileFirst[i] = first;
+    tileCounts[i] = count;
+    tileMin[i] = bmin;
+    tileMax[i] = bmax;
+    tileNear[i] = near;
+}
+
+// Ray distances are in multiples of the direction, which is longest at one of
+// the corners since the directions in between are their weighted averages
+float TileNear(vec3 origin, float cornerLength, vec3 bmin, vec3 bmax) {
+    return length(max(max(bmin - origin, origin - bmax), vec3(0))) / cornerLength;
+}
+
+// Adds the leaves of an instance's BVH inside the frustum, built in object space
+void CullInstance(uint index, vec3 origin, vec3 corners[4]) {
+    Instance instance = instances[index];
+    vec3 localOrigin = TransformPoint(instance, origin);
+    vec3 localCorners[4];
+    float cornerLength = 0;
+    for(int i = 0; i < 4; i++) {
+        localCorners[i] = TransformDirection(instance, corners[i]);
+        cornerLength = max(cornerLength, length(localCorners[i]));
+    }
+
+    if(instance.format == BVH_GRID) {
+        uint grid = instance.nodeOffset;
+        vec3 bmin = uintBitsToFloat(uvec3(grids[grid], grids[grid + 1], grids[grid + 2]));
+        vec3 bmax = uintBitsToFloat(uvec3(grids[grid + 4], grids[grid + 5], grids[grid + 6]));
+        AddTileCandidate(index, 0, 0, bmin, bmax, TileNear(localOrigin, cornerLength, bmin, bmax));
+        return;
+    }
+
+    vec4 planes[4];
+    TilePlanes(localOrigin, localCorners, planes);
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    if(instance.format == BVH_WIDE) {
+        uint root = instance.nodeOffset / 2;
+        while(true) {
+            BVH4Node node = wideNodes[root + current];
+            vec3 cell = uintBitsToFloat((uvec3(node.exponents, node.exponents >> 8, node.exponents >> 16) & 0xffu) << 23);
+
+            for(uint c = 0; c < node.childCount; c++) {
+                uint shift = 8 * c;
+                vec3 bmin = node.origin + vec3((uvec3(node.qmin[0], node.qmin[1], node.qmin[2]) >> shift) & 0xffu) * cell;
+                vec3 bmax = node.origin + vec3((uvec3(node.qmax[0], node.qmax[1], node.qmax[2]) >> shift) & 0xffu) * cell;
+                if(!BoxInFrustum(planes, bmin, bmax)) {
+                    continue;
+                }
+
+                uint count = (node.counts >> shift) & 0xffu;
+                if(count > 0) {
+                    float near = TileNear(localOrigin, cornerLength, bmin, bmax);
+                    AddTileCandidate(index, instance.primitiveOffset + node.children[c], count, bmin, bmax, near);
+                } else {
+                    stack[stackSize++] = node.children[c];
+                }
+            }
+
+            if(stackSize == 0 || tileOverflow) {
+                return;
+            }
+            current = stack[--stackSize];
+        }
+    }
+
+    uint root = instance.nodeOffset;
+    while(true) {
+        BVHNode node = nodes[root + current];
+
+        if(BoxInFrustum(planes, node.min, node.max)) {
+            if(node.count > 0) {
+                float near = TileNear(localOrigin, cornerLength, node.min, node.max);
+                AddTileCandidate(index, instance.primitiveOffset + node.leftFirst, node.count, node.min, node.max, near);
+            } else {
+                stack[stackSize++] = node.leftFirst + 1;
+                current = node.leftFirst;
+                continue;
+            }
+        }
+
+        if(stackSize == 0 || tileOverflow) {
+            return;
+        }
+        current = stack[--stackSize];
+    }
+}
+
+// Collects the candidates of the tile whose pixels the corner directions go
+// through, run by one invocation of the workgroup
+void CullTile(vec3 origin, vec3 corners[4]) {
+    tileCandidateCount = 0;
+    tileOverflow = false;
+
+    vec4 planes[4];
+    TilePlanes(origin, corners, planes);
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    while(true) {
+        BVHNode node = nodes[current];
+
+        if(BoxInFrustum(planes, node.min, node.max)) {
+            if(node.count > 0) {
+                for(uint i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                    CullInstance(i, origin, corners);
+                }
+            } else {
+                stack[stackSize++] = node.leftFirst + 1;
+                current = node.leftFirst;
+                continue;
+            }
+        }
+
+        if(stackSize == 0 || tileOverflow) {
+            return;
+        }
+        current = stack[--stackSize];
+    }
+}
+
+// Closest hit of a primary ray of this workgroup, the same as HitScene would
+// find. Only valid when the candidates didn't overflow, see tileOverflow.
+bool HitTile(Ray ray, out HitRecord record)
+{
+    bool hit_anything = false;
+    float closest = MAX_DISTANCE;
+
+    // Candidates are sorted by distance, so an instance's leaves can be spread
+    // between other instances'. The ray is moved into an instance's space whenever
+    // the instance differs from the previous candidate's, and the closest hit is
+    // moved back to world space at the end.
+    Instance instance;
+    Ray local;
+    vec3 invDir;
+    uint current = 0xffffffffu;
+    uint hitInstance = 0xffffffffu;
+
+    for(uint c = 0; c < tileCandidateCount; c++) {
+        if(tileNear[c] >= closest) {
+            break;
+        }
+
+        if(tileInstances[c] != current) {
+            current = tileInstances[c];
+            instance = instances[current];
+            local = Ray(TransformPoint(instance, ray.origin), TransformDirection(instance, ray.direction));
+            invDir = 1.0 / local.direction;
+        }
+
+        // Grids are kept whole
+        if(tileCounts[c] == 0) {
+            if(HitGrid(instance, local, 0.001, closest, record)) {
+                hit_anything = true;
+                closest = record.t;
+                hitInstance = current;
+            }
+            continue;
+        }
+
+        if(HitBounds(tileMin[c], tileMax[c], local, invDir, 0.001, closest) == INFINITY) {
+            continue;
+        }
+
+        if(HitLeaf(instance, tileFirst[c], tileCounts[c], local, 0.001, closest, record)) {
             hit_anything = true;
             closest = record.t;
+            hitInstance = current;
         }
     }
 
+    if(hit_anything) {
+        InstanceHitToWorld(instances[hitInstance], ray, record);
+    }
     return hit_anything;
+}
+
+#endif
+
+// Occlusion queries only need to know whether anything lies between tmin and
+// tmax. They skip every surface attribute and stop at the first hit found.
+
+bool OccludedSphere(in Sphere sphere, in Ray ray, float tmin, float tmax) {
+    vec3 oc = ray.origin - sphere.center;
+    float a = LengthSquared(ray.direction);
+    float halfB = dot(oc, ray.direction);
+    float c = LengthSquared(oc) - sphere.radius * sphere.radius;
+    float d = halfB * halfB - a * c;
+    if(d <= 0.0) {
+        return false;
+    }
+
+    float root = sqrt(d);
+    float t0 = (-halfB - root) / a;
+    float t1 = (-halfB + root) / a;
+    return (t0 > tmin && t0 < tmax) || (t1 > tmin && t1 < tmax);
+}
+
+bool OccludedRect(in Rect rect, in Ray ray, float tmin, float tmax) {
+    // Swizzle so the rect always lies in the xy plane, like HitRect's three cases
+    vec3 origin = rect.plane == XY ? ray.origin : (rect.plane == XZ ? ray.origin.xzy : ray.origin.yzx);
+    vec3 direction = rect.plane == XY ? ray.direction : (rect.plane == XZ ? ray.direction.xzy : ray.direction.yzx);
+
+    float t = (rect.k - origin.z) / direction.z;
+    if(t < tmin || t > tmax) {
+        return false;
+    }
+
+    vec2 p = origin.xy + t * direction.xy;
+    return p.x >= rect.x0 && p.x <= rect.x1 && p.y >= rect.y0 && p.y <= rect.y1;
+}
+
+bool OccludedPrimitive(uint primitive, in Ray ray, float tmin, float tmax) {
+    uint index = primitive & BVH_PRIMITIVE_INDEX;
+    if((primitive & BVH_PRIMITIVE_RECT) != 0) {
+        return OccludedRect(rects[index], ray, tmin, tmax);
+    }
+    return OccludedSphere(spheres[index], ray, tmin, tmax);
+}
+
+// Same as HitLeaf for occlusion queries
+bool OccludedLeaf(in Instance instance, uint first, uint count, Ray ray, float tmin, float tmax)
+{
+    if(instance.compressed == 0) {
+        for(uint i = first; i < first + count; i++) {
+            if(OccludedPrimitive(primitives[i], ray, tmin, tmax)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint header = primitives[first + 3];
+    uint sphereCount = header >> 24;
+    uint rects = first + BVH_LEAF_HEADER_SIZE;
+    for(uint i = rects; i < rects + count - sphereCount; i++) {
+        if(OccludedPrimitive(primitives[i], ray, tmin, tmax)) {
+            return true;
+        }
+    }
+
+    // Occlusion doesn't need the materials, the runs after the spheres are never read
+    vec3 origin = uintBitsToFloat(uvec3(primitives[first], primitives[first + 1], primitives[first + 2]));
+    vec3 step = uintBitsToFloat((uvec3(header, header >> 8, header >> 16) & 0xffu) << 23);
+    uint spheres = rects + count - sphereCount;
+    for(uint i = 0; i < sphereCount; i++) {
+        if(OccludedSphere(LeafSphere(spheres + 2 * i, origin, step, 0), ray, tmin, tmax)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#ifdef BVH_STACKLESS
+
+bool OccludedObject(in Instance instance, Ray ray, float tmin, float tmax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset;
+    uint current = 0;
+
+    do {
+        BVHNode node = nodes[root + current];
+
+        if(HitBounds(node.min, node.max, ray, invDir, tmin, tmax) != INFINITY) {
+            if(node.count == 0) {
+                current = node.leftFirst;
+                continue;
+            }
+
+            if(OccludedLeaf(instance, instance.primitiveOffset + node.leftFirst, node.count, ray, tmin, tmax)) {
+                return true;
+            }
+        }
+
+        current = skips[root + current];
+    } while(current != 0);
+
+    return false;
+}
+
+#else
+
+// Any hit ends the query, so children aren't sorted by distance. A leaf child is
+// visited before an interior sibling instead, since it can end the query
+// without fetching any more nodes.
+bool OccludedObject(in Instance instance, Ray ray, float tmin, float tmax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset;
+    if(HitBounds(nodes[root].min, nodes[root].max, ray, invDir, tmin, tmax) == INFINITY) {
+        return false;
+    }
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = root;
+
+    while(true) {
+        BVHNode node = nodes[current];
 
-//    IntersectData intersect;
-//    intersect.hit = false;
-//    intersect.ray = r;
-//    intersect.t = MAX_RENDER_DIST;
-//
-//    float t;
-//    int toVisitOffset = 0, currentNodeIndex = 0;
-//    int nodesToVisit[64];
-//
-//    while(true) {
-//
-//        if()
-//    }
+        if(node.count > 0) {
+            if(OccludedLeaf(instance, instance.primitiveOffset + node.leftFirst, node.count, ray, tmin, tmax)) {
+                return true;
+            }
+        } else {
+            uint first = root + node.leftFirst;
+            uint second = first + 1;
+            BVHNode left = nodes[first];
+            BVHNode right = nodes[second];
+            bool hitFirst = HitBounds(left.min, left.max, ray, invDir, tmin, tmax) != INFINITY;
+            bool hitSecond = HitBounds(right.min, right.max, ray, invDir, tmin, tmax) != INFINITY;
+
+            if(left.count == 0 && right.count > 0) {
+                uint tmp = first; first = second; second = tmp;
+                bool hit = hitFirst; hitFirst = hitSecond; hitSecond = hit;
+            }
+
+            if(hitFirst || hitSecond) {
+                if(hitFirst && hitSecond) {
+                    stack[stackSize++] = second;
+                }
+                current = hitFirst ? first : second;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return false;
 }
 
+#endif
+
+#ifndef BVH_STACKLESS
+
+// Leaf children are already tested as soon as their bounds are hit, interior ones are pushed as found
+bool OccludedObjectWide(in Instance instance, Ray ray, float tmin, float tmax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint root = instance.nodeOffset / 2;
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    while(true) {
+        BVH4Node node = wideNodes[root + current];
+        vec3 cell = uintBitsToFloat((uvec3(node.exponents, node.exponents >> 8, node.exponents >> 16) & 0xffu) << 23);
+
+        for(uint c = 0; c < node.childCount; c++) {
+            uint shift = 8 * c;
+            vec3 qmin = vec3((uvec3(node.qmin[0], node.qmin[1], node.qmin[2]) >> shift) & 0xffu);
+            vec3 qmax = vec3((uvec3(node.qmax[0], node.qmax[1], node.qmax[2]) >> shift) & 0xffu);
+            if(HitBounds(node.origin + qmin * cell, node.origin + qmax * cell, ray, invDir, tmin, tmax) == INFINITY) {
+                continue;
+            }
+
+            uint count = (node.counts >> shift) & 0xffu;
+            if(count == 0) {
+                stack[stackSize++] = node.children[c];
+                continue;
+            }
+
+            if(OccludedLeaf(instance, instance.primitiveOffset + node.children[c], count, ray, tmin, tmax)) {
+                return true;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return false;
+}
+
+#endif
+
+// Same walk as HitGrid, stopping at the first primitive anywhere before tmax
+bool OccludedGrid(in Instance instance, Ray ray, float tmin, float tmax)
+{
+    uint grid = instance.nodeOffset;
+    vec3 bmin = uintBitsToFloat(uvec3(grids[grid], grids[grid + 1], grids[grid + 2]));
+    vec3 bmax = uintBitsToFloat(uvec3(grids[grid + 4], grids[grid + 5], grids[grid + 6]));
+    vec3 invDir = 1.0 / ray.direction;
+    float enter = HitBounds(bmin, bmax, ray, invDir, tmin, tmax);
+    if(enter == INFINITY) {
+        return false;
+    }
+
+    uint hashMask = grids[grid + 3];
+    uvec3 resolution = uvec3(grids[grid + 8], grids[grid + 9], grids[grid + 10]);
+    uint cells = grid + GRID_HEADER_SIZE;
+    uint references = cells + grids[grid + 11] + 1;
+
+    vec3 cellSize = (bmax - bmin) / vec3(resolution);
+    vec3 position = ray.origin + ray.direction * enter;
+    ivec3 cell = clamp(ivec3(floor((position - bmin) / cellSize)), ivec3(0), ivec3(resolution) - 1);
+    ivec3 step = ivec3(sign(ray.direction));
+    vec3 boundary = bmin + (vec3(cell) + vec3(greaterThan(ray.direction, vec3(0)))) * cellSize;
+    vec3 next = mix(vec3(INFINITY), (boundary - ray.origin) * invDir, notEqual(ray.direction, vec3(0)));
+    vec3 delta = abs(cellSize * invDir);
+
+    while(true) {
+        uint offset = GridCell(cells, hashMask, resolution, cell);
+        for(uint i = references + grids[offset]; i < references + grids[offset + 1]; i++) {
+            if(OccludedPrimitive(grids[i], ray, tmin, tmax)) {
+                return true;
+            }
+        }
+
+        if(min(min(next.x, next.y), next.z) > tmax) {
+            return false;
+        }
+
+        bvec3 axis = bvec3(
+            next.x <= next.y && next.x <= next.z,
+            next.y < next.x && next.y <= next.z,
+            next.z < next.x && next.z < next.y
+        );
+        cell += step * ivec3(axis);
+        next = mix(next, next + delta, axis);
+        if(any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, ivec3(resolution)))) {
+            return false;
+        }
+    }
+}
+
+bool OccludedInstance(in Instance instance, Ray ray, float tmin, float tmax) {
+    Ray local = Ray(TransformPoint(instance, ray.origin), TransformDirection(instance, ray.direction));
+    if(instance.format == BVH_GRID) {
+        return OccludedGrid(instance, local, tmin, tmax);
+    }
+#ifdef BVH_STACKLESS
+    return OccludedObject(instance, local, tmin, tmax);
+#else
+    return instance.format == BVH_WIDE ?
+        OccludedObjectWide(instance, local, tmin, tmax) :
+        OccludedObject(instance, local, tmin, tmax);
+#endif
+}
+
+#ifdef BVH_STACKLESS
+
+// Whether anything lies on the ray between its origin and tmax, for shadow and visibility rays
+bool OccludedScene(Ray ray, float tmax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+
+    uint current = 0;
+
+    do {
+        BVHNode node = nodes[current];
+
+        if(HitBounds(node.min, node.max, ray, invDir, 0.001, tmax) != INFINITY) {
+            if(node.count == 0) {
+                current = node.leftFirst;
+                continue;
+            }
+
+            for(uint i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if(OccludedInstance(instances[i], ray, 0.001, tmax)) {
+                    return true;
+                }
+            }
+        }
+
+        current = skips[current];
+    } while(current != 0);
+
+    return false;
+}
+
+#else
+
+// Whether anything lies on the ray between its origin and tmax, for shadow and visibility rays
+bool OccludedScene(Ray ray, float tmax)
+{
+    vec3 invDir = 1.0 / ray.direction;
+
+    if(HitBounds(nodes[0].min, nodes[0].max, ray, invDir, 0.001, tmax) == INFINITY) {
+        return false;
+    }
+
+    uint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    uint current = 0;
+
+    while(true) {
+        BVHNode node = nodes[current];
+
+        if(node.count > 0) {
+            for(uint i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                if(OccludedInstance(instances[i], ray, 0.001, tmax)) {
+                    return true;
+                }
+            }
+        } else {
+            uint first = node.leftFirst;
+            uint second = first + 1;
+            bool hitFirst = HitBounds(nodes[first].min, nodes[first].max, ray, invDir, 0.001, tmax) != INFINITY;
+            bool hitSecond = HitBounds(nodes[second].min, nodes[second].max, ray, invDir, 0.001, tmax) != INFINITY;
+
+            if(hitFirst || hitSecond) {
+                if(hitFirst && hitSecond) {
+                    stack[stackSize++] = second;
+                }
+                current = hitFirst ? first : second;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return false;
+}
+
+#endif
+
 float schlick(float cosine, float ref_idx)
 {
     float r0 = (1 - ref_idx) / (1 + ref_idx);
@@ -483,7 +1498,7 @@ vec3 refract(vec3 uv, vec3 n, float etai_over_etat)
 
 vec3 emitted(in Material material, float u, float v, in vec3 p) {
     if(material.type == DIFFUSE_LIGHT) {
-        return GetTextureColor(textures[material.texture], u, v, p);
+        return GetTextureColor(GetTexture(material.texture), u, v, p);
     } else {
         return vec3(0);
     }
@@ -495,23 +1510,24 @@ bool Scatter(Ray ray, HitRecord record, out vec3 attenuation, out Ray scattered)
         return false;
     }
 
-    if(materials[record.materialIndex].type == DIFFUSE) {
+    Material material = GetMaterial(record.materialIndex);
+    if(material.type == DIFFUSE) {
         vec3 scatter_direction = record.normal + RandomUnitVector(RandomSeed);
         scattered = Ray(record.position, scatter_direction);
         attenuation = GetTextureColor(
-            textures[materials[record.materialIndex].texture], record.u, record.v, record.position
+            GetTexture(material.texture), record.u, record.v, record.position
         );
         return true;
-    } else if(materials[record.materialIndex].type == METAL) {
+    } else if(material.type == METAL) {
         vec3 reflected = reflect(normalize(ray.direction), record.normal);
         scattered = Ray(
-            record.position, reflected + materials[record.materialIndex].property * RandomInUnitSphere(RandomSeed)
+            record.position, reflected + material.property * RandomInUnitSphere(RandomSeed)
         );
-        attenuation = GetTextureColor(textures[materials[record.materialIndex].texture], record.u, record.v, record.position);
+        attenuation = GetTextureColor(GetTexture(material.texture), record.u, record.v, record.position);
         return dot(scattered.direction, record.normal) > 0;
-    } else if(materials[record.materialIndex].type == DIELECTRIC) {
+    } else if(material.type == DIELECTRIC) {
         attenuation = vec3(1);
-        float etai_over_etat = record.frontFace ? (1.0f / materials[record.materialIndex].property) : materials[record.materialIndex].property;
+        float etai_over_etat = record.frontFace ? (1.0f / material.property) : material.property;
 
         float cos_theta = min(dot(-normalize(ray.direction), record.normal), 1.0f);
         float sin_theta = sqrt(1.0f - cos_theta * cos_theta);
@@ -531,11 +1547,11 @@ bool Scatter(Ray ray, HitRecord record, out vec3 attenuation, out Ray scattered)
         vec3 refracted = refract(normalize(ray.direction), record.normal, etai_over_etat);
         scattered = Ray(record.position, refracted);
         return true;
-    } else if(materials[record.materialIndex].type == DIFFUSE_LIGHT) {
+    } else if(material.type == DIFFUSE_LIGHT) {
         return false;
-    } else if(materials[record.materialIndex].type == ISOTROPIC) {
+    } else if(material.type == ISOTROPIC) {
         scattered = Ray(record.position, RandomInUnitSphere(RandomSeed));
-        attenuation = GetTextureColor(textures[materials[record.materialIndex].texture], record.u, record.v, record.position);
+        attenuation = GetTextureColor(GetTexture(material.texture), record.u, record.v, record.position);
         return true;
     }
 
@@ -547,19 +1563,29 @@ vec3 RayColor(Ray ray_in, vec3 background, int depth)
     vec3 final = vec3(1);
     Ray ray = ray_in;
 
+    // Only the first ray leaves the camera through this workgroup's tile
+    bool primary = true;
+
     while(true) {
         HitRecord record;
         if(depth <= 0) {
             return vec3(0);
         }
 
-        if(!HitScene(ray, record)) {
+#ifdef TILE_CULLING
+        // Calling HitScene from a single place keeps the inlined shader small
+        bool hit = primary && !tileOverflow ? HitTile(ray, record) : HitScene(ray, record);
+#else
+        bool hit = HitScene(ray, record);
+#endif
+        primary = false;
+        if(!hit) {
             return background;
         }
 
         Ray scattered;
         vec3 attenuation;
-        vec3 emitted = emitted(materials[record.materialIndex], record.u, record.v, record.position);
+        vec3 emitted = emitted(GetMaterial(record.materialIndex), record.u, record.v, record.position);
 
         if(!Scatter(ray, record, attenuation, scattered)) {
             return final * emitted;
@@ -604,6 +1630,15 @@ Ray GetRay(Camera c, vec2 uv)
     );
 }
 
+#ifdef DEBUG_HEATMAP
+// Black through blue, green and red at 1 to white at 2
+vec3 Heatmap(float x)
+{
+    vec3 color = clamp(1.5 - abs(4.0 * x - vec3(3, 2, 1)), 0, 1) * clamp(4.0 * x, 0, 1);
+    return mix(color, vec3(1), clamp(x - 1.0, 0, 1));
+}
+#endif
+
 void GammaCorrect(inout vec4 px, int samples)
 {
     float scale = 1.0 / samples;
@@ -632,7 +1667,69 @@ void main()
         40, uwidth / uheight
     );
 
+#ifdef TILE_CULLING
+    // Primary rays are jittered anywhere inside their pixel, so the frustum
+    // goes through the outer corners of the tile's pixels
+    if(gl_LocalInvocationIndex == 0) {
+        vec2 tile = vec2(gl_WorkGroupID.xy * gl_WorkGroupSize.xy);
+        vec2 size = vec2(gl_WorkGroupSize.xy);
+        vec2 screen = vec2(uwidth, uheight);
+        vec3 corners[4] = vec3[](
+            GetRay(cam, tile / screen).direction,
+            GetRay(cam, (tile + vec2(size.x, 0)) / screen).direction,
+            GetRay(cam, (tile + size) / screen).direction,
+            GetRay(cam, (tile + vec2(0, size.y)) / screen).direction
+        );
+        CullTile(cam.origin, corners);
+    }
+    memoryBarrierShared();
+    barrier();
+#endif
+
+    // Only the tiles on the right and top edges reach past the image, after the
+    // barrier so every invocation gets to it
+    if(any(greaterThanEqual(vec2(coords), vec2(uwidth, uheight)))) {
+        return;
+    }
+
+#ifdef DEBUG_HEATMAP
+    // Counts the closest hit search of one ray through the pixel's center, the
+    // same search RayColor does for primary rays
+    HitRecord record;
+    Ray center = GetRay(cam, (vec2(coords) + 0.5) / vec2(uwidth, uheight));
+#ifdef TILE_CULLING
+    if(!tileOverflow) {
+        HitTile(center, record);
+    } else {
+        HitScene(center, record);
+    }
+#else
+    HitScene(center, record);
+#endif
+#if DEBUG_HEATMAP == 2
+    float heat = float(heatmapPrimitives) / HEATMAP_PRIMITIVE_SCALE;
+#else
+    float heat = float(heatmapNodes) / HEATMAP_NODE_SCALE;
+#endif
+    imageStore(framebuffer, coords, vec4(Heatmap(heat), 1));
+    return;
+#endif
+
     RandomSeed = float(BaseHash(floatBitsToUint(vec2(coords))))/float(0xffffffffU)+utime;
+
+#ifdef DEBUG_OCCLUSION
+    HitRecord record;
+    float open = 0;
+    if(HitScene(GetRay(cam, (coords + Hash2d(RandomSeed)) / vec2(uwidth, uheight)), record)) {
+        for(int i = 0; i < OCCLUSION_RAYS; i++) {
+            vec3 direction = normalize(record.normal + RandomUnitVector(RandomSeed));
+            open += OccludedScene(Ray(record.position, direction), OCCLUSION_DISTANCE) ? 0.0 : 1.0;
+        }
+        open /= OCCLUSION_RAYS;
+    }
+    imageStore(framebuffer, coords, vec4(vec3(open), 1) * 0.1 + imageLoad(framebuffer, coords) * 0.9);
+    return;
+#endif
     
     vec3 pixel;
     for(int i = 0; i < SAMPLES; i++) {
@@ -0,0 +1,1234 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bvh.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+// Rects are flat, give them some thickness so the slab test doesn't miss them
+#define RECT_THICKNESS 0.001f
+
+struct Bounds {
+    float min[3], max[3];
+};
+
+struct Bin {
+    struct Bounds bounds;
+    unsigned int count;
+};
+
+// The task's references fill the start of its range, the rest is room for the
+// references spatial splits duplicate. Without spatial splits capacity == count.
+struct Task {
+    unsigned int node, first, count, capacity, depth;
+    struct Bounds bounds, centroids; // Of the primitives in the task's range
+};
+
+struct SpatialSplit {
+    float cost;
+    int axis;
+    unsigned int bin; // First bin on the right
+    float position;
+    unsigned int leftCount, rightCount; // Straddling references count on both sides
+};
+
+struct Builder {
+    struct BVH* bvh;
+    struct Bounds* bounds; // Per primitive reference, indexed like bvh->primitives
+    struct BVHSettings settings;
+    float rootArea;
+    atomic_uint nodeCount;
+
+    // Subtrees handed to the worker pool, pending counts queued and running tasks
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct Task* tasks;
+    unsigned int taskCount, taskCapacity;
+    unsigned int pending;
+};
+
+static const struct BVHSettings defaultSettings = BVH_DEFAULT_SETTINGS;
+
+static void primitiveBounds(const struct Scene* scene, unsigned int primitive, struct Bounds* bounds) {
+    unsigned int index = primitive & BVH_PRIMITIVE_INDEX;
+
+    if(!(primitive & BVH_PRIMITIVE_RECT)) {
+        const struct Sphere* sphere = &scene->spheres[index];
+        for(int i = 0; i < 3; i++) {
+            bounds->min[i] = sphere->center[i] - sphere->radius;
+            bounds->max[i] = sphere->center[i] + sphere->radius;
+        }
+        return;
+    }
+
+    // Map the rect's plane coordinates onto world axes, see HitRect in raytracer.glsl
+    const struct Rect* rect = &scene->rects[index];
+    int a, b, k;
+    if(rect->plane == XY) {
+        a = 0; b = 1; k = 2;
+    } else if(rect->plane == XZ) {
+        a = 0; b = 2; k = 1;
+    } else {
+        a = 1; b = 2; k = 0;
+    }
+
+    bounds->min[a] = rect->x0;
+    bounds->max[a] = rect->x1;
+    bounds->min[b] = rect->y0;
+    bounds->max[b] = rect->y1;
+    bounds->min[k] = rect->k - RECT_THICKNESS;
+    bounds->max[k] = rect->k + RECT_THICKNESS;
+}
+
+static void emptyBounds(struct Bounds* bounds) {
+    for(int i = 0; i < 3; i++) {
+        bounds->min[i] = FLT_MAX;
+        bounds->max[i] = -FLT_MAX;
+    }
+}
+
+static void growBounds(struct Bounds* bounds, const struct Bounds* other) {
+    for(int i = 0; i < 3; i++) {
+        if(other->min[i] < bounds->min[i]) bounds->min[i] = other->min[i];
+        if(other->max[i] > bounds->max[i]) bounds->max[i] = other->max[i];
+    }
+}
+
+static float surfaceArea(const float* min, const float* max) {
+    float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    if(dx < 0 || dy < 0 || dz < 0) {
+        return 0;
+    }
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static float centroid(const struct Bounds* bounds, int axis) {
+    return (bounds->min[axis] + bounds->max[axis]) * 0.5f;
+}
+
+static void swapPrimitives(struct Builder* builder, unsigned int a, unsigned int b) {
+    unsigned int primitive = builder->bvh->primitives[a];
+    builder->bvh->primitives[a] = builder->bvh->primitives[b];
+    builder->bvh->primitives[b] = primitive;
+
+    struct Bounds bounds = builder->bounds[a];
+    builder->bounds[a] = builder->bounds[b];
+    builder->bounds[b] = bounds;
+}
+
+static _Bool pushTask(struct Builder* builder, struct Task task) {
+    pthread_mutex_lock(&builder->lock);
+
+    if(builder->taskCount == builder->taskCapacity) {
+        unsigned int capacity = builder->taskCapacity ? builder->taskCapacity * 2 : 64;
+        struct Task* tasks = realloc(builder->tasks, capacity * sizeof(struct Task));
+        if(!tasks) {
+            pthread_mutex_unlock(&builder->lock);
+            return 0;
+        }
+        builder->tasks = tasks;
+        builder->taskCapacity = capacity;
+    }
+
+    builder->tasks[builder->taskCount++] = task;
+    builder->pending++;
+    pthread_cond_signal(&builder->wake);
+    pthread_mutex_unlock(&builder->lock);
+    return 1;
+}
+
+static void growCentroids(struct Bounds* centroids, const struct Bounds* bounds) {
+    for(int i = 0; i < 3; i++) {
+        float c = centroid(bounds, i);
+        if(c < centroids->min[i]) centroids->min[i] = c;
+        if(c > centroids->max[i]) centroids->max[i] = c;
+    }
+}
+
+static void clipBounds(struct Bounds* bounds, int axis, float min, float max) {
+    if(bounds->min[axis] < min) bounds->min[axis] = min;
+    if(bounds->max[axis] > max) bounds->max[axis] = max;
+}
+
+// Bins the references' extents instead of their centroids and clips them to every
+// bin they overlap. Splitting between two bins puts the references that enter
+// before it on the left and the ones that exit after it on the right.
+static void findSpatialSplit(struct Builder* builder, const struct Task* task, struct SpatialSplit* split) {
+    unsigned int binCount = builder->settings.binCount;
+    split->cost = FLT_MAX;
+    split->axis = -1;
+
+    for(int axis = 0; axis < 3; axis++) {
+        float origin = task->bounds.min[axis];
+        float extent = task->bounds.max[axis] - origin;
+        if(extent <= 0) {
+            continue;
+        }
+
+        struct Bounds bins[BVH_MAX_BINS];
+        unsigned int entries[BVH_MAX_BINS] = { 0 }, exits[BVH_MAX_BINS] = { 0 };
+        for(unsigned int b = 0; b < binCount; b++) {
+            emptyBounds(&bins[b]);
+        }
+
+        float scale = binCount / extent;
+        for(unsigned int p = task->first; p < task->first + task->count; p++) {
+            const struct Bounds* bounds = &builder->bounds[p];
+            unsigned int first = (unsigned int)((bounds->min[axis] - origin) * scale);
+            unsigned int last = (unsigned int)((bounds->max[axis] - origin) * scale);
+            if(first >= binCount) first = binCount - 1;
+            if(last >= binCount) last = binCount - 1;
+
+            for(unsigned int b = first; b <= last; b++) {
+                struct Bounds clipped = *bounds;
+                clipBounds(&clipped, axis, origin + b / scale, origin + (b + 1) / scale);
+                growBounds(&bins[b], &clipped);
+            }
+            entries[first]++;
+            exits[last]++;
+        }
+
+        float rightCost[BVH_MAX_BINS];
+        unsigned int rightCount[BVH_MAX_BINS];
+        struct Bounds accumulated;
+        emptyBounds(&accumulated);
+        unsigned int accumulatedCount = 0;
+        for(unsigned int b = binCount - 1; b > 0; b--) {
+            growBounds(&accumulated, &bins[b]);
+            accumulatedCount += exits[b];
+            rightCount[b] = accumulatedCount;
+            rightCost[b] = accumulatedCount * surfaceArea(accumulated.min, accumulated.max);
+        }
+
+        emptyBounds(&accumulated);
+        accumulatedCount = 0;
+        for(unsigned int b = 1; b < binCount; b++) {
+            growBounds(&accumulated, &bins[b - 1]);
+            accumulatedCount += entries[b - 1];
+            if(accumulatedCount == 0 || rightCount[b] == 0) {
+                continue;
+            }
+
+            float cost = accumulatedCount * surfaceArea(accumulated.min, accumulated.max) + rightCost[b];
+            if(cost < split->cost) {
+                split->cost = cost;
+                split->axis = axis;
+                split->bin = b;
+                split->position = origin + b / scale;
+                split->leftCount = accumulatedCount;
+                split->rightCount = rightCount[b];
+            }
+        }
+    }
+}
+
+// Gives each child room for its references plus a share of the spare capacity
+// proportional to its count, so the subtree that got more references can
+// duplicate more of them.
+static void distributeCapacity(const struct Task* task, struct Task* children) {
+    unsigned int used = children[0].count + children[1].count;
+    unsigned int spare = task->capacity - used;
+    unsigned int leftSpare = (unsigned int)((unsigned long long)spare * children[0].count / used);
+
+    children[0].first = task->first;
+    children[0].capacity = children[0].count + leftSpare;
+    children[1].first = task->first + children[0].capacity;
+    children[1].capacity = task->capacity - children[0].capacity;
+}
+
+// Writes the references of both children out of place, since the straddling ones
+// are duplicated and the result no longer fits where the task's references were
+static _Bool splitReferences(struct Builder* builder, const struct Task* task, const struct SpatialSplit* split, struct Task* children) {
+    unsigned int count = task->count;
+    unsigned int* primitives = malloc(count * sizeof(unsigned int));
+    struct Bounds* bounds = malloc(count * sizeof(struct Bounds));
+    if(!primitives || !bounds) {
+        free(primitives);
+        free(bounds);
+        return 0;
+    }
+
+    memcpy(primitives, &builder->bvh->primitives[task->first], count * sizeof(unsigned int));
+    memcpy(bounds, &builder->bounds[task->first], count * sizeof(struct Bounds));
+
+    children[0].count = split->leftCount;
+    children[1].count = split->rightCount;
+    distributeCapacity(task, children);
+
+    // Classify the references the same way findSpatialSplit binned them
+    unsigned int binCount = builder->settings.binCount;
+    int axis = split->axis;
+    float origin = task->bounds.min[axis];
+    float scale = binCount / (task->bounds.max[axis] - origin);
+
+    unsigned int next[2] = { children[0].first, children[1].first };
+    for(unsigned int p = 0; p < count; p++) {
+        unsigned int first = (unsigned int)((bounds[p].min[axis] - origin) * scale);
+        unsigned int last = (unsigned int)((bounds[p].max[axis] - origin) * scale);
+        if(first >= binCount) first = binCount - 1;
+        if(last >= binCount) last = binCount - 1;
+
+        for(int c = 0; c < 2; c++) {
+            if(c == 0 ? first >= split->bin : last < split->bin) {
+                continue;
+            }
+
+            struct Bounds clipped = bounds[p];
+            if(c == 0) {
+                clipBounds(&clipped, axis, -FLT_MAX, split->position);
+            } else {
+                clipBounds(&clipped, axis, split->position, FLT_MAX);
+            }
+
+            unsigned int i = next[c]++;
+            builder->bvh->primitives[i] = primitives[p];
+            builder->bounds[i] = clipped;
+            growBounds(&children[c].bounds, &clipped);
+            growCentroids(&children[c].centroids, &clipped);
+        }
+    }
+
+    free(primitives);
+    free(bounds);
+    return 1;
+}
+
+static void subdivideChildren(struct Builder* builder, struct Task* children);
+
+static void subdivide(struct Builder* builder, const struct Task* task) {
+    const struct BVHSettings* settings = &builder->settings;
+    const struct Bounds* centroidBounds = &task->centroids;
+    unsigned int first = task->first, count = task->count;
+
+    struct BVHNode* node = &builder->bvh->nodes[task->node];
+    for(int i = 0; i < 3; i++) {
+        node->min[i] = task->bounds.min[i];
+        node->max[i] = task->bounds.max[i];
+    }
+    node->leftFirst = first;
+    node->count = count;
+    if(count <= 1 || count <= settings->minLeafSize || task->depth >= BVH_MAX_DEPTH) {
+        return;
+    }
+
+    // Bin centroids along every axis and sweep the bin boundaries for the cheapest split
+    struct Bin bins[3][BVH_MAX_BINS];
+    float scale[3];
+    unsigned int binCount = settings->binCount;
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = centroidBounds->max[axis] - centroidBounds->min[axis];
+        scale[axis] = extent > 0 ? binCount / extent : 0;
+        for(unsigned int b = 0; b < binCount; b++) {
+            emptyBounds(&bins[axis][b].bounds);
+            bins[axis][b].count = 0;
+        }
+    }
+
+    for(unsigned int p = first; p < first + count; p++) {
+        const struct Bounds* bounds = &builder->bounds[p];
+        for(int axis = 0; axis < 3; axis++) {
+            unsigned int b = (unsigned int)((centroid(bounds, axis) - centroidBounds->min[axis]) * scale[axis]);
+            if(b >= binCount) b = binCount - 1;
+            growBounds(&bins[axis][b].bounds, bounds);
+            bins[axis][b].count++;
+        }
+    }
+
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    unsigned int bestSplit = 0;
+    struct Bounds bestLeft, bestRight;
+    for(int axis = 0; axis < 3; axis++) {
+        if(scale[axis] == 0) {
+            continue;
+        }
+
+        // rightCost[b] holds the cost of everything in bins b and up
+        float rightCost[BVH_MAX_BINS];
+        struct Bounds rightBounds[BVH_MAX_BINS];
+        struct Bounds accumulated;
+        emptyBounds(&accumulated);
+        unsigned int accumulatedCount = 0;
+        for(unsigned int b = binCount - 1; b > 0; b--) {
+            growBounds(&accumulated, &bins[axis][b].bounds);
+            accumulatedCount += bins[axis][b].count;
+            rightCost[b] = accumulatedCount * surfaceArea(accumulated.min, accumulated.max);
+            rightBounds[b] = accumulated;
+        }
+
+        emptyBounds(&accumulated);
+        accumulatedCount = 0;
+        for(unsigned int b = 1; b < binCount; b++) {
+            growBounds(&accumulated, &bins[axis][b - 1].bounds);
+            accumulatedCount += bins[axis][b - 1].count;
+            if(accumulatedCount == 0 || accumulatedCount == count) {
+                continue;
+            }
+
+            float cost = accumulatedCount * surfaceArea(accumulated.min, accumulated.max) + rightCost[b];
+            if(cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+                bestLeft = accumulated;
+                bestRight = rightBounds[b];
+            }
+        }
+    }
+
+    // Spatial splits only pay off where the object split leaves the children
+    // overlapping, and only while the task has room for more references
+    struct SpatialSplit spatial = { .cost = FLT_MAX, .axis = -1 };
+    if(task->capacity > count && bestAxis >= 0) {
+        struct Bounds overlap = bestLeft;
+        for(int i = 0; i < 3; i++) {
+            if(bestRight.min[i] > overlap.min[i]) overlap.min[i] = bestRight.min[i];
+            if(bestRight.max[i] < overlap.max[i]) overlap.max[i] = bestRight.max[i];
+        }
+
+        if(surfaceArea(overlap.min, overlap.max) > BVH_SPATIAL_SPLIT_ALPHA * builder->rootArea) {
+            findSpatialSplit(builder, task, &spatial);
+            if(spatial.leftCount + spatial.rightCount > task->capacity) {
+                spatial.axis = -1;
+            }
+        }
+    }
+    _Bool useSpatial = spatial.axis >= 0 && spatial.cost < bestCost;
+
+    float area = surfaceArea(task->bounds.min, task->bounds.max);
+    float leafCost = BVH_INTERSECT_COST * count * area;
+    float splitCost = BVH_TRAVERSAL_COST * area + BVH_INTERSECT_COST * (useSpatial ? spatial.cost : bestCost);
+    if(count <= settings->maxLeafSize && ((bestAxis < 0 && !useSpatial) || splitCost >= leafCost)) {
+        return;
+    }
+
+    // Partition and gather the children's bounds on the way, so they don't need another pass
+    unsigned int left = atomic_fetch_add(&builder->nodeCount, 2);
+    struct Task children[2];
+    for(int c = 0; c < 2; c++) {
+        children[c].node = left + c;
+        children[c].depth = task->depth + 1;
+        emptyBounds(&children[c].bounds);
+        emptyBounds(&children[c].centroids);
+    }
+
+    // Falls back to the object split when the copies can't be allocated
+    if(useSpatial && splitReferences(builder, task, &spatial, children)) {
+        node->leftFirst = left;
+        node->count = 0;
+        subdivideChildren(builder, children);
+        return;
+    }
+
+    unsigned int i = first, j = first + count;
+    while(i < j) {
+        _Bool isLeft;
+        if(bestAxis >= 0) {
+            float c = centroid(&builder->bounds[i], bestAxis);
+            unsigned int b = (unsigned int)((c - centroidBounds->min[bestAxis]) * scale[bestAxis]);
+            isLeft = (b >= binCount ? binCount - 1 : b) < bestSplit;
+        } else {
+            // Every centroid is in the same spot, any split is as good as another
+            isLeft = i - first < count / 2;
+        }
+
+        struct Task* child = &children[isLeft ? 0 : 1];
+        growBounds(&child->bounds, &builder->bounds[i]);
+        growCentroids(&child->centroids, &builder->bounds[i]);
+        if(isLeft) {
+            i++;
+        } else {
+            swapPrimitives(builder, i, --j);
+        }
+    }
+
+    children[0].count = i - first;
+    children[1].count = count - children[0].count;
+    distributeCapacity(task, children);
+
+    // The right references move up past the spare room handed to the left child
+    if(children[1].first != i) {
+        memmove(&builder->bvh->primitives[children[1].first], &builder->bvh->primitives[i], children[1].count * sizeof(unsigned int));
+        memmove(&builder->bounds[children[1].first], &builder->bounds[i], children[1].count * sizeof(struct Bounds));
+    }
+
+    node->leftFirst = left;
+    node->count = 0;
+    subdivideChildren(builder, children);
+}
+
+static void subdivideChildren(struct Builder* builder, struct Task* children) {
+    const struct BVHSettings* settings = &builder->settings;
+    if(settings->threadCount > 1 && children[1].count >= settings->parallelThreshold && pushTask(builder, children[1])) {
+        subdivide(builder, &children[0]);
+        return;
+    }
+
+    subdivide(builder, &children[0]);
+    subdivide(builder, &children[1]);
+}
+
+static void* buildWorker(void* data) {
+    struct Builder* builder = data;
+
+    pthread_mutex_lock(&builder->lock);
+    while(1) {
+        while(builder->taskCount == 0 && builder->pending > 0) {
+            pthread_cond_wait(&builder->wake, &builder->lock);
+        }
+        if(builder->taskCount == 0) {
+            break;
+        }
+
+        struct Task task = builder->tasks[--builder->taskCount];
+        pthread_mutex_unlock(&builder->lock);
+
+        subdivide(builder, &task);
+
+        pthread_mutex_lock(&builder->lock);
+        if(--builder->pending == 0) {
+            pthread_cond_broadcast(&builder->wake);
+        }
+    }
+    pthread_mutex_unlock(&builder->lock);
+
+    return 0;
+}
+
+// Allocates a BVH for count primitives along with the per reference bounds the builder sorts
+static struct BVH* allocateBVH(unsigned int count, struct Bounds** bounds) {
+    struct BVH* bvh = calloc(1, sizeof(struct BVH));
+    if(!bvh) {
+        return 0;
+    }
+
+    bvh->primitiveCount = count;
+    bvh->primitives = malloc((count ? count : 1) * sizeof(unsigned int));
+    bvh->nodes = malloc((count ? 2 * count - 1 : 1) * sizeof(struct BVHNode));
+    *bounds = malloc((count ? count : 1) * sizeof(struct Bounds));
+    if(!bvh->primitives || !bvh->nodes || !*bounds) {
+        fprintf(stderr, "Failed to allocate BVH for %u primitives\n", count);
+        free(*bounds);
+        freeBVH(bvh);
+        return 0;
+    }
+
+    return bvh;
+}
+
+// Grows the reference arrays to capacity, and the nodes to what that many leaves need
+static _Bool reserveReferences(struct BVH* bvh, struct Bounds** bounds, unsigned int capacity) {
+    unsigned int* primitives = realloc(bvh->primitives, capacity * sizeof(unsigned int));
+    if(primitives) {
+        bvh->primitives = primitives;
+    }
+    struct Bounds* grownBounds = realloc(*bounds, capacity * sizeof(struct Bounds));
+    if(grownBounds) {
+        *bounds = grownBounds;
+    }
+    struct BVHNode* nodes = realloc(bvh->nodes, (2 * capacity - 1) * sizeof(struct BVHNode));
+    if(nodes) {
+        bvh->nodes = nodes;
+    }
+    return primitives && grownBounds && nodes;
+}
+
+// Packs the references in the order their leaves are stored in, which also
+// drops the unused room spatial splits leave between them
+static _Bool compactReferences(struct BVH* bvh) {
+    unsigned int count = 0;
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        count += bvh->nodes[i].count;
+    }
+
+    unsigned int* primitives = malloc(count * sizeof(unsigned int));
+    if(!primitives) {
+        fprintf(stderr, "Failed to allocate %u primitive references\n", count);
+        return 0;
+    }
+
+    unsigned int next = 0;
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        struct BVHNode* node = &bvh->nodes[i];
+        if(node->count) {
+            memcpy(&primitives[next], &bvh->primitives[node->leftFirst], node->count * sizeof(unsigned int));
+            node->leftFirst = next;
+            next += node->count;
+        }
+    }
+
+    free(bvh->primitives);
+    bvh->primitives = primitives;
+    bvh->primitiveCount = count;
+
+    struct BVHNode* nodes = realloc(bvh->nodes, bvh->nodeCount * sizeof(struct BVHNode));
+    if(nodes) {
+        bvh->nodes = nodes;
+    }
+    return 1;
+}
+
+// Builds over the references and bounds filled in by the caller, frees bounds
+static struct BVH* build(struct BVH* bvh, struct Bounds* bounds, const struct BVHSettings* settings) {
+    unsigned int count = bvh->primitiveCount;
+
+    struct Builder builder = { 0 };
+    builder.bvh = bvh;
+    builder.bounds = bounds;
+    builder.settings = settings ? *settings : defaultSettings;
+
+    if(builder.settings.binCount < 2) builder.settings.binCount = 2;
+    if(builder.settings.binCount > BVH_MAX_BINS) builder.settings.binCount = BVH_MAX_BINS;
+    if(builder.settings.threadCount == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        builder.settings.threadCount = processors > 0 ? (unsigned int)processors : 1;
+    }
+
+    // Room for the references spatial splits duplicate, the build goes without them if it can't be had
+    unsigned int capacity = count;
+    if(builder.settings.spatialSplitBudget > 0 && count > 0) {
+        capacity += (unsigned int)(count * builder.settings.spatialSplitBudget);
+        if(!reserveReferences(bvh, &builder.bounds, capacity)) {
+            capacity = count;
+        }
+    }
+
+    struct Task root = { .node = 0, .first = 0, .count = count, .capacity = capacity, .depth = 1 };
+    emptyBounds(&root.bounds);
+    emptyBounds(&root.centroids);
+    for(unsigned int i = 0; i < count; i++) {
+        growBounds(&root.bounds, &builder.bounds[i]);
+        growCentroids(&root.centroids, &builder.bounds[i]);
+    }
+    builder.rootArea = surfaceArea(root.bounds.min, root.bounds.max);
+
+    // An empty scene still gets a root, its inverted bounds make every ray miss it
+    atomic_init(&builder.nodeCount, 1);
+    pthread_mutex_init(&builder.lock, 0);
+    pthread_cond_init(&builder.wake, 0);
+
+    if(!pushTask(&builder, root)) {
+        fprintf(stderr, "Failed to allocate BVH build tasks\n");
+        free(builder.bounds);
+        freeBVH(bvh);
+        return 0;
+    }
+
+    // The calling thread works through the queue alongside the pool
+    pthread_t* threads = calloc(builder.settings.threadCount, sizeof(pthread_t));
+    unsigned int threadCount = 0;
+    while(threads && threadCount + 1 < builder.settings.threadCount) {
+        if(pthread_create(&threads[threadCount], 0, buildWorker, &builder) != 0) {
+            break;
+        }
+        threadCount++;
+    }
+
+    buildWorker(&builder);
+    for(unsigned int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], 0);
+    }
+
+    bvh->nodeCount = atomic_load(&builder.nodeCount);
+
+    free(threads);
+    free(builder.tasks);
+    free(builder.bounds);
+    pthread_cond_destroy(&builder.wake);
+    pthread_mutex_destroy(&builder.lock);
+
+    if(capacity > count && !compactReferences(bvh)) {
+        freeBVH(bvh);
+        return 0;
+    }
+
+    // References are only duplicated where a split clipped them
+    bvh->spatialSplits = bvh->primitiveCount > count;
+
+    // Keeps the build order if the layout can't be allocated
+    layoutBVH(bvh, builder.settings.layout, 0);
+    bvh->buildCost = bvhSAHCost(bvh);
+    return bvh;
+}
+
+struct BVH* buildBVH(const struct Scene* scene, const struct BVHSettings* settings) {
+    struct Object object = { 0, scene->sphereCount, 0, scene->rectCount };
+    return buildObjectBVH(scene, &object, settings);
+}
+
+struct BVH* buildObjectBVH(const struct Scene* scene, const struct Object* object, const struct BVHSettings* settings) {
+    struct Bounds* bounds;
+    struct BVH* bvh = allocateBVH(object->sphereCount + object->rectCount, &bounds);
+    if(!bvh) {
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < object->sphereCount; i++) {
+        bvh->primitives[i] = object->firstSphere + i;
+    }
+    for(unsigned int i = 0; i < object->rectCount; i++) {
+        bvh->primitives[object->sphereCount + i] = (object->firstRect + i) | BVH_PRIMITIVE_RECT;
+    }
+    for(unsigned int i = 0; i < bvh->primitiveCount; i++) {
+        primitiveBounds(scene, bvh->primitives[i], &bounds[i]);
+    }
+
+    return build(bvh, bounds, settings);
+}
+
+struct BVH* buildBVHFromBounds(const float* bounds, unsigned int count, const struct BVHSettings* settings) {
+    struct Bounds* primitiveBounds;
+    struct BVH* bvh = allocateBVH(count, &primitiveBounds);
+    if(!bvh) {
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < count; i++) {
+        bvh->primitives[i] = i;
+        for(int j = 0; j < 3; j++) {
+            primitiveBounds[i].min[j] = bounds[6 * i + j];
+            primitiveBounds[i].max[j] = bounds[6 * i + 3 + j];
+        }
+    }
+
+    return build(bvh, primitiveBounds, settings);
+}
+
+float bvhSAHCost(const struct BVH* bvh) {
+    const struct BVHNode* root = &bvh->nodes[0];
+    float rootArea = surfaceArea(root->min, root->max);
+    if(rootArea <= 0) {
+        return 0;
+    }
+
+    float cost = 0;
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        float area = surfaceArea(node->min, node->max) / rootArea;
+        cost += node->count ? BVH_INTERSECT_COST * node->count * area : BVH_TRAVERSAL_COST * area;
+    }
+    return cost;
+}
+
+void bvhPrimitiveBounds(const struct Scene* scene, unsigned int primitive, float* min, float* max) {
+    struct Bounds bounds;
+    primitiveBounds(scene, primitive, &bounds);
+    for(int i = 0; i < 3; i++) {
+        min[i] = bounds.min[i];
+        max[i] = bounds.max[i];
+    }
+}
+
+_Bool refitBVH(struct BVH* bvh, const struct Scene* scene) {
+    if(bvh->spatialSplits) {
+        return 0;
+    }
+    if(bvh->primitiveCount == 0) {
+        return 1;
+    }
+
+    // Children are always allocated after their parent, so walking the nodes
+    // backwards visits both children before the node itself. The SAH cost is
+    // summed in the same pass and normalized once the root is known.
+    float traversalArea = 0, intersectArea = 0;
+    for(unsigned int i = bvh->nodeCount; i-- > 0;) {
+        struct BVHNode* node = &bvh->nodes[i];
+        struct Bounds bounds;
+        emptyBounds(&bounds);
+
+        if(node->count) {
+            for(unsigned int j = node->leftFirst; j < node->leftFirst + node->count; j++) {
+                struct Bounds primitive;
+                primitiveBounds(scene, bvh->primitives[j], &primitive);
+                growBounds(&bounds, &primitive);
+            }
+        } else {
+            for(unsigned int j = node->leftFirst; j < node->leftFirst + 2; j++) {
+                const struct BVHNode* child = &bvh->nodes[j];
+                struct Bounds childBounds = {
+                    { child->min[0], child->min[1], child->min[2] },
+                    { child->max[0], child->max[1], child->max[2] }
+                };
+                growBounds(&bounds, &childBounds);
+            }
+        }
+
+        for(int j = 0; j < 3; j++) {
+            node->min[j] = bounds.min[j];
+            node->max[j] = bounds.max[j];
+        }
+
+        float area = surfaceArea(bounds.min, bounds.max);
+        if(node->count) {
+            intersectArea += area * node->count;
+        } else {
+            traversalArea += area;
+        }
+    }
+
+    float rootArea = surfaceArea(bvh->nodes[0].min, bvh->nodes[0].max);
+    if(rootArea <= 0) {
+        return 1;
+    }
+
+    float cost = (BVH_TRAVERSAL_COST * traversalArea + BVH_INTERSECT_COST * intersectArea) / rootArea;
+    return cost <= bvh->buildCost * BVH_REFIT_THRESHOLD;
+}
+
+// New order of the nodes as their old indices, filled a sibling pair at a time
+struct Layout {
+    const struct BVH* bvh;
+    unsigned int* order;
+    unsigned int count;
+};
+
+static void placeUnit(struct Layout* layout, unsigned int unit) {
+    layout->order[layout->count++] = unit;
+    if(unit != 0) {
+        layout->order[layout->count++] = unit + 1;
+    }
+}
+
+static float nodeArea(const struct BVH* bvh, unsigned int node) {
+    return surfaceArea(bvh->nodes[node].min, bvh->nodes[node].max);
+}
+
+static _Bool depthFirstLayout(struct Layout* layout) {
+    const struct BVH* bvh = layout->bvh;
+    unsigned int* stack = malloc(bvh->nodeCount * sizeof(unsigned int));
+    if(!stack) {
+        return 0;
+    }
+
+    unsigned int stackSize = 0;
+    stack[stackSize++] = 0;
+    placeUnit(layout, 0);
+    while(stackSize > 0) {
+        const struct BVHNode* node = &bvh->nodes[stack[--stackSize]];
+        if(node->count) {
+            continue;
+        }
+
+        // Popped next, so the larger child's pair directly follows this one
+        unsigned int left = node->leftFirst;
+        _Bool leftLarger = nodeArea(bvh, left) >= nodeArea(bvh, left + 1);
+        placeUnit(layout, left);
+        stack[stackSize++] = leftLarger ? left + 1 : left;
+        stack[stackSize++] = leftLarger ? left : left + 1;
+    }
+
+    free(stack);
+    return 1;
+}
+
+// Levels of sibling pairs below every node, 0 for leaves
+static unsigned int* unitHeights(const struct BVH* bvh) {
+    unsigned int* heights = malloc(bvh->nodeCount * sizeof(unsigned int));
+    if(!heights) {
+        return 0;
+    }
+
+    // Children come after their parent, so one backwards pass ending at the root does
+    unsigned int i = bvh->nodeCount;
+    do {
+        const struct BVHNode* node = &bvh->nodes[--i];
+        unsigned int left = node->leftFirst;
+        heights[i] = node->count ? 0 : 1 + (heights[left] > heights[left + 1] ? heights[left] : heights[left + 1]);
+    } while(i > 0);
+    return heights;
+}
+
+static void vanEmdeBoasLayout(struct Layout* layout, const unsigned int* heights, unsigned int unit, unsigned int levels);
+
+// Lays out every treelet rooted depth levels below unit
+static void vanEmdeBoasBottom(struct Layout* layout, const unsigned int* heights, unsigned int unit, unsigned int depth, unsigned int levels) {
+    for(unsigned int i = unit; i < unit + (unit ? 2 : 1); i++) {
+        const struct BVHNode* node = &layout->bvh->nodes[i];
+        if(node->count) {
+            continue;
+        }
+
+        if(depth == 1) {
+            vanEmdeBoasLayout(layout, heights, node->leftFirst, levels);
+        } else {
+            vanEmdeBoasBottom(layout, heights, node->leftFirst, depth - 1, levels);
+        }
+    }
+}
+
+// Units are the root or a sibling pair. Places the treelet of the given number of
+// unit levels below unit: the top half first, then each treelet hanging off it.
+static void vanEmdeBoasLayout(struct Layout* layout, const unsigned int* heights, unsigned int unit, unsigned int levels) {
+    if(levels == 1) {
+        placeUnit(layout, unit);
+        return;
+    }
+
+    unsigned int top = levels / 2;
+    vanEmdeBoasLayout(layout, heights, unit, top);
+    vanEmdeBoasBottom(layout, heights, unit, top, levels - top);
+}
+
+static float pairPriority(const struct BVH* bvh, const unsigned int* visits, unsigned int pair) {
+    if(visits) {
+        return (float)visits[pair] + (float)visits[pair + 1];
+    }
+    return nodeArea(bvh, pair) + nodeArea(bvh, pair + 1);
+}
+
+// Binary max heap of sibling pairs by priority
+struct PairHeap {
+    unsigned int* pairs;
+    float* priorities;
+    unsigned int size;
+};
+
+static void pushPair(struct PairHeap* heap, unsigned int pair, float priority) {
+    unsigned int i = heap->size++;
+    for(; i > 0 && heap->priorities[(i - 1) / 2] < priority; i = (i - 1) / 2) {
+        heap->pairs[i] = heap->pairs[(i - 1) / 2];
+        heap->priorities[i] = heap->priorities[(i - 1) / 2];
+    }
+    heap->pairs[i] = pair;
+    heap->priorities[i] = priority;
+}
+
+static unsigned int popPair(struct PairHeap* heap) {
+    unsigned int top = heap->pairs[0];
+    unsigned int last = heap->pairs[--heap->size];
+    float priority = heap->priorities[heap->size];
+    unsigned int i = 0;
+    while(2 * i + 1 < heap->size) {
+        unsigned int child = 2 * i + 1;
+        if(child + 1 < heap->size && heap->priorities[child + 1] > heap->priorities[child]) {
+            child++;
+        }
+        if(heap->priorities[child] <= priority) {
+            break;
+        }
+        heap->pairs[i] = heap->pairs[child];
+        heap->priorities[i] = heap->priorities[child];
+        i = child;
+    }
+    heap->pairs[i] = last;
+    heap->priorities[i] = priority;
+    return top;
+}
+
+// Pushes the child pairs of the units placed since next onto heap
+static unsigned int pushChildren(struct Layout* layout, const unsigned int* visits, struct PairHeap* heap, unsigned int next) {
+    for(; next < layout->count; next++) {
+        const struct BVHNode* node = &layout->bvh->nodes[layout->order[next]];
+        if(node->count == 0) {
+            pushPair(heap, node->leftFirst, pairPriority(layout->bvh, visits, node->leftFirst));
+        }
+    }
+    return next;
+}
+
+// Cuts the tree into treelets of up to BVH_LAYOUT_TREELET_PAIRS pairs, each grown
+// from its root by always adding the highest priority pair hanging off it, so
+// the likeliest paths through a treelet share its cache lines and pages. The
+// treelets are stored hottest root first, out of a heap of the pairs hanging off
+// the treelets placed so far.
+static _Bool frequencyLayout(struct Layout* layout, const unsigned int* visits) {
+    const struct BVH* bvh = layout->bvh;
+    unsigned int capacity = bvh->nodeCount / 2 + 1;
+    struct PairHeap roots = { malloc(capacity * sizeof(unsigned int)), malloc(capacity * sizeof(float)), 0 };
+    struct PairHeap treelet = { malloc(capacity * sizeof(unsigned int)), malloc(capacity * sizeof(float)), 0 };
+    _Bool ok = roots.pairs && roots.priorities && treelet.pairs && treelet.priorities;
+
+    if(ok) {
+        // The root is a single node, the treelet under it starts with its children
+        placeUnit(layout, 0);
+        unsigned int next = pushChildren(layout, visits, &treelet, 0);
+        while(1) {
+            for(unsigned int size = 0; size < BVH_LAYOUT_TREELET_PAIRS && treelet.size > 0; size++) {
+                placeUnit(layout, popPair(&treelet));
+                next = pushChildren(layout, visits, &treelet, next);
+            }
+
+            // What's left hanging off the treelet roots the next ones
+            while(treelet.size > 0) {
+                float priority = treelet.priorities[0];
+                pushPair(&roots, popPair(&treelet), priority);
+            }
+            if(roots.size == 0) {
+                break;
+            }
+
+            float priority = roots.priorities[0];
+            pushPair(&treelet, popPair(&roots), priority);
+        }
+    }
+
+    free(roots.pairs);
+    free(roots.priorities);
+    free(treelet.pairs);
+    free(treelet.priorities);
+    return ok;
+}
+
+_Bool layoutBVH(struct BVH* bvh, enum BVHLayout layout, const unsigned int* visits) {
+    if(layout == BVH_LAYOUT_BUILD_ORDER || bvh->primitiveCount == 0) {
+        return 1;
+    }
+
+    struct Layout state = { bvh, malloc(bvh->nodeCount * sizeof(unsigned int)), 0 };
+    unsigned int* newIndices = malloc(bvh->nodeCount * sizeof(unsigned int));
+    struct BVHNode* nodes = malloc(bvh->nodeCount * sizeof(struct BVHNode));
+    unsigned int* heights = 0;
+    _Bool ok = state.order && newIndices && nodes;
+
+    if(ok && layout == BVH_LAYOUT_DEPTH_FIRST) {
+        ok = depthFirstLayout(&state);
+    } else if(ok && layout == BVH_LAYOUT_VAN_EMDE_BOAS) {
+        heights = unitHeights(bvh);
+        ok = heights != 0;
+        if(ok) {
+            vanEmdeBoasLayout(&state, heights, 0, 1 + heights[0]);
+        }
+    } else if(ok) {
+        ok = frequencyLayout(&state, visits);
+    }
+
+    if(ok) {
+        for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+            newIndices[state.order[i]] = i;
+        }
+        for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+            nodes[i] = bvh->nodes[state.order[i]];
+            if(nodes[i].count == 0) {
+                nodes[i].leftFirst = newIndices[nodes[i].leftFirst];
+            }
+        }
+    }
+
+    free(state.order);
+    free(newIndices);
+    free(heights);
+    if(!ok) {
+        fprintf(stderr, "Failed to allocate the layout of %u nodes\n", bvh->nodeCount);
+        free(nodes);
+        return 0;
+    }
+
+    // Pack the references in the order their leaves are now stored in
+    struct BVHNode* oldNodes = bvh->nodes;
+    bvh->nodes = nodes;
+    if(!compactReferences(bvh)) {
+        bvh->nodes = oldNodes;
+        free(nodes);
+        return 0;
+    }
+    free(oldNodes);
+    return 1;
+}
+
+// Same test as HitBounds in raytracer.glsl, FLT_MAX on a miss
+static float boundsDistance(const struct BVHNode* node, const float* origin, const float* invDir, float tmin, float tmax) {
+    float enter = tmin, exit = tmax;
+    for(int i = 0; i < 3; i++) {
+        float t0 = (node->min[i] - origin[i]) * invDir[i];
+        float t1 = (node->max[i] - origin[i]) * invDir[i];
+        float near = invDir[i] < 0 ? t1 : t0;
+        float far = invDir[i] < 0 ? t0 : t1;
+        if(near > enter) enter = near;
+        if(far < exit) exit = far;
+    }
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+// Same tests as HitSphere and HitRect in raytracer.glsl, returns the hit distance or tmax
+static float primitiveDistance(const struct Scene* scene, unsigned int primitive, const float* origin, const float* direction, float tmin, float tmax) {
+    unsigned int index = primitive & BVH_PRIMITIVE_INDEX;
+
+    if(!(primitive & BVH_PRIMITIVE_RECT)) {
+        const struct Sphere* sphere = &scene->spheres[index];
+        float oc[3] = {
+            origin[0] - sphere->center[0], origin[1] - sphere->center[1], origin[2] - sphere->center[2]
+        };
+        float a = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+        float halfB = oc[0] * direction[0] + oc[1] * direction[1] + oc[2] * direction[2];
+        float c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - sphere->radius * sphere->radius;
+        float d = halfB * halfB - a * c;
+        if(d <= 0) {
+            return tmax;
+        }
+
+        float root = sqrtf(d);
+        float t = (-halfB - root) / a;
+        if(t > tmin && t < tmax) {
+            return t;
+        }
+        t = (-halfB + root) / a;
+        return t > tmin && t < tmax ? t : tmax;
+    }
+
+    const struct Rect* rect = &scene->rects[index];
+    int a, b, k;
+    if(rect->plane == XY) {
+        a = 0; b = 1; k = 2;
+    } else if(rect->plane == XZ) {
+        a = 0; b = 2; k = 1;
+    } else {
+        a = 1; b = 2; k = 0;
+    }
+
+    float t = (rect->k - origin[k]) / direction[k];
+    if(!(t > tmin && t < tmax)) {
+        return tmax;
+    }
+
+    float x = origin[a] + t * direction[a];
+    float y = origin[b] + t * direction[b];
+    return x >= rect->x0 && x <= rect->x1 && y >= rect->y0 && y <= rect->y1 ? t : tmax;
+}
+
+float traceBVH(const struct BVH* bvh, const struct Scene* scene, const float* origin, const float* direction, float tmax,
+    unsigned int* visits, unsigned int* hit) {
+    float tmin = 0.001f;
+    float invDir[3] = { 1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2] };
+    float closest = tmax;
+
+    if(visits) visits[0]++;
+    if(boundsDistance(&bvh->nodes[0], origin, invDir, tmin, closest) == FLT_MAX) {
+        return closest;
+    }
+
+    unsigned int stack[BVH_MAX_DEPTH + 1];
+    unsigned int stackSize = 0;
+    unsigned int current = 0;
+    while(1) {
+        const struct BVHNode* node = &bvh->nodes[current];
+
+        if(node->count) {
+            for(unsigned int i = node->leftFirst; i < node->leftFirst + node->count; i++) {
+                float t = primitiveDistance(scene, bvh->primitives[i], origin, direction, tmin, closest);
+                if(t < closest) {
+                    closest = t;
+                    if(hit) *hit = bvh->primitives[i];
+                }
+            }
+        } else {
+            // Visit the nearest child first, the far one is often culled by then
+            unsigned int near = node->leftFirst, far = near + 1;
+            if(visits) {
+                visits[near]++;
+                visits[far]++;
+            }
+
+            float tnear = boundsDistance(&bvh->nodes[near], origin, invDir, tmin, closest);
+            float tfar = boundsDistance(&bvh->nodes[far], origin, invDir, tmin, closest);
+            if(tfar < tnear) {
+                unsigned int tmp = near; near = far; far = tmp;
+                float t = tnear; tnear = tfar; tfar = t;
+            }
+
+            if(tnear != FLT_MAX) {
+                if(tfar != FLT_MAX) {
+                    stack[stackSize++] = far;
+                }
+                current = near;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+
+    return closest;
+}
+
+void computeSkipLinks(const struct BVH* bvh, unsigned int* skips) {
+    // The root of an empty BVH looks like an interior node, but has no children
+    skips[0] = 0;
+    if(bvh->primitiveCount == 0) {
+        return;
+    }
+
+    // Parents come before their children, so a node's link is known before its children need it
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        if(node->count == 0) {
+            skips[node->leftFirst] = node->leftFirst + 1;
+            skips[node->leftFirst + 1] = skips[i];
+        }
+    }
+}
+
+_Bool validBVH(const struct BVH* bvh, const struct Object* object) {
+    if(bvh->nodeCount == 0 || bvh->nodeCount > 2 * bvh->primitiveCount + 1) {
+        return 0;
+    }
+    if(bvh->primitiveCount == 0) {
+        return bvh->nodeCount == 1 && bvh->nodes[0].count == 0;
+    }
+
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        if(node->count ?
+            node->leftFirst > bvh->primitiveCount || node->count > bvh->primitiveCount - node->leftFirst :
+            node->leftFirst <= i || node->leftFirst >= bvh->nodeCount - 1) {
+            return 0;
+        }
+    }
+
+    // Children come after their parents, so a node's depth is known by the time
+    // it's reached. Nodes no parent leads to stay at 0 and are never traversed.
+    unsigned char* depths = calloc(bvh->nodeCount, 1);
+    if(!depths) {
+        return 0;
+    }
+    depths[0] = 1;
+    _Bool valid = 1;
+    for(unsigned int i = 0; i < bvh->nodeCount && valid; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        if(node->count || !depths[i]) {
+            continue;
+        }
+        valid = depths[i] < BVH_MAX_DEPTH;
+        for(unsigned int child = node->leftFirst; child < node->leftFirst + 2; child++) {
+            depths[child] = depths[child] > depths[i] ? depths[child] : depths[i] + 1;
+        }
+    }
+    free(depths);
+
+    for(unsigned int i = 0; i < bvh->primitiveCount && valid; i++) {
+        unsigned int index = bvh->primitives[i] & BVH_PRIMITIVE_INDEX;
+        valid = bvh->primitives[i] & BVH_PRIMITIVE_RECT ?
+            index >= object->firstRect && index - object->firstRect < object->rectCount :
+            index >= object->firstSphere && index - object->firstSphere < object->sphereCount;
+    }
+    return valid;
+}
+
+void freeBVH(struct BVH* bvh) {
+    free(bvh->nodes);
+    free(bvh->primitives);
+    free(bvh);
+}
@@ -0,0 +1,157 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bvh4.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+_Static_assert(sizeof(struct BVH4Node) == 2 * sizeof(struct BVHNode), "BVH4Node must take the space of two BVHNodes");
+
+struct Collapser {
+    const struct BVH* bvh;
+    struct BVH4Node* nodes;
+    unsigned int nodeCount;
+};
+
+static float halfArea(const struct BVHNode* node) {
+    float dx = node->max[0] - node->min[0], dy = node->max[1] - node->min[1], dz = node->max[2] - node->min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+// Smallest power of two cell size that covers extent in 255 cells, as a biased exponent
+static unsigned int cellExponent(float extent) {
+    int exponent;
+    frexpf(extent / 255.0f, &exponent);
+    if(extent <= 0 || exponent < -126) exponent = -126;
+    if(exponent > 127) exponent = 127;
+    return (unsigned int)(exponent + 127);
+}
+
+// Rounds outwards, so decoded bounds always contain the original ones
+static void quantize(float origin, float cell, float min, float max, unsigned int* qmin, unsigned int* qmax) {
+    float lo = floorf((min - origin) / cell), hi = ceilf((max - origin) / cell);
+    if(lo < 0) lo = 0;
+    if(hi > 255) hi = 255;
+    if(origin + lo * cell > min && lo > 0) lo--;
+    if(origin + hi * cell < max && hi < 255) hi++;
+    *qmin = (unsigned int)lo;
+    *qmax = (unsigned int)hi;
+}
+
+// Fills in wide node index from binary node index, returns the depth of the wide subtree or 0 on failure
+static unsigned int collapse(struct Collapser* collapser, unsigned int index, unsigned int wide) {
+    const struct BVHNode* nodes = collapser->bvh->nodes;
+    const struct BVHNode* node = &nodes[index];
+
+    unsigned int children[BVH4_WIDTH];
+    unsigned int childCount = 0;
+    if(node->count) {
+        children[childCount++] = index;
+    } else if(collapser->bvh->primitiveCount) {
+        children[childCount++] = node->leftFirst;
+        children[childCount++] = node->leftFirst + 1;
+    }
+
+    while(childCount < BVH4_WIDTH) {
+        int largest = -1;
+        float largestArea = -1;
+        for(unsigned int c = 0; c < childCount; c++) {
+            const struct BVHNode* child = &nodes[children[c]];
+            if(child->count == 0 && halfArea(child) > largestArea) {
+                largest = (int)c;
+                largestArea = halfArea(child);
+            }
+        }
+        if(largest < 0) {
+            break;
+        }
+
+        unsigned int opened = nodes[children[largest]].leftFirst;
+        children[largest] = opened;
+        children[childCount++] = opened + 1;
+    }
+
+    struct BVH4Node* result = &collapser->nodes[wide];
+    *result = (struct BVH4Node){ 0 };
+    result->childCount = childCount;
+
+    float cell[3];
+    for(int axis = 0; axis < 3; axis++) {
+        unsigned int exponent = cellExponent(node->max[axis] - node->min[axis]);
+        result->origin[axis] = node->min[axis];
+        result->exponents |= exponent << (8 * axis);
+        cell[axis] = ldexpf(1.0f, (int)exponent - 127);
+    }
+
+    // Interior children only get their wide node allocated here, the recursion below fills it in
+    for(unsigned int c = 0; c < childCount; c++) {
+        const struct BVHNode* child = &nodes[children[c]];
+        unsigned int shift = 8 * c;
+
+        for(int axis = 0; axis < 3; axis++) {
+            unsigned int qmin, qmax;
+            quantize(result->origin[axis], cell[axis], child->min[axis], child->max[axis], &qmin, &qmax);
+            result->qmin[axis] |= qmin << shift;
+            result->qmax[axis] |= qmax << shift;
+        }
+
+        if(child->count) {
+            if(child->count > 255) {
+                return 0;
+            }
+            result->counts |= child->count << shift;
+            result->children[c] = child->leftFirst;
+        } else {
+            result->children[c] = collapser->nodeCount++;
+        }
+    }
+
+    unsigned int depth = 1;
+    for(unsigned int c = 0; c < childCount; c++) {
+        if(nodes[children[c]].count) {
+            continue;
+        }
+
+        unsigned int childDepth = collapse(collapser, children[c], collapser->nodes[wide].children[c]);
+        if(childDepth == 0 || childDepth + 1 > BVH4_MAX_DEPTH) {
+            return 0;
+        }
+        if(childDepth + 1 > depth) {
+            depth = childDepth + 1;
+        }
+    }
+    return depth;
+}
+
+struct BVH4Node* collapseBVH(const struct BVH* bvh, unsigned int* nodeCount) {
+    // Every wide node replaces at least one binary interior node
+    unsigned int capacity = bvh->nodeCount / 2 + 1;
+    struct Collapser collapser = { bvh, malloc(capacity * sizeof(struct BVH4Node)), 1 };
+    if(!collapser.nodes) {
+        fprintf(stderr, "Failed to allocate %u wide BVH nodes\n", capacity);
+        return 0;
+    }
+
+    if(!collapse(&collapser, 0, 0)) {
+        free(collapser.nodes);
+        return 0;
+    }
+
+    *nodeCount = collapser.nodeCount;
+    return collapser.nodes;
+}
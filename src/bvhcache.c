@@ -0,0 +1,189 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "bvhcache.h"
+#include "mapfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 64 bit FNV-1a
+#define HASH_OFFSET 0xcbf29ce484222325ull
+#define HASH_PRIME 0x100000001b3ull
+
+static const char cacheMagic[8] = { 'r', 't', 'b', 'v', 'h', 0, 0, 0 };
+
+struct CacheHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int nodeSize; // sizeof(struct BVHNode) of the build that wrote the file
+    unsigned long long key;
+    unsigned int count;
+    unsigned int padding;
+};
+
+// Followed by the BVH's nodes and then its primitive references
+struct CacheEntry {
+    unsigned int nodeCount;
+    unsigned int primitiveCount;
+    float buildCost;
+    unsigned int spatialSplits;
+};
+
+static unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+unsigned long long hashBVHInput(const struct Scene* scene, const struct BVHSettings* settings) {
+    static const struct BVHSettings defaultSettings = BVH_DEFAULT_SETTINGS;
+    if(!settings) {
+        settings = &defaultSettings;
+    }
+
+    // Thread counts only change how fast the same BVH is built. Instances aren't
+    // included either, the top level is cheap enough to always build.
+    unsigned int values[] = {
+        settings->binCount, settings->maxLeafSize, settings->minLeafSize, (unsigned int)settings->layout,
+        scene->sphereCount, scene->rectCount, scene->objectCount
+    };
+    unsigned long long hash = hashBytes(HASH_OFFSET, values, sizeof(values));
+    hash = hashBytes(hash, &settings->spatialSplitBudget, sizeof(float));
+
+    // Only the fields in front of the materials, which can change without a rebuild
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        const struct Sphere* sphere = &scene->spheres[i];
+        hash = hashBytes(hash, sphere->center, sizeof(sphere->center));
+        hash = hashBytes(hash, &sphere->radius, sizeof(sphere->radius));
+    }
+    for(unsigned int i = 0; i < scene->rectCount; i++) {
+        const struct Rect* rect = &scene->rects[i];
+        float extent[] = { rect->x0, rect->x1, rect->y0, rect->y1, rect->k };
+        hash = hashBytes(hash, &rect->plane, sizeof(rect->plane));
+        hash = hashBytes(hash, extent, sizeof(extent));
+    }
+    return hashBytes(hash, scene->objects, scene->objectCount * sizeof(struct Object));
+}
+
+_Bool saveBVHCache(const char* path, unsigned long long key, struct BVH* const* bvhs, unsigned int count) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        fprintf(stderr, "Failed to create BVH cache %s\n", path);
+        return 0;
+    }
+
+    struct CacheHeader header = { { 0 }, BVH_CACHE_VERSION, sizeof(struct BVHNode), key, count, 0 };
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    _Bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for(unsigned int i = 0; ok && i < count; i++) {
+        const struct BVH* bvh = bvhs[i];
+        struct CacheEntry entry = { bvh->nodeCount, bvh->primitiveCount, bvh->buildCost, bvh->spatialSplits };
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1 &&
+            fwrite(bvh->nodes, sizeof(struct BVHNode), bvh->nodeCount, file) == bvh->nodeCount &&
+            fwrite(bvh->primitives, sizeof(unsigned int), bvh->primitiveCount, file) == bvh->primitiveCount;
+    }
+
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+    if(!ok) {
+        fprintf(stderr, "Failed to write BVH cache %s\n", path);
+        remove(path);
+    }
+    return ok;
+}
+
+static struct BVH* readBVH(const unsigned char** data, const unsigned char* end, const struct Object* object) {
+    struct CacheEntry entry;
+    if((size_t)(end - *data) < sizeof(entry)) {
+        return 0;
+    }
+    memcpy(&entry, *data, sizeof(entry));
+    *data += sizeof(entry);
+
+    size_t nodeSize = (size_t)entry.nodeCount * sizeof(struct BVHNode);
+    size_t primitiveSize = (size_t)entry.primitiveCount * sizeof(unsigned int);
+    if((size_t)(end - *data) < nodeSize || (size_t)(end - *data) - nodeSize < primitiveSize) {
+        return 0;
+    }
+
+    struct BVH* bvh = calloc(1, sizeof(struct BVH));
+    if(!bvh) {
+        return 0;
+    }
+    bvh->nodeCount = entry.nodeCount;
+    bvh->primitiveCount = entry.primitiveCount;
+    bvh->buildCost = entry.buildCost;
+    bvh->spatialSplits = entry.spatialSplits != 0;
+    bvh->nodes = malloc(nodeSize ? nodeSize : 1);
+    bvh->primitives = malloc(primitiveSize ? primitiveSize : 1);
+    if(!bvh->nodes || !bvh->primitives) {
+        freeBVH(bvh);
+        return 0;
+    }
+
+    memcpy(bvh->nodes, *data, nodeSize);
+    memcpy(bvh->primitives, *data + nodeSize, primitiveSize);
+    *data += nodeSize + primitiveSize;
+
+    // A damaged file could otherwise send traversal outside the arrays
+    if(!validBVH(bvh, object)) {
+        freeBVH(bvh);
+        return 0;
+    }
+    return bvh;
+}
+
+_Bool loadBVHCache(const char* path, unsigned long long key, const struct Object* objects, struct BVH** bvhs,
+    unsigned int count) {
+    size_t size;
+    const unsigned char* data = mapFile(path, &size);
+    if(!data) {
+        return 0;
+    }
+
+    // Caches of another scene, build or version are replaced without a message
+    struct CacheHeader header;
+    _Bool ok = size >= sizeof(header);
+    if(ok) {
+        memcpy(&header, data, sizeof(header));
+        ok = memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0 &&
+            header.version == BVH_CACHE_VERSION && header.nodeSize == sizeof(struct BVHNode) &&
+            header.key == key && header.count == count;
+    }
+
+    const unsigned char* next = data + sizeof(header);
+    for(unsigned int i = 0; ok && i < count; i++) {
+        bvhs[i] = readBVH(&next, data + size, &objects[i]);
+        if(!bvhs[i]) {
+            fprintf(stderr, "Ignoring damaged BVH cache %s\n", path);
+            for(unsigned int j = 0; j < i; j++) {
+                freeBVH(bvhs[j]);
+                bvhs[j] = 0;
+            }
+            ok = 0;
+        }
+    }
+
+    unmapFile(data, size);
+    return ok;
+}
@@ -0,0 +1,227 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bvhleaf.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+// Steps per axis of a sphere's center
+#define CENTER_STEPS 65535.0f
+
+// Smallest power of two step that covers extent in CENTER_STEPS steps, as a biased exponent
+static unsigned int stepExponent(float extent) {
+    int exponent;
+    frexpf(extent / CENTER_STEPS, &exponent);
+    if(extent <= 0 || exponent < -126) exponent = -126;
+    if(exponent > 127) exponent = 127;
+    return (unsigned int)(exponent + 127);
+}
+
+// Rounds away from zero to a half float, fails for values out of its normal range
+static _Bool packHalf(float value, unsigned int* half) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000u;
+    if(value == 0) {
+        *half = sign;
+        return 1;
+    }
+    if(!isfinite(value)) {
+        return 0;
+    }
+
+    int exponent;
+    float mantissa = frexpf(fabsf(value), &exponent);
+    unsigned int fraction = (unsigned int)ceilf((mantissa * 2.0f - 1.0f) * 1024.0f);
+    int biased = exponent + 14;
+    if(fraction == 1024) {
+        fraction = 0;
+        biased++;
+    }
+    if(biased < 1 || biased > 30) {
+        return 0;
+    }
+
+    *half = sign | (unsigned int)biased << 10 | fraction;
+    return 1;
+}
+
+// Spheres of a leaf sorted by material, returns how many there are
+static unsigned int leafSpheres(const struct Scene* scene, const struct BVH* bvh, const struct BVHNode* node, unsigned int* spheres) {
+    unsigned int count = 0;
+    for(unsigned int i = node->leftFirst; i < node->leftFirst + node->count; i++) {
+        unsigned int primitive = bvh->primitives[i];
+        if(primitive & BVH_PRIMITIVE_RECT) {
+            continue;
+        }
+        if(count == BVH_LEAF_MAX_SPHERES) {
+            return BVH_LEAF_MAX_SPHERES + 1;
+        }
+
+        // Insertion sort, leaves are small
+        unsigned int material = scene->spheres[primitive].material;
+        unsigned int j = count++;
+        for(; j > 0 && scene->spheres[spheres[j - 1]].material > material; j--) {
+            spheres[j] = spheres[j - 1];
+        }
+        spheres[j] = primitive;
+    }
+    return count;
+}
+
+// Smallest center of the leaf's spheres and the step exponent per axis
+static void leafGrid(const struct Scene* scene, const unsigned int* spheres, unsigned int count, float* min,
+    unsigned int* exponents) {
+    float max[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for(int axis = 0; axis < 3; axis++) {
+        min[axis] = INFINITY;
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        for(int axis = 0; axis < 3; axis++) {
+            float center = scene->spheres[spheres[i]].center[axis];
+            if(center < min[axis]) min[axis] = center;
+            if(center > max[axis]) max[axis] = center;
+        }
+    }
+    for(int axis = 0; axis < 3; axis++) {
+        if(count == 0) {
+            min[axis] = max[axis] = 0;
+        }
+        exponents[axis] = stepExponent(max[axis] - min[axis]);
+    }
+}
+
+// The sphere's two words. The radius is rounded up and grown by the distance the
+// center moved to its step, so the decoded sphere contains the original: leaf
+// bounds may cut off what it gains, never what the original covers. Fails when
+// the radius doesn't fit a half float.
+static _Bool packSphere(const struct Sphere* sphere, const float* min, const unsigned int* exponents, unsigned int* words) {
+    unsigned int steps[3];
+    double moved = 0, slack = 0;
+    for(int axis = 0; axis < 3; axis++) {
+        float step = ldexpf(1.0f, (int)exponents[axis] - 127);
+        float q = roundf((sphere->center[axis] - min[axis]) / step);
+        steps[axis] = q < 0 ? 0 : q > CENTER_STEPS ? (unsigned int)CENTER_STEPS : (unsigned int)q;
+
+        // As raytracer.glsl decodes it, with an ulp to spare for its rounding
+        float decoded = min[axis] + (float)steps[axis] * step;
+        double offset = (double)decoded - sphere->center[axis];
+        moved += offset * offset;
+        slack = fmax(slack, fabsf(decoded) * FLT_EPSILON);
+    }
+
+    double grown = fabsf(sphere->radius) + sqrt(moved) + slack;
+    float radius = (float)grown;
+    if(radius < grown) {
+        radius = nextafterf(radius, INFINITY);
+    }
+
+    unsigned int half;
+    if(!packHalf(copysignf(radius, sphere->radius), &half)) {
+        return 0;
+    }
+    words[0] = steps[0] | steps[1] << 16;
+    words[1] = steps[2] | half << 16;
+    return 1;
+}
+
+static unsigned int runCount(const struct Scene* scene, const unsigned int* spheres, unsigned int count) {
+    unsigned int runs = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        if(i == 0 || scene->spheres[spheres[i]].material != scene->spheres[spheres[i - 1]].material) {
+            runs++;
+        }
+    }
+    return runs;
+}
+
+unsigned int compressedLeafWordCount(const struct Scene* scene, const struct BVH* bvh) {
+    unsigned int spheres[BVH_LEAF_MAX_SPHERES];
+    unsigned long long wordCount = 0;
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        if(node->count == 0) {
+            continue;
+        }
+
+        unsigned int count = leafSpheres(scene, bvh, node, spheres);
+        if(count > BVH_LEAF_MAX_SPHERES) {
+            return 0;
+        }
+        float min[3];
+        unsigned int exponents[3];
+        leafGrid(scene, spheres, count, min, exponents);
+        for(unsigned int j = 0; j < count; j++) {
+            const struct Sphere* sphere = &scene->spheres[spheres[j]];
+            unsigned int words[2];
+            if(sphere->material > BVH_LEAF_MAX_MATERIAL || !packSphere(sphere, min, exponents, words)) {
+                return 0;
+            }
+        }
+
+        wordCount += BVH_LEAF_HEADER_SIZE + 2 * count + runCount(scene, spheres, count) + (node->count - count);
+    }
+    return wordCount < 0xffffffffull ? (unsigned int)wordCount : 0;
+}
+
+void compressLeaves(const struct Scene* scene, const struct BVH* bvh, unsigned int* words, struct BVHNode* nodes) {
+    unsigned int spheres[BVH_LEAF_MAX_SPHERES];
+    unsigned int next = 0;
+    memcpy(nodes, bvh->nodes, bvh->nodeCount * sizeof(struct BVHNode));
+
+    for(unsigned int i = 0; i < bvh->nodeCount; i++) {
+        const struct BVHNode* node = &bvh->nodes[i];
+        if(node->count == 0) {
+            continue;
+        }
+        nodes[i].leftFirst = next;
+
+        unsigned int count = leafSpheres(scene, bvh, node, spheres);
+        float min[3];
+        unsigned int exponents[3];
+        leafGrid(scene, spheres, count, min, exponents);
+
+        unsigned int* header = &words[next];
+        header[3] = count << 24;
+        for(int axis = 0; axis < 3; axis++) {
+            memcpy(&header[axis], &min[axis], sizeof(float));
+            header[3] |= exponents[axis] << (8 * axis);
+        }
+        next += BVH_LEAF_HEADER_SIZE;
+
+        for(unsigned int j = node->leftFirst; j < node->leftFirst + node->count; j++) {
+            if(bvh->primitives[j] & BVH_PRIMITIVE_RECT) {
+                words[next++] = bvh->primitives[j];
+            }
+        }
+
+        for(unsigned int j = 0; j < count; j++) {
+            packSphere(&scene->spheres[spheres[j]], min, exponents, &words[next]);
+            next += 2;
+        }
+
+        for(unsigned int j = 0; j < count;) {
+            unsigned int material = scene->spheres[spheres[j]].material;
+            unsigned int length = 0;
+            for(; j < count && scene->spheres[spheres[j]].material == material; j++) {
+                length++;
+            }
+            words[next++] = material | length << 24;
+        }
+    }
+}
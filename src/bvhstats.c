@@ -0,0 +1,164 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bvhstats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct StackEntry {
+    unsigned int node;
+    unsigned int depth;
+};
+
+static float surfaceArea(const float* min, const float* max) {
+    float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+    if(dx < 0 || dy < 0 || dz < 0) {
+        return 0;
+    }
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static float overlapArea(const struct BVHNode* a, const struct BVHNode* b) {
+    float min[3], max[3];
+    for(int i = 0; i < 3; i++) {
+        min[i] = a->min[i] > b->min[i] ? a->min[i] : b->min[i];
+        max[i] = a->max[i] < b->max[i] ? a->max[i] : b->max[i];
+    }
+    return surfaceArea(min, max);
+}
+
+_Bool analyzeBVH(const struct BVH* bvh, struct BVHStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    // Empty BVHs are a lone root without primitives, which would read as an interior node
+    if(!bvh || bvh->primitiveCount == 0) {
+        return 0;
+    }
+
+    // A binary tree never has more than half its nodes waiting on the stack
+    struct StackEntry* stack = malloc((bvh->nodeCount / 2 + 1) * sizeof(struct StackEntry));
+    if(!stack) {
+        return 0;
+    }
+
+    const struct BVHNode* root = &bvh->nodes[0];
+    float rootArea = surfaceArea(root->min, root->max);
+    unsigned long long depthSum = 0;
+    unsigned int interiorCount = 0;
+
+    stats->nodeCount = bvh->nodeCount;
+    stats->referenceCount = bvh->primitiveCount;
+    stats->sahCost = bvhSAHCost(bvh);
+    stats->minDepth = ~0u;
+
+    // Depths need a walk from the root, the layouts don't keep levels together
+    unsigned int stackSize = 0;
+    stack[stackSize++] = (struct StackEntry){ 0, 0 };
+    while(stackSize > 0) {
+        struct StackEntry entry = stack[--stackSize];
+        const struct BVHNode* node = &bvh->nodes[entry.node];
+
+        if(node->count > 0) {
+            stats->leafCount++;
+            depthSum += entry.depth;
+            if(entry.depth < stats->minDepth) stats->minDepth = entry.depth;
+            if(entry.depth > stats->maxDepth) stats->maxDepth = entry.depth;
+
+            unsigned int bucket = node->count < BVH_STATS_LEAF_SIZES ? node->count : BVH_STATS_LEAF_SIZES;
+            stats->leafSizes[bucket - 1]++;
+            if(node->count > stats->maxLeafSize) stats->maxLeafSize = node->count;
+            continue;
+        }
+
+        const struct BVHNode* left = &bvh->nodes[node->leftFirst];
+        const struct BVHNode* right = left + 1;
+        float overlap = overlapArea(left, right);
+        float area = surfaceArea(node->min, node->max);
+        if(rootArea > 0) {
+            stats->overlapCost += BVH_TRAVERSAL_COST * overlap / rootArea;
+        }
+        if(area > 0) {
+            stats->meanOverlap += overlap / area;
+        }
+        interiorCount++;
+
+        stack[stackSize++] = (struct StackEntry){ node->leftFirst + 1, entry.depth + 1 };
+        stack[stackSize++] = (struct StackEntry){ node->leftFirst, entry.depth + 1 };
+    }
+
+    free(stack);
+
+    stats->meanDepth = (float)((double)depthSum / stats->leafCount);
+    if(interiorCount > 0) {
+        stats->meanOverlap /= interiorCount;
+    }
+    return 1;
+}
+
+void printBVHStats(FILE* file, const char* name, const struct BVHStats* stats) {
+    fprintf(file, "%s\n", name);
+    fprintf(
+        file, "  nodes %u, leaves %u, references %u\n",
+        stats->nodeCount, stats->leafCount, stats->referenceCount
+    );
+    fprintf(
+        file, "  SAH cost %.2f, sibling overlap %.2f of it, %.1f%% of a node's area on average\n",
+        stats->sahCost, stats->overlapCost, stats->meanOverlap * 100.0f
+    );
+    fprintf(
+        file, "  leaf depth %u to %u, %.2f on average\n",
+        stats->minDepth, stats->maxDepth, stats->meanDepth
+    );
+
+    // One bar per leaf size, scaled to the most common one
+    unsigned int largest = 0;
+    for(int i = 0; i < BVH_STATS_LEAF_SIZES; i++) {
+        if(stats->leafSizes[i] > largest) largest = stats->leafSizes[i];
+    }
+
+    fprintf(file, "  leaf sizes, largest %u\n", stats->maxLeafSize);
+    for(int i = 0; i < BVH_STATS_LEAF_SIZES; i++) {
+        if(stats->leafSizes[i] == 0) {
+            continue;
+        }
+
+        char bar[41];
+        int length = (int)(40ull * stats->leafSizes[i] / largest);
+        memset(bar, '#', length);
+        bar[length] = 0;
+        fprintf(
+            file, "  %3u%s %8u %s\n",
+            i + 1, i + 1 == BVH_STATS_LEAF_SIZES ? "+" : " ", stats->leafSizes[i], bar
+        );
+    }
+}
+
+void printTLASStats(FILE* file, const struct TLAS* tlas) {
+    struct BVHStats stats;
+    if(analyzeBVH(tlas->topLevel, &stats)) {
+        printBVHStats(file, "top level", &stats);
+    }
+
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "object %u", i);
+        if(analyzeBVH(tlas->objects[i], &stats)) {
+            printBVHStats(file, name, &stats);
+        } else {
+            fprintf(file, "%s\n  empty\n", name);
+        }
+    }
+}
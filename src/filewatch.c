@@ -0,0 +1,159 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "filewatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct WatchedFile {
+#ifdef __linux__
+    int directory; // inotify watch of the directory, shared by the files in it
+    char name[256];
+#else
+    char path[1024];
+    struct stat status;
+#endif
+    _Bool changed;
+};
+
+struct FileWatch {
+#ifdef __linux__
+    int fd;
+#endif
+    unsigned int fileCount;
+    struct WatchedFile files[FILE_WATCH_MAX_FILES];
+};
+
+struct FileWatch* createFileWatch() {
+    struct FileWatch* watch = calloc(1, sizeof(struct FileWatch));
+    if(!watch) {
+        return 0;
+    }
+
+#ifdef __linux__
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch->fd < 0) {
+        fprintf(stderr, "Failed to initialise inotify\n");
+        free(watch);
+        return 0;
+    }
+#endif
+    return watch;
+}
+
+int watchFile(struct FileWatch* watch, const char* path) {
+    if(watch->fileCount == FILE_WATCH_MAX_FILES) {
+        fprintf(stderr, "Can't watch more than %d files\n", FILE_WATCH_MAX_FILES);
+        return -1;
+    }
+    struct WatchedFile* file = &watch->files[watch->fileCount];
+
+#ifdef __linux__
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    char directory[1024];
+    if(strlen(name) >= sizeof(file->name) || (size_t)(name - path) >= sizeof(directory)) {
+        fprintf(stderr, "Can't watch %s, the path is too long\n", path);
+        return -1;
+    }
+
+    // Watching the same directory twice gives back the same watch
+    if(slash) {
+        memcpy(directory, path, (size_t)(slash - path));
+        directory[slash - path] = 0;
+    } else {
+        strcpy(directory, ".");
+    }
+    file->directory = inotify_add_watch(watch->fd, slash == path ? "/" : directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if(file->directory < 0) {
+        fprintf(stderr, "Failed to watch %s\n", directory);
+        return -1;
+    }
+    strcpy(file->name, name);
+#else
+    if(strlen(path) >= sizeof(file->path)) {
+        fprintf(stderr, "Can't watch %s, the path is too long\n", path);
+        return -1;
+    }
+    strcpy(file->path, path);
+
+    // A file that doesn't exist yet changes once it's created
+    if(stat(path, &file->status)) {
+        memset(&file->status, 0, sizeof(file->status));
+    }
+#endif
+
+    file->changed = 0;
+    return (int)watch->fileCount++;
+}
+
+// Marks the files that changed since the last call
+static void readChanges(struct FileWatch* watch) {
+#ifdef __linux__
+    _Alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while((length = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        for(char* next = buffer; next < buffer + length;) {
+            const struct inotify_event* event = (const struct inotify_event*)next;
+            next += sizeof(struct inotify_event) + event->len;
+
+            for(unsigned int i = 0; i < watch->fileCount; i++) {
+                struct WatchedFile* file = &watch->files[i];
+                if(event->len && file->directory == event->wd && strcmp(file->name, event->name) == 0) {
+                    file->changed = 1;
+                }
+            }
+        }
+    }
+#else
+    for(unsigned int i = 0; i < watch->fileCount; i++) {
+        struct WatchedFile* file = &watch->files[i];
+        struct stat status;
+        if(stat(file->path, &status) == 0 && (status.st_mtime != file->status.st_mtime || status.st_size != file->status.st_size)) {
+            file->status = status;
+            file->changed = 1;
+        }
+    }
+#endif
+}
+
+int nextChangedFile(struct FileWatch* watch) {
+    readChanges(watch);
+
+    for(unsigned int i = 0; i < watch->fileCount; i++) {
+        if(watch->files[i].changed) {
+            watch->files[i].changed = 0;
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+void freeFileWatch(struct FileWatch* watch) {
+#ifdef __linux__
+    close(watch->fd);
+#endif
+    free(watch);
+}
@@ -0,0 +1,235 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "grid.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Primitive bounds are widened by this fraction of the grid's extent, so rays
+// grazing a primitive right at a cell boundary find it from either cell
+#define CELL_MARGIN 1e-5f
+
+// Primitives much larger than a cell are listed in every cell they cover, past
+// this many references in total the grid isn't worth it
+#define MAX_REFERENCES (1u << 28)
+
+static const struct GridSettings defaultSettings = GRID_DEFAULT_SETTINGS;
+
+static unsigned int objectPrimitive(const struct Object* object, unsigned int i) {
+    if(i < object->sphereCount) {
+        return object->firstSphere + i;
+    }
+    return (object->firstRect + i - object->sphereCount) | BVH_PRIMITIVE_RECT;
+}
+
+// Mean edge of the primitive's bounds
+static float primitiveSize(const struct Scene* scene, unsigned int primitive) {
+    float min[3], max[3];
+    bvhPrimitiveBounds(scene, primitive, min, max);
+    return (max[0] - min[0] + max[1] - min[1] + max[2] - min[2]) / 3.0f;
+}
+
+// Matches GridCell in raytracer.glsl
+static unsigned int cellIndex(const struct Grid* grid, const unsigned int* cell) {
+    if(grid->hashMask) {
+        return (cell[0] * 73856093u ^ cell[1] * 19349663u ^ cell[2] * 83492791u) & grid->hashMask;
+    }
+    return cell[0] + grid->resolution[0] * (cell[1] + grid->resolution[1] * cell[2]);
+}
+
+static void cellRange(const struct Grid* grid, const struct Scene* scene, unsigned int primitive, unsigned int* first, unsigned int* last) {
+    float min[3], max[3];
+    bvhPrimitiveBounds(scene, primitive, min, max);
+
+    for(int i = 0; i < 3; i++) {
+        float extent = grid->max[i] - grid->min[i];
+        float scale = grid->resolution[i] / extent;
+        float top = (float)(grid->resolution[i] - 1);
+        float a = (min[i] - extent * CELL_MARGIN - grid->min[i]) * scale;
+        float b = (max[i] + extent * CELL_MARGIN - grid->min[i]) * scale;
+        first[i] = (unsigned int)fminf(fmaxf(a, 0), top);
+        last[i] = (unsigned int)fminf(fmaxf(b, 0), top);
+    }
+}
+
+_Bool preferGrid(const struct Scene* scene, const struct Object* object) {
+    unsigned int count = object->sphereCount + object->rectCount;
+    if(count < GRID_MIN_PRIMITIVES) {
+        return 0;
+    }
+
+    double sum = 0, squares = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        double size = primitiveSize(scene, objectPrimitive(object, i));
+        sum += size;
+        squares += size * size;
+    }
+
+    double mean = sum / count;
+    double variance = squares / count - mean * mean;
+    return variance <= (double)GRID_MAX_SIZE_VARIATION * GRID_MAX_SIZE_VARIATION * mean * mean;
+}
+
+struct Grid* buildGrid(const struct Scene* scene, const struct Object* object, const struct GridSettings* settings) {
+    if(!settings) {
+        settings = &defaultSettings;
+    }
+
+    unsigned int count = object->sphereCount + object->rectCount;
+    if(count == 0) {
+        return 0;
+    }
+
+    struct Grid* grid = calloc(1, sizeof(struct Grid));
+    if(!grid) {
+        fprintf(stderr, "Failed to allocate a grid\n");
+        return 0;
+    }
+
+    double sizeSum = 0;
+    for(int i = 0; i < 3; i++) {
+        grid->min[i] = INFINITY;
+        grid->max[i] = -INFINITY;
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        float min[3], max[3];
+        bvhPrimitiveBounds(scene, objectPrimitive(object, i), min, max);
+        for(int j = 0; j < 3; j++) {
+            grid->min[j] = fminf(grid->min[j], min[j]);
+            grid->max[j] = fmaxf(grid->max[j], max[j]);
+        }
+        sizeSum += (max[0] - min[0] + max[1] - min[1] + max[2] - min[2]) / 3.0;
+    }
+
+    float largest = 0;
+    for(int i = 0; i < 3; i++) {
+        // Points don't have an extent to divide into cells
+        if(grid->max[i] <= grid->min[i]) {
+            grid->max[i] = grid->min[i] + 1.0f;
+        }
+        largest = fmaxf(largest, grid->max[i] - grid->min[i]);
+    }
+
+    float cellSize = settings->cellSize * (float)(sizeSum / count);
+    if(!(cellSize > 0)) {
+        cellSize = largest;
+    }
+
+    unsigned long long denseCount = 1;
+    for(int i = 0; i < 3; i++) {
+        float resolution = ceilf((grid->max[i] - grid->min[i]) / cellSize);
+        grid->resolution[i] = (unsigned int)fminf(fmaxf(resolution, 1), (float)settings->maxResolution);
+        denseCount *= grid->resolution[i];
+    }
+
+    double budget = settings->density * (double)count;
+    if(denseCount <= budget) {
+        grid->cellCount = (unsigned int)denseCount;
+    } else {
+        unsigned int tableSize = 2;
+        while(tableSize < budget && tableSize < (1u << 30)) {
+            tableSize <<= 1;
+        }
+        grid->cellCount = tableSize;
+        grid->hashMask = tableSize - 1;
+    }
+
+    // Counted at cells[index + 1], so the prefix sum leaves every cell's start at cells[index]
+    grid->cells = calloc(grid->cellCount + 1, sizeof(unsigned int));
+    if(!grid->cells) {
+        fprintf(stderr, "Failed to allocate %u grid cells\n", grid->cellCount);
+        freeGrid(grid);
+        return 0;
+    }
+
+    unsigned long long referenceCount = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned int first[3], last[3], cell[3];
+        cellRange(grid, scene, objectPrimitive(object, i), first, last);
+        referenceCount += (unsigned long long)(last[0] - first[0] + 1) * (last[1] - first[1] + 1) * (last[2] - first[2] + 1);
+        if(referenceCount > MAX_REFERENCES) {
+            fprintf(stderr, "Grid over %u primitives needs too many cell references\n", count);
+            freeGrid(grid);
+            return 0;
+        }
+
+        for(cell[2] = first[2]; cell[2] <= last[2]; cell[2]++) {
+            for(cell[1] = first[1]; cell[1] <= last[1]; cell[1]++) {
+                for(cell[0] = first[0]; cell[0] <= last[0]; cell[0]++) {
+                    grid->cells[cellIndex(grid, cell) + 1]++;
+                }
+            }
+        }
+    }
+
+    for(unsigned int i = 0; i < grid->cellCount; i++) {
+        grid->cells[i + 1] += grid->cells[i];
+    }
+
+    grid->referenceCount = (unsigned int)referenceCount;
+    grid->references = malloc((referenceCount ? referenceCount : 1) * sizeof(unsigned int));
+    if(!grid->references) {
+        fprintf(stderr, "Failed to allocate %u grid references\n", grid->referenceCount);
+        freeGrid(grid);
+        return 0;
+    }
+
+    // Filling moves each cell's start up to the next cell's, shift them back after
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned int primitive = objectPrimitive(object, i);
+        unsigned int first[3], last[3], cell[3];
+        cellRange(grid, scene, primitive, first, last);
+
+        for(cell[2] = first[2]; cell[2] <= last[2]; cell[2]++) {
+            for(cell[1] = first[1]; cell[1] <= last[1]; cell[1]++) {
+                for(cell[0] = first[0]; cell[0] <= last[0]; cell[0]++) {
+                    grid->references[grid->cells[cellIndex(grid, cell)]++] = primitive;
+                }
+            }
+        }
+    }
+    memmove(&grid->cells[1], &grid->cells[0], grid->cellCount * sizeof(unsigned int));
+    grid->cells[0] = 0;
+
+    return grid;
+}
+
+unsigned int gridWordCount(const struct Grid* grid) {
+    return GRID_HEADER_SIZE + grid->cellCount + 1 + grid->referenceCount;
+}
+
+void writeGrid(const struct Grid* grid, unsigned int* words) {
+    memcpy(&words[0], grid->min, sizeof(grid->min));
+    words[3] = grid->hashMask;
+    memcpy(&words[4], grid->max, sizeof(grid->max));
+    words[7] = 0;
+    memcpy(&words[8], grid->resolution, sizeof(grid->resolution));
+    words[11] = grid->cellCount;
+
+    unsigned int* cells = &words[GRID_HEADER_SIZE];
+    memcpy(cells, grid->cells, (grid->cellCount + 1) * sizeof(unsigned int));
+    memcpy(&cells[grid->cellCount + 1], grid->references, grid->referenceCount * sizeof(unsigned int));
+}
+
+void freeGrid(struct Grid* grid) {
+    free(grid->cells);
+    free(grid->references);
+    free(grid);
+}
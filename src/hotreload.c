@@ -0,0 +1,297 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "hotreload.h"
+#include "shader.h"
+#include "scenefile.h"
+#include "sceneparser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#define HOT_RELOAD_PATH_SIZE 1024
+#define HOT_RELOAD_DEFINES_SIZE 256
+
+struct HotReload {
+    GLFWwindow* context; // Hidden, current on the worker
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    _Bool quit;
+
+    // Requests the worker hasn't started on yet
+    _Bool shaderRequested;
+    char shaderPath[HOT_RELOAD_PATH_SIZE];
+    char shaderDefines[HOT_RELOAD_DEFINES_SIZE];
+
+    _Bool lbvhRequested;
+    char lbvhPath[HOT_RELOAD_PATH_SIZE];
+
+    _Bool sceneRequested;
+    char scenePath[HOT_RELOAD_PATH_SIZE];
+    char cachePath[HOT_RELOAD_PATH_SIZE]; // Empty to build without the cache
+    struct BVHSettings settings;
+
+    // Results the main thread hasn't taken yet
+    GLuint program;
+    char programDefines[HOT_RELOAD_DEFINES_SIZE];
+    struct LBVH* lbvh;
+    struct Scene* scene;
+    struct TLAS* tlas;
+};
+
+static GLuint compileShader(struct HotReload* reload, char* defines) {
+    char path[HOT_RELOAD_PATH_SIZE];
+    strcpy(path, reload->shaderPath);
+    strcpy(defines, reload->shaderDefines);
+    reload->shaderRequested = 0;
+    pthread_mutex_unlock(&reload->lock);
+
+    GLuint shader = shaderCreateWithDefines(path, GL_COMPUTE_SHADER, defines);
+    GLuint program = shader ? shaderCreateProgram(1, &shader) : 0;
+    if(!program) {
+        fprintf(stderr, "Keeping the old raytracer, %s failed to build\n", path);
+    }
+
+    // Objects are only complete for other contexts once the commands creating them finished
+    glFinish();
+    pthread_mutex_lock(&reload->lock);
+    return program;
+}
+
+static struct LBVH* compileLBVH(struct HotReload* reload) {
+    char path[HOT_RELOAD_PATH_SIZE];
+    strcpy(path, reload->lbvhPath);
+    reload->lbvhRequested = 0;
+    pthread_mutex_unlock(&reload->lock);
+
+    struct LBVH* lbvh = createLBVH(path);
+    if(!lbvh) {
+        fprintf(stderr, "Keeping the old LBVH, %s failed to build\n", path);
+    }
+
+    glFinish();
+    pthread_mutex_lock(&reload->lock);
+    return lbvh;
+}
+
+static struct Scene* loadScene(struct HotReload* reload, struct TLAS** tlas) {
+    char path[HOT_RELOAD_PATH_SIZE];
+    char cachePath[HOT_RELOAD_PATH_SIZE];
+    strcpy(path, reload->scenePath);
+    strcpy(cachePath, reload->cachePath);
+    struct BVHSettings settings = reload->settings;
+    reload->sceneRequested = 0;
+    pthread_mutex_unlock(&reload->lock);
+
+    struct Scene* scene = strstr(path, ".rtscene") ? loadSceneFile(path, 0) : parseSceneFile(path, 1);
+    *tlas = scene ? buildCachedTLAS(scene, &settings, cachePath[0] ? cachePath : 0) : 0;
+    if(!*tlas) {
+        fprintf(stderr, "Keeping the old scene, %s failed to load\n", path);
+        if(scene) {
+            freeScene(scene);
+            scene = 0;
+        }
+    }
+
+    pthread_mutex_lock(&reload->lock);
+    return scene;
+}
+
+// Works through the requests one at a time. The lock is held except while building.
+static void* reloadWorker(void* argument) {
+    struct HotReload* reload = argument;
+    glfwMakeContextCurrent(reload->context);
+
+    pthread_mutex_lock(&reload->lock);
+    while(1) {
+        while(!reload->quit && !reload->shaderRequested && !reload->lbvhRequested && !reload->sceneRequested) {
+            pthread_cond_wait(&reload->wake, &reload->lock);
+        }
+        if(reload->quit) {
+            break;
+        }
+
+        if(reload->shaderRequested) {
+            char defines[HOT_RELOAD_DEFINES_SIZE];
+            GLuint program = compileShader(reload, defines);
+            if(program) {
+                if(reload->program) {
+                    glDeleteProgram(reload->program);
+                }
+                reload->program = program;
+                strcpy(reload->programDefines, defines);
+            }
+        } else if(reload->lbvhRequested) {
+            struct LBVH* lbvh = compileLBVH(reload);
+            if(lbvh) {
+                if(reload->lbvh) {
+                    freeLBVH(reload->lbvh);
+                }
+                reload->lbvh = lbvh;
+            }
+        } else {
+            struct TLAS* tlas;
+            struct Scene* scene = loadScene(reload, &tlas);
+            if(scene) {
+                if(reload->scene) {
+                    freeTLAS(reload->tlas);
+                    freeScene(reload->scene);
+                }
+                reload->scene = scene;
+                reload->tlas = tlas;
+            }
+        }
+    }
+    pthread_mutex_unlock(&reload->lock);
+
+    glfwMakeContextCurrent(0);
+    return 0;
+}
+
+struct HotReload* createHotReload(GLFWwindow* window) {
+    struct HotReload* reload = calloc(1, sizeof(struct HotReload));
+    if(!reload) {
+        return 0;
+    }
+
+    // The context hints of the main window are still set, so both contexts match
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    reload->context = glfwCreateWindow(1, 1, "", 0, window);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if(!reload->context) {
+        fprintf(stderr, "Failed to create a context for hot reloading\n");
+        free(reload);
+        return 0;
+    }
+
+    pthread_mutex_init(&reload->lock, 0);
+    pthread_cond_init(&reload->wake, 0);
+    if(pthread_create(&reload->thread, 0, reloadWorker, reload)) {
+        fprintf(stderr, "Failed to start the hot reload worker\n");
+        pthread_mutex_destroy(&reload->lock);
+        pthread_cond_destroy(&reload->wake);
+        glfwDestroyWindow(reload->context);
+        free(reload);
+        return 0;
+    }
+    return reload;
+}
+
+static _Bool copyPath(char* target, const char* path) {
+    if(strlen(path) >= HOT_RELOAD_PATH_SIZE) {
+        fprintf(stderr, "Can't reload %s, the path is too long\n", path);
+        return 0;
+    }
+    strcpy(target, path);
+    return 1;
+}
+
+void reloadShader(struct HotReload* reload, const char* path, const char* defines) {
+    if(strlen(defines) >= HOT_RELOAD_DEFINES_SIZE) {
+        fprintf(stderr, "Can't reload %s, too many defines\n", path);
+        return;
+    }
+
+    pthread_mutex_lock(&reload->lock);
+    if(copyPath(reload->shaderPath, path)) {
+        strcpy(reload->shaderDefines, defines);
+        reload->shaderRequested = 1;
+        pthread_cond_signal(&reload->wake);
+    }
+    pthread_mutex_unlock(&reload->lock);
+}
+
+void reloadLBVH(struct HotReload* reload, const char* shaderPath) {
+    pthread_mutex_lock(&reload->lock);
+    if(copyPath(reload->lbvhPath, shaderPath)) {
+        reload->lbvhRequested = 1;
+        pthread_cond_signal(&reload->wake);
+    }
+    pthread_mutex_unlock(&reload->lock);
+}
+
+void reloadScene(struct HotReload* reload, const char* path, const struct BVHSettings* settings, const char* cachePath) {
+    struct BVHSettings defaultSettings = BVH_DEFAULT_SETTINGS;
+
+    pthread_mutex_lock(&reload->lock);
+    if(copyPath(reload->scenePath, path) && copyPath(reload->cachePath, cachePath ? cachePath : "")) {
+        reload->settings = settings ? *settings : defaultSettings;
+        reload->sceneRequested = 1;
+        pthread_cond_signal(&reload->wake);
+    }
+    pthread_mutex_unlock(&reload->lock);
+}
+
+GLuint takeReloadedShader(struct HotReload* reload, const char* defines) {
+    pthread_mutex_lock(&reload->lock);
+    GLuint program = reload->program;
+    _Bool current = strcmp(reload->programDefines, defines) == 0;
+    reload->program = 0;
+    pthread_mutex_unlock(&reload->lock);
+
+    if(program && !current) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+struct LBVH* takeReloadedLBVH(struct HotReload* reload) {
+    pthread_mutex_lock(&reload->lock);
+    struct LBVH* lbvh = reload->lbvh;
+    reload->lbvh = 0;
+    pthread_mutex_unlock(&reload->lock);
+    return lbvh;
+}
+
+_Bool takeReloadedScene(struct HotReload* reload, struct Scene** scene, struct TLAS** tlas) {
+    pthread_mutex_lock(&reload->lock);
+    *scene = reload->scene;
+    *tlas = reload->tlas;
+    reload->scene = 0;
+    reload->tlas = 0;
+    pthread_mutex_unlock(&reload->lock);
+    return *scene != 0;
+}
+
+void freeHotReload(struct HotReload* reload) {
+    pthread_mutex_lock(&reload->lock);
+    reload->quit = 1;
+    pthread_cond_signal(&reload->wake);
+    pthread_mutex_unlock(&reload->lock);
+    pthread_join(reload->thread, 0);
+
+    // Objects are shared, the main context can delete what was never taken
+    if(reload->program) {
+        glDeleteProgram(reload->program);
+    }
+    if(reload->lbvh) {
+        freeLBVH(reload->lbvh);
+    }
+    if(reload->scene) {
+        freeTLAS(reload->tlas);
+        freeScene(reload->scene);
+    }
+
+    pthread_mutex_destroy(&reload->lock);
+    pthread_cond_destroy(&reload->wake);
+    glfwDestroyWindow(reload->context);
+    free(reload);
+}
@@ -0,0 +1,259 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "lbvh.h"
+#include "shader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Morton codes use 30 bits, an even number of passes leaves the result in the first buffers
+#define RADIX_BITS 4
+#define RADIX_PASSES 8
+
+static const char* stageDefines[LBVH_STAGE_COUNT] = {
+    "#define STAGE_BOUNDS\n",
+    "#define STAGE_MORTON\n",
+    "#define STAGE_HISTOGRAM\n",
+    "#define STAGE_SCAN\n",
+    "#define STAGE_SCATTER\n",
+    "#define STAGE_HIERARCHY\n",
+    "#define STAGE_REFIT\n",
+    "#define STAGE_SKIP\n"
+};
+
+static unsigned int groupCount(unsigned int invocations) {
+    unsigned int groups = (invocations + LBVH_GROUP_SIZE - 1) / LBVH_GROUP_SIZE;
+    return groups ? groups : 1;
+}
+
+static void resizeBuffer(GLuint buffer, size_t size) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, 0, GL_DYNAMIC_COPY);
+}
+
+static void resizeBuffers(struct LBVH* lbvh, unsigned int capacity) {
+    size_t count = capacity ? capacity : 1;
+    size_t nodeCount = 2 * count - 1;
+    size_t histogramSize = (size_t)(1 << RADIX_BITS) * groupCount(capacity) * sizeof(GLuint);
+
+    for(int i = 0; i < 2; i++) {
+        resizeBuffer(lbvh->keyBuffers[i], count * sizeof(GLuint));
+        resizeBuffer(lbvh->valueBuffers[i], count * sizeof(GLuint));
+    }
+    resizeBuffer(lbvh->histogramBuffer, histogramSize);
+    resizeBuffer(lbvh->nodeBuffer, nodeCount * sizeof(struct BVHNode));
+    resizeBuffer(lbvh->parentBuffer, nodeCount * sizeof(GLuint));
+    resizeBuffer(lbvh->internalSlotBuffer, count * sizeof(GLuint));
+    resizeBuffer(lbvh->leafSlotBuffer, count * sizeof(GLuint));
+    resizeBuffer(lbvh->flagBuffer, count * sizeof(GLuint));
+    resizeBuffer(lbvh->skipBuffer, nodeCount * sizeof(GLuint));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    lbvh->capacity = capacity;
+}
+
+static void dispatch(struct LBVH* lbvh, enum LBVHStage stage, unsigned int groups) {
+    glUseProgram(lbvh->programs[stage]);
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+static void setUniforms(struct LBVH* lbvh, const struct Object* object) {
+    unsigned int count = object->sphereCount + object->rectCount;
+    for(int i = 0; i < LBVH_STAGE_COUNT; i++) {
+        GLuint program = lbvh->programs[i];
+        glProgramUniform1ui(program, glGetUniformLocation(program, "ucount"), count);
+        glProgramUniform1ui(program, glGetUniformLocation(program, "usphereCount"), object->sphereCount);
+        glProgramUniform1ui(program, glGetUniformLocation(program, "ufirstSphere"), object->firstSphere);
+        glProgramUniform1ui(program, glGetUniformLocation(program, "ufirstRect"), object->firstRect);
+        glProgramUniform1ui(program, glGetUniformLocation(program, "ugroupCount"), groupCount(count));
+    }
+}
+
+struct LBVH* createLBVH(const char* shaderPath) {
+    struct LBVH* lbvh = calloc(1, sizeof(struct LBVH));
+    if(!lbvh) {
+        return 0;
+    }
+
+    for(int i = 0; i < LBVH_STAGE_COUNT; i++) {
+        char defines[128];
+        snprintf(defines, sizeof(defines), "#define GROUP_SIZE %d\n%s", LBVH_GROUP_SIZE, stageDefines[i]);
+
+        GLuint shader = shaderCreateWithDefines(shaderPath, GL_COMPUTE_SHADER, defines);
+        lbvh->programs[i] = shader ? shaderCreateProgram(1, &shader) : 0;
+        if(!lbvh->programs[i]) {
+            fprintf(stderr, "Failed to create LBVH stage %d\n", i);
+            freeLBVH(lbvh);
+            return 0;
+        }
+    }
+
+    glGenBuffers(1, &lbvh->boundsBuffer);
+    glGenBuffers(2, lbvh->keyBuffers);
+    glGenBuffers(2, lbvh->valueBuffers);
+    glGenBuffers(1, &lbvh->histogramBuffer);
+    glGenBuffers(1, &lbvh->nodeBuffer);
+    glGenBuffers(1, &lbvh->parentBuffer);
+    glGenBuffers(1, &lbvh->internalSlotBuffer);
+    glGenBuffers(1, &lbvh->leafSlotBuffer);
+    glGenBuffers(1, &lbvh->flagBuffer);
+    glGenBuffers(1, &lbvh->skipBuffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 6 * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+    resizeBuffers(lbvh, 0);
+
+    return lbvh;
+}
+
+_Bool buildLBVH(struct LBVH* lbvh, struct TLAS* tlas, const struct Scene* scene, unsigned int object) {
+    struct Object range = sceneObject(scene, object);
+    unsigned int count = range.sphereCount + range.rectCount;
+    // Spatial splits may have given the host BVH more references than the object has primitives
+    if(count > tlas->objects[object]->primitiveCount) {
+        fprintf(stderr, "Object %u grew since the TLAS was built\n", object);
+        return 0;
+    }
+
+    // Compressed objects only get room for the nodes they have
+    if(tlas->compressed[object]) {
+        fprintf(stderr, "Object %u was uploaded with compressed leaves\n", object);
+        return 0;
+    }
+
+    if(count > lbvh->capacity || lbvh->capacity == 0) {
+        resizeBuffers(lbvh, count);
+    }
+    setUniforms(lbvh, &range);
+
+    // Order preserving encodings of +inf and -inf, see FloatToOrdered in lbvh.glsl
+    static const GLuint emptyBounds[6] = {
+        0xff800000u, 0xff800000u, 0xff800000u,
+        0x007fffffu, 0x007fffffu, 0x007fffffu
+    };
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->boundsBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyBounds), emptyBounds);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lbvh->flagBuffer);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH_NODE_BINDING, lbvh->nodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_BOUNDS_BINDING, lbvh->boundsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_HISTOGRAM_BINDING, lbvh->histogramBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_PARENT_BINDING, lbvh->parentBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_INTERNAL_SLOT_BINDING, lbvh->internalSlotBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_LEAF_SLOT_BINDING, lbvh->leafSlotBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_FLAG_BINDING, lbvh->flagBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_SKIP_BINDING, lbvh->skipBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_KEYS_IN_BINDING, lbvh->keyBuffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_VALUES_IN_BINDING, lbvh->valueBuffers[0]);
+
+    unsigned int groups = groupCount(count);
+    if(count > 0) {
+        dispatch(lbvh, LBVH_STAGE_BOUNDS, groups);
+        dispatch(lbvh, LBVH_STAGE_MORTON, groups);
+    }
+
+    for(int pass = 0; pass < RADIX_PASSES && count > 1; pass++) {
+        int in = pass % 2, out = 1 - in;
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_KEYS_IN_BINDING, lbvh->keyBuffers[in]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_VALUES_IN_BINDING, lbvh->valueBuffers[in]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_KEYS_OUT_BINDING, lbvh->keyBuffers[out]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_VALUES_OUT_BINDING, lbvh->valueBuffers[out]);
+
+        GLuint shift = pass * RADIX_BITS;
+        glProgramUniform1ui(lbvh->programs[LBVH_STAGE_HISTOGRAM],
+            glGetUniformLocation(lbvh->programs[LBVH_STAGE_HISTOGRAM], "ushift"), shift);
+        glProgramUniform1ui(lbvh->programs[LBVH_STAGE_SCATTER],
+            glGetUniformLocation(lbvh->programs[LBVH_STAGE_SCATTER], "ushift"), shift);
+
+        dispatch(lbvh, LBVH_STAGE_HISTOGRAM, groups);
+        dispatch(lbvh, LBVH_STAGE_SCAN, 1);
+        dispatch(lbvh, LBVH_STAGE_SCATTER, groups);
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_KEYS_IN_BINDING, lbvh->keyBuffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LBVH_VALUES_IN_BINDING, lbvh->valueBuffers[0]);
+
+    dispatch(lbvh, LBVH_STAGE_HIERARCHY, groupCount(count > 1 ? count - 1 : 1));
+    if(count > 0) {
+        dispatch(lbvh, LBVH_STAGE_REFIT, groups);
+    }
+    if(tlas->stackless) {
+        dispatch(lbvh, LBVH_STAGE_SKIP, groupCount(count ? 2 * count - 1 : 1));
+    }
+
+    // The TLAS keeps room for the largest possible BVH of every object, copy it in place
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, lbvh->nodeBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tlas->nodeBuffer);
+    glCopyBufferSubData(
+        GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, tlas->nodeOffsets[object] * sizeof(struct BVHNode),
+        (count ? 2 * count - 1 : 1) * sizeof(struct BVHNode)
+    );
+    if(tlas->stackless) {
+        glBindBuffer(GL_COPY_READ_BUFFER, lbvh->skipBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, tlas->skipBuffer);
+        glCopyBufferSubData(
+            GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, tlas->nodeOffsets[object] * sizeof(GLuint),
+            (count ? 2 * count - 1 : 1) * sizeof(GLuint)
+        );
+    }
+    if(count) {
+        glBindBuffer(GL_COPY_READ_BUFFER, lbvh->valueBuffers[0]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, tlas->primitiveBuffer);
+        glCopyBufferSubData(
+            GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, tlas->primitiveOffsets[object] * sizeof(GLuint),
+            count * sizeof(GLuint)
+        );
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH_NODE_BINDING, tlas->nodeBuffer);
+    if(glGetError() != GL_NO_ERROR) {
+        return 0;
+    }
+
+    // The host may have uploaded the object as a wide BVH
+    if(tlas->formats[object] != BVH_BINARY) {
+        tlas->formats[object] = BVH_BINARY;
+        return uploadTLASInstances(tlas, scene);
+    }
+    return 1;
+}
+
+void freeLBVH(struct LBVH* lbvh) {
+    for(int i = 0; i < LBVH_STAGE_COUNT; i++) {
+        if(lbvh->programs[i]) {
+            glDeleteProgram(lbvh->programs[i]);
+        }
+    }
+
+    if(lbvh->boundsBuffer) {
+        GLuint buffers[] = {
+            lbvh->boundsBuffer, lbvh->keyBuffers[0], lbvh->keyBuffers[1],
+            lbvh->valueBuffers[0], lbvh->valueBuffers[1], lbvh->histogramBuffer, lbvh->nodeBuffer,
+            lbvh->parentBuffer, lbvh->internalSlotBuffer, lbvh->leafSlotBuffer, lbvh->flagBuffer,
+            lbvh->skipBuffer
+        };
+        glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+    }
+
+    free(lbvh);
+}
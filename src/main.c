@@ -1,15 +1,29 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #define GLFW_INCLUDE_NONE
 #include <glfw/glfw3.h>
 
 #include "window.h"
 #include "shader.h"
+#include "scenes.h"
+#include "scenefile.h"
+#include "sceneparser.h"
+#include "tlas.h"
+#include "lbvh.h"
+#include "bvhstats.h"
+#include "filewatch.h"
+#include "hotreload.h"
+#include "scenestream.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#define RAYTRACER_PATH "../../shaders/raytracer.glsl"
+#define LBVH_PATH "../../shaders/lbvh.glsl"
+#define BVH_CACHE_PATH "bvh.cache"
+
 struct buffers {
     GLuint vao, vbo;
 };
@@ -17,6 +31,7 @@ struct buffers {
 static GLint timeloc;
 static GLint widthloc;
 static GLint heightloc;
+static GLint frameloc;
 static int frame = 0;
 static GLuint screenTexture;
 static GLuint texture1;
@@ -24,6 +39,44 @@ static GLuint texture2;
 static GLuint texture3;
 static GLuint computeprogram;
 
+static struct Scene* scene;
+static struct TLAS* tlas;
+static struct LBVH* lbvh;
+
+// Shaders and the scene file are rebuilt in the background when they change on disk
+static struct FileWatch* fileWatch;
+static struct HotReload* hotReload;
+static int raytracerFile = -1;
+static int lbvhFile = -1;
+static int sceneFile = -1;
+static const char* scenePath;
+
+// Large .rtscene files render while the rest of them is still loading
+static struct SceneStream* sceneStream;
+
+// Where S saves the scene, the argument after the scene. Nothing is saved without it.
+static const char* savePath;
+
+// Rebuild the first object's BVH on the GPU every frame instead of using the one built at startup
+static _Bool gpuBVH = 0;
+
+// Build the raytracer with BVH_STACKLESS, traversing with skip links instead of a stack
+static _Bool stacklessBVH = 0;
+
+// Build the raytracer with TILE_CULLING, primary rays only test the leaves in their workgroup's frustum.
+// Off by default, it made whole frames slower in every scene measured so far.
+static _Bool tileCulling = 0;
+
+// Build the raytracer with DEBUG_HEATMAP, 0 renders the image, 1 the bounding boxes
+// and 2 the primitives each pixel's primary ray tested
+static int heatmap = 0;
+
+// Build the raytracer with DEBUG_OCCLUSION, drawing ambient occlusion traced with occlusion queries
+static _Bool occlusion = 0;
+
+// Once every object's leaves are compressed the sphere buffer is no longer read
+static _Bool spheresReleased = 0;
+
 static int windowWidth;
 static int windowHeight;
 
@@ -95,20 +148,134 @@ inline struct buffers createBuffers()
     return buf;
 }
 
-inline void createComputeProgram()
+// The defines raytracer.glsl is built with for the current settings
+void computeDefines(char* defines)
 {
-    GLuint computeshader = shaderCreate("../../shaders/raytracer.glsl", GL_COMPUTE_SHADER);
-    computeprogram = shaderCreateProgram(1, &computeshader);
+    defines[0] = 0;
+    if(stacklessBVH) {
+        strcat(defines, "#define BVH_STACKLESS\n");
+    }
+    if(tileCulling) {
+        strcat(defines, "#define TILE_CULLING\n");
+    }
+    if(heatmap) {
+        char define[32];
+        snprintf(define, sizeof(define), "#define DEBUG_HEATMAP %d\n", heatmap);
+        strcat(defines, define);
+    }
+    if(occlusion) {
+        strcat(defines, "#define DEBUG_OCCLUSION\n");
+    }
+}
 
+void useComputeProgram(GLuint program)
+{
+    computeprogram = program;
     timeloc = glGetUniformLocation(computeprogram, "utime");
     widthloc = glGetUniformLocation(computeprogram, "uwidth");
     heightloc = glGetUniformLocation(computeprogram, "uheight");
+    frameloc = glGetUniformLocation(computeprogram, "uframe");
 
     glUseProgram(computeprogram);
     glUniform1f(widthloc, (GLfloat)windowWidth);
     glUniform1f(heightloc, (GLfloat)windowHeight);
 }
 
+inline void createComputeProgram()
+{
+    char defines[128];
+    computeDefines(defines);
+
+    GLuint computeshader = shaderCreateWithDefines(RAYTRACER_PATH, GL_COMPUTE_SHADER, defines);
+    useComputeProgram(shaderCreateProgram(1, &computeshader));
+}
+
+// Releases or restores the sphere buffer after the TLAS was uploaded
+void updateSphereBuffer()
+{
+    _Bool needed = tlasReadsSpheres(tlas, scene);
+    if(needed && spheresReleased) {
+        spheresReleased = !uploadScene(scene);
+    } else if(!needed && !spheresReleased) {
+        spheresReleased = releaseSphereBuffer(scene);
+    }
+}
+
+// Puts a reloaded scene in place of the current one, keeping the TLAS settings
+// the keys changed. The current one stays when the reloaded one can't be uploaded.
+void swapScene(struct Scene* reloadedScene, struct TLAS* reloadedTLAS)
+{
+    reloadedTLAS->stackless = tlas->stackless;
+    reloadedTLAS->compressLeaves = tlas->compressLeaves;
+    reloadedTLAS->gridMode = tlas->gridMode;
+    reloadedTLAS->gridSettings = tlas->gridSettings;
+
+    if(uploadScene(reloadedScene) && uploadTLAS(reloadedTLAS, reloadedScene)) {
+        // The rest of the old scene is no longer needed
+        if(sceneStream) {
+            closeSceneStream(sceneStream);
+            sceneStream = 0;
+        }
+        freeTLAS(tlas);
+        freeScene(scene);
+        scene = reloadedScene;
+        tlas = reloadedTLAS;
+        printf("reloaded %s\n", scenePath);
+    } else {
+        // The buffers are bound to the reloaded scene's by now
+        fprintf(stderr, "Keeping the old scene, %s failed to upload\n", scenePath);
+        freeTLAS(reloadedTLAS);
+        freeScene(reloadedScene);
+        uploadScene(scene);
+        uploadTLAS(tlas, scene);
+    }
+
+    spheresReleased = 0;
+    updateSphereBuffer();
+    frame = 0;
+}
+
+// Starts rebuilding the files that changed on disk and swaps in what finished.
+// Frames keep rendering with the old versions until then.
+void pollHotReload(const struct BVHSettings* settings)
+{
+    int file;
+    while((file = nextChangedFile(fileWatch)) >= 0) {
+        if(file == raytracerFile) {
+            char defines[128];
+            computeDefines(defines);
+            reloadShader(hotReload, RAYTRACER_PATH, defines);
+        } else if(file == lbvhFile) {
+            reloadLBVH(hotReload, LBVH_PATH);
+        } else if(file == sceneFile) {
+            reloadScene(hotReload, scenePath, settings, BVH_CACHE_PATH);
+        }
+    }
+
+    char defines[128];
+    computeDefines(defines);
+    GLuint program = takeReloadedShader(hotReload, defines);
+    if(program) {
+        printf("reloaded %s\n", RAYTRACER_PATH);
+        glDeleteProgram(computeprogram);
+        useComputeProgram(program);
+        frame = 0;
+    }
+
+    struct LBVH* reloadedLBVH = takeReloadedLBVH(hotReload);
+    if(reloadedLBVH) {
+        printf("reloaded %s\n", LBVH_PATH);
+        freeLBVH(lbvh);
+        lbvh = reloadedLBVH;
+    }
+
+    struct Scene* reloadedScene;
+    struct TLAS* reloadedTLAS;
+    if(takeReloadedScene(hotReload, &reloadedScene, &reloadedTLAS)) {
+        swapScene(reloadedScene, reloadedTLAS);
+    }
+}
+
 void resizeCallback(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
@@ -135,9 +302,103 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
         createComputeProgram();
         frame = 0;
     }
+
+    if(key == GLFW_KEY_B && action == GLFW_PRESS) {
+        gpuBVH = !gpuBVH;
+        printf("%s BVH\n", gpuBVH ? "GPU" : "host");
+
+        // The GPU builder rebuilds in place, which needs the room of uncompressed objects
+        if(gpuBVH && tlas->compressLeaves) {
+            printf("uncompressed leaves\n");
+            tlas->compressLeaves = 0;
+            uploadTLAS(tlas, scene);
+        }
+
+        // The LBVH overwrote the host BVH in the TLAS buffers, put it back
+        if(!gpuBVH) {
+            uploadTLAS(tlas, scene);
+        }
+        updateSphereBuffer();
+    }
+
+    if(key == GLFW_KEY_T && action == GLFW_PRESS) {
+        stacklessBVH = !stacklessBVH;
+        printf("%s traversal\n", stacklessBVH ? "stackless" : "stack");
+
+        // Stackless traversal needs every object binary and the skip links uploaded
+        tlas->stackless = stacklessBVH;
+        uploadTLAS(tlas, scene);
+        updateSphereBuffer();
+
+        glDeleteProgram(computeprogram);
+        createComputeProgram();
+        frame = 0;
+    }
+
+    if(key == GLFW_KEY_F && action == GLFW_PRESS) {
+        tileCulling = !tileCulling;
+        printf("tile culling %s\n", tileCulling ? "on" : "off");
+
+        glDeleteProgram(computeprogram);
+        createComputeProgram();
+        frame = 0;
+    }
+
+    if(key == GLFW_KEY_H && action == GLFW_PRESS) {
+        static const char* heatmaps[] = { "image", "node visit heatmap", "primitive test heatmap" };
+        heatmap = (heatmap + 1) % 3;
+        printf("%s\n", heatmaps[heatmap]);
+
+        glDeleteProgram(computeprogram);
+        createComputeProgram();
+        frame = 0;
+    }
+
+    if(key == GLFW_KEY_O && action == GLFW_PRESS) {
+        occlusion = !occlusion;
+        printf("%s\n", occlusion ? "ambient occlusion" : "image");
+
+        glDeleteProgram(computeprogram);
+        createComputeProgram();
+        frame = 0;
+    }
+
+    if(key == GLFW_KEY_I && action == GLFW_PRESS) {
+        printTLASStats(stdout, tlas);
+    }
+
+    if(key == GLFW_KEY_S && action == GLFW_PRESS) {
+        if(!savePath) {
+            printf("pass a .rtscene path after the scene to save it\n");
+        } else if(saveSceneFile(savePath, scene)) {
+            printf("saved %s\n", savePath);
+        }
+    }
+
+    if(key == GLFW_KEY_G && action == GLFW_PRESS) {
+        static const char* modes[] = { "no", "automatic", "all" };
+        tlas->gridMode = (enum GridMode)((tlas->gridMode + 1) % 3);
+        printf("%s grids\n", modes[tlas->gridMode]);
+        uploadTLAS(tlas, scene);
+        updateSphereBuffer();
+        frame = 0;
+    }
+
+    if(key == GLFW_KEY_C && action == GLFW_PRESS) {
+        if(gpuBVH) {
+            printf("the GPU BVH can't be compressed\n");
+            return;
+        }
+
+        tlas->compressLeaves = !tlas->compressLeaves;
+        printf("%s leaves\n", tlas->compressLeaves ? "compressed" : "uncompressed");
+        uploadTLAS(tlas, scene);
+        updateSphereBuffer();
+        frame = 0;
+    }
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
     GLFWwindow* window = windowCreate(500, 500, "Window", true);
 
@@ -148,6 +409,55 @@ int main(void)
     glfwSwapInterval(1);
 
     createComputeProgram();
+
+    // The walls overlap everything else in the room, spatial splits cut them up.
+    // The treelet layout keeps the nodes a ray visits together in memory.
+    struct BVHSettings settings = BVH_DEFAULT_SETTINGS;
+    settings.spatialSplitBudget = 0.5f;
+    settings.layout = BVH_LAYOUT_VAN_EMDE_BOAS;
+
+    // The camera in raytracer.glsl is placed for the Cornell box, which is
+    // rendered unless a .rtscene file or scene description is given. Files with
+    // objects of their own can't be streamed and are loaded whole.
+    savePath = argc > 2 ? argv[2] : 0;
+    if(argc > 1 && strstr(argv[1], ".rtscene")) {
+        sceneStream = openSceneStream(argv[1], &settings, &scene);
+        if(sceneStream && !uploadScene(scene)) {
+            closeSceneStream(sceneStream);
+            sceneStream = 0;
+            freeScene(scene);
+            scene = 0;
+        } else if(!sceneStream) {
+            scene = loadSceneFile(argv[1], 1);
+        }
+    } else {
+        scene = argc > 1 ? parseSceneFile(argv[1], 1) : createCornellBoxScene();
+        if(scene && !uploadScene(scene)) {
+            freeScene(scene);
+            scene = 0;
+        }
+    }
+    if(!scene) {
+        fprintf(stderr, "Failed to create the scene\n");
+        glDeleteProgram(computeprogram);
+        glfwTerminate();
+        return 1;
+    }
+
+    // A cache of the first chunk would only replace the one of the whole scene
+    tlas = sceneStream ? buildTLAS(scene, &settings) : buildCachedTLAS(scene, &settings, BVH_CACHE_PATH);
+    lbvh = createLBVH(LBVH_PATH);
+    if(!tlas || !uploadTLAS(tlas, scene) || !lbvh) {
+        fprintf(stderr, "Failed to create the acceleration structure\n");
+        if(sceneStream) closeSceneStream(sceneStream);
+        if(tlas) freeTLAS(tlas);
+        if(lbvh) freeLBVH(lbvh);
+        freeScene(scene);
+        glDeleteProgram(computeprogram);
+        glfwTerminate();
+        return 1;
+    }
+
     texture1 = uploadTexture("../../textures/texture1.jpg", GL_TEXTURE1);
     if(texture1 == 0) {
         glDeleteProgram(computeprogram);
@@ -184,7 +494,18 @@ int main(void)
     screenTexture = createScreenTexture(windowWidth, windowHeight);
     struct buffers bufs = createBuffers();
 
-    GLuint frameloc = glGetUniformLocation(computeprogram, "uframe");
+    // Without them the raytracer is still rebuilt with R
+    fileWatch = createFileWatch();
+    hotReload = fileWatch ? createHotReload(window) : 0;
+    if(hotReload) {
+        raytracerFile = watchFile(fileWatch, RAYTRACER_PATH);
+        lbvhFile = watchFile(fileWatch, LBVH_PATH);
+        if(argc > 1) {
+            scenePath = argv[1];
+            sceneFile = watchFile(fileWatch, scenePath);
+        }
+    }
+
     while(!glfwWindowShouldClose(window)) {
         if(!windowInFocus) {
             glfwPollEvents();
@@ -192,11 +513,45 @@ int main(void)
             continue;
         }
 
+        if(hotReload) {
+            pollHotReload(&settings);
+        }
+
+        // Every chunk that arrived restarts the accumulation with more of the scene
+        if(sceneStream) {
+            if(updateSceneStream(sceneStream, scene, &tlas)) {
+                updateSphereBuffer();
+                frame = 0;
+            }
+            if(sceneStreamFinished(sceneStream)) {
+                printf("streamed %s\n", argv[1]);
+                closeSceneStream(sceneStream);
+                sceneStream = 0;
+            }
+        }
+
+        // Edits since the last frame go up together, and only restart the
+        // accumulation when they change what's rendered
+        if(flushSceneEdits(scene)) {
+            frame = 0;
+        }
+        if(sceneGeometryEdited(scene)) {
+            if(!updateTLASObjects(tlas, scene, &settings)) {
+                fprintf(stderr, "Failed to update the acceleration structure\n");
+            }
+            updateSphereBuffer();
+        }
+
+        if(gpuBVH) {
+            buildLBVH(lbvh, tlas, scene, 0);
+        }
+
         {
             glUseProgram(computeprogram);
             glUniform1f(timeloc, (float)glfwGetTime());
             glUniform1i(frameloc, frame);
-            glDispatchCompute((GLuint)windowWidth, (GLuint)windowHeight, 1);
+            // One workgroup per 8x8 tile, see local_size in raytracer.glsl
+            glDispatchCompute((GLuint)(windowWidth + 7) / 8, (GLuint)(windowHeight + 7) / 8, 1);
         }
 
         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
@@ -215,12 +570,26 @@ int main(void)
         frame++;
     }
 
+    if(hotReload) {
+        freeHotReload(hotReload);
+    }
+    if(sceneStream) {
+        closeSceneStream(sceneStream);
+    }
+    if(fileWatch) {
+        freeFileWatch(fileWatch);
+    }
+
     glDeleteVertexArrays(1, &bufs.vao);
     glDeleteBuffers(1, &bufs.vbo);
 
     GLuint textures[] = { screenTexture, texture1, texture2, texture3 };
     glDeleteTextures(4, textures);
 
+    freeLBVH(lbvh);
+    freeTLAS(tlas);
+    freeScene(scene);
+
     glDeleteProgram(computeprogram);
     glDeleteProgram(quadprogram);
 
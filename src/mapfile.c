@@ -0,0 +1,100 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "mapfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const unsigned char* mapFile(const char* path, size_t* size) {
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+
+    unsigned char* data = length > 0 ? malloc((size_t)length) : 0;
+    if(data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+        free(data);
+        data = 0;
+    }
+    fclose(file);
+
+    *size = data ? (size_t)length : 0;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct stat status;
+    void* data = MAP_FAILED;
+    if(fstat(fd, &status) == 0 && status.st_size > 0) {
+        data = mmap(0, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(data == MAP_FAILED) {
+        return 0;
+    }
+
+    *size = (size_t)status.st_size;
+    return data;
+#endif
+}
+
+void unmapFile(const unsigned char* data, size_t size) {
+#ifdef _WIN32
+    free((void*)data);
+#else
+    munmap((void*)data, size);
+#endif
+}
+
+#ifndef _WIN32
+// Widens the range to the pages it touches, mmap put data at the start of one
+static void adviseMapped(const unsigned char* data, size_t offset, size_t size, int advice) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t first = offset / page * page;
+    if(size) {
+        madvise((void*)(data + first), offset + size - first, advice);
+    }
+}
+#endif
+
+void prefetchMapped(const unsigned char* data, size_t offset, size_t size) {
+#ifndef _WIN32
+    adviseMapped(data, offset, size, MADV_WILLNEED);
+#endif
+}
+
+void releaseMapped(const unsigned char* data, size_t offset, size_t size) {
+#ifndef _WIN32
+    adviseMapped(data, offset, size, MADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,799 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "outofcore.h"
+#include "scenefile.h"
+#include "mapfile.h"
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+// Primitives gathered per subtree before they're written out together
+#define WRITE_BATCH 256
+
+// Batches smaller than this are traced on the calling thread alone
+#define PARALLEL_BATCH 1024
+
+#define PI 3.14159265358979f
+
+static const char outOfCoreMagic[8] = { 'r', 't', 'o', 'o', 'c', 'o', 'r', 'e' };
+
+_Static_assert(sizeof(struct OutOfCoreSubtree) == 72, "OutOfCoreSubtree must not have padding");
+_Static_assert(sizeof(struct OutOfCoreHeader) == 72, "OutOfCoreHeader must not have padding");
+
+static unsigned long long alignOffset(unsigned long long offset) {
+    return (offset + OUT_OF_CORE_ALIGNMENT - 1) / OUT_OF_CORE_ALIGNMENT * OUT_OF_CORE_ALIGNMENT;
+}
+
+// Files past 2GB need 64 bit offsets, which plain fseek doesn't take everywhere
+static _Bool seekFile(FILE* file, unsigned long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static _Bool writeAt(FILE* file, unsigned long long offset, const void* data, size_t size, size_t count) {
+    return !count || (seekFile(file, offset) && fwrite(data, size, count, file) == count);
+}
+
+static _Bool readAt(FILE* file, unsigned long long offset, void* data, size_t size, size_t count) {
+    return !count || (seekFile(file, offset) && fread(data, size, count, file) == count);
+}
+
+// Spreads the low 10 bits of x out to every third bit
+static unsigned int spreadBits(unsigned int x) {
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+struct Builder {
+    struct SceneFileView file;
+    struct Scene view; // The file's spheres and rects
+    struct OutOfCoreSettings settings;
+    FILE* out;
+
+    // The grid over the primitives' centroids, cells are numbered in Morton
+    // order so consecutive ones are next to each other
+    float origin[3], scale[3];
+    unsigned int* cellSubtrees;
+
+    unsigned int subtreeCount;
+    struct OutOfCoreSubtree* subtrees;
+};
+
+static unsigned int primitiveCell(const struct Builder* builder, unsigned int primitive) {
+    float min[3], max[3];
+    bvhPrimitiveBounds(&builder->view, primitive, min, max);
+
+    unsigned int cell[3];
+    for(int i = 0; i < 3; i++) {
+        float x = ((min[i] + max[i]) * 0.5f - builder->origin[i]) * builder->scale[i];
+        cell[i] = x > 0 ? (x < OUT_OF_CORE_GRID_SIZE - 1 ? (unsigned int)x : OUT_OF_CORE_GRID_SIZE - 1) : 0;
+    }
+    return spreadBits(cell[0]) | spreadBits(cell[1]) << 1 | spreadBits(cell[2]) << 2;
+}
+
+static unsigned int primitiveCount(const struct Builder* builder) {
+    return builder->view.sphereCount + builder->view.rectCount;
+}
+
+// Rects come after the spheres
+static unsigned int primitiveReference(const struct Builder* builder, unsigned int index) {
+    return index < builder->view.sphereCount ? index : (index - builder->view.sphereCount) | BVH_PRIMITIVE_RECT;
+}
+
+static void findGrid(struct Builder* builder) {
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for(unsigned int i = 0; i < primitiveCount(builder); i++) {
+        float primitiveMin[3], primitiveMax[3];
+        bvhPrimitiveBounds(&builder->view, primitiveReference(builder, i), primitiveMin, primitiveMax);
+        for(int j = 0; j < 3; j++) {
+            float centroid = (primitiveMin[j] + primitiveMax[j]) * 0.5f;
+            min[j] = centroid < min[j] ? centroid : min[j];
+            max[j] = centroid > max[j] ? centroid : max[j];
+        }
+    }
+
+    for(int i = 0; i < 3; i++) {
+        builder->origin[i] = min[i];
+        builder->scale[i] = max[i] > min[i] ? OUT_OF_CORE_GRID_SIZE / (max[i] - min[i]) : 0;
+    }
+}
+
+// Cuts the cells in Morton order into runs of about subtreeSize primitives
+static _Bool planSubtrees(struct Builder* builder) {
+    unsigned int cellCount = OUT_OF_CORE_GRID_SIZE * OUT_OF_CORE_GRID_SIZE * OUT_OF_CORE_GRID_SIZE;
+    unsigned int* sphereCounts = calloc(cellCount, sizeof(unsigned int));
+    unsigned int* rectCounts = calloc(cellCount, sizeof(unsigned int));
+    builder->cellSubtrees = calloc(cellCount, sizeof(unsigned int));
+    if(!sphereCounts || !rectCounts || !builder->cellSubtrees) {
+        free(sphereCounts);
+        free(rectCounts);
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < primitiveCount(builder); i++) {
+        unsigned int cell = primitiveCell(builder, primitiveReference(builder, i));
+        if(i < builder->view.sphereCount) {
+            sphereCounts[cell]++;
+        } else {
+            rectCounts[cell]++;
+        }
+    }
+
+    // Counted first so the subtrees are allocated once
+    for(int pass = 0; pass < 2; pass++) {
+        unsigned int subtree = 0;
+        unsigned long long size = 0;
+        for(unsigned int i = 0; i < cellCount; i++) {
+            unsigned long long cellSize = (unsigned long long)sphereCounts[i] + rectCounts[i];
+            if(!cellSize) {
+                continue;
+            }
+            if(size && size + cellSize > builder->settings.subtreeSize) {
+                subtree++;
+                size = 0;
+            }
+            size += cellSize;
+
+            if(pass == 1) {
+                builder->cellSubtrees[i] = subtree;
+                builder->subtrees[subtree].sphereCount += sphereCounts[i];
+                builder->subtrees[subtree].rectCount += rectCounts[i];
+            }
+        }
+
+        if(pass == 0) {
+            builder->subtreeCount = size ? subtree + 1 : 0;
+            builder->subtrees = calloc(builder->subtreeCount ? builder->subtreeCount : 1, sizeof(struct OutOfCoreSubtree));
+            if(!builder->subtrees) {
+                free(sphereCounts);
+                free(rectCounts);
+                return 0;
+            }
+        }
+    }
+    free(sphereCounts);
+    free(rectCounts);
+    return 1;
+}
+
+// Copies every primitive to its subtree's section. They're gathered per subtree
+// first, so the writes are batches rather than single primitives all over the file.
+static _Bool writePrimitives(struct Builder* builder) {
+    unsigned int count = builder->subtreeCount;
+    struct Sphere* spheres = malloc((size_t)count * WRITE_BATCH * sizeof(struct Sphere));
+    struct Rect* rects = malloc((size_t)count * WRITE_BATCH * sizeof(struct Rect));
+    unsigned int* gathered = calloc(2 * (size_t)count, sizeof(unsigned int));
+    unsigned int* written = calloc(2 * (size_t)count, sizeof(unsigned int));
+    _Bool ok = spheres && rects && gathered && written;
+
+    for(unsigned int i = 0; ok && i < primitiveCount(builder); i++) {
+        unsigned int reference = primitiveReference(builder, i);
+        unsigned int subtree = builder->cellSubtrees[primitiveCell(builder, reference)];
+        const struct OutOfCoreSubtree* s = &builder->subtrees[subtree];
+        unsigned int index = reference & BVH_PRIMITIVE_INDEX;
+
+        if(!(reference & BVH_PRIMITIVE_RECT)) {
+            spheres[(size_t)subtree * WRITE_BATCH + gathered[subtree]++] = builder->view.spheres[index];
+            if(gathered[subtree] == WRITE_BATCH) {
+                ok = writeAt(builder->out, s->sphereOffset + (unsigned long long)written[subtree] * sizeof(struct Sphere),
+                    &spheres[(size_t)subtree * WRITE_BATCH], sizeof(struct Sphere), WRITE_BATCH);
+                written[subtree] += WRITE_BATCH;
+                gathered[subtree] = 0;
+            }
+        } else {
+            rects[(size_t)subtree * WRITE_BATCH + gathered[count + subtree]++] = builder->view.rects[index];
+            if(gathered[count + subtree] == WRITE_BATCH) {
+                ok = writeAt(builder->out, s->rectOffset + (unsigned long long)written[count + subtree] * sizeof(struct Rect),
+                    &rects[(size_t)subtree * WRITE_BATCH], sizeof(struct Rect), WRITE_BATCH);
+                written[count + subtree] += WRITE_BATCH;
+                gathered[count + subtree] = 0;
+            }
+        }
+    }
+
+    for(unsigned int i = 0; ok && i < count; i++) {
+        const struct OutOfCoreSubtree* s = &builder->subtrees[i];
+        ok = writeAt(builder->out, s->sphereOffset + (unsigned long long)written[i] * sizeof(struct Sphere),
+                &spheres[(size_t)i * WRITE_BATCH], sizeof(struct Sphere), gathered[i]) &&
+            writeAt(builder->out, s->rectOffset + (unsigned long long)written[count + i] * sizeof(struct Rect),
+                &rects[(size_t)i * WRITE_BATCH], sizeof(struct Rect), gathered[count + i]);
+    }
+
+    free(spheres);
+    free(rects);
+    free(gathered);
+    free(written);
+    return ok;
+}
+
+// Reads every subtree's primitives back into one scene at a time and writes its
+// BVH from offset on. Returns where the file continues, or 0 on failure.
+static unsigned long long writeSubtreeBVHs(struct Builder* builder, unsigned long long offset) {
+    struct Scene* scene = createScene();
+    if(!scene) {
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < builder->subtreeCount; i++) {
+        struct OutOfCoreSubtree* subtree = &builder->subtrees[i];
+        scene->sphereCount = 0;
+        scene->rectCount = 0;
+        if((subtree->sphereCount && !addSpheres(scene, subtree->sphereCount)) ||
+           (subtree->rectCount && !addRects(scene, subtree->rectCount)) ||
+           !readAt(builder->out, subtree->sphereOffset, scene->spheres, sizeof(struct Sphere), subtree->sphereCount) ||
+           !readAt(builder->out, subtree->rectOffset, scene->rects, sizeof(struct Rect), subtree->rectCount)) {
+            freeScene(scene);
+            return 0;
+        }
+
+        struct BVH* bvh = buildBVH(scene, &builder->settings.bvh);
+        if(!bvh) {
+            freeScene(scene);
+            return 0;
+        }
+
+        for(int j = 0; j < 3; j++) {
+            subtree->min[j] = bvh->nodes[0].min[j];
+            subtree->max[j] = bvh->nodes[0].max[j];
+        }
+        subtree->nodeOffset = offset;
+        subtree->nodeCount = bvh->nodeCount;
+        subtree->primitiveOffset = alignOffset(offset + (unsigned long long)bvh->nodeCount * sizeof(struct BVHNode));
+        subtree->primitiveCount = bvh->primitiveCount;
+        offset = alignOffset(subtree->primitiveOffset + (unsigned long long)bvh->primitiveCount * sizeof(unsigned int));
+
+        _Bool written = writeAt(builder->out, subtree->nodeOffset, bvh->nodes, sizeof(struct BVHNode), bvh->nodeCount) &&
+            writeAt(builder->out, subtree->primitiveOffset, bvh->primitives, sizeof(unsigned int), bvh->primitiveCount);
+        freeBVH(bvh);
+        if(!written) {
+            freeScene(scene);
+            return 0;
+        }
+    }
+
+    freeScene(scene);
+    return offset;
+}
+
+static _Bool writeTopLevel(struct Builder* builder, struct OutOfCoreHeader* header, unsigned long long offset) {
+    float* bounds = malloc((builder->subtreeCount ? builder->subtreeCount : 1) * 6 * sizeof(float));
+    if(!bounds) {
+        return 0;
+    }
+    for(unsigned int i = 0; i < builder->subtreeCount; i++) {
+        memcpy(&bounds[6 * i], builder->subtrees[i].min, 3 * sizeof(float));
+        memcpy(&bounds[6 * i + 3], builder->subtrees[i].max, 3 * sizeof(float));
+    }
+
+    // Every subtree gets a leaf of its own, so rays only queue where they enter
+    struct BVHSettings settings = builder->settings.bvh;
+    settings.spatialSplitBudget = 0;
+    settings.minLeafSize = 1;
+    settings.maxLeafSize = 1;
+    struct BVH* topLevel = builder->subtreeCount ? buildBVHFromBounds(bounds, builder->subtreeCount, &settings) : 0;
+    free(bounds);
+    if(builder->subtreeCount && !topLevel) {
+        return 0;
+    }
+
+    header->topNodeOffset = offset;
+    header->topNodeCount = topLevel ? topLevel->nodeCount : 0;
+    header->topPrimitiveOffset = alignOffset(offset + (unsigned long long)header->topNodeCount * sizeof(struct BVHNode));
+    header->topPrimitiveCount = topLevel ? topLevel->primitiveCount : 0;
+
+    _Bool ok = !topLevel || (
+        writeAt(builder->out, header->topNodeOffset, topLevel->nodes, sizeof(struct BVHNode), topLevel->nodeCount) &&
+        writeAt(builder->out, header->topPrimitiveOffset, topLevel->primitives, sizeof(unsigned int), topLevel->primitiveCount)
+    );
+    if(topLevel) {
+        freeBVH(topLevel);
+    }
+    return ok;
+}
+
+_Bool buildOutOfCoreFile(const char* scenePath, const char* path, const struct OutOfCoreSettings* settings) {
+    struct Builder builder;
+    memset(&builder, 0, sizeof(builder));
+    struct BVHSettings defaultBVH = BVH_DEFAULT_SETTINGS;
+    builder.settings.bvh = defaultBVH;
+    if(settings) {
+        builder.settings = *settings;
+    }
+    if(!builder.settings.subtreeSize) {
+        builder.settings.subtreeSize = OUT_OF_CORE_SUBTREE_SIZE;
+    }
+
+    if(!openSceneFile(scenePath, &builder.file)) {
+        return 0;
+    }
+    const unsigned int* counts = builder.file.counts;
+    if(counts[SCENE_SECTION_OBJECTS]) {
+        fprintf(stderr, "%s has objects, only scenes without them can be traced out of core\n", scenePath);
+        closeSceneFile(&builder.file);
+        return 0;
+    }
+    builder.view.sphereCount = counts[SCENE_SECTION_SPHERES];
+    builder.view.spheres = (struct Sphere*)builder.file.sections[SCENE_SECTION_SPHERES];
+    builder.view.rectCount = counts[SCENE_SECTION_RECTS];
+    builder.view.rects = (struct Rect*)builder.file.sections[SCENE_SECTION_RECTS];
+
+    builder.out = fopen(path, "w+b");
+    if(!builder.out) {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        closeSceneFile(&builder.file);
+        return 0;
+    }
+
+    struct OutOfCoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, outOfCoreMagic, sizeof(outOfCoreMagic));
+    header.version = OUT_OF_CORE_VERSION;
+    header.textureCount = counts[SCENE_SECTION_TEXTURES];
+    header.materialCount = counts[SCENE_SECTION_MATERIALS];
+    header.textureOffset = alignOffset(sizeof(header));
+    header.materialOffset = alignOffset(header.textureOffset + header.textureCount * sizeof(struct Texture));
+    header.subtreeOffset = alignOffset(header.materialOffset + header.materialCount * sizeof(struct Material));
+
+    findGrid(&builder);
+    _Bool ok = planSubtrees(&builder);
+    unsigned long long offset = 0;
+    if(ok) {
+        // The subtree table goes before the primitives, its size is only known now
+        header.subtreeCount = builder.subtreeCount;
+        offset = alignOffset(header.subtreeOffset + builder.subtreeCount * sizeof(struct OutOfCoreSubtree));
+        for(unsigned int i = 0; i < builder.subtreeCount; i++) {
+            struct OutOfCoreSubtree* subtree = &builder.subtrees[i];
+            subtree->sphereOffset = offset;
+            offset = alignOffset(offset + (unsigned long long)subtree->sphereCount * sizeof(struct Sphere));
+            subtree->rectOffset = offset;
+            offset = alignOffset(offset + (unsigned long long)subtree->rectCount * sizeof(struct Rect));
+        }
+
+        ok = writeAt(builder.out, header.textureOffset, builder.file.sections[SCENE_SECTION_TEXTURES],
+                sizeof(struct Texture), header.textureCount) &&
+            writeAt(builder.out, header.materialOffset, builder.file.sections[SCENE_SECTION_MATERIALS],
+                sizeof(struct Material), header.materialCount) &&
+            writePrimitives(&builder);
+    }
+
+    // The scene file isn't read past this point
+    closeSceneFile(&builder.file);
+
+    ok = ok && (offset = writeSubtreeBVHs(&builder, offset)) != 0 && writeTopLevel(&builder, &header, offset) &&
+        writeAt(builder.out, header.subtreeOffset, builder.subtrees, sizeof(struct OutOfCoreSubtree), builder.subtreeCount) &&
+        writeAt(builder.out, 0, &header, sizeof(header), 1);
+
+    if(fclose(builder.out) != 0) {
+        ok = 0;
+    }
+    if(!ok) {
+        fprintf(stderr, "Failed to build %s out of core from %s\n", path, scenePath);
+        remove(path);
+    }
+    free(builder.cellSubtrees);
+    free(builder.subtrees);
+    return ok;
+}
+
+static size_t subtreeSize(const struct OutOfCoreSubtree* subtree) {
+    return subtree->sphereCount * sizeof(struct Sphere) + subtree->rectCount * sizeof(struct Rect) +
+        subtree->nodeCount * sizeof(struct BVHNode) + subtree->primitiveCount * sizeof(unsigned int);
+}
+
+static _Bool inFile(const struct OutOfCoreScene* scene, unsigned long long offset, unsigned long long count, size_t size) {
+    return offset <= scene->size && count * size <= scene->size - offset;
+}
+
+struct OutOfCoreScene* openOutOfCoreScene(const char* path, size_t residentLimit, unsigned int threadCount) {
+    struct OutOfCoreScene* scene = calloc(1, sizeof(struct OutOfCoreScene));
+    if(!scene) {
+        return 0;
+    }
+
+    scene->data = mapFile(path, &scene->size);
+    if(!scene->data) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        free(scene);
+        return 0;
+    }
+
+    struct OutOfCoreHeader* header = &scene->header;
+    _Bool valid = scene->size >= sizeof(*header);
+    if(valid) {
+        memcpy(header, scene->data, sizeof(*header));
+        valid = !memcmp(header->magic, outOfCoreMagic, sizeof(outOfCoreMagic)) && header->version == OUT_OF_CORE_VERSION &&
+            inFile(scene, header->subtreeOffset, header->subtreeCount, sizeof(struct OutOfCoreSubtree)) &&
+            inFile(scene, header->textureOffset, header->textureCount, sizeof(struct Texture)) &&
+            inFile(scene, header->materialOffset, header->materialCount, sizeof(struct Material)) &&
+            inFile(scene, header->topNodeOffset, header->topNodeCount, sizeof(struct BVHNode)) &&
+            inFile(scene, header->topPrimitiveOffset, header->topPrimitiveCount, sizeof(unsigned int)) &&
+            (header->topNodeCount != 0) == (header->subtreeCount != 0);
+    }
+
+    // Only the table is checked here, the subtrees are checked when first used
+    scene->subtrees = valid ? (const struct OutOfCoreSubtree*)(scene->data + header->subtreeOffset) : 0;
+    for(unsigned int i = 0; valid && i < header->subtreeCount; i++) {
+        const struct OutOfCoreSubtree* subtree = &scene->subtrees[i];
+        valid = inFile(scene, subtree->sphereOffset, subtree->sphereCount, sizeof(struct Sphere)) &&
+            inFile(scene, subtree->rectOffset, subtree->rectCount, sizeof(struct Rect)) &&
+            inFile(scene, subtree->nodeOffset, subtree->nodeCount, sizeof(struct BVHNode)) &&
+            inFile(scene, subtree->primitiveOffset, subtree->primitiveCount, sizeof(unsigned int)) &&
+            subtree->nodeCount != 0;
+    }
+    if(valid) {
+        scene->topLevel.nodeCount = header->topNodeCount;
+        scene->topLevel.nodes = (struct BVHNode*)(scene->data + header->topNodeOffset);
+        scene->topLevel.primitiveCount = header->topPrimitiveCount;
+        scene->topLevel.primitives = (unsigned int*)(scene->data + header->topPrimitiveOffset);
+
+        // The top level's references are subtree indices, never rects
+        struct Object subtrees = { .sphereCount = header->subtreeCount };
+        valid = !header->subtreeCount || validBVH(&scene->topLevel, &subtrees);
+    }
+    if(!valid) {
+        fprintf(stderr, "%s is not a valid version %d out of core scene\n", path, OUT_OF_CORE_VERSION);
+        closeOutOfCoreScene(scene);
+        return 0;
+    }
+
+    scene->textures = (const struct Texture*)(scene->data + header->textureOffset);
+    scene->materials = (const struct Material*)(scene->data + header->materialOffset);
+
+    if(threadCount == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = processors > 0 ? (unsigned int)processors : 1;
+    }
+    scene->threadCount = threadCount;
+    scene->residentLimit = residentLimit;
+    scene->lastUse = calloc(header->subtreeCount ? header->subtreeCount : 1, sizeof(unsigned long long));
+    scene->checked = calloc(header->subtreeCount ? header->subtreeCount : 1, sizeof(_Bool));
+    if(!scene->lastUse || !scene->checked) {
+        fprintf(stderr, "Failed to allocate %s\n", path);
+        closeOutOfCoreScene(scene);
+        return 0;
+    }
+    return scene;
+}
+
+static void releaseSubtree(struct OutOfCoreScene* scene, unsigned int index) {
+    const struct OutOfCoreSubtree* subtree = &scene->subtrees[index];
+    releaseMapped(scene->data, subtree->sphereOffset, subtree->sphereCount * sizeof(struct Sphere));
+    releaseMapped(scene->data, subtree->rectOffset, subtree->rectCount * sizeof(struct Rect));
+    releaseMapped(scene->data, subtree->nodeOffset, subtree->nodeCount * sizeof(struct BVHNode));
+    releaseMapped(scene->data, subtree->primitiveOffset, subtree->primitiveCount * sizeof(unsigned int));
+    scene->residentSize -= subtreeSize(subtree);
+    scene->lastUse[index] = 0;
+}
+
+// The subtree's BVH, pointing into the mapped file
+static struct BVH subtreeBVH(const struct OutOfCoreScene* scene, const struct OutOfCoreSubtree* subtree) {
+    struct BVH bvh;
+    memset(&bvh, 0, sizeof(bvh));
+    bvh.nodeCount = subtree->nodeCount;
+    bvh.nodes = (struct BVHNode*)(scene->data + subtree->nodeOffset);
+    bvh.primitiveCount = subtree->primitiveCount;
+    bvh.primitives = (unsigned int*)(scene->data + subtree->primitiveOffset);
+    return bvh;
+}
+
+// Reads the subtree ahead of its batch, and releases the least recently used
+// others until the resident ones fit the limit again. Returns 0 with a message
+// when the subtree turns out to be damaged the first time it's used.
+static _Bool useSubtree(struct OutOfCoreScene* scene, unsigned int index) {
+    const struct OutOfCoreSubtree* subtree = &scene->subtrees[index];
+    if(!scene->checked[index]) {
+        struct BVH bvh = subtreeBVH(scene, subtree);
+        struct Object primitives = { .sphereCount = subtree->sphereCount, .rectCount = subtree->rectCount };
+        if(!validBVH(&bvh, &primitives)) {
+            fprintf(stderr, "Damaged or unreadable subtree %u in out of core scene\n", index);
+            return 0;
+        }
+        scene->checked[index] = 1;
+    }
+
+    if(!scene->lastUse[index]) {
+        prefetchMapped(scene->data, subtree->sphereOffset, subtree->sphereCount * sizeof(struct Sphere));
+        prefetchMapped(scene->data, subtree->rectOffset, subtree->rectCount * sizeof(struct Rect));
+        prefetchMapped(scene->data, subtree->nodeOffset, subtree->nodeCount * sizeof(struct BVHNode));
+        prefetchMapped(scene->data, subtree->primitiveOffset, subtree->primitiveCount * sizeof(unsigned int));
+        scene->residentSize += subtreeSize(subtree);
+    }
+    scene->lastUse[index] = ++scene->useCount;
+
+    while(scene->residentSize > scene->residentLimit) {
+        unsigned int oldest = index;
+        for(unsigned int i = 0; i < scene->header.subtreeCount; i++) {
+            if(scene->lastUse[i] && scene->lastUse[i] < scene->lastUse[oldest]) {
+                oldest = i;
+            }
+        }
+        if(oldest == index) {
+            break;
+        }
+        releaseSubtree(scene, oldest);
+    }
+    return 1;
+}
+
+// Distances where the ray enters and leaves the box, 0 when it starts inside.
+// Returns 0 when it misses the box before tmax.
+static _Bool boxDistances(const float* min, const float* max, const struct OutOfCoreRay* ray, const float* invDir,
+    float tmax, float* enter, float* exit) {
+    float near = 0, far = tmax;
+    for(int i = 0; i < 3; i++) {
+        float t0 = (min[i] - ray->origin[i]) * invDir[i];
+        float t1 = (max[i] - ray->origin[i]) * invDir[i];
+        if(invDir[i] < 0) {
+            float t = t0; t0 = t1; t1 = t;
+        }
+        near = t0 > near ? t0 : near;
+        far = t1 < far ? t1 : far;
+    }
+    *enter = near;
+    *exit = far;
+    return near <= far;
+}
+
+// The subtree the ray enters next, ordered by distance and then index, after the
+// one at (entry, current) and before the closest hit. Returns UINT_MAX when the
+// ray is done.
+static unsigned int nextSubtree(const struct OutOfCoreScene* scene, const struct OutOfCoreRay* ray, float closest,
+    float* entry, unsigned int current) {
+    float invDir[3] = { 1.0f / ray->direction[0], 1.0f / ray->direction[1], 1.0f / ray->direction[2] };
+    const struct BVH* topLevel = &scene->topLevel;
+    float after = *entry, best = closest;
+    unsigned int next = UINT_MAX;
+
+    // The top level was checked to be at most BVH_MAX_DEPTH levels deep, every
+    // level below the root adds one entry at most
+    unsigned int stack[BVH_MAX_DEPTH + 1];
+    unsigned int stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize) {
+        const struct BVHNode* node = &topLevel->nodes[stack[--stackSize]];
+
+        // Subtrees inside a node left before the current entry were entered before it
+        float enter, exit;
+        if(!boxDistances(node->min, node->max, ray, invDir, best, &enter, &exit) || exit < after) {
+            continue;
+        }
+
+        if(node->count) {
+            for(unsigned int i = node->leftFirst; i < node->leftFirst + node->count; i++) {
+                unsigned int index = topLevel->primitives[i];
+                const struct OutOfCoreSubtree* subtree = &scene->subtrees[index];
+                if(!boxDistances(subtree->min, subtree->max, ray, invDir, best, &enter, &exit)) {
+                    continue;
+                }
+
+                _Bool later = enter > after || (enter == after && (current == UINT_MAX || index > current));
+                _Bool sooner = enter < best || (enter == best && index < next);
+                if(later && sooner) {
+                    best = enter;
+                    next = index;
+                }
+            }
+        } else {
+            stack[stackSize++] = node->leftFirst;
+            stack[stackSize++] = node->leftFirst + 1;
+        }
+    }
+
+    *entry = best;
+    return next;
+}
+
+// Closest hit in one resident subtree, closer than what the ray hit so far
+static void traceSubtree(const struct OutOfCoreScene* scene, unsigned int index, const struct OutOfCoreRay* ray,
+    struct OutOfCoreHit* hit) {
+    const struct OutOfCoreSubtree* subtree = &scene->subtrees[index];
+    struct Scene view;
+    memset(&view, 0, sizeof(view));
+    view.sphereCount = subtree->sphereCount;
+    view.spheres = (struct Sphere*)(scene->data + subtree->sphereOffset);
+    view.rectCount = subtree->rectCount;
+    view.rects = (struct Rect*)(scene->data + subtree->rectOffset);
+
+    struct BVH bvh = subtreeBVH(scene, subtree);
+    unsigned int primitive;
+    float t = traceBVH(&bvh, &view, ray->origin, ray->direction, hit->t, 0, &primitive);
+    if(t >= hit->t) {
+        return;
+    }
+
+    // The same normals and texture coordinates as HitSphere and HitRect in raytracer.glsl
+    float position[3];
+    for(int i = 0; i < 3; i++) {
+        position[i] = ray->origin[i] + t * ray->direction[i];
+    }
+    hit->t = t;
+
+    unsigned int primitiveIndex = primitive & BVH_PRIMITIVE_INDEX;
+    if(!(primitive & BVH_PRIMITIVE_RECT)) {
+        const struct Sphere* sphere = &view.spheres[primitiveIndex];
+        for(int i = 0; i < 3; i++) {
+            hit->normal[i] = (position[i] - sphere->center[i]) / sphere->radius;
+        }
+        hit->u = 0.5f - atan2f(-hit->normal[2], hit->normal[0]) / (2 * PI);
+        hit->v = 0.5f - asinf(fmaxf(-1, fminf(1, -hit->normal[1]))) / PI;
+        hit->material = sphere->material;
+        return;
+    }
+
+    const struct Rect* rect = &view.rects[primitiveIndex];
+    int a = rect->plane == YZ ? 1 : 0, b = rect->plane == XY ? 1 : 2, k = 3 - a - b;
+    hit->normal[0] = hit->normal[1] = hit->normal[2] = 0;
+    hit->normal[k] = 1;
+    hit->u = (position[a] - rect->x0) / (rect->x1 - rect->x0);
+    hit->v = (position[b] - rect->y0) / (rect->y1 - rect->y0);
+    hit->material = rect->material;
+}
+
+struct TraceBatch {
+    const struct OutOfCoreScene* scene;
+    unsigned int subtree;
+    const struct OutOfCoreRay* rays;
+    struct OutOfCoreHit* hits;
+    const unsigned int* batch;
+    unsigned int first, end;
+
+    // Per ray, where it goes next
+    unsigned int* subtrees;
+    float* entries;
+};
+
+static void* traceBatch(void* argument) {
+    const struct TraceBatch* task = argument;
+    for(unsigned int i = task->first; i < task->end; i++) {
+        unsigned int ray = task->batch[i];
+        traceSubtree(task->scene, task->subtree, &task->rays[ray], &task->hits[ray]);
+        task->subtrees[ray] = nextSubtree(task->scene, &task->rays[ray], task->hits[ray].t, &task->entries[ray], task->subtree);
+    }
+    return 0;
+}
+
+// Traces the batch split between the threads, the calling thread takes the first slice
+static void traceBatchParallel(struct OutOfCoreScene* scene, struct TraceBatch* task, unsigned int count) {
+    unsigned int threadCount = count < PARALLEL_BATCH ? 1 : scene->threadCount;
+    struct TraceBatch tasks[64];
+    pthread_t threads[64];
+    threadCount = threadCount < 64 ? threadCount : 64;
+
+    unsigned int started = 0;
+    for(unsigned int i = 0; i < threadCount; i++) {
+        tasks[i] = *task;
+        tasks[i].first = (unsigned int)((unsigned long long)count * i / threadCount);
+        tasks[i].end = (unsigned int)((unsigned long long)count * (i + 1) / threadCount);
+    }
+    while(started + 1 < threadCount && pthread_create(&threads[started + 1], 0, traceBatch, &tasks[started + 1]) == 0) {
+        started++;
+    }
+
+    // Slices whose thread failed to start are traced here after the first one
+    for(unsigned int i = 0; i < threadCount; i++) {
+        if(i == 0 || i > started) {
+            traceBatch(&tasks[i]);
+        }
+    }
+    for(unsigned int i = 1; i <= started; i++) {
+        pthread_join(threads[i], 0);
+    }
+}
+
+_Bool traceOutOfCore(struct OutOfCoreScene* scene, const struct OutOfCoreRay* rays, unsigned int count, struct OutOfCoreHit* hits) {
+    unsigned int subtreeCount = scene->header.subtreeCount;
+    for(unsigned int i = 0; i < count; i++) {
+        hits[i].t = rays[i].tmax;
+    }
+    if(!subtreeCount || !count) {
+        return 1;
+    }
+
+    // Every subtree's queue is a list linked through queued, the batch taken from
+    // it is copied out so the rays can be queued again while it's traced
+    unsigned int* heads = malloc(subtreeCount * sizeof(unsigned int));
+    unsigned int* sizes = calloc(subtreeCount, sizeof(unsigned int));
+    unsigned int* queued = malloc(count * sizeof(unsigned int));
+    unsigned int* batch = malloc(count * sizeof(unsigned int));
+    unsigned int* subtrees = malloc(count * sizeof(unsigned int));
+    float* entries = malloc(count * sizeof(float));
+    if(!heads || !sizes || !queued || !batch || !subtrees || !entries) {
+        fprintf(stderr, "Failed to allocate queues for %u rays\n", count);
+        free(heads);
+        free(sizes);
+        free(queued);
+        free(batch);
+        free(subtrees);
+        free(entries);
+        return 0;
+    }
+    memset(heads, 0xff, subtreeCount * sizeof(unsigned int));
+    _Bool ok = 1;
+
+    for(unsigned int i = 0; i < count; i++) {
+        entries[i] = 0;
+        subtrees[i] = nextSubtree(scene, &rays[i], hits[i].t, &entries[i], UINT_MAX);
+        if(subtrees[i] != UINT_MAX) {
+            queued[i] = heads[subtrees[i]];
+            heads[subtrees[i]] = i;
+            sizes[subtrees[i]]++;
+        }
+    }
+
+    while(1) {
+        unsigned int fullest = 0;
+        for(unsigned int i = 1; i < subtreeCount; i++) {
+            fullest = sizes[i] > sizes[fullest] ? i : fullest;
+        }
+        if(!sizes[fullest]) {
+            break;
+        }
+
+        unsigned int batchSize = 0;
+        for(unsigned int ray = heads[fullest]; ray != UINT_MAX; ray = queued[ray]) {
+            batch[batchSize++] = ray;
+        }
+        heads[fullest] = UINT_MAX;
+        sizes[fullest] = 0;
+
+        if(!useSubtree(scene, fullest)) {
+            ok = 0;
+            break;
+        }
+        struct TraceBatch task = { scene, fullest, rays, hits, batch, 0, batchSize, subtrees, entries };
+        traceBatchParallel(scene, &task, batchSize);
+
+        for(unsigned int i = 0; i < batchSize; i++) {
+            unsigned int ray = batch[i];
+            if(subtrees[ray] != UINT_MAX) {
+                queued[ray] = heads[subtrees[ray]];
+                heads[subtrees[ray]] = ray;
+                sizes[subtrees[ray]]++;
+            }
+        }
+    }
+
+    free(heads);
+    free(sizes);
+    free(queued);
+    free(batch);
+    free(subtrees);
+    free(entries);
+    return ok;
+}
+
+void closeOutOfCoreScene(struct OutOfCoreScene* scene) {
+    if(scene->data) {
+        unmapFile(scene->data, scene->size);
+    }
+    free(scene->lastUse);
+    free(scene->checked);
+    free(scene);
+}
@@ -16,17 +16,756 @@
 
 #include "scene.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <glad/glad.h>
+
+// Capacity an empty array grows to when its first elements are added
+#define SCENE_INITIAL_CAPACITY 16
+
+// std140 layout of SceneCounts
+struct GPUCounts {
+    unsigned int textureCount;
+    unsigned int materialCount;
+    unsigned int sphereCount;
+    unsigned int rectCount;
+};
+
+_Static_assert(sizeof(struct GPUCounts) == 16, "GPUCounts must match the std140 layout of SceneCounts");
+
+static const size_t elementSizes[SCENE_ARRAY_COUNT] = {
+    sizeof(struct Texture),
+    sizeof(struct Material),
+    sizeof(struct Rect),
+    sizeof(struct Sphere),
+    sizeof(struct Object),
+    sizeof(struct Instance)
+};
+
+static const GLuint bindings[] = {
+    SCENE_TEXTURE_BINDING,
+    SCENE_MATERIAL_BINDING,
+    SCENE_RECT_BINDING,
+    SCENE_SPHERE_BINDING
+};
+
+static unsigned int* arrayCount(struct Scene* scene, enum SceneArray array) {
+    switch(array) {
+        case SCENE_TEXTURES: return &scene->textureCount;
+        case SCENE_MATERIALS: return &scene->materialCount;
+        case SCENE_RECTS: return &scene->rectCount;
+        case SCENE_SPHERES: return &scene->sphereCount;
+        case SCENE_OBJECTS: return &scene->objectCount;
+        default: return &scene->instanceCount;
+    }
+}
+
+static size_t alignArray(size_t offset) {
+    return (offset + SCENE_ARENA_ALIGNMENT - 1) / SCENE_ARENA_ALIGNMENT * SCENE_ARENA_ALIGNMENT;
+}
+
+// Offsets of every array and, past the last one, the size of the arena
+static void layoutArrays(const unsigned int* capacities, size_t* offsets) {
+    offsets[0] = 0;
+    for(int i = 0; i < SCENE_ARRAY_COUNT; i++) {
+        offsets[i + 1] = alignArray(offsets[i] + capacities[i] * elementSizes[i]);
+    }
+}
+
+size_t sceneArrayOffset(const struct Scene* scene, enum SceneArray array) {
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->capacities, offsets);
+    return offsets[array];
+}
+
+static void pointArrays(struct Scene* scene) {
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->capacities, offsets);
+
+    unsigned char* arena = scene->arena;
+    scene->textures = arena ? (struct Texture*)(arena + offsets[SCENE_TEXTURES]) : 0;
+    scene->materials = arena ? (struct Material*)(arena + offsets[SCENE_MATERIALS]) : 0;
+    scene->rects = arena ? (struct Rect*)(arena + offsets[SCENE_RECTS]) : 0;
+    scene->spheres = arena ? (struct Sphere*)(arena + offsets[SCENE_SPHERES]) : 0;
+    scene->objects = arena ? (struct Object*)(arena + offsets[SCENE_OBJECTS]) : 0;
+    scene->instances = arena ? (struct Instance*)(arena + offsets[SCENE_INSTANCES]) : 0;
+}
+
+// Moves the arrays to the layout of the new capacities in an arena of arenaSize
+// bytes, which has to be at least the size of that layout
+static _Bool relayoutArena(struct Scene* scene, const unsigned int* capacities, size_t arenaSize) {
+    size_t oldOffsets[SCENE_ARRAY_COUNT + 1];
+    size_t newOffsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->capacities, oldOffsets);
+    layoutArrays(capacities, newOffsets);
+
+    if(arenaSize > scene->arenaSize) {
+        unsigned char* arena = realloc(scene->arena, arenaSize);
+        if(!arena) {
+            return 0;
+        }
+        scene->arena = arena;
+        scene->arenaSize = arenaSize;
+    }
+
+    // Arrays moving up go first starting from the last one, then the ones moving
+    // down starting from the first, so none overwrites one that hasn't moved yet
+    for(int i = SCENE_ARRAY_COUNT - 1; i >= 0; i--) {
+        if(newOffsets[i] > oldOffsets[i]) {
+            memmove(scene->arena + newOffsets[i], scene->arena + oldOffsets[i], *arrayCount(scene, i) * elementSizes[i]);
+        }
+    }
+    for(int i = 0; i < SCENE_ARRAY_COUNT; i++) {
+        if(newOffsets[i] < oldOffsets[i]) {
+            memmove(scene->arena + newOffsets[i], scene->arena + oldOffsets[i], *arrayCount(scene, i) * elementSizes[i]);
+        }
+    }
+
+    // Failing to shrink just keeps the larger allocation
+    if(!arenaSize) {
+        free(scene->arena);
+        scene->arena = 0;
+        scene->arenaSize = 0;
+    } else if(arenaSize < scene->arenaSize) {
+        unsigned char* arena = realloc(scene->arena, arenaSize);
+        if(arena) {
+            scene->arena = arena;
+            scene->arenaSize = arenaSize;
+        }
+    }
+
+    memcpy(scene->capacities, capacities, sizeof(scene->capacities));
+    pointArrays(scene);
+    return 1;
+}
+
+static void* addElements(struct Scene* scene, enum SceneArray array, unsigned int count) {
+    unsigned int* used = arrayCount(scene, array);
+    if(count > UINT_MAX - *used) {
+        return 0;
+    }
+
+    if(*used + count > scene->capacities[array]) {
+        unsigned int capacities[SCENE_ARRAY_COUNT];
+        memcpy(capacities, scene->capacities, sizeof(capacities));
+        unsigned int capacity = capacities[array] <= UINT_MAX / 2 ? capacities[array] * 2 : UINT_MAX;
+        capacity = capacity > SCENE_INITIAL_CAPACITY ? capacity : SCENE_INITIAL_CAPACITY;
+        capacities[array] = capacity > *used + count ? capacity : *used + count;
+
+        // The arena doubles as well, so later arrays growing doesn't reallocate every time
+        size_t offsets[SCENE_ARRAY_COUNT + 1];
+        layoutArrays(capacities, offsets);
+        size_t arenaSize = scene->arenaSize;
+        if(offsets[SCENE_ARRAY_COUNT] > arenaSize) {
+            arenaSize = offsets[SCENE_ARRAY_COUNT] > 2 * arenaSize ? offsets[SCENE_ARRAY_COUNT] : 2 * arenaSize;
+        }
+        if(!relayoutArena(scene, capacities, arenaSize)) {
+            return 0;
+        }
+    }
+
+    unsigned char* first = scene->arena + sceneArrayOffset(scene, array) + *used * elementSizes[array];
+    memset(first, 0, count * elementSizes[array]);
+    *used += count;
+    scene->canonical = 0;
+    return first;
+}
+
+struct Texture* addTextures(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_TEXTURES, count);
+}
+
+struct Material* addMaterials(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_MATERIALS, count);
+}
+
+struct Sphere* addSpheres(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_SPHERES, count);
+}
+
+struct Rect* addRects(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_RECTS, count);
+}
+
+struct Object* addObjects(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_OBJECTS, count);
+}
+
+struct Instance* addInstances(struct Scene* scene, unsigned int count) {
+    return addElements(scene, SCENE_INSTANCES, count);
+}
+
+_Bool reserveScene(struct Scene* scene, const unsigned int* capacities) {
+    unsigned int reserved[SCENE_ARRAY_COUNT];
+    for(int i = 0; i < SCENE_ARRAY_COUNT; i++) {
+        reserved[i] = capacities[i] > scene->capacities[i] ? capacities[i] : scene->capacities[i];
+    }
+
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(reserved, offsets);
+    size_t arenaSize = offsets[SCENE_ARRAY_COUNT] > scene->arenaSize ? offsets[SCENE_ARRAY_COUNT] : scene->arenaSize;
+    return relayoutArena(scene, reserved, arenaSize);
+}
+
+_Bool compactScene(struct Scene* scene) {
+    unsigned int counts[SCENE_ARRAY_COUNT];
+    for(int i = 0; i < SCENE_ARRAY_COUNT; i++) {
+        counts[i] = *arrayCount(scene, i);
+    }
+
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(counts, offsets);
+    return relayoutArena(scene, counts, offsets[SCENE_ARRAY_COUNT]);
+}
+
+struct Scene* createScene() {
+    return calloc(1, sizeof(struct Scene));
+}
+
+static _Bool uploadCounts(struct Scene* scene) {
+    struct GPUCounts counts = { scene->textureCount, scene->materialCount, scene->sphereCount, scene->rectCount };
+    glBindBuffer(GL_UNIFORM_BUFFER, scene->countBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(counts), &counts);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    scene->countsDirty = 0;
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+// Binds each GPU array's range of the storage buffer. Zero sized ranges can't be
+// bound, so empty arrays and left out spheres still get one element.
+static void bindArrays(struct Scene* scene) {
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->bufferCapacities, offsets);
+
+    for(int i = 0; i < SCENE_GPU_ARRAY_COUNT; i++) {
+        unsigned int count = *arrayCount(scene, i);
+        size_t rangeSize = (count && (scene->bufferHasSpheres || i != SCENE_SPHERES) ? count : 1) * elementSizes[i];
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, bindings[i], scene->buffer, (GLintptr)offsets[i], (GLsizeiptr)rangeSize);
+    }
+}
+
+// Copies the arena up to the spheres, and the spheres too when they're included,
+// into one buffer with room for every array's capacity. With arrays the GPU
+// arrays are copied from there instead, each to its offset in the arena.
+static _Bool uploadArena(struct Scene* scene, _Bool spheres, const void* const* arrays) {
+    GLint alignment;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    if(alignment <= 0 || SCENE_ARENA_ALIGNMENT % alignment) {
+        fprintf(stderr, "Scene arrays aren't aligned to the %d bytes storage buffer offsets need\n", alignment);
+        return 0;
+    }
+
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->capacities, offsets);
+
+    unsigned int sphereCapacity = scene->capacities[SCENE_SPHERES];
+    size_t size = offsets[SCENE_SPHERES] + (spheres ? scene->sphereCount * sizeof(struct Sphere) : 0);
+    size_t bufferSize = offsets[SCENE_SPHERES] + (spheres && sphereCapacity ? sphereCapacity : 1) * sizeof(struct Sphere);
+
+    if(!scene->buffer) {
+        glGenBuffers(1, &scene->buffer);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene->buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)bufferSize, 0, GL_DYNAMIC_DRAW);
+    if(arrays) {
+        for(int i = 0; i < (spheres ? SCENE_GPU_ARRAY_COUNT : SCENE_SPHERES); i++) {
+            size_t arraySize = *arrayCount(scene, (enum SceneArray)i) * elementSizes[i];
+            if(arraySize) {
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr)offsets[i], (GLsizeiptr)arraySize, arrays[i]);
+            }
+        }
+    } else if(size) {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr)size, scene->arena);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    memcpy(scene->bufferCapacities, scene->capacities, sizeof(scene->bufferCapacities));
+    scene->bufferHasSpheres = spheres;
+    memset(scene->dirtyRangeCounts, 0, sizeof(scene->dirtyRangeCounts));
+    bindArrays(scene);
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+_Bool uploadSceneArrays(struct Scene* scene, const void* const* arrays) {
+    if(!scene->countBuffer) {
+        glGenBuffers(1, &scene->countBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, scene->countBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(struct GPUCounts), 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, SCENE_COUNTS_BINDING, scene->countBuffer);
+    }
+
+    _Bool uploaded = uploadArena(scene, 1, arrays) && uploadCounts(scene);
+    if(!uploaded) {
+        fprintf(stderr, "Failed to upload scene (%u textures, %u materials, %u spheres, %u rects)\n",
+            scene->textureCount, scene->materialCount, scene->sphereCount, scene->rectCount);
+    }
+    return uploaded;
+}
 
 _Bool uploadScene(struct Scene* scene) {
+    return uploadSceneArrays(scene, 0);
+}
 
+_Bool releaseSphereBuffer(struct Scene* scene) {
+    return uploadArena(scene, 0, 0) && (!scene->countsDirty || uploadCounts(scene));
+}
+
+static void extendRange(struct SceneRange* range, unsigned int first, unsigned int end) {
+    if(range->first >= range->end) {
+        range->first = first;
+        range->end = end;
+    } else {
+        range->first = first < range->first ? first : range->first;
+        range->end = end > range->end ? end : range->end;
+    }
+}
+
+// Adds elements [first, end) of a GPU array to the ones the next flush uploads
+static void markDirty(struct Scene* scene, enum SceneArray array, unsigned int first, unsigned int end) {
+    if(first >= end) {
+        return;
+    }
+
+    // One slot more than kept, for the new range before anything is merged
+    struct SceneRange ranges[SCENE_DIRTY_RANGES + 1];
+    unsigned int count = 0;
+    const struct SceneRange* dirty = scene->dirtyRanges[array];
+    unsigned int dirtyCount = scene->dirtyRangeCounts[array];
+
+    // Ranges overlapping or touching the new one are merged into it
+    unsigned int i = 0;
+    while(i < dirtyCount && dirty[i].end < first) {
+        ranges[count++] = dirty[i++];
+    }
+    struct SceneRange merged = { first, end };
+    while(i < dirtyCount && dirty[i].first <= end) {
+        extendRange(&merged, dirty[i].first, dirty[i].end);
+        i++;
+    }
+    ranges[count++] = merged;
+    while(i < dirtyCount) {
+        ranges[count++] = dirty[i++];
+    }
+
+    // Past the limit the two ranges with the smallest gap become one, which
+    // uploads the fewest clean elements along with them
+    if(count > SCENE_DIRTY_RANGES) {
+        unsigned int closest = 0;
+        for(unsigned int j = 1; j + 1 < count; j++) {
+            if(ranges[j + 1].first - ranges[j].end < ranges[closest + 1].first - ranges[closest].end) {
+                closest = j;
+            }
+        }
+        ranges[closest].end = ranges[closest + 1].end;
+        memmove(&ranges[closest + 1], &ranges[closest + 2], (count - closest - 2) * sizeof(struct SceneRange));
+        count--;
+    }
+
+    memcpy(scene->dirtyRanges[array], ranges, count * sizeof(struct SceneRange));
+    scene->dirtyRangeCounts[array] = count;
+}
+
+// Marks elements [first, end) as changed, for the buffer and, for spheres and
+// rects, the objects containing them
+static void markEdited(struct Scene* scene, enum SceneArray array, unsigned int first, unsigned int end) {
+    scene->canonical = 0;
+    if(array < SCENE_GPU_ARRAY_COUNT) {
+        markDirty(scene, array, first, end);
+    }
+    if(array == SCENE_SPHERES) {
+        extendRange(&scene->editedSpheres, first, end);
+    } else if(array == SCENE_RECTS) {
+        extendRange(&scene->editedRects, first, end);
+    }
+}
+
+static void* element(struct Scene* scene, enum SceneArray array, unsigned int index) {
+    return scene->arena + sceneArrayOffset(scene, array) + index * elementSizes[array];
+}
+
+static _Bool setElement(struct Scene* scene, enum SceneArray array, unsigned int index, const void* value) {
+    if(index >= *arrayCount(scene, array)) {
+        fprintf(stderr, "Can't set element %u of %u\n", index, *arrayCount(scene, array));
+        return 0;
+    }
+
+    void* target = element(scene, array, index);
+    if(memcmp(target, value, elementSizes[array])) {
+        memcpy(target, value, elementSizes[array]);
+        markEdited(scene, array, index, index + 1);
+        scene->imageChanged = 1;
+    }
+    return 1;
+}
+
+_Bool setTexture(struct Scene* scene, unsigned int index, const struct Texture* texture) {
+    // Padding isn't compared, it never reaches the shader
+    struct Texture padded = *texture;
+    memset(padded.padding, 0, sizeof(padded.padding));
+    return setElement(scene, SCENE_TEXTURES, index, &padded);
+}
+
+_Bool setMaterial(struct Scene* scene, unsigned int index, const struct Material* material) {
+    return setElement(scene, SCENE_MATERIALS, index, material);
+}
+
+_Bool setSphere(struct Scene* scene, unsigned int index, const struct Sphere* sphere) {
+    struct Sphere padded = *sphere;
+    memset(padded.padding, 0, sizeof(padded.padding));
+    return setElement(scene, SCENE_SPHERES, index, &padded);
+}
+
+_Bool setRect(struct Scene* scene, unsigned int index, const struct Rect* rect) {
+    return setElement(scene, SCENE_RECTS, index, rect);
+}
+
+// Makes room for one element at index, moving the ones after it up
+static _Bool insertElement(struct Scene* scene, enum SceneArray array, unsigned int index, const void* value) {
+    unsigned int count = *arrayCount(scene, array);
+    if(index > count) {
+        fprintf(stderr, "Can't insert element %u of %u\n", index, count);
+        return 0;
+    }
+    if(!addElements(scene, array, 1)) {
+        fprintf(stderr, "Failed to grow the scene for %u elements\n", count + 1);
+        return 0;
+    }
+
+    unsigned char* target = element(scene, array, index);
+    memmove(target + elementSizes[array], target, (count - index) * elementSizes[array]);
+    memcpy(target, value, elementSizes[array]);
+    markEdited(scene, array, index, count + 1);
+    scene->countsDirty = 1;
+    return 1;
+}
+
+static void removeElement(struct Scene* scene, enum SceneArray array, unsigned int index) {
+    unsigned int* count = arrayCount(scene, array);
+    unsigned char* target = element(scene, array, index);
+    memmove(target, target + elementSizes[array], (*count - index - 1) * elementSizes[array]);
+    (*count)--;
+
+    // The removed slot counts as edited too, so the objects containing it are found
+    markEdited(scene, array, index, *count + 1);
+    scene->countsDirty = 1;
+}
+
+// References at or past index move by offset, which is 1 after an insertion and
+// -1 after a removal. The texture inserted at index keeps what it was given.
+static void moveTextureReferences(struct Scene* scene, unsigned int index, int offset) {
+    for(unsigned int i = 0; i < scene->materialCount; i++) {
+        if(scene->materials[i].texture >= index) {
+            scene->materials[i].texture += offset;
+            markDirty(scene, SCENE_MATERIALS, i, i + 1);
+        }
+    }
+    for(unsigned int i = 0; i < scene->textureCount; i++) {
+        struct Texture* texture = &scene->textures[i];
+        if(texture->type != CHECKERED || (offset > 0 && i == index)) {
+            continue;
+        }
+        if(texture->property1 >= index || texture->property2 >= index) {
+            texture->property1 += texture->property1 >= index ? offset : 0;
+            texture->property2 += texture->property2 >= index ? offset : 0;
+            markDirty(scene, SCENE_TEXTURES, i, i + 1);
+        }
+    }
+}
+
+// Compressed leaves keep their spheres' materials, so moved references count
+// as edited spheres for the TLAS as well
+static void moveMaterialReferences(struct Scene* scene, unsigned int index, int offset) {
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        if(scene->spheres[i].material >= index) {
+            scene->spheres[i].material += offset;
+            markEdited(scene, SCENE_SPHERES, i, i + 1);
+        }
+    }
+    for(unsigned int i = 0; i < scene->rectCount; i++) {
+        if(scene->rects[i].material >= index) {
+            scene->rects[i].material += offset;
+            markDirty(scene, SCENE_RECTS, i, i + 1);
+        }
+    }
+}
+
+_Bool insertTexture(struct Scene* scene, unsigned int index, const struct Texture* texture) {
+    struct Texture padded = *texture;
+    memset(padded.padding, 0, sizeof(padded.padding));
+    if(!insertElement(scene, SCENE_TEXTURES, index, &padded)) {
+        return 0;
+    }
+
+    moveTextureReferences(scene, index, 1);
+    return 1;
+}
+
+_Bool insertMaterial(struct Scene* scene, unsigned int index, const struct Material* material) {
+    if(!insertElement(scene, SCENE_MATERIALS, index, material)) {
+        return 0;
+    }
+
+    moveMaterialReferences(scene, index, 1);
+    return 1;
+}
+
+_Bool removeTexture(struct Scene* scene, unsigned int index) {
+    if(index >= scene->textureCount) {
+        fprintf(stderr, "Can't remove texture %u of %u\n", index, scene->textureCount);
+        return 0;
+    }
+    for(unsigned int i = 0; i < scene->materialCount; i++) {
+        if(scene->materials[i].texture == index) {
+            fprintf(stderr, "Can't remove texture %u, material %u uses it\n", index, i);
+            return 0;
+        }
+    }
+    for(unsigned int i = 0; i < scene->textureCount; i++) {
+        const struct Texture* texture = &scene->textures[i];
+        if(i != index && texture->type == CHECKERED && (texture->property1 == index || texture->property2 == index)) {
+            fprintf(stderr, "Can't remove texture %u, texture %u uses it\n", index, i);
+            return 0;
+        }
+    }
+
+    removeElement(scene, SCENE_TEXTURES, index);
+    moveTextureReferences(scene, index, -1);
+    return 1;
+}
+
+_Bool removeMaterial(struct Scene* scene, unsigned int index) {
+    if(index >= scene->materialCount) {
+        fprintf(stderr, "Can't remove material %u of %u\n", index, scene->materialCount);
+        return 0;
+    }
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        if(scene->spheres[i].material == index) {
+            fprintf(stderr, "Can't remove material %u, sphere %u uses it\n", index, i);
+            return 0;
+        }
+    }
+    for(unsigned int i = 0; i < scene->rectCount; i++) {
+        if(scene->rects[i].material == index) {
+            fprintf(stderr, "Can't remove material %u, rect %u uses it\n", index, i);
+            return 0;
+        }
+    }
+
+    removeElement(scene, SCENE_MATERIALS, index);
+    moveMaterialReferences(scene, index, -1);
+    return 1;
+}
+
+// Moves the objects' ranges of spheres or rects after a primitive was inserted
+// at index into object, or removed from index when object is UINT_MAX
+static void moveObjectRanges(struct Scene* scene, enum SceneArray array, unsigned int object, unsigned int index) {
+    for(unsigned int i = 0; i < scene->objectCount; i++) {
+        struct Object* o = &scene->objects[i];
+        unsigned int* first = array == SCENE_SPHERES ? &o->firstSphere : &o->firstRect;
+        unsigned int* count = array == SCENE_SPHERES ? &o->sphereCount : &o->rectCount;
+
+        if(object != UINT_MAX) {
+            if(i == object || (*first < index && *first + *count > index)) {
+                (*count)++;
+            } else if(*first >= index) {
+                (*first)++;
+            }
+        } else if(*first > index) {
+            (*first)--;
+        } else if(*first + *count > index) {
+            (*count)--;
+        }
+    }
+}
+
+static _Bool insertPrimitive(struct Scene* scene, enum SceneArray array, unsigned int object, const void* value) {
+    if(object >= sceneObjectCount(scene)) {
+        fprintf(stderr, "Can't insert into object %u of %u\n", object, sceneObjectCount(scene));
+        return 0;
+    }
+
+    struct Object o = sceneObject(scene, object);
+    unsigned int index = array == SCENE_SPHERES ? o.firstSphere + o.sphereCount : o.firstRect + o.rectCount;
+    if(!insertElement(scene, array, index, value)) {
+        return 0;
+    }
+
+    moveObjectRanges(scene, array, object, index);
+    scene->imageChanged = 1;
+    return 1;
+}
+
+static _Bool removePrimitive(struct Scene* scene, enum SceneArray array, unsigned int index) {
+    if(index >= *arrayCount(scene, array)) {
+        fprintf(stderr, "Can't remove primitive %u of %u\n", index, *arrayCount(scene, array));
+        return 0;
+    }
+
+    removeElement(scene, array, index);
+    moveObjectRanges(scene, array, UINT_MAX, index);
+    scene->imageChanged = 1;
+    return 1;
+}
+
+_Bool insertSphere(struct Scene* scene, unsigned int object, const struct Sphere* sphere) {
+    struct Sphere padded = *sphere;
+    memset(padded.padding, 0, sizeof(padded.padding));
+    return insertPrimitive(scene, SCENE_SPHERES, object, &padded);
+}
+
+_Bool insertRect(struct Scene* scene, unsigned int object, const struct Rect* rect) {
+    return insertPrimitive(scene, SCENE_RECTS, object, rect);
+}
+
+_Bool removeSphere(struct Scene* scene, unsigned int index) {
+    return removePrimitive(scene, SCENE_SPHERES, index);
+}
+
+_Bool removeRect(struct Scene* scene, unsigned int index) {
+    return removePrimitive(scene, SCENE_RECTS, index);
+}
+
+static const struct Instance identityInstance = {
+    { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }, 0
+};
+
+_Bool appendObject(struct Scene* scene, const struct Sphere* spheres, unsigned int sphereCount,
+    const struct Rect* rects, unsigned int rectCount) {
+    unsigned int firstSphere = scene->sphereCount, firstRect = scene->rectCount;
+    unsigned int objectCount = scene->objectCount, instanceCount = scene->instanceCount;
+
+    // The implicit object becomes a real one first, it would take the new primitives in otherwise
+    unsigned int added = objectCount ? 1 : 2;
+    if(!addSpheres(scene, sphereCount) || !addRects(scene, rectCount) || !addObjects(scene, added) ||
+        !addInstances(scene, added)) {
+        fprintf(stderr, "Failed to grow the scene for %u spheres and %u rects\n", sphereCount, rectCount);
+        scene->sphereCount = firstSphere;
+        scene->rectCount = firstRect;
+        scene->objectCount = objectCount;
+        scene->instanceCount = instanceCount;
+        return 0;
+    }
+
+    // Taken after adding, which may have moved the arrays
+    if(!objectCount) {
+        struct Object everything = { 0, firstSphere, 0, firstRect };
+        scene->objects[0] = everything;
+        scene->instances[0] = identityInstance;
+    }
+    struct Object object = { firstSphere, sphereCount, firstRect, rectCount };
+    scene->objects[scene->objectCount - 1] = object;
+    scene->instances[scene->instanceCount - 1] = identityInstance;
+    scene->instances[scene->instanceCount - 1].object = scene->objectCount - 1;
+
+    if(sphereCount) {
+        memcpy(element(scene, SCENE_SPHERES, firstSphere), spheres, sphereCount * sizeof(struct Sphere));
+    }
+    if(rectCount) {
+        memcpy(element(scene, SCENE_RECTS, firstRect), rects, rectCount * sizeof(struct Rect));
+    }
+
+    // Not edited, the object is new to the TLAS rather than changed
+    markDirty(scene, SCENE_SPHERES, firstSphere, scene->sphereCount);
+    markDirty(scene, SCENE_RECTS, firstRect, scene->rectCount);
+    scene->countsDirty = 1;
+    scene->imageChanged = 1;
+    return 1;
+}
+
+_Bool flushSceneEdits(struct Scene* scene) {
+    _Bool imageChanged = scene->imageChanged;
+    scene->imageChanged = 0;
+
+    // Not uploaded yet, uploadScene will take everything
+    if(!scene->buffer) {
+        memset(scene->dirtyRangeCounts, 0, sizeof(scene->dirtyRangeCounts));
+        return imageChanged;
+    }
+
+    // Growing an array moves the ones after it, and the spheres can outgrow the
+    // buffer. Left out spheres don't need any room.
+    unsigned int laidOut = scene->bufferHasSpheres ? SCENE_GPU_ARRAY_COUNT : SCENE_SPHERES;
+    if(memcmp(scene->bufferCapacities, scene->capacities, laidOut * sizeof(unsigned int))) {
+        if(!uploadArena(scene, scene->bufferHasSpheres, 0) || !uploadCounts(scene)) {
+            fprintf(stderr, "Failed to upload the edited scene\n");
+        }
+        return imageChanged;
+    }
+
+    size_t offsets[SCENE_ARRAY_COUNT + 1];
+    layoutArrays(scene->bufferCapacities, offsets);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, scene->buffer);
+    for(int i = 0; i < SCENE_GPU_ARRAY_COUNT; i++) {
+        if(i == SCENE_SPHERES && !scene->bufferHasSpheres) {
+            continue;
+        }
+
+        // Ranges past the count are left over from removals and are never read
+        unsigned int count = *arrayCount(scene, i);
+        for(unsigned int j = 0; j < scene->dirtyRangeCounts[i]; j++) {
+            struct SceneRange range = scene->dirtyRanges[i][j];
+            range.end = range.end < count ? range.end : count;
+            if(range.first < range.end) {
+                glBufferSubData(
+                    GL_SHADER_STORAGE_BUFFER, (GLintptr)(offsets[i] + range.first * elementSizes[i]),
+                    (GLsizeiptr)((range.end - range.first) * elementSizes[i]), element(scene, i, range.first)
+                );
+            }
+        }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    memset(scene->dirtyRangeCounts, 0, sizeof(scene->dirtyRangeCounts));
+
+    // The bound ranges follow the counts
+    if(scene->countsDirty) {
+        uploadCounts(scene);
+        bindArrays(scene);
+    }
+
+    if(glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "Failed to upload the edited scene\n");
+    }
+    return imageChanged;
+}
+
+_Bool sceneGeometryEdited(const struct Scene* scene) {
+    return scene->editedSpheres.first < scene->editedSpheres.end || scene->editedRects.first < scene->editedRects.end;
+}
+
+unsigned int sceneObjectCount(const struct Scene* scene) {
+    return scene->objectCount ? scene->objectCount : 1;
+}
+
+struct Object sceneObject(const struct Scene* scene, unsigned int object) {
+    if(scene->objectCount) {
+        return scene->objects[object];
+    }
+
+    struct Object everything = { 0, scene->sphereCount, 0, scene->rectCount };
+    return everything;
+}
+
+unsigned int sceneInstanceCount(const struct Scene* scene) {
+    return scene->objectCount ? scene->instanceCount : 1;
+}
+
+const struct Instance* sceneInstance(const struct Scene* scene, unsigned int instance) {
+    return scene->objectCount ? &scene->instances[instance] : &identityInstance;
 }
 
 void freeScene(struct Scene* scene) {
-    free(scene->textures);
-    free(scene->materials);
-    free(scene->spheres);
-    free(scene->rects);
+    if(scene->buffer) {
+        GLuint buffers[] = { scene->buffer, scene->countBuffer };
+        glDeleteBuffers(2, buffers);
+    }
+
+    free(scene->arena);
     free(scene);
-}
\ No newline at end of file
+}
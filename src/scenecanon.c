@@ -0,0 +1,336 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "scenecanon.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MORTON_BITS 10
+
+struct TextureKey {
+    struct Texture texture; // With the textures a checkered one picks replaced by the ones they're merged into
+    unsigned int index;
+};
+
+struct MaterialKey {
+    struct Material material;
+    unsigned int index;
+};
+
+struct PrimitiveKey {
+    unsigned int cell;
+    unsigned int material;
+    unsigned int morton;
+    unsigned int index;
+};
+
+static int compareIndices(unsigned int a, unsigned int b) {
+    return a < b ? -1 : a > b;
+}
+
+// Equal textures end up next to each other, the first of them first
+static int compareTextureKeys(const void* a, const void* b) {
+    const struct TextureKey* x = a;
+    const struct TextureKey* y = b;
+    int order = memcmp(&x->texture, &y->texture, sizeof(struct Texture));
+    return order ? order : compareIndices(x->index, y->index);
+}
+
+static int compareMaterialKeys(const void* a, const void* b) {
+    const struct MaterialKey* x = a;
+    const struct MaterialKey* y = b;
+    if(x->material.type != y->material.type) {
+        return x->material.type < y->material.type ? -1 : 1;
+    }
+    if(x->material.texture != y->material.texture) {
+        return compareIndices(x->material.texture, y->material.texture);
+    }
+    int order = memcmp(&x->material.property, &y->material.property, sizeof(float));
+    return order ? order : compareIndices(x->index, y->index);
+}
+
+static int comparePrimitiveKeys(const void* a, const void* b) {
+    const struct PrimitiveKey* x = a;
+    const struct PrimitiveKey* y = b;
+    if(x->cell != y->cell) {
+        return compareIndices(x->cell, y->cell);
+    }
+    if(x->material != y->material) {
+        return compareIndices(x->material, y->material);
+    }
+    if(x->morton != y->morton) {
+        return compareIndices(x->morton, y->morton);
+    }
+    return compareIndices(x->index, y->index);
+}
+
+static int compareBoundaries(const void* a, const void* b) {
+    return compareIndices(*(const unsigned int*)a, *(const unsigned int*)b);
+}
+
+// References past the end stay past it
+static unsigned int remapIndex(const unsigned int* indices, unsigned int count, unsigned int newCount, unsigned int index) {
+    return index < count ? indices[index] : newCount;
+}
+
+static _Bool mergeTextures(struct Scene* scene) {
+    unsigned int count = scene->textureCount;
+    if(count < 2) {
+        return 1;
+    }
+
+    // What each texture is merged into, by old index
+    struct TextureKey* keys = malloc(count * sizeof(struct TextureKey));
+    unsigned int* merged = malloc(count * sizeof(unsigned int));
+    if(!keys || !merged) {
+        free(keys);
+        free(merged);
+        return 0;
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        merged[i] = i;
+    }
+
+    // Checkered textures only match once the textures they pick from do, which
+    // takes another round for every level of nesting. A texture is always merged
+    // into the first of its kind, which only gets earlier with every round.
+    _Bool changed = 1;
+    while(changed) {
+        changed = 0;
+        for(unsigned int i = 0; i < count; i++) {
+            struct Texture* key = &keys[i].texture;
+            *key = scene->textures[i];
+            memset(key->padding, 0, sizeof(key->padding));
+            if(key->type == CHECKERED) {
+                key->property1 = remapIndex(merged, count, count, key->property1);
+                key->property2 = remapIndex(merged, count, count, key->property2);
+            }
+            keys[i].index = i;
+        }
+        qsort(keys, count, sizeof(struct TextureKey), compareTextureKeys);
+
+        unsigned int first = 0;
+        for(unsigned int i = 0; i < count; i++) {
+            if(memcmp(&keys[i].texture, &keys[first].texture, sizeof(struct Texture)) != 0) {
+                first = i;
+            }
+            if(merged[keys[i].index] != keys[first].index) {
+                merged[keys[i].index] = keys[first].index;
+                changed = 1;
+            }
+        }
+    }
+
+    // The textures kept move down in order. The first of a kind comes before the
+    // ones merged into it, so its new index is already in place of its old one.
+    unsigned int* indices = merged;
+    unsigned int kept = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        if(merged[i] == i) {
+            indices[i] = kept;
+            scene->textures[kept++] = scene->textures[i];
+        } else {
+            indices[i] = indices[merged[i]];
+        }
+    }
+
+    for(unsigned int i = 0; i < kept; i++) {
+        struct Texture* texture = &scene->textures[i];
+        if(texture->type == CHECKERED) {
+            texture->property1 = remapIndex(indices, count, kept, texture->property1);
+            texture->property2 = remapIndex(indices, count, kept, texture->property2);
+        }
+    }
+    for(unsigned int i = 0; i < scene->materialCount; i++) {
+        scene->materials[i].texture = remapIndex(indices, count, kept, scene->materials[i].texture);
+    }
+    scene->textureCount = kept;
+
+    free(keys);
+    free(merged);
+    return 1;
+}
+
+static _Bool mergeMaterials(struct Scene* scene) {
+    unsigned int count = scene->materialCount;
+    if(count == 0) {
+        return 1;
+    }
+
+    struct MaterialKey* keys = malloc(count * sizeof(struct MaterialKey));
+    unsigned int* indices = malloc(count * sizeof(unsigned int));
+    if(!keys || !indices) {
+        free(keys);
+        free(indices);
+        return 0;
+    }
+    for(unsigned int i = 0; i < count; i++) {
+        keys[i].material = scene->materials[i];
+        keys[i].index = i;
+    }
+    qsort(keys, count, sizeof(struct MaterialKey), compareMaterialKeys);
+
+    // The distinct materials are gathered at the front of the keys as they're found
+    unsigned int kept = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        if(kept == 0 || memcmp(&keys[kept - 1].material, &keys[i].material, sizeof(struct Material)) != 0) {
+            keys[kept++].material = keys[i].material;
+        }
+        indices[keys[i].index] = kept - 1;
+    }
+
+    for(unsigned int i = 0; i < kept; i++) {
+        scene->materials[i] = keys[i].material;
+    }
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        scene->spheres[i].material = remapIndex(indices, count, kept, scene->spheres[i].material);
+    }
+    for(unsigned int i = 0; i < scene->rectCount; i++) {
+        scene->rects[i].material = remapIndex(indices, count, kept, scene->rects[i].material);
+    }
+    scene->materialCount = kept;
+
+    free(keys);
+    free(indices);
+    return 1;
+}
+
+static unsigned int spreadBits(unsigned int x) {
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+static void primitiveCentroid(const struct Scene* scene, enum SceneArray array, unsigned int index, float* centroid) {
+    if(array == SCENE_SPHERES) {
+        memcpy(centroid, scene->spheres[index].center, 3 * sizeof(float));
+        return;
+    }
+
+    const struct Rect* rect = &scene->rects[index];
+    int a = rect->plane == YZ ? 1 : 0, b = rect->plane == XY ? 1 : 2;
+    centroid[a] = 0.5f * (rect->x0 + rect->x1);
+    centroid[b] = 0.5f * (rect->y0 + rect->y1);
+    centroid[3 - a - b] = rect->k;
+}
+
+// Sorts elements [first, end) of the spheres or rects, buffer has room for them
+static void sortSegment(struct Scene* scene, enum SceneArray array, unsigned int first, unsigned int end,
+    struct PrimitiveKey* keys, unsigned char* buffer) {
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for(unsigned int i = first; i < end; i++) {
+        float centroid[3];
+        primitiveCentroid(scene, array, i, centroid);
+        for(int j = 0; j < 3; j++) {
+            min[j] = fminf(min[j], centroid[j]);
+            max[j] = fmaxf(max[j], centroid[j]);
+        }
+    }
+
+    // Cells of about SCENE_CANON_CELL_SIZE primitives, from the top bits of the Morton code
+    unsigned int count = end - first, levels = 0;
+    while(levels < MORTON_BITS && ((unsigned long long)SCENE_CANON_CELL_SIZE << 3 * levels) < count) {
+        levels++;
+    }
+
+    const float steps = (float)((1 << MORTON_BITS) - 1);
+    for(unsigned int i = first; i < end; i++) {
+        float centroid[3];
+        primitiveCentroid(scene, array, i, centroid);
+        unsigned int morton = 0;
+        for(int j = 0; j < 3; j++) {
+            float extent = max[j] - min[j];
+            float cell = extent > 0 ? (centroid[j] - min[j]) / extent * steps : 0;
+            morton |= spreadBits((unsigned int)fminf(fmaxf(cell, 0), steps)) << j;
+        }
+
+        struct PrimitiveKey* key = &keys[i - first];
+        key->cell = levels ? morton >> 3 * (MORTON_BITS - levels) : 0;
+        key->material = array == SCENE_SPHERES ? scene->spheres[i].material : scene->rects[i].material;
+        key->morton = morton;
+        key->index = i;
+    }
+    qsort(keys, count, sizeof(struct PrimitiveKey), comparePrimitiveKeys);
+
+    size_t size = array == SCENE_SPHERES ? sizeof(struct Sphere) : sizeof(struct Rect);
+    unsigned char* elements = array == SCENE_SPHERES ? (unsigned char*)scene->spheres : (unsigned char*)scene->rects;
+    for(unsigned int i = 0; i < count; i++) {
+        memcpy(buffer + i * size, elements + keys[i].index * size, size);
+    }
+    memcpy(elements + first * size, buffer, count * size);
+}
+
+// The objects' ranges cut the array into segments that are either entirely in a
+// range or entirely out of it, which are sorted on their own
+static _Bool sortPrimitives(struct Scene* scene, enum SceneArray array) {
+    unsigned int count = array == SCENE_SPHERES ? scene->sphereCount : scene->rectCount;
+    if(count < 2) {
+        return 1;
+    }
+
+    unsigned int boundaryCount = 2 * scene->objectCount + 2;
+    unsigned int* boundaries = malloc(boundaryCount * sizeof(unsigned int));
+    struct PrimitiveKey* keys = malloc(count * sizeof(struct PrimitiveKey));
+    unsigned char* buffer = malloc(count * sizeof(struct Sphere));
+    if(!boundaries || !keys || !buffer) {
+        free(boundaries);
+        free(keys);
+        free(buffer);
+        return 0;
+    }
+
+    boundaries[0] = 0;
+    boundaries[1] = count;
+    for(unsigned int i = 0; i < scene->objectCount; i++) {
+        const struct Object* object = &scene->objects[i];
+        boundaries[2 * i + 2] = array == SCENE_SPHERES ? object->firstSphere : object->firstRect;
+        boundaries[2 * i + 3] = boundaries[2 * i + 2] + (array == SCENE_SPHERES ? object->sphereCount : object->rectCount);
+    }
+    qsort(boundaries, boundaryCount, sizeof(unsigned int), compareBoundaries);
+
+    for(unsigned int i = 0; i + 1 < boundaryCount; i++) {
+        if(boundaries[i + 1] - boundaries[i] > 1) {
+            sortSegment(scene, array, boundaries[i], boundaries[i + 1], keys, buffer);
+        }
+    }
+
+    free(boundaries);
+    free(keys);
+    free(buffer);
+    return 1;
+}
+
+_Bool canonicalizeScene(struct Scene* scene) {
+    unsigned int textureCount = scene->textureCount, materialCount = scene->materialCount;
+    _Bool ok = mergeTextures(scene) && mergeMaterials(scene) && sortPrimitives(scene, SCENE_SPHERES) &&
+        sortPrimitives(scene, SCENE_RECTS);
+
+    // Give back the room of the merged entries
+    if(scene->textureCount < textureCount || scene->materialCount < materialCount) {
+        compactScene(scene);
+    }
+    if(!ok) {
+        fprintf(stderr, "Failed to allocate while sorting the scene\n");
+    }
+    scene->canonical = ok;
+    return ok;
+}
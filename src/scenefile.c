@@ -0,0 +1,283 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "scenefile.h"
+#include "mapfile.h"
+#include "scenecanon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char sceneMagic[8] = { 'r', 't', 's', 'c', 'e', 'n', 'e', 0 };
+
+static const unsigned int sectionElementSizes[SCENE_SECTION_COUNT] = {
+    sizeof(struct Texture),
+    sizeof(struct Material),
+    sizeof(struct Sphere),
+    sizeof(struct Rect),
+    sizeof(struct Object),
+    sizeof(struct Instance)
+};
+
+static const enum SceneArray sectionArrays[SCENE_SECTION_COUNT] = {
+    SCENE_TEXTURES,
+    SCENE_MATERIALS,
+    SCENE_SPHERES,
+    SCENE_RECTS,
+    SCENE_OBJECTS,
+    SCENE_INSTANCES
+};
+
+static unsigned long long alignSection(unsigned long long offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+static unsigned int sectionCount(const struct Scene* scene, enum SceneSection section) {
+    switch(section) {
+        case SCENE_SECTION_TEXTURES: return scene->textureCount;
+        case SCENE_SECTION_MATERIALS: return scene->materialCount;
+        case SCENE_SECTION_SPHERES: return scene->sphereCount;
+        case SCENE_SECTION_RECTS: return scene->rectCount;
+        case SCENE_SECTION_OBJECTS: return scene->objectCount;
+        // Instances of scenes without objects are never read
+        case SCENE_SECTION_INSTANCES: return scene->objectCount ? scene->instanceCount : 0;
+        default: return 0;
+    }
+}
+
+static _Bool writeZeros(FILE* file, unsigned long long count) {
+    static const unsigned char zeros[SCENE_FILE_ALIGNMENT];
+    while(count) {
+        size_t size = count < sizeof(zeros) ? (size_t)count : sizeof(zeros);
+        if(fwrite(zeros, 1, size, file) != size) {
+            return 0;
+        }
+        count -= size;
+    }
+    return 1;
+}
+
+static struct Scene* copySections(const void** sections, const unsigned int* counts) {
+    struct Scene* scene = createScene();
+    if(!scene) {
+        return 0;
+    }
+
+    unsigned int capacities[SCENE_ARRAY_COUNT];
+    for(int i = 0; i < SCENE_SECTION_COUNT; i++) {
+        capacities[sectionArrays[i]] = counts[i];
+    }
+    if(!reserveScene(scene, capacities)) {
+        freeScene(scene);
+        return 0;
+    }
+
+    // Reserved above, so adding doesn't move the arrays
+    memcpy(addTextures(scene, counts[SCENE_SECTION_TEXTURES]), sections[SCENE_SECTION_TEXTURES],
+        counts[SCENE_SECTION_TEXTURES] * sizeof(struct Texture));
+    memcpy(addMaterials(scene, counts[SCENE_SECTION_MATERIALS]), sections[SCENE_SECTION_MATERIALS],
+        counts[SCENE_SECTION_MATERIALS] * sizeof(struct Material));
+    memcpy(addSpheres(scene, counts[SCENE_SECTION_SPHERES]), sections[SCENE_SECTION_SPHERES],
+        counts[SCENE_SECTION_SPHERES] * sizeof(struct Sphere));
+    memcpy(addRects(scene, counts[SCENE_SECTION_RECTS]), sections[SCENE_SECTION_RECTS],
+        counts[SCENE_SECTION_RECTS] * sizeof(struct Rect));
+    memcpy(addObjects(scene, counts[SCENE_SECTION_OBJECTS]), sections[SCENE_SECTION_OBJECTS],
+        counts[SCENE_SECTION_OBJECTS] * sizeof(struct Object));
+    memcpy(addInstances(scene, counts[SCENE_SECTION_INSTANCES]), sections[SCENE_SECTION_INSTANCES],
+        counts[SCENE_SECTION_INSTANCES] * sizeof(struct Instance));
+    return scene;
+}
+
+static struct Scene* copyScene(const struct Scene* scene) {
+    const void* sections[SCENE_SECTION_COUNT];
+    unsigned int counts[SCENE_SECTION_COUNT];
+    for(int i = 0; i < SCENE_SECTION_COUNT; i++) {
+        sections[i] = scene->arena + sceneArrayOffset(scene, sectionArrays[i]);
+        counts[i] = sectionCount(scene, (enum SceneSection)i);
+    }
+    return copySections(sections, counts);
+}
+
+_Bool saveSceneFile(const char* path, const struct Scene* scene) {
+    // Sorted once here rather than on every load
+    struct Scene* sorted = scene->canonical ? 0 : copyScene(scene);
+    if(sorted) {
+        canonicalizeScene(sorted);
+        scene = sorted;
+    }
+
+    struct SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, sceneMagic, sizeof(sceneMagic));
+    header.version = SCENE_FILE_VERSION;
+    header.sectionCount = SCENE_SECTION_COUNT;
+    header.flags = scene->canonical ? SCENE_FILE_CANONICAL : 0;
+
+    unsigned long long offset = alignSection(sizeof(header));
+    for(int i = 0; i < SCENE_SECTION_COUNT; i++) {
+        struct SceneFileSection* section = &header.sections[i];
+        section->offset = offset;
+        section->count = sectionCount(scene, (enum SceneSection)i);
+        section->elementSize = sectionElementSizes[i];
+        offset = alignSection(offset + (unsigned long long)section->count * section->elementSize);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        if(sorted) {
+            freeScene(sorted);
+        }
+        return 0;
+    }
+
+    _Bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    unsigned long long written = sizeof(header);
+    for(int i = 0; ok && i < SCENE_SECTION_COUNT; i++) {
+        const struct SceneFileSection* section = &header.sections[i];
+        const unsigned char* elements = scene->arena + sceneArrayOffset(scene, sectionArrays[i]);
+        ok = writeZeros(file, section->offset - written) &&
+            fwrite(elements, section->elementSize, section->count, file) == section->count;
+        written = section->offset + (unsigned long long)section->count * section->elementSize;
+    }
+    ok = ok && writeZeros(file, offset - written);
+
+    if(fclose(file) != 0) {
+        ok = 0;
+    }
+    if(!ok) {
+        fprintf(stderr, "Failed to write scene %s\n", path);
+        remove(path);
+    }
+    if(sorted) {
+        freeScene(sorted);
+    }
+    return ok;
+}
+
+// Points the view's sections at the start of each section in its data, or
+// returns 0 when the header doesn't describe sections of this build's layouts
+// inside the file
+static _Bool findSections(struct SceneFileView* file) {
+    struct SceneFileHeader header;
+    if(file->size < sizeof(header)) {
+        return 0;
+    }
+
+    // Version 1 headers are shorter, the flags read as the zeros after them
+    memcpy(&header, file->data, sizeof(header));
+    if(memcmp(header.magic, sceneMagic, sizeof(sceneMagic)) != 0 ||
+       (header.version != 1 && header.version != SCENE_FILE_VERSION) || header.sectionCount != SCENE_SECTION_COUNT) {
+        return 0;
+    }
+
+    for(int i = 0; i < SCENE_SECTION_COUNT; i++) {
+        const struct SceneFileSection* section = &header.sections[i];
+        unsigned long long sectionSize = (unsigned long long)section->count * section->elementSize;
+        if(section->elementSize != sectionElementSizes[i] || section->offset % SCENE_FILE_ALIGNMENT ||
+           section->offset > file->size || sectionSize > file->size - section->offset) {
+            return 0;
+        }
+
+        file->sections[i] = file->data + section->offset;
+        file->counts[i] = section->count;
+    }
+    file->canonical = header.version >= 2 && (header.flags & SCENE_FILE_CANONICAL);
+    return 1;
+}
+
+// A damaged file could otherwise send the BVH builders outside the primitive arrays
+static _Bool validObjects(const struct Scene* scene) {
+    for(unsigned int i = 0; i < scene->objectCount; i++) {
+        const struct Object* object = &scene->objects[i];
+        if(object->firstSphere > scene->sphereCount || object->sphereCount > scene->sphereCount - object->firstSphere ||
+           object->firstRect > scene->rectCount || object->rectCount > scene->rectCount - object->firstRect) {
+            return 0;
+        }
+    }
+
+    for(unsigned int i = 0; i < scene->instanceCount; i++) {
+        if(scene->instances[i].object >= scene->objectCount) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+_Bool openSceneFile(const char* path, struct SceneFileView* file) {
+    file->data = mapFile(path, &file->size);
+    if(!file->data) {
+        fprintf(stderr, "Failed to open scene %s\n", path);
+        return 0;
+    }
+
+    if(!findSections(file)) {
+        fprintf(stderr, "%s is not a valid version %d scene file\n", path, SCENE_FILE_VERSION);
+        unmapFile(file->data, file->size);
+        file->data = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void closeSceneFile(struct SceneFileView* file) {
+    unmapFile(file->data, file->size);
+    file->data = 0;
+}
+
+struct Scene* loadSceneFile(const char* path, _Bool upload) {
+    struct SceneFileView file;
+    if(!openSceneFile(path, &file)) {
+        return 0;
+    }
+
+    struct Scene* scene = copySections(file.sections, file.counts);
+    if(!scene) {
+        fprintf(stderr, "Failed to allocate scene %s\n", path);
+    } else if(!validObjects(scene)) {
+        fprintf(stderr, "Damaged scene file %s\n", path);
+        freeScene(scene);
+        scene = 0;
+    } else {
+        // Canonical files are uploaded straight from the mapping, the arena copy
+        // is only read by the host. Others are sorted first, which reorders the
+        // arrays, so they're uploaded from the arena. A scene that couldn't be
+        // sorted still renders the same.
+        _Bool uploaded = 1;
+        if(file.canonical) {
+            scene->canonical = 1;
+            const void* arrays[SCENE_GPU_ARRAY_COUNT];
+            for(int i = 0; i < SCENE_SECTION_COUNT; i++) {
+                if(sectionArrays[i] < SCENE_GPU_ARRAY_COUNT) {
+                    arrays[sectionArrays[i]] = file.sections[i];
+                }
+            }
+            uploaded = !upload || uploadSceneArrays(scene, arrays);
+        } else {
+            canonicalizeScene(scene);
+            uploaded = !upload || uploadScene(scene);
+        }
+        if(!uploaded) {
+            freeScene(scene);
+            scene = 0;
+        }
+    }
+
+    closeSceneFile(&file);
+    return scene;
+}
@@ -0,0 +1,491 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "sceneparser.h"
+#include "scenecanon.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Digits past this many only move the exponent, floats don't need them and the
+// mantissa stays exact as a double
+#define NUMBER_MANTISSA_LIMIT 100000000000000ull
+
+struct Parser {
+    FILE* file;
+    const char* name;
+    _Bool failed;
+
+    // Current line, for error messages
+    unsigned int line;
+    const char* lineStart;
+
+    // Unparsed part of the buffer, the file is read into it in chunks
+    char* start;
+    char* end;
+    _Bool endOfFile;
+
+    struct Scene* scene;
+
+    // One more byte for the terminator of a last line without a newline
+    char buffer[SCENE_PARSER_BUFFER_SIZE + 1];
+};
+
+static _Bool parseError(struct Parser* parser, const char* at, const char* format, ...) {
+    fprintf(stderr, "%s:%u:%u: ", parser->name, parser->line, (unsigned int)(at - parser->lineStart) + 1);
+
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+
+    fputc('\n', stderr);
+    parser->failed = 1;
+    return 0;
+}
+
+// Returns the next line terminated in place, or null at the end of the file or
+// when reading failed
+static char* readLine(struct Parser* parser) {
+    for(;;) {
+        char* newline = memchr(parser->start, '\n', (size_t)(parser->end - parser->start));
+        if(newline || (parser->endOfFile && parser->start < parser->end)) {
+            char* line = parser->start;
+            char* lineEnd = newline ? newline : parser->end;
+            *lineEnd = 0;
+            parser->start = newline ? newline + 1 : parser->end;
+
+            parser->line++;
+            parser->lineStart = line;
+            return line;
+        }
+        if(parser->endOfFile) {
+            return 0;
+        }
+
+        // Move the partial line to the front and fill the rest of the buffer behind it
+        size_t partial = (size_t)(parser->end - parser->start);
+        if(partial == SCENE_PARSER_BUFFER_SIZE) {
+            parser->line++;
+            parser->lineStart = parser->start;
+            parseError(parser, parser->end, "line longer than %d bytes", SCENE_PARSER_BUFFER_SIZE);
+            return 0;
+        }
+
+        memmove(parser->buffer, parser->start, partial);
+        size_t size = SCENE_PARSER_BUFFER_SIZE - partial;
+        size_t read = fread(parser->buffer + partial, 1, size, parser->file);
+        parser->start = parser->buffer;
+        parser->end = parser->buffer + partial + read;
+
+        if(read < size) {
+            if(ferror(parser->file)) {
+                fprintf(stderr, "Failed to read %s\n", parser->name);
+                parser->failed = 1;
+                return 0;
+            }
+            parser->endOfFile = 1;
+        }
+    }
+}
+
+static char* skipSpace(char* c) {
+    while(*c == ' ' || *c == '\t' || *c == '\r') {
+        c++;
+    }
+    return c;
+}
+
+static _Bool endOfToken(char c) {
+    return c == 0 || c == ' ' || c == '\t' || c == '\r' || c == '#';
+}
+
+static _Bool endOfLine(const char* c) {
+    return *c == 0 || *c == '#';
+}
+
+static int tokenLength(const char* c) {
+    int length = 0;
+    while(!endOfToken(c[length])) {
+        length++;
+    }
+    return length;
+}
+
+// Moves past the token and the space after it when it's word
+static _Bool matchWord(char** cursor, const char* word) {
+    size_t length = strlen(word);
+    if(strncmp(*cursor, word, length) != 0 || !endOfToken((*cursor)[length])) {
+        return 0;
+    }
+
+    *cursor = skipSpace(*cursor + length);
+    return 1;
+}
+
+static _Bool expected(struct Parser* parser, const char* at, const char* what) {
+    if(endOfLine(at)) {
+        return parseError(parser, at, "expected %s", what);
+    }
+    return parseError(parser, at, "expected %s, got '%.*s'", what, tokenLength(at), at);
+}
+
+static _Bool expectEnd(struct Parser* parser, const char* c) {
+    if(!endOfLine(c)) {
+        return parseError(parser, c, "unexpected '%.*s'", tokenLength(c), c);
+    }
+    return 1;
+}
+
+// Decimal numbers with an optional fraction and exponent. strtof would be several
+// times slower and depends on the locale.
+static _Bool parseNumber(struct Parser* parser, char** cursor, float* value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    char* c = *cursor;
+    _Bool negative = *c == '-';
+    if(*c == '-' || *c == '+') {
+        c++;
+    }
+
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    for(; *c >= '0' && *c <= '9'; c++, digits++) {
+        if(mantissa < NUMBER_MANTISSA_LIMIT) {
+            mantissa = mantissa * 10 + (unsigned int)(*c - '0');
+        } else {
+            exponent++;
+        }
+    }
+    if(*c == '.') {
+        for(c++; *c >= '0' && *c <= '9'; c++, digits++) {
+            if(mantissa < NUMBER_MANTISSA_LIMIT) {
+                mantissa = mantissa * 10 + (unsigned int)(*c - '0');
+                exponent--;
+            }
+        }
+    }
+
+    _Bool valid = digits > 0;
+    if(valid && (*c == 'e' || *c == 'E')) {
+        c++;
+        _Bool negativeExponent = *c == '-';
+        if(*c == '-' || *c == '+') {
+            c++;
+        }
+
+        int power = 0;
+        valid = *c >= '0' && *c <= '9';
+        for(; *c >= '0' && *c <= '9'; c++) {
+            if(power < 1000) {
+                power = power * 10 + (*c - '0');
+            }
+        }
+        exponent += negativeExponent ? -power : power;
+    }
+    if(!valid || !endOfToken(*c)) {
+        return expected(parser, *cursor, "a number");
+    }
+
+    double result = (double)mantissa;
+    for(; exponent > 22; exponent -= 22) {
+        result *= 1e22;
+    }
+    for(; exponent < -22; exponent += 22) {
+        result /= 1e22;
+    }
+    result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+
+    *value = (float)(negative ? -result : result);
+    *cursor = skipSpace(c);
+    return 1;
+}
+
+static _Bool parseNumbers(struct Parser* parser, char** cursor, float* values, int count) {
+    for(int i = 0; i < count; i++) {
+        if(!parseNumber(parser, cursor, &values[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Leaves the cursor at the token when it isn't an unsigned integer
+static _Bool readUnsigned(char** cursor, unsigned int* value) {
+    char* c = *cursor;
+    unsigned long long result = 0;
+    for(; *c >= '0' && *c <= '9' && result <= UINT_MAX; c++) {
+        result = result * 10 + (unsigned int)(*c - '0');
+    }
+    if(c == *cursor || result > UINT_MAX || !endOfToken(*c)) {
+        return 0;
+    }
+
+    *value = (unsigned int)result;
+    *cursor = skipSpace(c);
+    return 1;
+}
+
+// Indices of textures, materials and objects have to be declared by an earlier line
+static _Bool parseIndex(struct Parser* parser, char** cursor, const char* what, unsigned int count, unsigned int* index) {
+    const char* at = *cursor;
+    if(!readUnsigned(cursor, index)) {
+        char description[32];
+        snprintf(description, sizeof(description), "a %s index", what);
+        return expected(parser, at, description);
+    }
+    if(*index >= count) {
+        return parseError(parser, at, "%s %u isn't declared, there are %u", what, *index, count);
+    }
+    return 1;
+}
+
+static _Bool outOfMemory(struct Parser* parser) {
+    return parseError(parser, parser->lineStart, "out of memory");
+}
+
+static _Bool parseTexture(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    struct Texture texture = { .albedo = { 1, 1, 1 }, .type = SOLID_COLOR };
+
+    _Bool ok;
+    if(matchWord(&c, "solid")) {
+        ok = parseNumbers(parser, &c, texture.albedo, 3);
+    } else if(matchWord(&c, "checkered")) {
+        texture.type = CHECKERED;
+        ok = parseIndex(parser, &c, "texture", scene->textureCount, &texture.property1) &&
+            parseIndex(parser, &c, "texture", scene->textureCount, &texture.property2);
+    } else if(matchWord(&c, "image")) {
+        texture.type = IMAGE;
+        if(!readUnsigned(&c, &texture.property1)) {
+            return expected(parser, c, "an image index");
+        }
+        ok = endOfLine(c) || parseNumbers(parser, &c, texture.albedo, 3);
+    } else {
+        return expected(parser, c, "solid, checkered or image");
+    }
+
+    if(!ok || !expectEnd(parser, c)) {
+        return 0;
+    }
+
+    struct Texture* added = addTextures(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = texture;
+    return 1;
+}
+
+static _Bool parseMaterial(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    struct Material material = { DIFFUSE, 0, 0 };
+
+    if(matchWord(&c, "diffuse")) {
+        material.type = DIFFUSE;
+    } else if(matchWord(&c, "metal")) {
+        material.type = METAL;
+    } else if(matchWord(&c, "dielectric")) {
+        material.type = DIELECTRIC;
+    } else if(matchWord(&c, "light")) {
+        material.type = DIFFUSE_LIGHT;
+    } else {
+        return expected(parser, c, "diffuse, metal, dielectric or light");
+    }
+
+    if(!parseIndex(parser, &c, "texture", scene->textureCount, &material.texture) ||
+       (!endOfLine(c) && !parseNumber(parser, &c, &material.property)) || !expectEnd(parser, c)) {
+        return 0;
+    }
+
+    struct Material* added = addMaterials(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = material;
+    return 1;
+}
+
+static _Bool parseSphere(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    struct Sphere sphere = { 0 };
+
+    if(!parseNumbers(parser, &c, sphere.center, 3) || !parseNumber(parser, &c, &sphere.radius) ||
+       !parseIndex(parser, &c, "material", scene->materialCount, &sphere.material) || !expectEnd(parser, c)) {
+        return 0;
+    }
+
+    struct Sphere* added = addSpheres(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = sphere;
+    return 1;
+}
+
+static _Bool parseRect(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    struct Rect rect;
+
+    if(matchWord(&c, "xy")) {
+        rect.plane = XY;
+    } else if(matchWord(&c, "xz")) {
+        rect.plane = XZ;
+    } else if(matchWord(&c, "yz")) {
+        rect.plane = YZ;
+    } else {
+        return expected(parser, c, "xy, xz or yz");
+    }
+
+    if(!parseNumber(parser, &c, &rect.x0) || !parseNumber(parser, &c, &rect.x1) ||
+       !parseNumber(parser, &c, &rect.y0) || !parseNumber(parser, &c, &rect.y1) ||
+       !parseNumber(parser, &c, &rect.k) ||
+       !parseIndex(parser, &c, "material", scene->materialCount, &rect.material) || !expectEnd(parser, c)) {
+        return 0;
+    }
+
+    struct Rect* added = addRects(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = rect;
+    return 1;
+}
+
+// The last object takes every sphere and rect added since it was declared
+static void closeObject(struct Scene* scene) {
+    if(scene->objectCount) {
+        struct Object* object = &scene->objects[scene->objectCount - 1];
+        object->sphereCount = scene->sphereCount - object->firstSphere;
+        object->rectCount = scene->rectCount - object->firstRect;
+    }
+}
+
+static _Bool parseObject(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    if(!scene->objectCount && (scene->sphereCount || scene->rectCount)) {
+        return parseError(parser, parser->lineStart, "the first object has to come before every sphere and rect");
+    }
+
+    if(!expectEnd(parser, c)) {
+        return 0;
+    }
+
+    closeObject(scene);
+    struct Object object = { scene->sphereCount, 0, scene->rectCount, 0 };
+    struct Object* added = addObjects(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = object;
+    return 1;
+}
+
+static _Bool parseInstance(struct Parser* parser, char* c) {
+    struct Scene* scene = parser->scene;
+    struct Instance instance;
+
+    if(!parseIndex(parser, &c, "object", scene->objectCount, &instance.object) ||
+       !parseNumbers(parser, &c, &instance.transform[0][0], 12) || !expectEnd(parser, c)) {
+        return 0;
+    }
+
+    struct Instance* added = addInstances(scene, 1);
+    if(!added) {
+        return outOfMemory(parser);
+    }
+    *added = instance;
+    return 1;
+}
+
+struct Scene* parseScene(FILE* file, const char* name, _Bool canonicalize) {
+    struct Parser* parser = calloc(1, sizeof(struct Parser));
+    struct Scene* scene = createScene();
+    if(!parser || !scene) {
+        fprintf(stderr, "Failed to allocate a parser for %s\n", name);
+        free(parser);
+        if(scene) freeScene(scene);
+        return 0;
+    }
+
+    parser->file = file;
+    parser->name = name;
+    parser->start = parser->buffer;
+    parser->end = parser->buffer;
+    parser->scene = scene;
+
+    // Ordered by how often the statements appear in large scenes
+    char* line;
+    while((line = readLine(parser))) {
+        char* c = skipSpace(line);
+        _Bool ok;
+        if(endOfLine(c)) {
+            continue;
+        } else if(matchWord(&c, "sphere")) {
+            ok = parseSphere(parser, c);
+        } else if(matchWord(&c, "rect")) {
+            ok = parseRect(parser, c);
+        } else if(matchWord(&c, "instance")) {
+            ok = parseInstance(parser, c);
+        } else if(matchWord(&c, "object")) {
+            ok = parseObject(parser, c);
+        } else if(matchWord(&c, "material")) {
+            ok = parseMaterial(parser, c);
+        } else if(matchWord(&c, "texture")) {
+            ok = parseTexture(parser, c);
+        } else {
+            ok = parseError(parser, c, "unknown statement '%.*s'", tokenLength(c), c);
+        }
+
+        if(!ok) {
+            break;
+        }
+    }
+
+    _Bool failed = parser->failed;
+    free(parser);
+    if(failed) {
+        freeScene(scene);
+        return 0;
+    }
+
+    // Give back the room the arrays grew past their final size
+    closeObject(scene);
+    if(canonicalize) {
+        canonicalizeScene(scene);
+    }
+    compactScene(scene);
+    return scene;
+}
+
+struct Scene* parseSceneFile(const char* path, _Bool canonicalize) {
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Failed to open scene %s\n", path);
+        return 0;
+    }
+
+    struct Scene* scene = parseScene(file, path, canonicalize);
+    fclose(file);
+    return scene;
+}
@@ -0,0 +1,202 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "scenes.h"
+
+#include <string.h>
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+static struct Scene* copyScene(
+    const struct Texture* textures, unsigned int textureCount,
+    const struct Material* materials, unsigned int materialCount,
+    const struct Sphere* spheres, unsigned int sphereCount,
+    const struct Rect* rects, unsigned int rectCount,
+    const struct Object* objects, unsigned int objectCount,
+    const struct Instance* instances, unsigned int instanceCount
+) {
+    struct Scene* scene = createScene();
+    if(!scene) {
+        return 0;
+    }
+
+    unsigned int capacities[SCENE_ARRAY_COUNT] = { 0 };
+    capacities[SCENE_TEXTURES] = textureCount;
+    capacities[SCENE_MATERIALS] = materialCount;
+    capacities[SCENE_SPHERES] = sphereCount;
+    capacities[SCENE_RECTS] = rectCount;
+    capacities[SCENE_OBJECTS] = objectCount;
+    capacities[SCENE_INSTANCES] = instanceCount;
+    if(!reserveScene(scene, capacities)) {
+        freeScene(scene);
+        return 0;
+    }
+
+    // Reserved above, so adding doesn't move the arrays
+    memcpy(addTextures(scene, textureCount), textures, textureCount * sizeof(struct Texture));
+    memcpy(addMaterials(scene, materialCount), materials, materialCount * sizeof(struct Material));
+    memcpy(addSpheres(scene, sphereCount), spheres, sphereCount * sizeof(struct Sphere));
+    memcpy(addRects(scene, rectCount), rects, rectCount * sizeof(struct Rect));
+    memcpy(addObjects(scene, objectCount), objects, objectCount * sizeof(struct Object));
+    memcpy(addInstances(scene, instanceCount), instances, instanceCount * sizeof(struct Instance));
+    return scene;
+}
+
+struct Scene* createShowcaseScene() {
+    static const struct Texture textures[] = {
+        { .albedo = { 1, 1, 1 }, .type = CHECKERED, .property1 = 1, .property2 = 2 },
+        { .albedo = { 1.0f, 0.75f, 0.75f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 0.5f, 0.5f, 0.75f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 1, 1, 1 }, .type = IMAGE, .property1 = 0, .property2 = 0 },
+        { .albedo = { 1, 1, 1 }, .type = IMAGE, .property1 = 1, .property2 = 0 }
+    };
+
+    static const struct Material materials[] = {
+        { DIELECTRIC, 1, 1.5f },
+        { DIFFUSE, 3, 0.0f },
+        { DIFFUSE_LIGHT, 1, 0.25f },
+        { DIFFUSE, 0, 0 },
+        { DIFFUSE_LIGHT, 2, 0 },
+        { METAL, 1, 0.25f },
+        { DIFFUSE, 4, 0 },
+        { DIFFUSE, 1, 0 }
+    };
+
+    static const struct Sphere spheres[] = {
+        { .center = { 0, 0, -3 }, .radius = 1, .material = 6 },
+        { .center = { 3, 0, -4 }, .radius = 1, .material = 1 },
+        { .center = { -2, 0, -4 }, .radius = 1, .material = 0 },
+        { .center = { 2, 0, -2 }, .radius = 1, .material = 5 },
+        { .center = { -1.5f, 0, -6 }, .radius = 1, .material = 5 },
+        { .center = { 3, 0, -6 }, .radius = 1, .material = 0 },
+        { .center = { -1, 0, -1 }, .radius = 1, .material = 7 },
+        { .center = { 0.5f, 0, -5 }, .radius = 1, .material = 7 },
+        { .center = { 0, -1001, -3 }, .radius = 1000, .material = 5 }
+    };
+
+    static const struct Rect rects[] = {
+        { XY, -7, 7, -20, 20, 3, 2 },
+        { XY, -7, 7, -20, 20, -11, 4 }
+    };
+
+    return copyScene(
+        textures, COUNT(textures), materials, COUNT(materials),
+        spheres, COUNT(spheres), rects, COUNT(rects),
+        0, 0, 0, 0
+    );
+}
+
+struct Scene* createThreeSpheresScene() {
+    static const struct Texture textures[] = {
+        { .albedo = { 1, 1, 1 }, .type = IMAGE, .property1 = 1, .property2 = 0 },
+        { .albedo = { 0, 0, 0 }, .type = CHECKERED, .property1 = 2, .property2 = 3 },
+        { .albedo = { 0.9f, 0.9f, 0.9f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 0, 0, 0 }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 1, 0, 0 }, .type = IMAGE, .property1 = 0, .property2 = 0 },
+
+        { .albedo = { 0.73f, 0.73f, 0.73f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 0.73f, 0.5f, 0.5f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 },
+        { .albedo = { 1, 1, 1 }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 }
+    };
+
+    static const struct Material materials[] = {
+        { DIFFUSE_LIGHT, 7, 0 }, // Emission
+        { DIFFUSE, 1, 0 }, // Ground
+        { DIELECTRIC, 0, 1.5f }, // Scene object 1
+        { METAL, 0, 0 }, // Scene object 2
+        { DIFFUSE, 0, 0 }, // Scene object 3
+        { DIFFUSE, 5, 0 },
+        { DIFFUSE, 6, 0 }
+    };
+
+    static const struct Sphere spheres[] = {
+        { .center = { 0, -1001, 0 }, .radius = 1000, .material = 1 }, // Ground
+        { .center = { 0, 0, 0 }, .radius = 1, .material = 2 }, // Scene object 1
+        { .center = { -2, 0, 0 }, .radius = 1, .material = 4 }, // Scene object 2
+        { .center = { 2, 0, 0 }, .radius = 1, .material = 3 } // Scene object 3
+    };
+
+    static const struct Rect rects[] = {
+        { XY, -7, 7, 0, 10, 5, 0 }, // Light 1
+        { XY, -7, 7, -1, 10, -3, 5 },
+        { YZ, -7, 7, -10, 10, -5, 6 }
+    };
+
+    return copyScene(
+        textures, COUNT(textures), materials, COUNT(materials),
+        spheres, COUNT(spheres), rects, COUNT(rects),
+        0, 0, 0, 0
+    );
+}
+
+struct Scene* createCornellBoxScene() {
+    static const struct Texture textures[] = {
+        { .albedo = { 0.65f, 0.05f, 0.05f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 }, // Red
+        { .albedo = { 0.12f, 0.45f, 0.15f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 }, // Green
+        { .albedo = { 0.73f, 0.73f, 0.73f }, .type = SOLID_COLOR, .property1 = 0, .property2 = 0 }, // White
+        { .albedo = { 1, 1, 1 }, .type = IMAGE, .property1 = 2, .property2 = 0 }
+    };
+
+    static const struct Material materials[] = {
+        { DIFFUSE, 0, 0 }, // Red wall
+        { DIFFUSE, 1, 0 }, // Green wall
+        { DIFFUSE, 2, 0 }, // White wall
+        { DIFFUSE_LIGHT, 3, 0 }, // Light
+        { DIFFUSE, 4, 0 },
+        { DIELECTRIC, 2, 1.5f },
+        { METAL, 2, 0.25f }
+    };
+
+    static const struct Sphere spheres[] = {
+        { .center = { 215, 215, 130 }, .radius = 50, .material = 5 },
+        { .center = { 400, 50, 100 }, .radius = 50, .material = 6 }
+    };
+
+    static const struct Rect rects[] = {
+        { YZ, 0, 555, 0, 555, 555, 1 },
+        { YZ, 0, 555, 0, 555, 0, 3 },
+        { XZ, 0, 555, 0, 555, 555, 2 },
+        { XZ, 0, 555, 0, 555, 0, 2 },
+        { XY, 0, 555, 0, 555, 555, 1 },
+
+        // Unit box, placed twice by the instances below
+        { XY, 0, 1, 0, 1, 1, 2 },
+        { XY, 0, 1, 0, 1, 0, 2 },
+
+        { XZ, 0, 1, 0, 1, 1, 2 },
+        { XZ, 0, 1, 0, 1, 0, 2 },
+
+        { YZ, 0, 1, 0, 1, 1, 2 },
+        { YZ, 0, 1, 0, 1, 0, 2 }
+    };
+
+    static const struct Object objects[] = {
+        { 0, 2, 0, 5 }, // Room
+        { 0, 0, 5, 6 } // Box
+    };
+
+    static const struct Instance instances[] = {
+        { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }, 0 },
+        { { { 165, 0, 0, 130 }, { 0, 165, 0, 0 }, { 0, 0, 165, 65 } }, 1 },
+        { { { 165, 0, 0, 265 }, { 0, 555, 0, 0 }, { 0, 0, 165, 295 } }, 1 }
+    };
+
+    return copyScene(
+        textures, COUNT(textures), materials, COUNT(materials),
+        spheres, COUNT(spheres), rects, COUNT(rects),
+        objects, COUNT(objects), instances, COUNT(instances)
+    );
+}
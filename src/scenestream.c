@@ -0,0 +1,377 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "scenestream.h"
+#include "scenefile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+struct StreamChunk {
+    struct Object range; // Into the file's spheres and rects, which end up at the same indices in the scene
+    struct BVH* bvh;
+};
+
+struct SceneStream {
+    struct SceneFileView file;
+    struct Scene view; // Points into the mapped file, only the primitive arrays are set
+    struct BVHSettings settings;
+
+    unsigned int chunkCount;
+    struct StreamChunk* chunks;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    _Bool cancel;
+
+    // Written by the worker under the lock. A chunk whose BVH failed to build
+    // ends the stream there, failed is set instead of refined.
+    unsigned int builtCount;
+    struct TLAS* refined;
+    _Bool failed;
+
+    // Only touched by the main thread
+    unsigned int appendedCount;
+    _Bool finished;
+};
+
+// Primitives before the end of chunk, spheres first in proportion to their share
+// so every chunk mixes both as the whole scene does
+static struct Object chunkEnd(const struct SceneStream* stream, unsigned long long end) {
+    unsigned long long sphereCount = stream->view.sphereCount;
+    unsigned long long total = sphereCount + stream->view.rectCount;
+    struct Object prefix = { 0, 0, 0, 0 };
+    if(total) {
+        prefix.sphereCount = (unsigned int)(end * sphereCount / total);
+        prefix.rectCount = (unsigned int)(end - prefix.sphereCount);
+    }
+    return prefix;
+}
+
+// Chunks start at SCENE_STREAM_FIRST_CHUNK primitives and double up to SCENE_STREAM_MAX_CHUNK
+static _Bool planChunks(struct SceneStream* stream) {
+    unsigned long long total = (unsigned long long)stream->view.sphereCount + stream->view.rectCount;
+    unsigned long long size = SCENE_STREAM_FIRST_CHUNK;
+    unsigned int count = 1;
+    for(unsigned long long end = size; end < total; end += size) {
+        size = size * 2 < SCENE_STREAM_MAX_CHUNK ? size * 2 : SCENE_STREAM_MAX_CHUNK;
+        count++;
+    }
+
+    stream->chunks = calloc(count, sizeof(struct StreamChunk));
+    if(!stream->chunks) {
+        return 0;
+    }
+    stream->chunkCount = count;
+
+    unsigned long long first = 0;
+    size = SCENE_STREAM_FIRST_CHUNK;
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned long long end = first + size < total ? first + size : total;
+        struct Object from = chunkEnd(stream, first), to = chunkEnd(stream, end);
+        struct Object range = { from.sphereCount, to.sphereCount - from.sphereCount, from.rectCount, to.rectCount - from.rectCount };
+        stream->chunks[i].range = range;
+
+        first = end;
+        size = size * 2 < SCENE_STREAM_MAX_CHUNK ? size * 2 : SCENE_STREAM_MAX_CHUNK;
+    }
+    return 1;
+}
+
+// Builds the chunks after the first in order, then the BVH over everything. The
+// view is only read, so the main thread copies from the file at the same time.
+static void* streamWorker(void* argument) {
+    struct SceneStream* stream = argument;
+    for(unsigned int i = 1; i < stream->chunkCount; i++) {
+        pthread_mutex_lock(&stream->lock);
+        _Bool cancel = stream->cancel;
+        pthread_mutex_unlock(&stream->lock);
+        if(cancel) {
+            return 0;
+        }
+
+        struct BVH* bvh = buildObjectBVH(&stream->view, &stream->chunks[i].range, &stream->settings);
+        pthread_mutex_lock(&stream->lock);
+        if(bvh) {
+            stream->chunks[i].bvh = bvh;
+            stream->builtCount = i + 1;
+        } else {
+            stream->failed = 1;
+        }
+        pthread_mutex_unlock(&stream->lock);
+        if(!bvh) {
+            return 0;
+        }
+    }
+
+    // Scenes that fit the first chunk already have their final BVH
+    if(stream->chunkCount == 1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    _Bool cancel = stream->cancel;
+    pthread_mutex_unlock(&stream->lock);
+    if(cancel) {
+        return 0;
+    }
+
+    // The view has no objects, so the TLAS gets a single one over everything
+    struct TLAS* refined = buildTLAS(&stream->view, &stream->settings);
+    pthread_mutex_lock(&stream->lock);
+    stream->refined = refined;
+    stream->failed = !refined;
+    pthread_mutex_unlock(&stream->lock);
+    return 0;
+}
+
+// Textures, materials and the first chunk, with room for the rest of the file
+static struct Scene* loadFirstChunk(struct SceneStream* stream) {
+    struct Scene* scene = createScene();
+    if(!scene) {
+        return 0;
+    }
+
+    // Every later chunk adds an object and an instance, and the first one becomes
+    // an object of its own then too
+    const unsigned int* counts = stream->file.counts;
+    unsigned int capacities[SCENE_ARRAY_COUNT] = { 0 };
+    capacities[SCENE_TEXTURES] = counts[SCENE_SECTION_TEXTURES];
+    capacities[SCENE_MATERIALS] = counts[SCENE_SECTION_MATERIALS];
+    capacities[SCENE_SPHERES] = counts[SCENE_SECTION_SPHERES];
+    capacities[SCENE_RECTS] = counts[SCENE_SECTION_RECTS];
+    capacities[SCENE_OBJECTS] = stream->chunkCount;
+    capacities[SCENE_INSTANCES] = stream->chunkCount;
+    if(!reserveScene(scene, capacities)) {
+        freeScene(scene);
+        return 0;
+    }
+
+    // Reserved above, so adding doesn't move the arrays
+    struct Object first = stream->chunks[0].range;
+    memcpy(addTextures(scene, counts[SCENE_SECTION_TEXTURES]), stream->file.sections[SCENE_SECTION_TEXTURES],
+        counts[SCENE_SECTION_TEXTURES] * sizeof(struct Texture));
+    memcpy(addMaterials(scene, counts[SCENE_SECTION_MATERIALS]), stream->file.sections[SCENE_SECTION_MATERIALS],
+        counts[SCENE_SECTION_MATERIALS] * sizeof(struct Material));
+    memcpy(addSpheres(scene, first.sphereCount), stream->view.spheres, first.sphereCount * sizeof(struct Sphere));
+    memcpy(addRects(scene, first.rectCount), stream->view.rects, first.rectCount * sizeof(struct Rect));
+    return scene;
+}
+
+static void freeStream(struct SceneStream* stream) {
+    for(unsigned int i = 0; i < stream->chunkCount; i++) {
+        if(stream->chunks[i].bvh) {
+            freeBVH(stream->chunks[i].bvh);
+        }
+    }
+    if(stream->refined) {
+        freeTLAS(stream->refined);
+    }
+    free(stream->chunks);
+    closeSceneFile(&stream->file);
+    free(stream);
+}
+
+struct SceneStream* openSceneStream(const char* path, const struct BVHSettings* settings, struct Scene** scene) {
+    struct SceneStream* stream = calloc(1, sizeof(struct SceneStream));
+    if(!stream) {
+        fprintf(stderr, "Failed to allocate the stream of %s\n", path);
+        return 0;
+    }
+    if(!openSceneFile(path, &stream->file)) {
+        free(stream);
+        return 0;
+    }
+    if(stream->file.counts[SCENE_SECTION_OBJECTS]) {
+        closeSceneFile(&stream->file);
+        free(stream);
+        return 0;
+    }
+
+    struct BVHSettings defaults = BVH_DEFAULT_SETTINGS;
+    stream->settings = settings ? *settings : defaults;
+    stream->view.sphereCount = stream->file.counts[SCENE_SECTION_SPHERES];
+    stream->view.spheres = (struct Sphere*)stream->file.sections[SCENE_SECTION_SPHERES];
+    stream->view.rectCount = stream->file.counts[SCENE_SECTION_RECTS];
+    stream->view.rects = (struct Rect*)stream->file.sections[SCENE_SECTION_RECTS];
+
+    if(!planChunks(stream) || !(*scene = loadFirstChunk(stream))) {
+        fprintf(stderr, "Failed to allocate scene %s\n", path);
+        freeStream(stream);
+        return 0;
+    }
+
+    stream->builtCount = 1;
+    stream->appendedCount = 1;
+    pthread_mutex_init(&stream->lock, 0);
+    if(pthread_create(&stream->thread, 0, streamWorker, stream) != 0) {
+        fprintf(stderr, "Failed to start streaming %s\n", path);
+        pthread_mutex_destroy(&stream->lock);
+        freeScene(*scene);
+        freeStream(stream);
+        return 0;
+    }
+    return stream;
+}
+
+// Adds the elements that differ between a and b to range
+static void addDifferences(struct SceneRange* range, const void* a, const void* b, unsigned int count, size_t size) {
+    const unsigned char* x = a;
+    const unsigned char* y = b;
+    unsigned int first = 0, end = count;
+    while(first < end && !memcmp(x + first * size, y + first * size, size)) {
+        first++;
+    }
+    while(end > first && !memcmp(x + (end - 1) * size, y + (end - 1) * size, size)) {
+        end--;
+    }
+
+    if(first < end) {
+        _Bool empty = range->first >= range->end;
+        range->first = empty || first < range->first ? first : range->first;
+        range->end = empty || end > range->end ? end : range->end;
+    }
+}
+
+// Whether the scene still has the file's spheres and rects at the file's indices,
+// only edited in place, and no objects besides the chunks
+static _Bool matchesFile(const struct SceneStream* stream, const struct Scene* scene) {
+    return scene->sphereCount == stream->view.sphereCount && scene->rectCount == stream->view.rectCount &&
+        scene->objectCount == stream->chunkCount && scene->instanceCount == stream->chunkCount;
+}
+
+// Puts the BVH over the whole scene in place of the chunks, taking refined on
+// success. It was built from the file, so spheres and rects edited while the
+// scene was streaming count as edited again for updateTLASObjects to catch up.
+// Fails when spheres or rects were inserted or removed, the refined BVH's
+// references don't match the scene then.
+static _Bool swapRefined(struct SceneStream* stream, struct Scene* scene, struct TLAS** tlas, struct TLAS* refined) {
+    if(!matchesFile(stream, scene)) {
+        fprintf(stderr, "Keeping the streamed chunks, the scene changed size while streaming\n");
+        return 0;
+    }
+
+    // The scene goes back to having no objects, the refined TLAS was built over the implicit one
+    unsigned int objectCount = scene->objectCount, instanceCount = scene->instanceCount;
+    scene->objectCount = 0;
+    scene->instanceCount = 0;
+
+    refined->stackless = (*tlas)->stackless;
+    refined->compressLeaves = (*tlas)->compressLeaves;
+    refined->gridMode = (*tlas)->gridMode;
+    refined->gridSettings = (*tlas)->gridSettings;
+    if(!uploadTLAS(refined, scene)) {
+        // The buffers may be bound to the refined TLAS's by now
+        scene->objectCount = objectCount;
+        scene->instanceCount = instanceCount;
+        uploadTLAS(*tlas, scene);
+        fprintf(stderr, "Failed to upload the BVH over the whole streamed scene\n");
+        return 0;
+    }
+
+    addDifferences(&scene->editedSpheres, scene->spheres, stream->view.spheres, scene->sphereCount, sizeof(struct Sphere));
+    addDifferences(&scene->editedRects, scene->rects, stream->view.rects, scene->rectCount, sizeof(struct Rect));
+    freeTLAS(*tlas);
+    *tlas = refined;
+    return 1;
+}
+
+_Bool updateSceneStream(struct SceneStream* stream, struct Scene* scene, struct TLAS** tlas) {
+    if(stream->finished) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    unsigned int builtCount = stream->builtCount;
+    struct TLAS* refined = stream->refined;
+    _Bool failed = stream->failed;
+    stream->refined = 0;
+    pthread_mutex_unlock(&stream->lock);
+
+    _Bool changed = 0;
+    for(; stream->appendedCount < builtCount; stream->appendedCount++) {
+        struct StreamChunk* chunk = &stream->chunks[stream->appendedCount];
+        struct Object range = chunk->range;
+        _Bool shifted = scene->sphereCount != range.firstSphere || scene->rectCount != range.firstRect;
+        if(!appendObject(scene, &stream->view.spheres[range.firstSphere], range.sphereCount,
+            &stream->view.rects[range.firstRect], range.rectCount)) {
+            failed = 1;
+            break;
+        }
+
+        // Spheres or rects inserted or removed since the stream started moved the
+        // chunk away from the file's indices its BVH refers to
+        if(shifted) {
+            struct Object object = sceneObject(scene, scene->objectCount - 1);
+            struct BVH* bvh = buildObjectBVH(scene, &object, &stream->settings);
+            if(!bvh) {
+                scene->instanceCount--;
+                failed = 1;
+                break;
+            }
+            freeBVH(chunk->bvh);
+            chunk->bvh = bvh;
+        }
+        if(!addTLASObject(*tlas, scene, chunk->bvh)) {
+            // The object stays in the scene, but without its instance nothing refers to it
+            scene->instanceCount--;
+            failed = 1;
+            break;
+        }
+        chunk->bvh = 0;
+        changed = 1;
+    }
+
+    if(changed && (!rebuildTopLevel(*tlas, scene, &stream->settings) || !uploadTLAS(*tlas, scene))) {
+        fprintf(stderr, "Failed to update the acceleration structure of the streamed scene\n");
+    }
+
+    // The chunks stay when the final BVH fails, they cover the whole scene just as well
+    if(stream->appendedCount == stream->chunkCount && (refined || failed || stream->chunkCount == 1)) {
+        if(refined && swapRefined(stream, scene, tlas, refined)) {
+            refined = 0;
+            changed = 1;
+        } else if(failed) {
+            fprintf(stderr, "Keeping the streamed chunks, the BVH over the whole scene failed\n");
+        }
+        stream->finished = 1;
+    } else if(failed) {
+        fprintf(stderr, "Stopped streaming after %u of %u chunks\n", stream->appendedCount, stream->chunkCount);
+        stream->finished = 1;
+    }
+
+    if(refined) {
+        freeTLAS(refined);
+    }
+    return changed;
+}
+
+_Bool sceneStreamFinished(const struct SceneStream* stream) {
+    return stream->finished;
+}
+
+void closeSceneStream(struct SceneStream* stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->cancel = 1;
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->thread, 0);
+    pthread_mutex_destroy(&stream->lock);
+    freeStream(stream);
+}
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Returns null-terminated string
 inline char* fileRead(const char* path)
@@ -32,14 +33,29 @@ inline char* fileRead(const char* path)
 }
 
 GLuint shaderCreate(const char* path, GLenum type)
-{       
+{
+    return shaderCreateWithDefines(path, type, 0);
+}
+
+GLuint shaderCreateWithDefines(const char* path, GLenum type, const char* defines)
+{
     char* src = fileRead(path);
     if(!src) {
         return 0;
     }
 
+    // Defines have to come after the #version directive
+    char* body = src;
+    if(strncmp(src, "#version", 8) == 0) {
+        body = strchr(src, '\n');
+        body = body ? body + 1 : src + strlen(src);
+    }
+
+    const GLchar* sources[] = { src, defines ? defines : "", "\n", body };
+    GLint lengths[] = { (GLint)(body - src), -1, -1, -1 };
+
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &src, 0);
+    glShaderSource(shader, 4, sources, lengths);
     glCompileShader(shader);
 
     free(src);
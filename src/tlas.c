@@ -0,0 +1,666 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "tlas.h"
+#include "bvhcache.h"
+#include "bvhleaf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glad/glad.h>
+
+// std430 layout of Instance in raytracer.glsl
+struct GPUInstance {
+    float worldToObject[3][4];
+    unsigned int nodeOffset;
+    unsigned int primitiveOffset;
+    unsigned int format;
+    unsigned int compressed;
+};
+
+_Static_assert(sizeof(struct GPUInstance) == 64, "GPUInstance must match the std430 layout of Instance");
+
+// Rounded up to an even count, so every BVH starts on a wide node boundary
+static unsigned int maxNodeCount(unsigned int primitiveCount) {
+    return primitiveCount ? 2 * primitiveCount : 2;
+}
+
+static _Bool invertTransform(const float m[3][4], float inverse[3][4]) {
+    float c0 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    float c1 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    float c2 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    float det = m[0][0] * c0 + m[0][1] * c1 + m[0][2] * c2;
+    if(det == 0) {
+        return 0;
+    }
+
+    float s = 1.0f / det;
+    inverse[0][0] = c0 * s;
+    inverse[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * s;
+    inverse[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * s;
+    inverse[1][0] = c1 * s;
+    inverse[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * s;
+    inverse[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * s;
+    inverse[2][0] = c2 * s;
+    inverse[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * s;
+    inverse[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * s;
+
+    for(int i = 0; i < 3; i++) {
+        inverse[i][3] = -(inverse[i][0] * m[0][3] + inverse[i][1] * m[1][3] + inverse[i][2] * m[2][3]);
+    }
+    return 1;
+}
+
+// World space bounds of a transformed box, as six floats like buildBVHFromBounds takes them
+static void transformBounds(const float m[3][4], const struct BVHNode* box, float* bounds) {
+    for(int i = 0; i < 3; i++) {
+        float min = m[i][3], max = m[i][3];
+        for(int j = 0; j < 3; j++) {
+            float a = m[i][j] * box->min[j], b = m[i][j] * box->max[j];
+            min += a < b ? a : b;
+            max += a < b ? b : a;
+        }
+        bounds[i] = min;
+        bounds[3 + i] = max;
+    }
+}
+
+// Loads the objects' BVHs from cachePath when it has them and saves them there
+// otherwise. Without a cachePath every object is built.
+static struct TLAS* createTLAS(const struct Scene* scene, const struct BVHSettings* settings, const char* cachePath) {
+    struct TLAS* tlas = calloc(1, sizeof(struct TLAS));
+    if(!tlas) {
+        return 0;
+    }
+
+    unsigned int objectCount = sceneObjectCount(scene);
+    tlas->objects = calloc(objectCount, sizeof(struct BVH*));
+    tlas->nodeOffsets = calloc(objectCount, sizeof(unsigned int));
+    tlas->primitiveOffsets = calloc(objectCount, sizeof(unsigned int));
+    tlas->formats = calloc(objectCount, sizeof(enum BVHFormat));
+    tlas->gridOffsets = calloc(objectCount, sizeof(unsigned int));
+    tlas->compressed = calloc(objectCount, sizeof(_Bool));
+    tlas->objectRanges = calloc(objectCount, sizeof(struct Object));
+    if(!tlas->objects || !tlas->nodeOffsets || !tlas->primitiveOffsets || !tlas->formats || !tlas->gridOffsets || !tlas->compressed ||
+        !tlas->objectRanges) {
+        fprintf(stderr, "Failed to allocate TLAS for %u objects\n", objectCount);
+        freeTLAS(tlas);
+        return 0;
+    }
+
+    struct GridSettings gridSettings = GRID_DEFAULT_SETTINGS;
+    tlas->gridMode = GRID_AUTO;
+    tlas->gridSettings = gridSettings;
+
+    for(unsigned int i = 0; i < objectCount; i++) {
+        tlas->objectRanges[i] = sceneObject(scene, i);
+    }
+
+    unsigned long long key = cachePath ? hashBVHInput(scene, settings) : 0;
+    if(cachePath && loadBVHCache(cachePath, key, tlas->objectRanges, tlas->objects, objectCount)) {
+        tlas->objectCount = objectCount;
+    } else {
+        for(unsigned int i = 0; i < objectCount; i++) {
+            struct Object object = sceneObject(scene, i);
+            tlas->objects[i] = buildObjectBVH(scene, &object, settings);
+            if(!tlas->objects[i]) {
+                freeTLAS(tlas);
+                return 0;
+            }
+            tlas->objectCount++;
+        }
+
+        // A cache that can't be written only costs the next launch a rebuild
+        if(cachePath) {
+            saveBVHCache(cachePath, key, tlas->objects, objectCount);
+        }
+    }
+
+    if(!rebuildTopLevel(tlas, scene, settings)) {
+        freeTLAS(tlas);
+        return 0;
+    }
+    return tlas;
+}
+
+struct TLAS* buildTLAS(const struct Scene* scene, const struct BVHSettings* settings) {
+    return createTLAS(scene, settings, 0);
+}
+
+struct TLAS* buildCachedTLAS(const struct Scene* scene, const struct BVHSettings* settings, const char* cachePath) {
+    return createTLAS(scene, settings, cachePath);
+}
+
+_Bool rebuildTopLevel(struct TLAS* tlas, const struct Scene* scene, const struct BVHSettings* settings) {
+    unsigned int count = sceneInstanceCount(scene);
+    float* bounds = malloc((count ? count : 1) * 6 * sizeof(float));
+    unsigned int* instances = malloc((count ? count : 1) * sizeof(unsigned int));
+    if(!bounds || !instances) {
+        fprintf(stderr, "Failed to allocate the top level for %u instances\n", count);
+        free(bounds);
+        free(instances);
+        return 0;
+    }
+
+    unsigned int used = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        const struct Instance* instance = sceneInstance(scene, i);
+        if(instance->object >= tlas->objectCount) {
+            fprintf(stderr, "Instance %u refers to missing object %u\n", i, instance->object);
+            free(bounds);
+            free(instances);
+            return 0;
+        }
+
+        // Empty objects are never hit, their inverted bounds would only get in the way
+        const struct BVH* object = tlas->objects[instance->object];
+        if(object->primitiveCount == 0) {
+            continue;
+        }
+
+        transformBounds(instance->transform, &object->nodes[0], &bounds[6 * used]);
+        instances[used++] = i;
+    }
+
+    // The top level's room in the node buffer only fits one reference per instance
+    struct BVHSettings topLevelSettings = BVH_DEFAULT_SETTINGS;
+    if(settings) {
+        topLevelSettings = *settings;
+    }
+    topLevelSettings.spatialSplitBudget = 0;
+
+    // Instances are never compressed, larger leaves would only slow the top level down
+    topLevelSettings.minLeafSize = 1;
+
+    struct BVH* topLevel = buildBVHFromBounds(bounds, used, &topLevelSettings);
+    free(bounds);
+    if(!topLevel) {
+        free(instances);
+        return 0;
+    }
+
+    // Map the boxes back to the instances they came from
+    for(unsigned int i = 0; i < used; i++) {
+        topLevel->primitives[i] = instances[topLevel->primitives[i]];
+    }
+    free(instances);
+
+    if(tlas->topLevel) {
+        freeBVH(tlas->topLevel);
+    }
+    tlas->topLevel = topLevel;
+    return 1;
+}
+
+static _Bool overlaps(unsigned int first, unsigned int count, struct SceneRange range) {
+    return range.first < range.end && first < range.end && range.first < first + count;
+}
+
+static _Bool uploadChangedObjects(struct TLAS* tlas, const struct Scene* scene, const _Bool* changed);
+
+_Bool updateTLASObjects(struct TLAS* tlas, struct Scene* scene, const struct BVHSettings* settings) {
+    if(!sceneGeometryEdited(scene)) {
+        return 1;
+    }
+
+    _Bool* changed = calloc(tlas->objectCount ? tlas->objectCount : 1, sizeof(_Bool));
+    if(!changed) {
+        fprintf(stderr, "Failed to allocate TLAS updates for %u objects\n", tlas->objectCount);
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        struct Object object = sceneObject(scene, i);
+        _Bool moved = memcmp(&object, &tlas->objectRanges[i], sizeof(struct Object)) != 0;
+        if(!moved && !overlaps(object.firstSphere, object.sphereCount, scene->editedSpheres) &&
+            !overlaps(object.firstRect, object.rectCount, scene->editedRects)) {
+            continue;
+        }
+
+        // Refitting keeps the references, so objects whose primitives were
+        // inserted, removed or moved along with those are built again
+        changed[i] = 1;
+        if(moved || !refitBVH(tlas->objects[i], scene)) {
+            struct BVH* bvh = buildObjectBVH(scene, &object, settings);
+            if(!bvh) {
+                free(changed);
+                return 0;
+            }
+            freeBVH(tlas->objects[i]);
+            tlas->objects[i] = bvh;
+            tlas->objectRanges[i] = object;
+        }
+    }
+
+    struct SceneRange empty = { 0, 0 };
+    scene->editedSpheres = empty;
+    scene->editedRects = empty;
+    _Bool ok = rebuildTopLevel(tlas, scene, settings) && (uploadChangedObjects(tlas, scene, changed) || uploadTLAS(tlas, scene));
+    free(changed);
+    return ok;
+}
+
+// Grows one of the per object arrays by an element, zeroed
+static _Bool growObjectArray(void** array, unsigned int count, size_t elementSize) {
+    unsigned char* grown = realloc(*array, (count + 1) * elementSize);
+    if(!grown) {
+        return 0;
+    }
+    memset(grown + count * elementSize, 0, elementSize);
+    *array = grown;
+    return 1;
+}
+
+_Bool addTLASObject(struct TLAS* tlas, const struct Scene* scene, struct BVH* bvh) {
+    unsigned int count = tlas->objectCount;
+    if(sceneObjectCount(scene) <= count) {
+        fprintf(stderr, "Scene has no object %u for the TLAS to add\n", count);
+        return 0;
+    }
+
+    // Arrays that already grew just have room to spare when a later one fails
+    if(!growObjectArray((void**)&tlas->objects, count, sizeof(struct BVH*)) ||
+        !growObjectArray((void**)&tlas->nodeOffsets, count, sizeof(unsigned int)) ||
+        !growObjectArray((void**)&tlas->primitiveOffsets, count, sizeof(unsigned int)) ||
+        !growObjectArray((void**)&tlas->formats, count, sizeof(enum BVHFormat)) ||
+        !growObjectArray((void**)&tlas->gridOffsets, count, sizeof(unsigned int)) ||
+        !growObjectArray((void**)&tlas->compressed, count, sizeof(_Bool)) ||
+        !growObjectArray((void**)&tlas->objectRanges, count, sizeof(struct Object))) {
+        fprintf(stderr, "Failed to grow TLAS to %u objects\n", count + 1);
+        return 0;
+    }
+
+    tlas->objects[count] = bvh;
+    tlas->objectRanges[count] = sceneObject(scene, count);
+    tlas->objectCount++;
+    return 1;
+}
+
+_Bool uploadTLASInstances(struct TLAS* tlas, const struct Scene* scene) {
+    // Stored in the order of the top level's primitives, so its leaves index them directly
+    unsigned int instanceCount = tlas->topLevel->primitiveCount;
+    struct GPUInstance* instances = calloc(instanceCount ? instanceCount : 1, sizeof(struct GPUInstance));
+    if(!instances) {
+        fprintf(stderr, "Failed to allocate %u instances\n", instanceCount);
+        return 0;
+    }
+
+    for(unsigned int i = 0; i < instanceCount; i++) {
+        unsigned int index = tlas->topLevel->primitives[i];
+        const struct Instance* instance = sceneInstance(scene, index);
+        if(!invertTransform(instance->transform, instances[i].worldToObject)) {
+            fprintf(stderr, "Instance %u has a singular transform\n", index);
+            free(instances);
+            return 0;
+        }
+        instances[i].nodeOffset = tlas->formats[instance->object] == BVH_GRID ?
+            tlas->gridOffsets[instance->object] : tlas->nodeOffsets[instance->object];
+        instances[i].primitiveOffset = tlas->primitiveOffsets[instance->object];
+        instances[i].format = tlas->formats[instance->object];
+        instances[i].compressed = tlas->compressed[instance->object];
+    }
+
+    if(!tlas->instanceBuffer) {
+        glGenBuffers(1, &tlas->instanceBuffer);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->instanceBuffer);
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER, (instanceCount ? instanceCount : 1) * sizeof(struct GPUInstance),
+        instances, GL_STATIC_DRAW
+    );
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    free(instances);
+
+    if(glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "Failed to upload %u instances\n", instanceCount);
+        return 0;
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TLAS_INSTANCE_BINDING, tlas->instanceBuffer);
+    return 1;
+}
+
+// Links are indexed like the nodes, the unused slots of each object's region stay 0
+static _Bool uploadSkipLinks(struct TLAS* tlas) {
+    unsigned int* skips = calloc(tlas->nodeCount, sizeof(unsigned int));
+    if(!skips) {
+        fprintf(stderr, "Failed to allocate %u skip links\n", tlas->nodeCount);
+        return 0;
+    }
+
+    computeSkipLinks(tlas->topLevel, skips);
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        computeSkipLinks(tlas->objects[i], &skips[tlas->nodeOffsets[i]]);
+    }
+
+    if(!tlas->skipBuffer) {
+        glGenBuffers(1, &tlas->skipBuffer);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->skipBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, tlas->nodeCount * sizeof(unsigned int), skips, GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    free(skips);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH_SKIP_BINDING, tlas->skipBuffer);
+    return 1;
+}
+
+// Builds the grids of the objects gridMode picks and marks those objects BVH_GRID,
+// the rest are marked binary until uploadTLAS stores their BVHs
+static _Bool uploadGrids(struct TLAS* tlas, const struct Scene* scene) {
+    struct Grid** grids = calloc(tlas->objectCount ? tlas->objectCount : 1, sizeof(struct Grid*));
+    if(!grids) {
+        fprintf(stderr, "Failed to allocate grids for %u objects\n", tlas->objectCount);
+        return 0;
+    }
+
+    unsigned int wordCount = 0;
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        struct Object object = sceneObject(scene, i);
+        _Bool wanted = tlas->gridMode == GRID_ALWAYS || (tlas->gridMode == GRID_AUTO && preferGrid(scene, &object));
+
+        // Objects without a grid, empty ones or those too large for it, keep their BVH
+        grids[i] = wanted ? buildGrid(scene, &object, &tlas->gridSettings) : 0;
+        tlas->formats[i] = grids[i] ? BVH_GRID : BVH_BINARY;
+        if(grids[i]) {
+            tlas->gridOffsets[i] = wordCount;
+            wordCount += gridWordCount(grids[i]);
+        }
+    }
+
+    unsigned int* words = calloc(wordCount ? wordCount : 1, sizeof(unsigned int));
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        if(grids[i]) {
+            if(words) {
+                writeGrid(grids[i], &words[tlas->gridOffsets[i]]);
+            }
+            freeGrid(grids[i]);
+        }
+    }
+    free(grids);
+
+    if(!words) {
+        fprintf(stderr, "Failed to allocate %u words of grids\n", wordCount);
+        return 0;
+    }
+
+    if(!tlas->gridBuffer) {
+        glGenBuffers(1, &tlas->gridBuffer);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->gridBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (wordCount ? wordCount : 1) * sizeof(unsigned int), words, GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    free(words);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GRID_BINDING, tlas->gridBuffer);
+    return 1;
+}
+
+// Writes an object's nodes, 4-wide when they fit the format, and its primitive
+// references or compressed leaves into the buffers
+static _Bool uploadObject(struct TLAS* tlas, const struct Scene* scene, unsigned int index, unsigned int leafWordCount) {
+    struct BVH object = *tlas->objects[index];
+    if(leafWordCount) {
+        struct BVHNode* nodes = malloc(object.nodeCount * sizeof(struct BVHNode));
+        unsigned int* words = malloc(leafWordCount * sizeof(unsigned int));
+        if(!nodes || !words) {
+            fprintf(stderr, "Failed to allocate %u words of compressed leaves\n", leafWordCount);
+            free(nodes);
+            free(words);
+            return 0;
+        }
+
+        compressLeaves(scene, tlas->objects[index], words, nodes);
+        object.nodes = nodes;
+        object.primitives = words;
+        object.primitiveCount = leafWordCount;
+    }
+    tlas->compressed[index] = leafWordCount != 0;
+
+    if(tlas->formats[index] != BVH_GRID) {
+        GLintptr offset = tlas->nodeOffsets[index] * sizeof(struct BVHNode);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->nodeBuffer);
+
+        // Objects that don't fit the wide format stay binary
+        unsigned int wideCount;
+        struct BVH4Node* wide = tlas->stackless ? 0 : collapseBVH(&object, &wideCount);
+        if(wide) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, wideCount * sizeof(struct BVH4Node), wide);
+            tlas->formats[index] = BVH_WIDE;
+            free(wide);
+        } else {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, object.nodeCount * sizeof(struct BVHNode), object.nodes);
+            tlas->formats[index] = BVH_BINARY;
+        }
+    }
+
+    // Grids read their own references, but the LBVH can still turn the object back into a BVH
+    if(object.primitiveCount) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->primitiveBuffer);
+        glBufferSubData(
+            GL_SHADER_STORAGE_BUFFER, tlas->primitiveOffsets[index] * sizeof(unsigned int),
+            object.primitiveCount * sizeof(unsigned int), object.primitives
+        );
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    if(leafWordCount) {
+        free(object.nodes);
+        free(object.primitives);
+    }
+    return 1;
+}
+
+_Bool uploadTLAS(struct TLAS* tlas, const struct Scene* scene) {
+    if(!uploadGrids(tlas, scene)) {
+        return 0;
+    }
+
+    unsigned int* leafWordCounts = calloc(tlas->objectCount ? tlas->objectCount : 1, sizeof(unsigned int));
+    if(!leafWordCounts) {
+        fprintf(stderr, "Failed to allocate leaf sizes for %u objects\n", tlas->objectCount);
+        return 0;
+    }
+
+    // The top level keeps room for every instance, so its size doesn't move the objects.
+    // Compressed leaves can take more words than the references, their room is the larger of the two.
+    unsigned int nodeCount = maxNodeCount(sceneInstanceCount(scene));
+    unsigned int primitiveCount = 0;
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        const struct BVH* object = tlas->objects[i];
+        if(tlas->compressLeaves && tlas->formats[i] != BVH_GRID && object->primitiveCount) {
+            leafWordCounts[i] = compressedLeafWordCount(scene, object);
+        }
+
+        tlas->nodeOffsets[i] = nodeCount;
+        tlas->primitiveOffsets[i] = primitiveCount;
+        nodeCount += leafWordCounts[i] ? (object->nodeCount + 1) & ~1u : maxNodeCount(object->primitiveCount);
+        primitiveCount += object->primitiveCount > leafWordCounts[i] ? object->primitiveCount : leafWordCounts[i];
+    }
+    tlas->nodeCount = nodeCount;
+    tlas->primitiveCount = primitiveCount;
+    tlas->uploadedObjectCount = tlas->objectCount;
+
+    if(!tlas->nodeBuffer) {
+        glGenBuffers(1, &tlas->nodeBuffer);
+        glGenBuffers(1, &tlas->primitiveBuffer);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->nodeBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, nodeCount * sizeof(struct BVHNode), 0, GL_STATIC_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tlas->topLevel->nodeCount * sizeof(struct BVHNode), tlas->topLevel->nodes);
+
+    // Zero sized buffers can't be bound, empty scenes still get one element
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->primitiveBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (primitiveCount ? primitiveCount : 1) * sizeof(unsigned int), 0, GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        if(!uploadObject(tlas, scene, i, leafWordCounts[i])) {
+            free(leafWordCounts);
+            return 0;
+        }
+    }
+    free(leafWordCounts);
+
+    if(tlas->stackless && !uploadSkipLinks(tlas)) {
+        return 0;
+    }
+
+    if(glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "Failed to upload TLAS (%u nodes)\n", nodeCount);
+        return 0;
+    }
+
+    // Both views alias the same buffer
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH_NODE_BINDING, tlas->nodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH4_NODE_BINDING, tlas->nodeBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BVH_PRIMITIVE_BINDING, tlas->primitiveBuffer);
+    return uploadTLASInstances(tlas, scene);
+}
+
+// Room uploadTLAS left an object in the shared buffers, up to where the next one starts
+static unsigned int nodeRoom(const struct TLAS* tlas, unsigned int index) {
+    unsigned int end = index + 1 < tlas->uploadedObjectCount ? tlas->nodeOffsets[index + 1] : tlas->nodeCount;
+    return end - tlas->nodeOffsets[index];
+}
+
+static unsigned int primitiveRoom(const struct TLAS* tlas, unsigned int index) {
+    unsigned int end = index + 1 < tlas->uploadedObjectCount ? tlas->primitiveOffsets[index + 1] : tlas->primitiveCount;
+    return end - tlas->primitiveOffsets[index];
+}
+
+// Writes the changed objects and the top level over their old versions, keeping
+// the formats the last uploadTLAS picked. Returns 0 without writing anything
+// when one of them doesn't fit its room anymore or is a grid.
+static _Bool uploadChangedObjects(struct TLAS* tlas, const struct Scene* scene, const _Bool* changed) {
+    unsigned int topLevelRoom = tlas->uploadedObjectCount ? tlas->nodeOffsets[0] : tlas->nodeCount;
+    if(!tlas->nodeBuffer || tlas->uploadedObjectCount != tlas->objectCount || tlas->topLevel->nodeCount > topLevelRoom) {
+        return 0;
+    }
+
+    unsigned int* leafWordCounts = calloc(tlas->objectCount ? tlas->objectCount : 1, sizeof(unsigned int));
+    if(!leafWordCounts) {
+        return 0;
+    }
+
+    // Sized like uploadTLAS sizes them
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        const struct BVH* object = tlas->objects[i];
+        if(!changed[i]) {
+            continue;
+        }
+        if(tlas->formats[i] == BVH_GRID) {
+            free(leafWordCounts);
+            return 0;
+        }
+        if(tlas->compressLeaves && object->primitiveCount) {
+            leafWordCounts[i] = compressedLeafWordCount(scene, object);
+        }
+
+        unsigned int nodes = leafWordCounts[i] ? (object->nodeCount + 1) & ~1u : maxNodeCount(object->primitiveCount);
+        unsigned int primitives = object->primitiveCount > leafWordCounts[i] ? object->primitiveCount : leafWordCounts[i];
+        if(nodes > nodeRoom(tlas, i) || primitives > primitiveRoom(tlas, i)) {
+            free(leafWordCounts);
+            return 0;
+        }
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->nodeBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tlas->topLevel->nodeCount * sizeof(struct BVHNode), tlas->topLevel->nodes);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    _Bool ok = 1;
+    for(unsigned int i = 0; ok && i < tlas->objectCount; i++) {
+        if(changed[i]) {
+            ok = uploadObject(tlas, scene, i, leafWordCounts[i]);
+        }
+    }
+    free(leafWordCounts);
+
+    // The links of the objects that didn't change are still valid
+    if(ok && tlas->stackless) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlas->skipBuffer);
+        for(unsigned int i = 0; ok && i <= tlas->objectCount; i++) {
+            const struct BVH* bvh = i == tlas->objectCount ? tlas->topLevel : tlas->objects[i];
+            if(i < tlas->objectCount && !changed[i]) {
+                continue;
+            }
+
+            unsigned int* skips = malloc(bvh->nodeCount * sizeof(unsigned int));
+            ok = skips != 0;
+            if(ok) {
+                computeSkipLinks(bvh, skips);
+                unsigned int offset = i == tlas->objectCount ? 0 : tlas->nodeOffsets[i];
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(unsigned int), bvh->nodeCount * sizeof(unsigned int), skips);
+                free(skips);
+            }
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    if(!ok || glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "Failed to update the TLAS in place, uploading it again\n");
+        return 0;
+    }
+
+    // Formats and compression can change with the objects, the instances are small
+    return uploadTLASInstances(tlas, scene);
+}
+
+_Bool tlasReadsSpheres(const struct TLAS* tlas, const struct Scene* scene) {
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        struct Object object = sceneObject(scene, i);
+        if(object.sphereCount && !tlas->compressed[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void freeTLAS(struct TLAS* tlas) {
+    if(tlas->nodeBuffer) {
+        GLuint buffers[] = { tlas->nodeBuffer, tlas->primitiveBuffer, tlas->instanceBuffer };
+        glDeleteBuffers(3, buffers);
+    }
+    if(tlas->skipBuffer) {
+        glDeleteBuffers(1, &tlas->skipBuffer);
+    }
+    if(tlas->gridBuffer) {
+        glDeleteBuffers(1, &tlas->gridBuffer);
+    }
+
+    for(unsigned int i = 0; i < tlas->objectCount; i++) {
+        freeBVH(tlas->objects[i]);
+    }
+    if(tlas->topLevel) {
+        freeBVH(tlas->topLevel);
+    }
+
+    free(tlas->objects);
+    free(tlas->nodeOffsets);
+    free(tlas->primitiveOffsets);
+    free(tlas->formats);
+    free(tlas->gridOffsets);
+    free(tlas->compressed);
+    free(tlas->objectRanges);
+    free(tlas);
+}
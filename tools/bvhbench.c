@@ -0,0 +1,245 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+// Reports BVH build and refit times and SAH cost for random scenes of increasing size,
+// then how fast rays traverse the BVH on the host with every node layout.
+// Usage: bvhbench [threads]
+
+#include "bvh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// One in this many primitives is a rect
+#define RECT_RATIO 8
+
+// Rays traced per layout, the profiling pass for BVH_LAYOUT_FREQUENCY uses another set as many
+#define RAY_COUNT (1 << 18)
+
+static unsigned int randomState = 0x9e3779b9u;
+
+static float randomFloat() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (randomState & 0xffffff) / (float)0x1000000;
+}
+
+static struct Scene* createRandomScene(unsigned int primitiveCount) {
+    struct Scene* scene = createScene();
+    if(!scene) {
+        return 0;
+    }
+
+    unsigned int rectCount = primitiveCount / RECT_RATIO;
+    unsigned int sphereCount = primitiveCount - rectCount;
+    if((sphereCount && !addSpheres(scene, sphereCount)) || (rectCount && !addRects(scene, rectCount))) {
+        freeScene(scene);
+        return 0;
+    }
+
+    // Keep the density constant so deeper trees don't just mean smaller primitives
+    float size = 100.0f * (float)primitiveCount / 10000.0f;
+    for(unsigned int i = 0; i < sphereCount; i++) {
+        struct Sphere* sphere = &scene->spheres[i];
+        for(int j = 0; j < 3; j++) {
+            sphere->center[j] = randomFloat() * size;
+        }
+        sphere->radius = 0.1f + randomFloat();
+        sphere->material = 0;
+    }
+
+    for(unsigned int i = 0; i < rectCount; i++) {
+        struct Rect* rect = &scene->rects[i];
+        rect->plane = (enum Plane)(i % 3);
+        rect->x0 = randomFloat() * size;
+        rect->x1 = rect->x0 + 0.5f + randomFloat() * 4.0f;
+        rect->y0 = randomFloat() * size;
+        rect->y1 = rect->y0 + 0.5f + randomFloat() * 4.0f;
+        rect->k = randomFloat() * size;
+        rect->material = 0;
+    }
+    return scene;
+}
+
+// Moves every sphere by up to distance along each axis, like one step of an animation
+static void moveSpheres(struct Scene* scene, float distance) {
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        for(int j = 0; j < 3; j++) {
+            scene->spheres[i].center[j] += (randomFloat() * 2.0f - 1.0f) * distance;
+        }
+    }
+}
+
+// Origins anywhere in the scene, pointing in every direction
+static float* createRandomRays(unsigned int primitiveCount) {
+    float* rays = malloc(RAY_COUNT * 6 * sizeof(float));
+    if(!rays) {
+        return 0;
+    }
+
+    float size = 100.0f * (float)primitiveCount / 10000.0f;
+    for(unsigned int i = 0; i < RAY_COUNT; i++) {
+        for(int j = 0; j < 3; j++) {
+            rays[6 * i + j] = randomFloat() * size;
+            rays[6 * i + 3 + j] = randomFloat() * 2.0f - 1.0f;
+        }
+    }
+    return rays;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static double traceRays(const struct BVH* bvh, const struct Scene* scene, const float* rays, unsigned int* visits) {
+    double start = now();
+    for(unsigned int i = 0; i < RAY_COUNT; i++) {
+        traceBVH(bvh, scene, &rays[6 * i], &rays[6 * i + 3], 1e30f, visits, 0);
+    }
+    return now() - start;
+}
+
+static _Bool benchmarkLayouts(unsigned int primitiveCount, unsigned int threads) {
+    static const char* layoutNames[] = { "build", "frequency", "depth", "veb" };
+    static const enum BVHLayout layouts[] = {
+        BVH_LAYOUT_BUILD_ORDER, BVH_LAYOUT_FREQUENCY, BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_VAN_EMDE_BOAS
+    };
+
+    struct Scene* scene = createRandomScene(primitiveCount);
+    struct BVHSettings settings = BVH_DEFAULT_SETTINGS;
+    settings.threadCount = threads;
+    struct BVH* bvh = scene ? buildBVH(scene, &settings) : 0;
+    float* profileRays = createRandomRays(primitiveCount);
+    float* rays = createRandomRays(primitiveCount);
+    unsigned int* visits = bvh ? calloc(bvh->nodeCount, sizeof(unsigned int)) : 0;
+    _Bool ok = scene && bvh && profileRays && rays && visits;
+
+    // The visits are indexed by the build order, so they're measured before any other layout
+    if(ok) {
+        traceRays(bvh, scene, profileRays, visits);
+    }
+
+    for(int i = 0; ok && i < (int)(sizeof(layouts) / sizeof(layouts[0])); i++) {
+        ok = layoutBVH(bvh, layouts[i], visits);
+        if(ok) {
+            double elapsed = traceRays(bvh, scene, rays, 0);
+            printf(
+                "%12u %10s %12.2f %12.2f\n",
+                primitiveCount, layoutNames[i], elapsed * 1000.0, RAY_COUNT / elapsed * 1e-6
+            );
+        }
+    }
+
+    free(visits);
+    free(rays);
+    free(profileRays);
+    if(bvh) freeBVH(bvh);
+    if(scene) freeScene(scene);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    unsigned int threads = argc > 1 ? (unsigned int)atoi(argv[1]) : 0;
+    static const unsigned int sizes[] = { 10000, 100000, 1000000 };
+
+    printf("%12s %8s %12s %12s %12s\n", "primitives", "threads", "build (ms)", "nodes", "SAH cost");
+    for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct Scene* scene = createRandomScene(sizes[i]);
+        if(!scene) {
+            fprintf(stderr, "Failed to create a scene with %u primitives\n", sizes[i]);
+            return 1;
+        }
+
+        // Compare against a single threaded build so the pool's speedup is visible
+        unsigned int threadCounts[] = { 1, threads };
+        for(int j = 0; j < 2; j++) {
+            struct BVHSettings settings = BVH_DEFAULT_SETTINGS;
+            settings.threadCount = threadCounts[j];
+
+            double start = now();
+            struct BVH* bvh = buildBVH(scene, &settings);
+            double elapsed = now() - start;
+            if(!bvh) {
+                freeScene(scene);
+                return 1;
+            }
+
+            char threadText[16];
+            if(threadCounts[j]) {
+                snprintf(threadText, sizeof(threadText), "%u", threadCounts[j]);
+            } else {
+                snprintf(threadText, sizeof(threadText), "all");
+            }
+
+            printf(
+                "%12u %8s %12.2f %12u %12.2f\n",
+                sizes[i], threadText, elapsed * 1000.0, bvh->nodeCount, bvhSAHCost(bvh)
+            );
+            freeBVH(bvh);
+        }
+
+        // Spatial splits trade build time and duplicated references for a lower SAH cost
+        struct BVHSettings spatialSettings = BVH_DEFAULT_SETTINGS;
+        spatialSettings.threadCount = threads;
+        spatialSettings.spatialSplitBudget = 0.5f;
+
+        double spatialStart = now();
+        struct BVH* bvh = buildBVH(scene, &spatialSettings);
+        double spatialElapsed = now() - spatialStart;
+        if(!bvh) {
+            freeScene(scene);
+            return 1;
+        }
+
+        printf(
+            "%12u %8s %12.2f %12u %12.2f\n",
+            sizes[i], "sbvh", spatialElapsed * 1000.0, bvh->nodeCount, bvhSAHCost(bvh)
+        );
+        freeBVH(bvh);
+
+        bvh = buildBVH(scene, 0);
+        if(!bvh) {
+            freeScene(scene);
+            return 1;
+        }
+
+        moveSpheres(scene, 1.0f);
+        double start = now();
+        _Bool keep = refitBVH(bvh, scene);
+        double elapsed = now() - start;
+
+        printf(
+            "%12u %8s %12.2f %12u %12.2f%s\n",
+            sizes[i], "refit", elapsed * 1000.0, bvh->nodeCount, bvhSAHCost(bvh), keep ? "" : " (rebuild)"
+        );
+        freeBVH(bvh);
+        freeScene(scene);
+    }
+
+    printf("\n%12s %10s %12s %12s\n", "primitives", "layout", "trace (ms)", "Mrays/s");
+    for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if(!benchmarkLayouts(sizes[i], threads)) {
+            fprintf(stderr, "Failed to benchmark the layouts of %u primitives\n", sizes[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
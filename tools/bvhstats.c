@@ -0,0 +1,62 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+// Prints the quality statistics of the acceleration structure of one of the
+// scenes in scenes.h or of a scene file, its top level and every object's BVH.
+// Usage: bvhstats [showcase|spheres|cornell|file.rtscene|file.scene] [spatial split budget]
+
+#include "bvhstats.h"
+#include "scenes.h"
+#include "scenefile.h"
+#include "sceneparser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char** argv) {
+    const char* name = argc > 1 ? argv[1] : "cornell";
+    struct Scene* scene;
+    if(strcmp(name, "showcase") == 0) {
+        scene = createShowcaseScene();
+    } else if(strcmp(name, "spheres") == 0) {
+        scene = createThreeSpheresScene();
+    } else if(strcmp(name, "cornell") == 0) {
+        scene = createCornellBoxScene();
+    } else if(strstr(name, ".rtscene")) {
+        scene = loadSceneFile(name, 0);
+    } else {
+        scene = parseSceneFile(name, 1);
+    }
+
+    if(!scene) {
+        fprintf(stderr, "Failed to create the %s scene\n", name);
+        return 1;
+    }
+
+    struct BVHSettings settings = BVH_DEFAULT_SETTINGS;
+    settings.spatialSplitBudget = argc > 2 ? (float)atof(argv[2]) : 0.0f;
+    struct TLAS* tlas = buildTLAS(scene, &settings);
+    if(!tlas) {
+        freeScene(scene);
+        return 1;
+    }
+
+    printTLASStats(stdout, tlas);
+    freeTLAS(tlas);
+    freeScene(scene);
+    return 0;
+}
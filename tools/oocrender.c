@@ -0,0 +1,434 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+// Offline path tracing of scenes larger than memory through outofcore.h, with the
+// camera and materials of raytracer.glsl. Every sample is traced a bounce at a
+// time for the whole image, so each bounce is one batch of rays for the tracer
+// to sort into its subtrees.
+//
+// Usage: oocrender build <scene.rtscene> <output.ooc> [primitives per subtree]
+//        oocrender render <scene.ooc> <output.ppm> [width height [samples [resident MB]]]
+
+#include "outofcore.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEPTH 100
+#define TMAX 1e30f
+#define PI 3.14159265358979f
+
+// The images main.c loads, relative to where it runs
+#define IMAGE_COUNT 3
+static const char* imagePaths[IMAGE_COUNT] = {
+    "../../textures/texture1.jpg", "../../textures/texture2.jpg", "../../textures/texture3.jpg"
+};
+
+struct Image {
+    int width, height;
+    unsigned char* data; // RGB, null when the image couldn't be loaded
+};
+
+struct Camera {
+    float origin[3];
+    float lowerLeft[3];
+    float horizontal[3];
+    float vertical[3];
+};
+
+// A path still being traced, final is the product of what it went through
+struct Path {
+    unsigned int pixel;
+    float final[3];
+};
+
+static struct Image images[IMAGE_COUNT];
+static unsigned int randomState = 1;
+
+static float randomFloat() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (randomState & 0xffffff) / (float)0x1000000;
+}
+
+static float dot(const float* a, const float* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void normalize(float* v) {
+    float length = sqrtf(dot(v, v));
+    for(int i = 0; i < 3; i++) {
+        v[i] /= length;
+    }
+}
+
+static void cross(const float* a, const float* b, float* result) {
+    result[0] = a[1] * b[2] - a[2] * b[1];
+    result[1] = a[2] * b[0] - a[0] * b[2];
+    result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static void randomUnitVector(float* v) {
+    float a = randomFloat() * 2 * PI;
+    float z = randomFloat() * 2 - 1;
+    float r = sqrtf(1 - z * z);
+    v[0] = r * cosf(a);
+    v[1] = r * sinf(a);
+    v[2] = z;
+}
+
+static void randomInUnitSphere(float* v) {
+    float z = randomFloat() * 2 - 1;
+    float phi = randomFloat() * 2 * PI;
+    float r = cbrtf(randomFloat());
+    float s = sqrtf(1 - z * z);
+    v[0] = r * s * sinf(phi);
+    v[1] = r * s * cosf(phi);
+    v[2] = r * z;
+}
+
+// NewCamera in raytracer.glsl
+static struct Camera createCamera(float aspectRatio) {
+    const float lookfrom[3] = { 273, 273, -800 }, lookat[3] = { 273, 273, 273 }, vup[3] = { 0, 1, 0 };
+    float height = 2 * tanf(40 * PI / 180 / 2);
+    float width = aspectRatio * height;
+
+    float w[3], u[3], v[3];
+    for(int i = 0; i < 3; i++) {
+        w[i] = lookfrom[i] - lookat[i];
+    }
+    normalize(w);
+    cross(vup, w, u);
+    normalize(u);
+    cross(w, u, v);
+
+    struct Camera camera;
+    for(int i = 0; i < 3; i++) {
+        camera.origin[i] = lookfrom[i];
+        camera.horizontal[i] = width * u[i];
+        camera.vertical[i] = height * v[i];
+        camera.lowerLeft[i] = lookfrom[i] - camera.horizontal[i] / 2 - camera.vertical[i] / 2 - w[i];
+    }
+    return camera;
+}
+
+static void loadImages() {
+    for(int i = 0; i < IMAGE_COUNT; i++) {
+        int channels;
+        images[i].data = stbi_load(imagePaths[i], &images[i].width, &images[i].height, &channels, 3);
+        if(!images[i].data) {
+            fprintf(stderr, "Failed to load %s, its textures come out white\n", imagePaths[i]);
+        }
+    }
+}
+
+static void sampleImage(unsigned int index, float u, float v, float* color) {
+    const struct Image* image = index < IMAGE_COUNT ? &images[index] : 0;
+    if(!image || !image->data) {
+        color[0] = color[1] = color[2] = 1;
+        return;
+    }
+
+    u = 1.0f - fminf(fmaxf(u, 0), 1);
+    v = 1.0f - fminf(fmaxf(v, 0), 1);
+    int x = (int)(u * (image->width - 1) + 0.5f);
+    int y = (int)(v * (image->height - 1) + 0.5f);
+    const unsigned char* texel = &image->data[3 * ((size_t)y * image->width + x)];
+    for(int i = 0; i < 3; i++) {
+        color[i] = texel[i] / 255.0f;
+    }
+}
+
+static struct Texture getTexture(const struct OutOfCoreScene* scene, unsigned int index) {
+    if(index < scene->header.textureCount) {
+        return scene->textures[index];
+    }
+    struct Texture missing = { { 1, 0, 1 }, SOLID_COLOR, 0, 0, { 0, 0 } };
+    return missing;
+}
+
+// GetTextureColor in raytracer.glsl
+static void textureColor(const struct OutOfCoreScene* scene, unsigned int index, float u, float v, const float* position,
+    float* color) {
+    struct Texture texture = getTexture(scene, index);
+    if(texture.type == IMAGE) {
+        sampleImage(texture.property1, u, v, color);
+        return;
+    }
+    if(texture.type == SOLID_COLOR) {
+        memcpy(color, texture.albedo, sizeof(texture.albedo));
+        return;
+    }
+    if(texture.type != CHECKERED) {
+        color[0] = color[1] = color[2] = 0;
+        return;
+    }
+
+    // The blocks' textures are tinted by their albedo, unlike image textures on their own
+    float sines = sinf(10 * position[0]) * sinf(10 * position[1]) * sinf(10 * position[2]);
+    struct Texture block = getTexture(scene, sines < 0 ? texture.property1 : texture.property2);
+    if(block.type == SOLID_COLOR) {
+        memcpy(color, block.albedo, sizeof(block.albedo));
+    } else if(block.type == IMAGE) {
+        sampleImage(block.property1, u, v, color);
+        for(int i = 0; i < 3; i++) {
+            color[i] *= block.albedo[i];
+        }
+    } else {
+        color[0] = 0;
+        color[1] = sines < 0 ? 0 : 1;
+        color[2] = 0;
+    }
+}
+
+static float schlick(float cosine, float refIdx) {
+    float r0 = (1 - refIdx) / (1 + refIdx);
+    r0 = r0 * r0;
+    return r0 + (1 - r0) * powf(1 - cosine, 5);
+}
+
+// Scatter and emitted in raytracer.glsl. Returns 0 when the path ends here.
+static _Bool scatter(const struct OutOfCoreScene* scene, struct OutOfCoreRay* ray, const struct OutOfCoreHit* hit,
+    float* emitted, float* attenuation) {
+    struct Material material = { DIFFUSE, scene->header.textureCount, 0 };
+    if(hit->material < scene->header.materialCount) {
+        material = scene->materials[hit->material];
+    }
+
+    float position[3], normal[3], direction[3];
+    for(int i = 0; i < 3; i++) {
+        position[i] = ray->origin[i] + hit->t * ray->direction[i];
+        direction[i] = ray->direction[i];
+    }
+    _Bool frontFace = dot(ray->direction, hit->normal) < 0;
+    for(int i = 0; i < 3; i++) {
+        normal[i] = frontFace ? hit->normal[i] : -hit->normal[i];
+    }
+
+    emitted[0] = emitted[1] = emitted[2] = 0;
+    if(material.type == DIFFUSE_LIGHT) {
+        textureColor(scene, material.texture, hit->u, hit->v, position, emitted);
+        return 0;
+    }
+    if(fabsf(direction[0]) < 1e-8f && fabsf(direction[1]) < 1e-8f && fabsf(direction[2]) < 1e-8f) {
+        return 0;
+    }
+    normalize(direction);
+    memcpy(ray->origin, position, sizeof(position));
+
+    float offset[3];
+    if(material.type == DIFFUSE) {
+        randomUnitVector(offset);
+        for(int i = 0; i < 3; i++) {
+            ray->direction[i] = normal[i] + offset[i];
+        }
+        textureColor(scene, material.texture, hit->u, hit->v, position, attenuation);
+        return 1;
+    }
+
+    float cosine = dot(direction, normal);
+    float reflected[3];
+    for(int i = 0; i < 3; i++) {
+        reflected[i] = direction[i] - 2 * cosine * normal[i];
+    }
+
+    if(material.type == METAL) {
+        randomInUnitSphere(offset);
+        for(int i = 0; i < 3; i++) {
+            ray->direction[i] = reflected[i] + material.property * offset[i];
+        }
+        textureColor(scene, material.texture, hit->u, hit->v, position, attenuation);
+        return dot(ray->direction, normal) > 0;
+    }
+
+    if(material.type == DIELECTRIC) {
+        attenuation[0] = attenuation[1] = attenuation[2] = 1;
+        float ratio = frontFace ? 1.0f / material.property : material.property;
+        float cosTheta = fminf(-cosine, 1.0f);
+        float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+        if(ratio * sinTheta > 1 || randomFloat() < schlick(cosTheta, ratio)) {
+            memcpy(ray->direction, reflected, sizeof(reflected));
+            return 1;
+        }
+
+        float perpendicular[3];
+        for(int i = 0; i < 3; i++) {
+            perpendicular[i] = ratio * (direction[i] + cosTheta * normal[i]);
+        }
+        float parallel = -sqrtf(fabsf(1.0f - dot(perpendicular, perpendicular)));
+        for(int i = 0; i < 3; i++) {
+            ray->direction[i] = perpendicular[i] + parallel * normal[i];
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Adds one sample of every pixel to pixels, DEPTH bounces at most
+static _Bool renderSample(struct OutOfCoreScene* scene, const struct Camera* camera, unsigned int width, unsigned int height,
+    struct OutOfCoreRay* rays, struct OutOfCoreHit* hits, struct Path* paths, float* pixels) {
+    unsigned int count = width * height;
+    for(unsigned int y = 0; y < height; y++) {
+        for(unsigned int x = 0; x < width; x++) {
+            unsigned int i = y * width + x;
+            float u = (x + randomFloat()) / width, v = (y + randomFloat()) / height;
+            for(int j = 0; j < 3; j++) {
+                rays[i].origin[j] = camera->origin[j];
+                rays[i].direction[j] = camera->lowerLeft[j] + u * camera->horizontal[j] + v * camera->vertical[j] -
+                    camera->origin[j];
+                paths[i].final[j] = 1;
+            }
+            rays[i].tmax = TMAX;
+            paths[i].pixel = i;
+        }
+    }
+
+    for(unsigned int depth = DEPTH; depth > 0 && count > 0; depth--) {
+        if(!traceOutOfCore(scene, rays, count, hits)) {
+            return 0;
+        }
+
+        // Paths that go on are moved to the front, the background is black
+        unsigned int alive = 0;
+        for(unsigned int i = 0; i < count; i++) {
+            if(hits[i].t >= rays[i].tmax) {
+                continue;
+            }
+
+            float emitted[3], attenuation[3];
+            float* final = paths[i].final;
+            if(!scatter(scene, &rays[i], &hits[i], emitted, attenuation)) {
+                for(int j = 0; j < 3; j++) {
+                    pixels[3 * paths[i].pixel + j] += final[j] * emitted[j];
+                }
+                continue;
+            }
+
+            for(int j = 0; j < 3; j++) {
+                final[j] *= emitted[j] + attenuation[j];
+            }
+            rays[alive] = rays[i];
+            paths[alive] = paths[i];
+            alive++;
+        }
+        count = alive;
+    }
+    return 1;
+}
+
+static _Bool writeImage(const char* path, const float* pixels, unsigned int width, unsigned int height, unsigned int samples) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 0;
+    }
+
+    // GammaCorrect in raytracer.glsl, rows go from the top down
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    unsigned char* row = malloc(3 * width);
+    _Bool ok = row != 0;
+    for(unsigned int y = height; ok && y-- > 0;) {
+        for(unsigned int i = 0; i < 3 * width; i++) {
+            float value = sqrtf(fminf(fmaxf(pixels[3 * y * width + i] / samples, 0), 1));
+            row[i] = (unsigned char)(value * 255 + 0.5f);
+        }
+        ok = fwrite(row, 1, 3 * width, file) == 3 * width;
+    }
+
+    free(row);
+    ok = fclose(file) == 0 && ok;
+    if(!ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+    }
+    return ok;
+}
+
+static int render(const char* input, const char* output, unsigned int width, unsigned int height, unsigned int samples,
+    size_t residentLimit) {
+    struct OutOfCoreScene* scene = openOutOfCoreScene(input, residentLimit, 0);
+    if(!scene) {
+        return 1;
+    }
+    loadImages();
+
+    unsigned int count = width * height;
+    struct OutOfCoreRay* rays = malloc(count * sizeof(struct OutOfCoreRay));
+    struct OutOfCoreHit* hits = malloc(count * sizeof(struct OutOfCoreHit));
+    struct Path* paths = malloc(count * sizeof(struct Path));
+    float* pixels = calloc(3 * (size_t)count, sizeof(float));
+    struct Camera camera = createCamera((float)width / height);
+
+    _Bool ok = rays && hits && paths && pixels;
+    if(!ok) {
+        fprintf(stderr, "Failed to allocate a %ux%u image\n", width, height);
+    }
+    for(unsigned int i = 0; ok && i < samples; i++) {
+        ok = renderSample(scene, &camera, width, height, rays, hits, paths, pixels);
+        fprintf(stderr, "\rSample %u/%u", i + 1, samples);
+    }
+    fprintf(stderr, "\n");
+    ok = ok && writeImage(output, pixels, width, height, samples);
+
+    free(rays);
+    free(hits);
+    free(paths);
+    free(pixels);
+    for(int i = 0; i < IMAGE_COUNT; i++) {
+        stbi_image_free(images[i].data);
+    }
+    closeOutOfCoreScene(scene);
+    return ok ? 0 : 1;
+}
+
+static int usage() {
+    fprintf(
+        stderr, "Usage: oocrender build <scene.rtscene> <output.ooc> [primitives per subtree]\n"
+        "       oocrender render <scene.ooc> <output.ppm> [width height [samples [resident MB]]]\n"
+    );
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 4) {
+        return usage();
+    }
+
+    if(strcmp(argv[1], "build") == 0) {
+        struct OutOfCoreSettings settings = { 0, BVH_DEFAULT_SETTINGS };
+        if(argc > 4) {
+            settings.subtreeSize = (unsigned int)strtoul(argv[4], 0, 10);
+        }
+        return buildOutOfCoreFile(argv[2], argv[3], &settings) ? 0 : 1;
+    }
+
+    if(strcmp(argv[1], "render") == 0) {
+        unsigned int width = argc > 5 ? (unsigned int)strtoul(argv[4], 0, 10) : 800;
+        unsigned int height = argc > 5 ? (unsigned int)strtoul(argv[5], 0, 10) : 600;
+        unsigned int samples = argc > 6 ? (unsigned int)strtoul(argv[6], 0, 10) : 25;
+        size_t residentLimit = (argc > 7 ? (size_t)strtoul(argv[7], 0, 10) : 1024) * 1024 * 1024;
+        if(width == 0 || height == 0 || samples == 0) {
+            return usage();
+        }
+        return render(argv[2], argv[3], width, height, samples, residentLimit);
+    }
+    return usage();
+}
@@ -0,0 +1,154 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// Reports how fast scene descriptions parse next to how fast the same file can
+// only be read, for generated scenes of increasing size or the given file, and
+// how long canonicalizeScene takes on the parsed scene after that.
+// Usage: scenebench [file]
+
+#include "sceneparser.h"
+#include "scenecanon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define GENERATED_PATH "scenebench.scene"
+
+// One in this many primitives is a rect
+#define RECT_RATIO 8
+
+static unsigned int randomState = 0x9e3779b9u;
+
+static float randomFloat() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (randomState & 0xffffff) / (float)0x1000000;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static _Bool writeRandomScene(const char* path, unsigned int primitiveCount) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        return 0;
+    }
+
+    fprintf(file, "texture solid 0.73 0.73 0.73\ntexture checkered 0 0\n");
+    fprintf(file, "material diffuse 0\nmaterial metal 1 0.25\nmaterial dielectric 0 1.5\n");
+
+    float size = 100.0f * (float)primitiveCount / 10000.0f;
+    for(unsigned int i = 0; i < primitiveCount; i++) {
+        if(i % RECT_RATIO == 0) {
+            static const char* planes[] = { "xy", "xz", "yz" };
+            float x0 = randomFloat() * size;
+            float y0 = randomFloat() * size;
+            fprintf(
+                file, "rect %s %g %g %g %g %g %u\n", planes[i % 3], x0, x0 + 0.5f + randomFloat() * 4.0f,
+                y0, y0 + 0.5f + randomFloat() * 4.0f, randomFloat() * size, i % 3
+            );
+        } else {
+            fprintf(
+                file, "sphere %g %g %g %g %u\n", randomFloat() * size, randomFloat() * size, randomFloat() * size,
+                0.1f + randomFloat(), i % 3
+            );
+        }
+    }
+    return fclose(file) == 0;
+}
+
+// Reads the whole file in chunks like the parser, the bound parsing could reach
+static double readFile(const char* path, long* size) {
+    static char buffer[SCENE_PARSER_BUFFER_SIZE];
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        return -1.0;
+    }
+
+    double start = now();
+    size_t read;
+    *size = 0;
+    while((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        *size += (long)read;
+    }
+    double elapsed = now() - start;
+
+    fclose(file);
+    return elapsed;
+}
+
+static _Bool benchmarkFile(const char* path) {
+    long size;
+    double readTime = readFile(path, &size);
+    if(readTime < 0.0) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        return 0;
+    }
+
+    double start = now();
+    struct Scene* scene = parseSceneFile(path, 0);
+    double parseTime = now() - start;
+    if(!scene) {
+        return 0;
+    }
+
+    start = now();
+    canonicalizeScene(scene);
+    double sortTime = now() - start;
+
+    double megabytes = size / (1024.0 * 1024.0);
+    printf(
+        "%12u %12u %10.1f %12.1f %12.2f %12.1f %12.2f %12.2f\n",
+        scene->sphereCount, scene->rectCount, megabytes, megabytes / readTime, parseTime * 1000.0,
+        megabytes / parseTime, (scene->sphereCount + scene->rectCount) / parseTime * 1e-6, sortTime * 1000.0
+    );
+    freeScene(scene);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    printf(
+        "%12s %12s %10s %12s %12s %12s %12s %12s\n",
+        "spheres", "rects", "MB", "read MB/s", "parse (ms)", "parse MB/s", "Mprims/s", "sort (ms)"
+    );
+
+    if(argc > 1) {
+        return benchmarkFile(argv[1]) ? 0 : 1;
+    }
+
+    // Files are read back from the page cache, so this compares against memory bandwidth
+    static const unsigned int sizes[] = { 10000, 100000, 1000000, 10000000 };
+    for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if(!writeRandomScene(GENERATED_PATH, sizes[i])) {
+            fprintf(stderr, "Failed to write a scene with %u primitives\n", sizes[i]);
+            remove(GENERATED_PATH);
+            return 1;
+        }
+
+        _Bool ok = benchmarkFile(GENERATED_PATH);
+        remove(GENERATED_PATH);
+        if(!ok) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,452 @@
+// Copyright (c) 2021 Pathfinders
+// This file is part of rt.
+//
+// rt is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// rt is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with rt.  If not, see <https://www.gnu.org/licenses/>.
+
+// Generates scenes with controlled statistics, for benchmarking acceleration
+// structures, upload paths and shading divergence at scale. Everything is placed
+// in the 555 unit cube the camera in raytracer.glsl looks at, lit by one rect
+// light under its top. The same seed and options always give the same scene.
+//
+// Usage: scenegen [options] <output .rtscene or .scene>
+//        scenegen [options] --corpus <directory>
+//
+//   --spheres <count>        Spheres, 100000 by default
+//   --rects <count>          Rects besides the light, none by default
+//   --distribution <name>    uniform (default), clustered or stadium
+//   --materials <name>       diffuse, mixed (default) or specular
+//   --material-count <count> Materials the primitives pick from, 16 by default
+//   --textures <count>       Textures the materials pick from, 8 by default
+//   --seed <seed>            1 by default
+//
+// Distributions:
+//   uniform    primitives spread evenly through the cube
+//   clustered  gaussian clusters around random centers, about one per cube root of the count
+//   stadium    teapot in a stadium: nearly everything in a tiny ball in the middle,
+//              and a hundredth of the primitives as large spheres on a ring around it
+//
+// Material mixes: diffuse only, mixed (60% diffuse, 20% metal and 20% dielectric)
+// or specular (half metal and half dielectric, where rays diverge the most).
+// Every fourth texture is checkered and every eighth an image.
+//
+// --corpus writes <distribution>-<spheres>.rtscene for every distribution and
+// every power of ten from 10 up to --spheres spheres (10 million by default), each
+// with an eighth as many rects.
+
+#include "scenefile.h"
+#include "scenecanon.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CUBE_SIZE 555.0f
+
+// Images main.c loads, image textures pick one of them
+#define IMAGE_COUNT 3
+
+#define CORPUS_RECT_RATIO 8
+
+enum Distribution {
+    UNIFORM,
+    CLUSTERED,
+    STADIUM,
+    DISTRIBUTION_COUNT
+};
+
+enum MaterialMix {
+    MIX_DIFFUSE,
+    MIX_MIXED,
+    MIX_SPECULAR,
+    MIX_COUNT
+};
+
+static const char* distributionNames[] = { "uniform", "clustered", "stadium" };
+static const char* mixNames[] = { "diffuse", "mixed", "specular" };
+
+struct GeneratorSettings {
+    unsigned int sphereCount;
+    unsigned int rectCount;
+    enum Distribution distribution;
+    enum MaterialMix mix;
+    unsigned int materialCount;
+    unsigned int textureCount;
+    unsigned int seed;
+};
+
+static unsigned int randomState;
+
+static unsigned int randomInt() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static float randomFloat() {
+    return (randomInt() & 0xffffff) / (float)0x1000000;
+}
+
+static float randomGaussian() {
+    float u = 1.0f - randomFloat();
+    float v = randomFloat();
+    return sqrtf(-2.0f * logf(u)) * cosf(6.2831853f * v);
+}
+
+static void addTexturesTo(struct Scene* scene, const struct GeneratorSettings* settings) {
+    for(unsigned int i = 0; i < settings->textureCount; i++) {
+        struct Texture* texture = &scene->textures[i];
+        // Checkered ones pick two solid ones before them
+        if(i % 4 == 3) {
+            texture->type = CHECKERED;
+            texture->property1 = i - 1;
+            texture->property2 = i - 2;
+        } else if(i % 8 == 6) {
+            texture->type = IMAGE;
+            texture->property1 = randomInt() % IMAGE_COUNT;
+        } else {
+            texture->type = SOLID_COLOR;
+        }
+        for(int j = 0; j < 3; j++) {
+            texture->albedo[j] = texture->type == IMAGE ? 1.0f : 0.1f + 0.8f * randomFloat();
+        }
+    }
+
+    // The light's texture comes last
+    struct Texture* light = &scene->textures[settings->textureCount];
+    light->type = SOLID_COLOR;
+    for(int j = 0; j < 3; j++) {
+        light->albedo[j] = 15.0f;
+    }
+}
+
+static enum MaterialType randomMaterialType(enum MaterialMix mix) {
+    float choice = randomFloat();
+    switch(mix) {
+        case MIX_DIFFUSE: return DIFFUSE;
+        case MIX_MIXED: return choice < 0.6f ? DIFFUSE : choice < 0.8f ? METAL : DIELECTRIC;
+        default: return choice < 0.5f ? METAL : DIELECTRIC;
+    }
+}
+
+static void addMaterialsTo(struct Scene* scene, const struct GeneratorSettings* settings) {
+    for(unsigned int i = 0; i < settings->materialCount; i++) {
+        struct Material* material = &scene->materials[i];
+        material->type = randomMaterialType(settings->mix);
+        material->texture = randomInt() % settings->textureCount;
+        if(material->type == METAL) {
+            material->property = 0.5f * randomFloat();
+        } else if(material->type == DIELECTRIC) {
+            material->property = 1.3f + 0.5f * randomFloat();
+        }
+    }
+
+    struct Material* light = &scene->materials[settings->materialCount];
+    light->type = DIFFUSE_LIGHT;
+    light->texture = settings->textureCount;
+}
+
+// Places the i-th of count primitives and returns the size they're given, which
+// keeps the fraction of the space they fill about the same at every count
+static float placePrimitive(const struct GeneratorSettings* settings, unsigned int i, unsigned int count, const float* clusters,
+    unsigned int clusterCount, float* center) {
+    float spacing = CUBE_SIZE / cbrtf((float)count);
+    switch(settings->distribution) {
+        case UNIFORM:
+            for(int j = 0; j < 3; j++) {
+                center[j] = randomFloat() * CUBE_SIZE;
+            }
+            return 0.25f * spacing;
+
+        case CLUSTERED: {
+            const float* cluster = &clusters[4 * (randomInt() % clusterCount)];
+            for(int j = 0; j < 3; j++) {
+                center[j] = fminf(fmaxf(cluster[j] + cluster[3] * randomGaussian(), 0.0f), CUBE_SIZE);
+            }
+            return 0.1f * spacing;
+        }
+
+        default: {
+            // The stadium takes every hundredth primitive
+            float middle = 0.5f * CUBE_SIZE;
+            if(i % 100 == 99) {
+                float angle = 6.2831853f * randomFloat();
+                center[0] = middle + 0.45f * CUBE_SIZE * cosf(angle);
+                center[1] = 0.2f * CUBE_SIZE * randomFloat();
+                center[2] = middle + 0.45f * CUBE_SIZE * sinf(angle);
+                return 0.02f * CUBE_SIZE;
+            }
+
+            // The teapot is a ball a hundredth of the cube across
+            float teapot = 0.005f * CUBE_SIZE;
+            float direction[3];
+            float length;
+            do {
+                for(int j = 0; j < 3; j++) {
+                    direction[j] = 2.0f * randomFloat() - 1.0f;
+                }
+                length = direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2];
+            } while(length > 1.0f);
+            for(int j = 0; j < 3; j++) {
+                center[j] = middle + teapot * direction[j];
+            }
+            return 0.25f * 0.01f * spacing;
+        }
+    }
+}
+
+static struct Scene* generateScene(const struct GeneratorSettings* settings) {
+    randomState = settings->seed ? settings->seed : 0x9e3779b9u;
+
+    // The light takes one more texture, material and rect
+    unsigned int capacities[SCENE_ARRAY_COUNT] = { 0 };
+    capacities[SCENE_TEXTURES] = settings->textureCount + 1;
+    capacities[SCENE_MATERIALS] = settings->materialCount + 1;
+    capacities[SCENE_SPHERES] = settings->sphereCount;
+    capacities[SCENE_RECTS] = settings->rectCount + 1;
+
+    struct Scene* scene = createScene();
+    if(!scene || !reserveScene(scene, capacities) ||
+        !addTextures(scene, capacities[SCENE_TEXTURES]) || !addMaterials(scene, capacities[SCENE_MATERIALS]) ||
+        (settings->sphereCount && !addSpheres(scene, settings->sphereCount)) || !addRects(scene, capacities[SCENE_RECTS])) {
+        fprintf(stderr, "Failed to allocate a scene with %u spheres and %u rects\n", settings->sphereCount, settings->rectCount);
+        if(scene) {
+            freeScene(scene);
+        }
+        return 0;
+    }
+
+    addTexturesTo(scene, settings);
+    addMaterialsTo(scene, settings);
+
+    // Clusters are a center and a standard deviation each
+    unsigned int primitiveCount = settings->sphereCount + settings->rectCount;
+    unsigned int clusterCount = (unsigned int)cbrtf((float)primitiveCount) + 1;
+    float* clusters = malloc(4 * clusterCount * sizeof(float));
+    if(!clusters) {
+        freeScene(scene);
+        return 0;
+    }
+    for(unsigned int i = 0; i < clusterCount; i++) {
+        for(int j = 0; j < 3; j++) {
+            clusters[4 * i + j] = randomFloat() * CUBE_SIZE;
+        }
+        clusters[4 * i + 3] = (0.005f + 0.03f * randomFloat()) * CUBE_SIZE;
+    }
+
+    for(unsigned int i = 0; i < settings->sphereCount; i++) {
+        struct Sphere* sphere = &scene->spheres[i];
+        float size = placePrimitive(settings, i, primitiveCount, clusters, clusterCount, sphere->center);
+        sphere->radius = size * (0.5f + randomFloat());
+        sphere->material = randomInt() % settings->materialCount;
+    }
+
+    for(unsigned int i = 0; i < settings->rectCount; i++) {
+        struct Rect* rect = &scene->rects[i];
+        float center[3];
+        float size = 2.0f * placePrimitive(settings, i, primitiveCount, clusters, clusterCount, center);
+
+        // The plane's own axes first, then the one it's placed along
+        static const int axes[3][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 2, 0 } };
+        rect->plane = (enum Plane)(randomInt() % 3);
+        const int* axis = axes[rect->plane];
+        rect->x0 = center[axis[0]] - size * (0.25f + randomFloat());
+        rect->x1 = center[axis[0]] + size * (0.25f + randomFloat());
+        rect->y0 = center[axis[1]] - size * (0.25f + randomFloat());
+        rect->y1 = center[axis[1]] + size * (0.25f + randomFloat());
+        rect->k = center[axis[2]];
+        rect->material = randomInt() % settings->materialCount;
+    }
+    free(clusters);
+
+    // Facing down just under the top of the cube, like the Cornell box's
+    struct Rect light = { XZ, 0.2f * CUBE_SIZE, 0.8f * CUBE_SIZE, 0.2f * CUBE_SIZE, 0.8f * CUBE_SIZE, CUBE_SIZE - 1.0f, settings->materialCount };
+    scene->rects[settings->rectCount] = light;
+    return scene;
+}
+
+static const char* planeName(enum Plane plane) {
+    static const char* names[] = { "xy", "xz", "yz" };
+    return names[plane];
+}
+
+// Scene description of a generated scene, which never has objects or instances
+static _Bool writeSceneDescription(const char* path, const struct Scene* scene, const struct GeneratorSettings* settings) {
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        return 0;
+    }
+
+    fprintf(
+        file, "# scenegen --spheres %u --rects %u --distribution %s --materials %s --material-count %u --textures %u --seed %u\n\n",
+        settings->sphereCount, settings->rectCount, distributionNames[settings->distribution], mixNames[settings->mix],
+        settings->materialCount, settings->textureCount, settings->seed
+    );
+
+    for(unsigned int i = 0; i < scene->textureCount; i++) {
+        const struct Texture* texture = &scene->textures[i];
+        if(texture->type == CHECKERED) {
+            fprintf(file, "texture checkered %u %u\n", texture->property1, texture->property2);
+        } else if(texture->type == IMAGE) {
+            fprintf(file, "texture image %u %g %g %g\n", texture->property1, texture->albedo[0], texture->albedo[1], texture->albedo[2]);
+        } else {
+            fprintf(file, "texture solid %g %g %g\n", texture->albedo[0], texture->albedo[1], texture->albedo[2]);
+        }
+    }
+
+    static const char* materialNames[] = { "diffuse", "metal", "dielectric", "light" };
+    for(unsigned int i = 0; i < scene->materialCount; i++) {
+        const struct Material* material = &scene->materials[i];
+        if(material->type == METAL || material->type == DIELECTRIC) {
+            fprintf(file, "material %s %u %g\n", materialNames[material->type], material->texture, material->property);
+        } else {
+            fprintf(file, "material %s %u\n", materialNames[material->type], material->texture);
+        }
+    }
+
+    for(unsigned int i = 0; i < scene->sphereCount; i++) {
+        const struct Sphere* sphere = &scene->spheres[i];
+        fprintf(file, "sphere %g %g %g %g %u\n", sphere->center[0], sphere->center[1], sphere->center[2], sphere->radius, sphere->material);
+    }
+
+    for(unsigned int i = 0; i < scene->rectCount; i++) {
+        const struct Rect* rect = &scene->rects[i];
+        fprintf(
+            file, "rect %s %g %g %g %g %g %u\n", planeName(rect->plane), rect->x0, rect->x1, rect->y0, rect->y1, rect->k, rect->material
+        );
+    }
+    return fclose(file) == 0;
+}
+
+static _Bool writeScene(const char* path, const struct GeneratorSettings* settings) {
+    struct Scene* scene = generateScene(settings);
+    if(!scene) {
+        return 0;
+    }
+
+    // In place, so saveSceneFile doesn't sort a copy and descriptions come out sorted too
+    canonicalizeScene(scene);
+
+    size_t length = strlen(path);
+    _Bool binary = length >= 8 && strcmp(path + length - 8, ".rtscene") == 0;
+    _Bool written = binary ? saveSceneFile(path, scene) : writeSceneDescription(path, scene, settings);
+    if(written) {
+        printf(
+            "%s: %u spheres, %u rects, %u materials, %u textures\n",
+            path, scene->sphereCount, scene->rectCount, scene->materialCount, scene->textureCount
+        );
+    } else {
+        fprintf(stderr, "Failed to write %s\n", path);
+    }
+
+    freeScene(scene);
+    return written;
+}
+
+static _Bool writeCorpus(const char* directory, struct GeneratorSettings settings) {
+    unsigned int maxSpheres = settings.sphereCount;
+    for(int distribution = 0; distribution < DISTRIBUTION_COUNT; distribution++) {
+        for(unsigned long long spheres = 10; spheres <= maxSpheres; spheres *= 10) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s-%llu.rtscene", directory, distributionNames[distribution], spheres);
+
+            settings.distribution = (enum Distribution)distribution;
+            settings.sphereCount = (unsigned int)spheres;
+            settings.rectCount = (unsigned int)spheres / CORPUS_RECT_RATIO;
+            if(!writeScene(path, &settings)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int findName(const char* name, const char** names, int count) {
+    for(int i = 0; i < count; i++) {
+        if(strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int usage() {
+    fprintf(
+        stderr, "Usage: scenegen [--spheres n] [--rects n] [--distribution uniform|clustered|stadium]\n"
+        "                [--materials diffuse|mixed|specular] [--material-count n] [--textures n]\n"
+        "                [--seed n] <output .rtscene or .scene> | --corpus <directory>\n"
+    );
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    struct GeneratorSettings settings = { 100000, 0, UNIFORM, MIX_MIXED, 16, 8, 1 };
+    _Bool spheresGiven = 0;
+    const char* output = 0;
+    const char* corpus = 0;
+
+    for(int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        if(option[0] != '-') {
+            output = option;
+            continue;
+        }
+        if(i + 1 == argc) {
+            return usage();
+        }
+
+        const char* value = argv[++i];
+        if(strcmp(option, "--spheres") == 0) {
+            settings.sphereCount = (unsigned int)strtoul(value, 0, 10);
+            spheresGiven = 1;
+        } else if(strcmp(option, "--rects") == 0) {
+            settings.rectCount = (unsigned int)strtoul(value, 0, 10);
+        } else if(strcmp(option, "--distribution") == 0) {
+            int distribution = findName(value, distributionNames, DISTRIBUTION_COUNT);
+            if(distribution < 0) {
+                return usage();
+            }
+            settings.distribution = (enum Distribution)distribution;
+        } else if(strcmp(option, "--materials") == 0) {
+            int mix = findName(value, mixNames, MIX_COUNT);
+            if(mix < 0) {
+                return usage();
+            }
+            settings.mix = (enum MaterialMix)mix;
+        } else if(strcmp(option, "--material-count") == 0) {
+            settings.materialCount = (unsigned int)strtoul(value, 0, 10);
+        } else if(strcmp(option, "--textures") == 0) {
+            settings.textureCount = (unsigned int)strtoul(value, 0, 10);
+        } else if(strcmp(option, "--seed") == 0) {
+            settings.seed = (unsigned int)strtoul(value, 0, 10);
+        } else if(strcmp(option, "--corpus") == 0) {
+            corpus = value;
+        } else {
+            return usage();
+        }
+    }
+
+    if((!output && !corpus) || settings.materialCount == 0 || settings.textureCount == 0) {
+        return usage();
+    }
+
+    if(corpus) {
+        if(!spheresGiven) {
+            settings.sphereCount = 10000000;
+        }
+        return writeCorpus(corpus, settings) ? 0 : 1;
+    }
+    return writeScene(output, &settings) ? 0 : 1;
+}